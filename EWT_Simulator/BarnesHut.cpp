@@ -0,0 +1,383 @@
+//--------------------------------------------------------------------------------------
+// File: BarnesHut.cpp
+//
+// Barnes-Hut quadtree over the wave centres
+//--------------------------------------------------------------------------------------
+#include "BarnesHut.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // 16 bits per axis
+    const unsigned int MAX_LEVEL = 16;
+
+    // Levels split serially before the subtrees are handed to the pool, up to 4^3 tasks
+    const unsigned int TOP_LEVELS = 3;
+
+    uint32_t SpreadBits( uint32_t v )
+    {
+        v &= 0xFFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    uint32_t Quadrant( uint32_t iCode, unsigned int iLevel )
+    {
+        return (iCode >> (2 * (MAX_LEVEL - 1 - iLevel))) & 3;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CBarnesHut::CBarnesHut() :
+    m_fRootX( 0 ),
+    m_fRootY( 0 ),
+    m_fRootSize( 1 )
+{
+    m_Params.fOpeningAngle = 0.5f;
+    m_Params.fSoftening = 0.01f;
+    m_Params.iLeafSize = 8;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Build
+//--------------------------------------------------------------------------------------
+void CBarnesHut::Build( const std::vector<WaveCentre>& Centres )
+{
+    CThreadPool& pool = GetThreadPool();
+    const size_t iNumCentres = Centres.size();
+
+    m_Nodes.clear();
+    m_Centres.resize( iNumCentres );
+    m_Codes.resize( iNumCentres );
+    if ( iNumCentres == 0 )
+        return;
+
+    // Root square
+    float fMinX = Centres[0].vPosition.x, fMaxX = fMinX;
+    float fMinY = Centres[0].vPosition.y, fMaxY = fMinY;
+    for ( const WaveCentre& c : Centres )
+    {
+        fMinX = std::min( fMinX, c.vPosition.x );
+        fMaxX = std::max( fMaxX, c.vPosition.x );
+        fMinY = std::min( fMinY, c.vPosition.y );
+        fMaxY = std::max( fMaxY, c.vPosition.y );
+    }
+    m_fRootX = fMinX;
+    m_fRootY = fMinY;
+    m_fRootSize = std::max( std::max( fMaxX - fMinX, fMaxY - fMinY ) * 1.0001f, 1e-6f );
+
+    // Morton codes, then sort (code, index) pairs: chunks in parallel, then merge rounds
+    std::vector<uint64_t> keys( iNumCentres );
+    const float fScale = 65535.0f / m_fRootSize;
+    pool.ParallelFor( iNumCentres, 4096, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            uint32_t x = (uint32_t)((Centres[i].vPosition.x - m_fRootX) * fScale);
+            uint32_t y = (uint32_t)((Centres[i].vPosition.y - m_fRootY) * fScale);
+            uint32_t iCode = SpreadBits( x ) | (SpreadBits( y ) << 1);
+            keys[i] = ((uint64_t)iCode << 32) | (uint64_t)i;
+        }
+    } );
+
+    const size_t iNumChunks = std::max<size_t>( 1, std::min<size_t>( pool.GetNumThreads(), iNumCentres / 4096 ) );
+    const size_t iChunkSize = (iNumCentres + iNumChunks - 1) / iNumChunks;
+    pool.ParallelFor( iNumChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+            std::sort( keys.begin() + std::min( c * iChunkSize, iNumCentres ), keys.begin() + std::min( (c + 1) * iChunkSize, iNumCentres ) );
+    } );
+    for ( size_t iWidth = iChunkSize ; iWidth < iNumCentres ; iWidth *= 2 )
+    {
+        const size_t iNumMerges = (iNumCentres + 2 * iWidth - 1) / (2 * iWidth);
+        pool.ParallelFor( iNumMerges, 1, [&]( size_t iBegin, size_t iEnd )
+        {
+            for ( size_t m = iBegin ; m < iEnd ; m++ )
+            {
+                size_t iFirst = m * 2 * iWidth;
+                size_t iMiddle = std::min( iFirst + iWidth, iNumCentres );
+                size_t iLast = std::min( iFirst + 2 * iWidth, iNumCentres );
+                std::inplace_merge( keys.begin() + iFirst, keys.begin() + iMiddle, keys.begin() + iLast );
+            }
+        } );
+    }
+
+    pool.ParallelFor( iNumCentres, 4096, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            m_Codes[i] = (uint32_t)(keys[i] >> 32);
+            m_Centres[i] = Centres[(uint32_t)keys[i]];
+        }
+    } );
+
+    // Top levels, serially
+    std::vector<BuildTask> tasks;
+    m_Nodes.push_back( Node() );
+    m_Nodes[0].fSize = m_fRootSize;
+    BuildTop( 0, 0, (uint32_t)iNumCentres, 0, tasks );
+    const size_t iNumTopNodes = m_Nodes.size();
+
+    // Subtrees, in parallel
+    pool.ParallelFor( tasks.size(), 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t t = iBegin ; t < iEnd ; t++ )
+        {
+            BuildTask& task = tasks[t];
+            task.Nodes.push_back( Node() );
+            task.Nodes[0].fSize = NodeSize( task.iLevel );
+            BuildSubtree( task.Nodes, 0, task.iBegin, task.iEnd, task.iLevel );
+        }
+    } );
+
+    // Splice every subtree in, its root replacing the placeholder and the rest appended
+    for ( BuildTask& task : tasks )
+    {
+        const uint32_t iBase = (uint32_t)m_Nodes.size();
+        for ( size_t i = 0 ; i < task.Nodes.size() ; i++ )
+        {
+            Node node = task.Nodes[i];
+            if ( node.iNumChildren )
+                node.iFirstChild = iBase + node.iFirstChild - 1;
+            if ( i == 0 )
+                m_Nodes[task.iNode] = node;
+            else
+                m_Nodes.push_back( node );
+        }
+    }
+
+    // Moments of the top nodes; children always come after their parent
+    for ( size_t i = iNumTopNodes ; i-- > 0 ; )
+    {
+        const bool bPlaceholder = std::any_of( tasks.begin(), tasks.end(), [i]( const BuildTask& task ) { return task.iNode == i; } );
+        if ( !bPlaceholder )
+            ComputeMoments( m_Nodes, m_Nodes[i] );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// First sorted centre in [iBegin, iEnd) whose quadrant at iLevel is at least iQuadrant
+//--------------------------------------------------------------------------------------
+uint32_t CBarnesHut::FindSplit( uint32_t iBegin, uint32_t iEnd, unsigned int iLevel, uint32_t iQuadrant ) const
+{
+    auto it = std::partition_point( m_Codes.begin() + iBegin, m_Codes.begin() + iEnd,
+                                    [&]( uint32_t iCode ) { return Quadrant( iCode, iLevel ) < iQuadrant; } );
+    return (uint32_t)(it - m_Codes.begin());
+}
+
+
+//--------------------------------------------------------------------------------------
+// Split the first TOP_LEVELS levels, turning every node at the bottom into a task
+//--------------------------------------------------------------------------------------
+void CBarnesHut::BuildTop( uint32_t iNode, uint32_t iBegin, uint32_t iEnd, unsigned int iLevel, std::vector<BuildTask>& Tasks )
+{
+    m_Nodes[iNode].iBegin = iBegin;
+    m_Nodes[iNode].iEnd = iEnd;
+
+    if ( iLevel == TOP_LEVELS || iEnd - iBegin <= m_Params.iLeafSize )
+    {
+        BuildTask task;
+        task.iNode = iNode;
+        task.iBegin = iBegin;
+        task.iEnd = iEnd;
+        task.iLevel = iLevel;
+        Tasks.push_back( std::move( task ) );
+        return;
+    }
+
+    uint32_t splits[5] = { iBegin, 0, 0, 0, iEnd };
+    uint32_t iNumChildren = 0;
+    for ( uint32_t q = 1 ; q < 4 ; q++ )
+        splits[q] = FindSplit( iBegin, iEnd, iLevel, q );
+    for ( uint32_t q = 0 ; q < 4 ; q++ )
+        iNumChildren += (splits[q + 1] > splits[q]) ? 1 : 0;
+
+    const uint32_t iFirstChild = (uint32_t)m_Nodes.size();
+    m_Nodes[iNode].iFirstChild = iFirstChild;
+    m_Nodes[iNode].iNumChildren = iNumChildren;
+    m_Nodes.resize( m_Nodes.size() + iNumChildren );
+
+    uint32_t iChild = iFirstChild;
+    for ( uint32_t q = 0 ; q < 4 ; q++ )
+    {
+        if ( splits[q + 1] > splits[q] )
+        {
+            m_Nodes[iChild].fSize = NodeSize( iLevel + 1 );
+            BuildTop( iChild++, splits[q], splits[q + 1], iLevel + 1, Tasks );
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Recursive build of one subtree into its own node array
+//--------------------------------------------------------------------------------------
+void CBarnesHut::BuildSubtree( std::vector<Node>& Nodes, uint32_t iNode, uint32_t iBegin, uint32_t iEnd, unsigned int iLevel ) const
+{
+    Nodes[iNode].iBegin = iBegin;
+    Nodes[iNode].iEnd = iEnd;
+    Nodes[iNode].iFirstChild = 0;
+    Nodes[iNode].iNumChildren = 0;
+
+    if ( iEnd - iBegin > m_Params.iLeafSize && iLevel < MAX_LEVEL )
+    {
+        uint32_t splits[5] = { iBegin, 0, 0, 0, iEnd };
+        uint32_t iNumChildren = 0;
+        for ( uint32_t q = 1 ; q < 4 ; q++ )
+            splits[q] = FindSplit( iBegin, iEnd, iLevel, q );
+        for ( uint32_t q = 0 ; q < 4 ; q++ )
+            iNumChildren += (splits[q + 1] > splits[q]) ? 1 : 0;
+
+        const uint32_t iFirstChild = (uint32_t)Nodes.size();
+        Nodes[iNode].iFirstChild = iFirstChild;
+        Nodes[iNode].iNumChildren = iNumChildren;
+        Nodes.resize( Nodes.size() + iNumChildren );
+
+        uint32_t iChild = iFirstChild;
+        for ( uint32_t q = 0 ; q < 4 ; q++ )
+        {
+            if ( splits[q + 1] > splits[q] )
+            {
+                Nodes[iChild].fSize = NodeSize( iLevel + 1 );
+                BuildSubtree( Nodes, iChild++, splits[q], splits[q + 1], iLevel + 1 );
+            }
+        }
+    }
+
+    ComputeMoments( Nodes, Nodes[iNode] );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Monopole of a leaf from its centres, of an inner node from its children
+//--------------------------------------------------------------------------------------
+void CBarnesHut::ComputeMoments( std::vector<Node>& Nodes, Node& node ) const
+{
+    float fStrength = 0, fWeight = 0, fSumX = 0, fSumY = 0, fMeanX = 0, fMeanY = 0;
+
+    if ( node.iNumChildren == 0 )
+    {
+        for ( uint32_t i = node.iBegin ; i < node.iEnd ; i++ )
+        {
+            const WaveCentre& c = m_Centres[i];
+            const float w = fabsf( c.fStrength );
+            fStrength += c.fStrength;
+            fWeight += w;
+            fSumX += w * c.vPosition.x;
+            fSumY += w * c.vPosition.y;
+            fMeanX += c.vPosition.x;
+            fMeanY += c.vPosition.y;
+        }
+        fMeanX /= (float)(node.iEnd - node.iBegin);
+        fMeanY /= (float)(node.iEnd - node.iBegin);
+    }
+    else
+    {
+        for ( uint32_t i = 0 ; i < node.iNumChildren ; i++ )
+        {
+            const Node& child = Nodes[node.iFirstChild + i];
+            fStrength += child.fStrength;
+            fWeight += child.fWeight;
+            fSumX += child.fWeight * child.fCentroidX;
+            fSumY += child.fWeight * child.fCentroidY;
+            fMeanX += child.fCentroidX;
+            fMeanY += child.fCentroidY;
+        }
+        fMeanX /= (float)node.iNumChildren;
+        fMeanY /= (float)node.iNumChildren;
+    }
+
+    node.fStrength = fStrength;
+    node.fWeight = fWeight;
+    node.fCentroidX = (fWeight > 0) ? fSumX / fWeight : fMeanX;
+    node.fCentroidY = (fWeight > 0) ? fSumY / fWeight : fMeanY;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Evaluate
+//--------------------------------------------------------------------------------------
+FluidFloat2 CBarnesHut::Evaluate( const FluidFloat2& position ) const
+{
+    FluidFloat2 acceleration = { 0, 0 };
+    if ( m_Nodes.empty() )
+        return acceleration;
+
+    const float fThetaSq = m_Params.fOpeningAngle * m_Params.fOpeningAngle;
+    const float fSofteningSq = m_Params.fSoftening * m_Params.fSoftening;
+
+    auto accumulate = [&]( float x, float y, float fStrength )
+    {
+        const float dx = x - position.x;
+        const float dy = y - position.y;
+        const float fScale = fStrength / (dx * dx + dy * dy + fSofteningSq);
+        acceleration.x += fScale * dx;
+        acceleration.y += fScale * dy;
+    };
+
+    // Each level pushes at most 4 children
+    uint32_t stack[4 * (MAX_LEVEL + 1)];
+    int iTop = 0;
+    stack[iTop++] = 0;
+    while ( iTop > 0 )
+    {
+        const Node& node = m_Nodes[stack[--iTop]];
+        const float dx = node.fCentroidX - position.x;
+        const float dy = node.fCentroidY - position.y;
+
+        if ( node.fSize * node.fSize < fThetaSq * (dx * dx + dy * dy) )
+        {
+            accumulate( node.fCentroidX, node.fCentroidY, node.fStrength );
+        }
+        else if ( node.iNumChildren == 0 )
+        {
+            for ( uint32_t i = node.iBegin ; i < node.iEnd ; i++ )
+                accumulate( m_Centres[i].vPosition.x, m_Centres[i].vPosition.y, m_Centres[i].fStrength );
+        }
+        else
+        {
+            for ( uint32_t i = 0 ; i < node.iNumChildren ; i++ )
+                stack[iTop++] = node.iFirstChild + i;
+        }
+    }
+
+    return acceleration;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CBarnesHut::Evaluate( const FluidFloat2* pPositions, size_t iCount, FluidFloat2* pAcceleration ) const
+{
+    GetThreadPool().ParallelFor( iCount, 256, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+            pAcceleration[i] = Evaluate( pPositions[i] );
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidFloat2 CBarnesHut::EvaluateDirect( const FluidFloat2& position ) const
+{
+    const float fSofteningSq = m_Params.fSoftening * m_Params.fSoftening;
+
+    FluidFloat2 acceleration = { 0, 0 };
+    for ( const WaveCentre& c : m_Centres )
+    {
+        const float dx = c.vPosition.x - position.x;
+        const float dy = c.vPosition.y - position.y;
+        const float fScale = c.fStrength / (dx * dx + dy * dy + fSofteningSq);
+        acceleration.x += fScale * dx;
+        acceleration.y += fScale * dy;
+    }
+    return acceleration;
+}
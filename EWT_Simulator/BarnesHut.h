@@ -0,0 +1,94 @@
+//--------------------------------------------------------------------------------------
+// File: BarnesHut.h
+//
+// Field of many wave centres, evaluated with a Barnes-Hut quadtree. Each centre pulls
+// (or, with a negative strength, pushes) every granule with
+//     a = s (c - p) / (|c - p|^2 + eps^2)
+// the 2D 1 / r falloff. A node of the tree is replaced by a single centre at its
+// strength-weighted centroid when size / distance < theta, so evaluating N granules
+// against C centres costs O(N log C) instead of O(N C).
+//
+// The tree is rebuilt every step: centres are sorted by Morton code, the top levels are
+// split serially and the subtrees below them are built in parallel.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstdint>
+#include <vector>
+
+struct WaveCentre
+{
+    FluidFloat2 vPosition;
+    float fStrength;
+};
+
+struct BarnesHutParameters
+{
+    float fOpeningAngle;        // theta, 0 opens every node (exact), 0.5 is typical
+    float fSoftening;           // eps, keeps the field finite at a centre
+    unsigned int iLeafSize;     // Centres per leaf before it is split
+};
+
+//--------------------------------------------------------------------------------------
+class CBarnesHut
+{
+public:
+    CBarnesHut();
+
+    void SetParameters( const BarnesHutParameters& params ) { m_Params = params; }
+    const BarnesHutParameters& GetParameters() const { return m_Params; }
+
+    // Build the tree over the centres
+    void Build( const std::vector<WaveCentre>& Centres );
+
+    // Acceleration of a granule at position
+    FluidFloat2 Evaluate( const FluidFloat2& position ) const;
+
+    // Acceleration of many granules, spread over the thread pool
+    void Evaluate( const FluidFloat2* pPositions, size_t iCount, FluidFloat2* pAcceleration ) const;
+
+    // Reference O(C) sum over every centre
+    FluidFloat2 EvaluateDirect( const FluidFloat2& position ) const;
+
+    size_t GetNumNodes() const { return m_Nodes.size(); }
+    size_t GetNumCentres() const { return m_Centres.size(); }
+
+private:
+    struct Node
+    {
+        float fCentroidX;           // |strength| weighted, so mixed signs stay inside the node
+        float fCentroidY;
+        float fStrength;            // Sum of the strengths
+        float fWeight;              // Sum of |strength|
+        float fSize;                // Side of the node's square
+        uint32_t iFirstChild;       // Children are consecutive, 0 for a leaf
+        uint32_t iNumChildren;
+        uint32_t iBegin;            // Range of sorted centres
+        uint32_t iEnd;
+    };
+
+    struct BuildTask
+    {
+        uint32_t iNode;             // Placeholder in m_Nodes for the subtree root
+        uint32_t iBegin;
+        uint32_t iEnd;
+        unsigned int iLevel;
+        std::vector<Node> Nodes;
+    };
+
+    void BuildTop( uint32_t iNode, uint32_t iBegin, uint32_t iEnd, unsigned int iLevel, std::vector<BuildTask>& Tasks );
+    void BuildSubtree( std::vector<Node>& Nodes, uint32_t iNode, uint32_t iBegin, uint32_t iEnd, unsigned int iLevel ) const;
+    uint32_t FindSplit( uint32_t iBegin, uint32_t iEnd, unsigned int iLevel, uint32_t iQuadrant ) const;
+    void ComputeMoments( std::vector<Node>& Nodes, Node& node ) const;
+    float NodeSize( unsigned int iLevel ) const { return m_fRootSize / (float)(1u << iLevel); }
+
+    BarnesHutParameters         m_Params;
+    std::vector<WaveCentre>     m_Centres;          // Sorted by Morton code
+    std::vector<uint32_t>       m_Codes;
+    std::vector<Node>           m_Nodes;
+    float                       m_fRootX;
+    float                       m_fRootY;
+    float                       m_fRootSize;
+};
@@ -0,0 +1,169 @@
+//--------------------------------------------------------------------------------------
+// File: BarnesHutBenchmark.cpp
+//
+// Accuracy against speed of the Barnes-Hut wave centre field: for every opening angle,
+// times the parallel build and evaluation over all granules, and measures the error
+// against the direct sum on a sample of them.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread BarnesHutBenchmark.cpp BarnesHut.cpp ThreadPool.cpp
+//
+// Usage: BarnesHutBenchmark [--centres C] [--granules N] [--threads T] [--samples S]
+//                           [--leaf L] [--repeat R]
+//   --samples    granules checked against the direct sum
+//   --repeat     build and evaluate R times, the fastest run is reported
+//--------------------------------------------------------------------------------------
+#include "BarnesHut.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+
+namespace
+{
+    double ElapsedMs( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    // Centres clustered in a few blobs with mixed signs, the case the tree finds hardest
+    std::vector<WaveCentre> MakeCentres( size_t iCount, std::mt19937& rng )
+    {
+        std::uniform_real_distribution<float> uniform( 0.0f, 1.0f );
+        std::normal_distribution<float> normal( 0.0f, 0.05f );
+
+        FluidFloat2 blobs[8];
+        for ( FluidFloat2& blob : blobs )
+            blob = { uniform( rng ), uniform( rng ) };
+
+        std::vector<WaveCentre> centres( iCount );
+        for ( size_t i = 0 ; i < iCount ; i++ )
+        {
+            if ( i % 2 )
+            {
+                centres[i].vPosition = { uniform( rng ), uniform( rng ) };
+            }
+            else
+            {
+                const FluidFloat2& blob = blobs[rng() % 8];
+                centres[i].vPosition = { blob.x + normal( rng ), blob.y + normal( rng ) };
+            }
+            centres[i].fStrength = (uniform( rng ) < 0.8f ? 1.0f : -1.0f) * (0.5f + uniform( rng )) / (float)iCount;
+        }
+        return centres;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    size_t iNumCentres = 16384;
+    size_t iNumGranules = 65536;
+    size_t iNumSamples = 1024;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    unsigned int iLeafSize = 8;
+    int iRepeat = 3;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--centres" ) && bHasValue )
+            iNumCentres = (size_t)atol( argv[++i] );
+        else if ( !strcmp( argv[i], "--granules" ) && bHasValue )
+            iNumGranules = (size_t)atol( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--samples" ) && bHasValue )
+            iNumSamples = (size_t)atol( argv[++i] );
+        else if ( !strcmp( argv[i], "--leaf" ) && bHasValue )
+            iLeafSize = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--repeat" ) && bHasValue )
+            iRepeat = atoi( argv[++i] );
+        else
+        {
+            fprintf( stderr, "Usage: %s [--centres C] [--granules N] [--threads T] [--samples S] [--leaf L] [--repeat R]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    SetThreadPoolSize( iNumThreads );
+    iNumSamples = std::min( iNumSamples, iNumGranules );
+
+    std::mt19937 rng( 1234 );
+    std::vector<WaveCentre> centres = MakeCentres( iNumCentres, rng );
+
+    std::uniform_real_distribution<float> uniform( 0.0f, 1.0f );
+    std::vector<FluidFloat2> granules( iNumGranules );
+    for ( FluidFloat2& p : granules )
+        p = { uniform( rng ), uniform( rng ) };
+    std::vector<FluidFloat2> acceleration( iNumGranules );
+
+    CBarnesHut tree;
+    BarnesHutParameters params = tree.GetParameters();
+    params.iLeafSize = iLeafSize;
+    params.fSoftening = 0.005f;
+
+    // Reference: direct sum on the samples, timed and scaled up to every granule
+    tree.SetParameters( params );
+    tree.Build( centres );
+
+    const size_t iSampleStride = iNumGranules / iNumSamples;
+    std::vector<FluidFloat2> reference( iNumSamples );
+    auto start = std::chrono::steady_clock::now();
+    GetThreadPool().ParallelFor( iNumSamples, 16, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+            reference[i] = tree.EvaluateDirect( granules[i * iSampleStride] );
+    } );
+    const double fDirectMs = ElapsedMs( start ) * (double)iNumGranules / (double)iNumSamples;
+
+    double fReferenceRms = 0;
+    for ( const FluidFloat2& a : reference )
+        fReferenceRms += a.x * a.x + a.y * a.y;
+    fReferenceRms = sqrt( fReferenceRms / (double)iNumSamples );
+
+    printf( "%zu centres, %zu granules, %u threads, leaf %u\n", iNumCentres, iNumGranules, iNumThreads, iLeafSize );
+    printf( "direct sum %.2f ms (estimated from %zu samples)\n\n", fDirectMs, iNumSamples );
+    printf( "%6s %8s %10s %10s %10s %12s %12s\n", "theta", "nodes", "build ms", "eval ms", "speedup", "rms error", "max error" );
+
+    const float thetas[] = { 0.0f, 0.2f, 0.3f, 0.5f, 0.7f, 1.0f };
+    for ( float fTheta : thetas )
+    {
+        params.fOpeningAngle = fTheta;
+        tree.SetParameters( params );
+
+        double fBuildMs = 1e30, fEvaluateMs = 1e30;
+        for ( int r = 0 ; r < iRepeat ; r++ )
+        {
+            start = std::chrono::steady_clock::now();
+            tree.Build( centres );
+            fBuildMs = std::min( fBuildMs, ElapsedMs( start ) );
+
+            start = std::chrono::steady_clock::now();
+            tree.Evaluate( granules.data(), iNumGranules, acceleration.data() );
+            fEvaluateMs = std::min( fEvaluateMs, ElapsedMs( start ) );
+        }
+
+        // Error relative to the RMS field, so granules near a zero of the field do not dominate
+        double fErrorSq = 0, fMaxError = 0;
+        for ( size_t i = 0 ; i < iNumSamples ; i++ )
+        {
+            const FluidFloat2& a = acceleration[i * iSampleStride];
+            const double dx = a.x - reference[i].x;
+            const double dy = a.y - reference[i].y;
+            fErrorSq += dx * dx + dy * dy;
+            fMaxError = std::max( fMaxError, sqrt( dx * dx + dy * dy ) );
+        }
+
+        printf( "%6.2f %8zu %10.2f %10.2f %9.1fx %12.2e %12.2e\n", fTheta, tree.GetNumNodes(), fBuildMs, fEvaluateMs,
+                fDirectMs / (fBuildMs + fEvaluateMs), sqrt( fErrorSq / (double)iNumSamples ) / fReferenceRms, fMaxError / fReferenceRms );
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+//--------------------------------------------------------------------------------------
+// File: BoundarySDF.cpp
+//
+// Signed distance field builder for static boundaries
+//--------------------------------------------------------------------------------------
+#include "BoundarySDF.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+    // Per polygon data used while rasterising
+    struct SDFShape
+    {
+        const SDFPolygon* pPolygon;
+        float fMinX, fMinY, fMaxX, fMaxY;
+    };
+
+    float DistanceToSegmentSq( float px, float py, const SDFPoint& a, const SDFPoint& b )
+    {
+        float ex = b.x - a.x;
+        float ey = b.y - a.y;
+        float wx = px - a.x;
+        float wy = py - a.y;
+        float len_sq = ex * ex + ey * ey;
+        float t = (len_sq > 0) ? std::min( std::max( (wx * ex + wy * ey) / len_sq, 0.0f ), 1.0f ) : 0.0f;
+        float dx = wx - t * ex;
+        float dy = wy - t * ey;
+        return dx * dx + dy * dy;
+    }
+
+    // Unsigned distance to the outline and even-odd inside test in one walk over the edges
+    float ShapeDistance( const SDFPolygon& polygon, float px, float py )
+    {
+        const std::vector<SDFPoint>& v = polygon.Vertices;
+        const size_t n = v.size();
+
+        float dist_sq = FLT_MAX;
+        bool bInside = false;
+        for ( size_t i = 0, j = n - 1 ; i < n ; j = i++ )
+        {
+            dist_sq = std::min( dist_sq, DistanceToSegmentSq( px, py, v[j], v[i] ) );
+            if ( (v[i].y > py) != (v[j].y > py) &&
+                 px < (v[j].x - v[i].x) * (py - v[i].y) / (v[j].y - v[i].y) + v[i].x )
+            {
+                bInside = !bInside;
+            }
+        }
+
+        // Solid side is negative
+        float dist = sqrtf( dist_sq );
+        bool bSolid = polygon.bContainer ? !bInside : bInside;
+        return bSolid ? -dist : dist;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CBoundarySDF::CBoundarySDF() :
+    m_iWidth( 0 ),
+    m_iHeight( 0 ),
+    m_fOriginX( 0 ),
+    m_fOriginY( 0 ),
+    m_fCellSize( 1 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+// Build the field
+// The solid region is the union of every shape's solid side, so the field is the
+// minimum of the per shape signed distances. Obstacles whose bounding box is further
+// away than the best distance so far are skipped without touching their edges.
+//--------------------------------------------------------------------------------------
+void CBoundarySDF::Build( const std::vector<SDFPolygon>& Polygons,
+                          float fOriginX, float fOriginY, float fCellSize,
+                          unsigned int iWidth, unsigned int iHeight )
+{
+    m_iWidth = iWidth;
+    m_iHeight = iHeight;
+    m_fOriginX = fOriginX;
+    m_fOriginY = fOriginY;
+    m_fCellSize = fCellSize;
+    m_Distance.assign( (size_t)iWidth * iHeight, FLT_MAX );
+
+    std::vector<SDFShape> shapes;
+    for ( const SDFPolygon& polygon : Polygons )
+    {
+        if ( polygon.Vertices.size() < 3 )
+            continue;
+
+        SDFShape shape = { &polygon, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for ( const SDFPoint& p : polygon.Vertices )
+        {
+            shape.fMinX = std::min( shape.fMinX, p.x );
+            shape.fMinY = std::min( shape.fMinY, p.y );
+            shape.fMaxX = std::max( shape.fMaxX, p.x );
+            shape.fMaxY = std::max( shape.fMaxY, p.y );
+        }
+        shapes.push_back( shape );
+    }
+
+    GetThreadPool().ParallelFor( iHeight, 4, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t y = iBegin ; y < iEnd ; y++ )
+        {
+            float py = fOriginY + fCellSize * (float)y;
+            float* pRow = &m_Distance[y * iWidth];
+
+            for ( unsigned int x = 0 ; x < iWidth ; x++ )
+            {
+                float px = fOriginX + fCellSize * (float)x;
+                float best = FLT_MAX;
+
+                for ( const SDFShape& shape : shapes )
+                {
+                    // Outside an obstacle's box the distance can only be larger than the box distance
+                    if ( !shape.pPolygon->bContainer )
+                    {
+                        float bx = std::max( std::max( shape.fMinX - px, px - shape.fMaxX ), 0.0f );
+                        float by = std::max( std::max( shape.fMinY - py, py - shape.fMaxY ), 0.0f );
+                        float box_sq = bx * bx + by * by;
+                        if ( box_sq > 0 && (best <= 0 || box_sq >= best * best) )
+                            continue;
+                    }
+                    best = std::min( best, ShapeDistance( *shape.pPolygon, px, py ) );
+                }
+
+                pRow[x] = best;
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Bilinear lookup, kept in step with SampleBoundarySDF in FluidCS11.hlsl
+//--------------------------------------------------------------------------------------
+float CBoundarySDF::Sample( float x, float y, float* pGradX, float* pGradY ) const
+{
+    if ( m_Distance.empty() )
+    {
+        *pGradX = 0;
+        *pGradY = 0;
+        return FLT_MAX;
+    }
+
+    float gx = std::min( std::max( (x - m_fOriginX) / m_fCellSize, 0.0f ), (float)(m_iWidth - 1) );
+    float gy = std::min( std::max( (y - m_fOriginY) / m_fCellSize, 0.0f ), (float)(m_iHeight - 1) );
+    unsigned int x0 = std::min( (unsigned int)gx, m_iWidth - 2 );
+    unsigned int y0 = std::min( (unsigned int)gy, m_iHeight - 2 );
+    float fx = gx - (float)x0;
+    float fy = gy - (float)y0;
+
+    const float* pRow0 = &m_Distance[(size_t)y0 * m_iWidth + x0];
+    const float* pRow1 = pRow0 + m_iWidth;
+    float d00 = pRow0[0], d10 = pRow0[1];
+    float d01 = pRow1[0], d11 = pRow1[1];
+
+    *pGradX = ((d10 - d00) * (1 - fy) + (d11 - d01) * fy) / m_fCellSize;
+    *pGradY = ((d01 - d00) * (1 - fx) + (d11 - d10) * fx) / m_fCellSize;
+    return (d00 * (1 - fx) + d10 * fx) * (1 - fy) + (d01 * (1 - fx) + d11 * fx) * fy;
+}
+
+
+//--------------------------------------------------------------------------------------
+SDFPolygon CBoundarySDF::MakeBox( float fMinX, float fMinY, float fMaxX, float fMaxY, bool bContainer )
+{
+    SDFPolygon box;
+    box.Vertices = { { fMinX, fMinY }, { fMaxX, fMinY }, { fMaxX, fMaxY }, { fMinX, fMaxY } };
+    box.bContainer = bContainer;
+    return box;
+}
+
+
+//--------------------------------------------------------------------------------------
+SDFPolygon CBoundarySDF::MakeCircle( float fCenterX, float fCenterY, float fRadius, unsigned int iSegments, bool bContainer )
+{
+    SDFPolygon circle;
+    circle.bContainer = bContainer;
+    for ( unsigned int i = 0 ; i < iSegments ; i++ )
+    {
+        float a = 6.28318531f * (float)i / (float)iSegments;
+        circle.Vertices.push_back( { fCenterX + fRadius * cosf( a ), fCenterY + fRadius * sinf( a ) } );
+    }
+    return circle;
+}
@@ -0,0 +1,63 @@
+//--------------------------------------------------------------------------------------
+// File: BoundarySDF.h
+//
+// Static boundaries (containers and obstacles) precomputed as a signed distance field
+// on a regular grid. The integrate pass samples it with a bilinear lookup, so the wall
+// term costs the same per particle however complex the geometry is.
+//
+// Sign convention matches the old g_vPlanes test: positive in free space, negative
+// inside solid material.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+
+struct SDFPoint
+{
+    float x;
+    float y;
+};
+
+// A closed polygon. Obstacles are solid inside, containers are solid outside.
+struct SDFPolygon
+{
+    std::vector<SDFPoint> Vertices;
+    bool bContainer;
+};
+
+//--------------------------------------------------------------------------------------
+class CBoundarySDF
+{
+public:
+    CBoundarySDF();
+
+    // Rasterise the polygons into an iWidth x iHeight grid of nodes spaced fCellSize
+    // apart, node (0,0) sitting at (fOriginX, fOriginY). Rows are built in parallel.
+    void Build( const std::vector<SDFPolygon>& Polygons,
+                float fOriginX, float fOriginY, float fCellSize,
+                unsigned int iWidth, unsigned int iHeight );
+
+    // CPU mirror of SampleBoundarySDF in FluidCS11.hlsl
+    // Returns the distance and the gradient of the bilinear patch at (x, y)
+    float Sample( float x, float y, float* pGradX, float* pGradY ) const;
+
+    bool IsEmpty() const { return m_Distance.empty(); }
+    const float* GetData() const { return m_Distance.data(); }
+    unsigned int GetWidth() const { return m_iWidth; }
+    unsigned int GetHeight() const { return m_iHeight; }
+    float GetOriginX() const { return m_fOriginX; }
+    float GetOriginY() const { return m_fOriginY; }
+    float GetCellSize() const { return m_fCellSize; }
+
+    // Helpers for the common shapes
+    static SDFPolygon MakeBox( float fMinX, float fMinY, float fMaxX, float fMaxY, bool bContainer );
+    static SDFPolygon MakeCircle( float fCenterX, float fCenterY, float fRadius, unsigned int iSegments, bool bContainer );
+
+private:
+    std::vector<float>  m_Distance;
+    unsigned int        m_iWidth;
+    unsigned int        m_iHeight;
+    float               m_fOriginX;
+    float               m_fOriginY;
+    float               m_fCellSize;
+};
@@ -0,0 +1,329 @@
+//--------------------------------------------------------------------------------------
+// File: CoarseGrain.cpp
+//
+// Reduction of the sorted cell ranges into coarse fields and the field file writer
+//--------------------------------------------------------------------------------------
+#include "CoarseGrain.h"
+#include "FluidConstants.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+    const char FILE_MAGIC[8] = { 'E', 'W', 'T', 'C', 'F', 'L', 'D', '1' };
+    const uint32_t RECORD_MAGIC = 0x444C4643; // 'CFLD'
+    const uint32_t FILE_VERSION = 1;
+
+    const unsigned int GRID_DIM = CFluidSimulatorCPU::GRID_DIM;
+
+    struct FileHeader
+    {
+        char Magic[8];
+        uint32_t iVersion;
+    };
+
+    struct RecordHeader
+    {
+        uint32_t iMagic;
+        uint32_t iDim;
+        uint64_t iStep;
+        double fTime;
+        float fCellSize;
+        uint32_t iX;
+        uint32_t iY;
+        uint32_t iWidth;
+        uint32_t iHeight;
+        uint32_t iRadialBins;
+        float fRadialBinWidth;
+        uint32_t iReserved;
+        uint64_t iNumParticles;
+    };
+
+    static_assert( sizeof( CoarseCell ) == 20 && sizeof( CoarseRadialBin ) == 20 && sizeof( RecordHeader ) == 64,
+                   "The field layout must not depend on the compiler" );
+
+    FILE* OpenFile( const char* szPath, const char* szMode )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, szMode ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, szMode );
+#endif
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CoarseGrainSettings CoarseGrainDefaultSettings()
+{
+    CoarseGrainSettings settings;
+    settings.iCellBlock = 4;
+    settings.iRadialBins = 0;
+    settings.fRadialBinWidth = 4 * FLUID_INITIAL_PARTICLE_SPACING;
+    return settings;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CoarseGrainCrop( const CoarseCell* pCells, unsigned int iDim, float fCellSize, CoarseGrainFrame& frame )
+{
+    unsigned int iMinX = iDim, iMinY = iDim, iMaxX = 0, iMaxY = 0;
+    uint64_t iNumParticles = 0;
+    for ( unsigned int y = 0 ; y < iDim ; y++ )
+    {
+        for ( unsigned int x = 0 ; x < iDim ; x++ )
+        {
+            const uint32_t iCount = pCells[y * iDim + x].iCount;
+            if ( iCount == 0 )
+                continue;
+            iMinX = std::min( iMinX, x );
+            iMinY = std::min( iMinY, y );
+            iMaxX = std::max( iMaxX, x );
+            iMaxY = std::max( iMaxY, y );
+            iNumParticles += iCount;
+        }
+    }
+
+    frame.iDim = iDim;
+    frame.fCellSize = fCellSize;
+    frame.iNumParticles = iNumParticles;
+    frame.fRadialBinWidth = 0;
+    frame.Radial.clear();
+    if ( iNumParticles == 0 )
+    {
+        frame.iX = frame.iY = frame.iWidth = frame.iHeight = 0;
+        frame.Cells.clear();
+        return;
+    }
+
+    frame.iX = iMinX;
+    frame.iY = iMinY;
+    frame.iWidth = iMaxX - iMinX + 1;
+    frame.iHeight = iMaxY - iMinY + 1;
+    frame.Cells.resize( (size_t)frame.iWidth * frame.iHeight );
+    for ( unsigned int y = 0 ; y < frame.iHeight ; y++ )
+    {
+        const CoarseCell* pRow = pCells + (size_t)(iMinY + y) * iDim + iMinX;
+        std::copy( pRow, pRow + frame.iWidth, frame.Cells.begin() + (size_t)y * frame.iWidth );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CCoarseGrainer::CCoarseGrainer() :
+    m_Settings( CoarseGrainDefaultSettings() ),
+    m_Frame(),
+    m_iNumReduced( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+void CCoarseGrainer::SetSettings( const CoarseGrainSettings& settings )
+{
+    m_Settings = settings;
+
+    // Round the block down to a power of two that divides the grid
+    unsigned int iBlock = 1;
+    while ( iBlock * 2 <= std::min( settings.iCellBlock, GRID_DIM ) )
+        iBlock *= 2;
+    m_Settings.iCellBlock = iBlock;
+    if ( !(m_Settings.fRadialBinWidth > 0) )
+        m_Settings.iRadialBins = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Every coarse row walks the grid cells of its blocks in key order, so the particles
+// are read in the order the step stored them
+//--------------------------------------------------------------------------------------
+template <class T>
+void CCoarseGrainer::Reduce( const TFluidParticle<T>* pSorted, const T* pDensities, const FluidCellRange* pGridIndices,
+                             const uint32_t* pSortedIds, size_t iNumOwned, float fCellSize, float fParticleMass )
+{
+    const unsigned int iBlock = m_Settings.iCellBlock;
+    const unsigned int iDim = GRID_DIM / iBlock;
+    const unsigned int iBins = m_Settings.iRadialBins;
+    const double fInvBinWidth = iBins ? 1.0 / m_Settings.fRadialBinWidth : 0.0;
+    const double fHalfMass = 0.5 * fParticleMass;
+
+    m_Cells.resize( (size_t)iDim * iDim );
+    m_RowRadial.assign( (size_t)iDim * iBins, RadialSum() );
+
+    GetThreadPool().ParallelFor( iDim, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t cy = iBegin ; cy < iEnd ; cy++ )
+        {
+            RadialSum* pRadial = m_RowRadial.data() + cy * iBins;
+
+            for ( unsigned int cx = 0 ; cx < iDim ; cx++ )
+            {
+                uint32_t iCount = 0;
+                double fDisplacementX = 0, fDisplacementY = 0, fEnergy = 0, fDensity = 0;
+
+                for ( unsigned int y = (unsigned int)cy * iBlock ; y < (unsigned int)(cy + 1) * iBlock ; y++ )
+                {
+                    for ( unsigned int x = cx * iBlock ; x < (cx + 1) * iBlock ; x++ )
+                    {
+                        const FluidCellRange& range = pGridIndices[y * GRID_DIM + x];
+                        for ( uint32_t i = range.iStart ; i < range.iEnd ; i++ )
+                        {
+                            if ( pSortedIds && pSortedIds[i] >= iNumOwned )
+                                continue;
+
+                            const TFluidParticle<T>& P = pSorted[i];
+                            const double dx = (double)P.vPosition.x - P.vIndex.x;
+                            const double dy = (double)P.vPosition.y - P.vIndex.y;
+                            const double vx = P.vVelocity.x;
+                            const double vy = P.vVelocity.y;
+                            const double fKinetic = fHalfMass * (vx * vx + vy * vy);
+
+                            iCount++;
+                            fDisplacementX += dx;
+                            fDisplacementY += dy;
+                            fEnergy += fKinetic;
+                            fDensity += pDensities[i];
+
+                            if ( iBins )
+                            {
+                                const double rx = (double)P.vPosition.x - P.vCenter.x;
+                                const double ry = (double)P.vPosition.y - P.vCenter.y;
+                                const double r = sqrt( rx * rx + ry * ry );
+                                RadialSum& bin = pRadial[(size_t)std::min( r * fInvBinWidth, (double)(iBins - 1) )];
+                                bin.fCount += 1;
+                                bin.fDisplacement += sqrt( dx * dx + dy * dy );
+                                bin.fRadialVelocity += (r > 0) ? (vx * rx + vy * ry) / r : 0.0;
+                                bin.fKineticEnergy += fKinetic;
+                                bin.fDensity += pDensities[i];
+                            }
+                        }
+                    }
+                }
+
+                const double fInvCount = iCount ? 1.0 / iCount : 0.0;
+                CoarseCell& cell = m_Cells[cy * iDim + cx];
+                cell.iCount = iCount;
+                cell.vDisplacement = { (float)(fDisplacementX * fInvCount), (float)(fDisplacementY * fInvCount) };
+                cell.fKineticEnergy = (float)fEnergy;
+                cell.fDensity = (float)(fDensity * fInvCount);
+            }
+        }
+    } );
+
+    CoarseGrainCrop( m_Cells.data(), iDim, fCellSize * iBlock, m_Frame );
+
+    m_Frame.fRadialBinWidth = iBins ? m_Settings.fRadialBinWidth : 0.0f;
+    m_Frame.Radial.resize( iBins );
+    for ( unsigned int b = 0 ; b < iBins ; b++ )
+    {
+        RadialSum total = {};
+        for ( unsigned int cy = 0 ; cy < iDim ; cy++ )
+        {
+            const RadialSum& row = m_RowRadial[(size_t)cy * iBins + b];
+            total.fCount += row.fCount;
+            total.fDisplacement += row.fDisplacement;
+            total.fRadialVelocity += row.fRadialVelocity;
+            total.fKineticEnergy += row.fKineticEnergy;
+            total.fDensity += row.fDensity;
+        }
+
+        const double fInvCount = (total.fCount > 0) ? 1.0 / total.fCount : 0.0;
+        CoarseRadialBin& bin = m_Frame.Radial[b];
+        bin.iCount = (uint32_t)total.fCount;
+        bin.fDisplacement = (float)(total.fDisplacement * fInvCount);
+        bin.fRadialVelocity = (float)(total.fRadialVelocity * fInvCount);
+        bin.fKineticEnergy = (float)total.fKineticEnergy;
+        bin.fDensity = (float)(total.fDensity * fInvCount);
+    }
+
+    m_iNumReduced++;
+}
+
+
+//--------------------------------------------------------------------------------------
+CCoarseFieldWriter::CCoarseFieldWriter() :
+    m_pFile( nullptr ),
+    m_bFailed( false ),
+    m_Report()
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CCoarseFieldWriter::Open( const char* szPath )
+{
+    Close();
+
+    m_pFile = OpenFile( szPath, "wb" );
+    if ( !m_pFile )
+        return false;
+
+    m_bFailed = false;
+    m_Report = CoarseFieldReport();
+
+    FileHeader header = {};
+    memcpy( header.Magic, FILE_MAGIC, sizeof( header.Magic ) );
+    header.iVersion = FILE_VERSION;
+    m_bFailed = fwrite( &header, sizeof( header ), 1, m_pFile ) != 1;
+    m_Report.iWrittenBytes = sizeof( header );
+    return !m_bFailed;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CCoarseFieldWriter::Write( uint64_t iStep, double fTime, const CoarseGrainFrame& frame )
+{
+    if ( !m_pFile || m_bFailed )
+        return false;
+
+    RecordHeader header = {};
+    header.iMagic = RECORD_MAGIC;
+    header.iDim = frame.iDim;
+    header.iStep = iStep;
+    header.fTime = fTime;
+    header.fCellSize = frame.fCellSize;
+    header.iX = frame.iX;
+    header.iY = frame.iY;
+    header.iWidth = frame.iWidth;
+    header.iHeight = frame.iHeight;
+    header.iRadialBins = (uint32_t)frame.Radial.size();
+    header.fRadialBinWidth = frame.fRadialBinWidth;
+    header.iNumParticles = frame.iNumParticles;
+
+    const size_t iNumCells = (size_t)frame.iWidth * frame.iHeight;
+    bool bOk = fwrite( &header, sizeof( header ), 1, m_pFile ) == 1;
+    bOk = bOk && (iNumCells == 0 || fwrite( frame.Cells.data(), sizeof( CoarseCell ), iNumCells, m_pFile ) == iNumCells);
+    bOk = bOk && (frame.Radial.empty() || fwrite( frame.Radial.data(), sizeof( CoarseRadialBin ), frame.Radial.size(), m_pFile ) == frame.Radial.size());
+    if ( !bOk )
+    {
+        m_bFailed = true;
+        return false;
+    }
+
+    m_Report.iFrames++;
+    m_Report.iWrittenBytes += sizeof( header ) + iNumCells * sizeof( CoarseCell ) + frame.Radial.size() * sizeof( CoarseRadialBin );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CCoarseFieldWriter::Close()
+{
+    if ( !m_pFile )
+        return !m_bFailed;
+
+    if ( fclose( m_pFile ) != 0 )
+        m_bFailed = true;
+    m_pFile = nullptr;
+    return !m_bFailed;
+}
+
+
+template void CCoarseGrainer::Reduce<float>( const TFluidParticle<float>*, const float*, const FluidCellRange*, const uint32_t*,
+                                             size_t, float, float );
+template void CCoarseGrainer::Reduce<double>( const TFluidParticle<double>*, const double*, const FluidCellRange*, const uint32_t*,
+                                              size_t, float, float );
@@ -0,0 +1,154 @@
+//--------------------------------------------------------------------------------------
+// File: CoarseGrain.h
+//
+// In-situ coarse graining. Rather than every particle of every step, the output of a
+// long run can be a few fields per block of grid cells: particle count, mean
+// displacement from the rest position, kinetic energy and mean density, and optionally
+// a radial profile of the particles around their wave centre (vCenter). The reducer
+// runs inside the CPU simulator's step (FluidParameters::pCoarseGrainer) on the sorted
+// cell ranges the step has just built, so it reads each particle once and needs no
+// sort or search of its own; the viewer computes the same cells on the GPU
+// (CoarseGrainCS in FluidCS11.hlsl).
+//
+// A field file holds one record per reduced step and only the box of coarse cells that
+// hold particles; at the default 4x4 grid cells per coarse cell a record is well under a
+// hundredth of the step's particles and densities. Full particle dumps go to a
+// trajectory file (TrajectoryStore.h) at a much lower cadence.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Same layout as CoarseCell in FluidCS11.hlsl
+struct CoarseCell
+{
+    uint32_t iCount;
+    FluidFloat2 vDisplacement;      // Mean of position - rest position
+    float fKineticEnergy;           // Sum of 0.5 m |v|^2
+    float fDensity;                 // Mean
+};
+
+// Particles at a distance from their wave centre of [i, i + 1) * fRadialBinWidth; the
+// last bin also takes those further out
+struct CoarseRadialBin
+{
+    uint32_t iCount;
+    float fDisplacement;            // Mean |position - rest position|
+    float fRadialVelocity;          // Mean velocity away from the centre
+    float fKineticEnergy;           // Sum of 0.5 m |v|^2
+    float fDensity;                 // Mean
+};
+
+struct CoarseGrainSettings
+{
+    unsigned int iCellBlock;        // Grid cells per coarse cell on a side, a power of two up to 256
+    unsigned int iRadialBins;       // 0 for no radial profile
+    float fRadialBinWidth;
+};
+
+CoarseGrainSettings CoarseGrainDefaultSettings();
+
+// The fields of one step. Cells covers the box [iX, iX + iWidth) x [iY, iY + iHeight)
+// of the iDim x iDim coarse cells, row by row; coarse cell (x, y) spans
+// [x, x + 1) * fCellSize by [y, y + 1) * fCellSize of the map.
+struct CoarseGrainFrame
+{
+    unsigned int iDim;
+    float fCellSize;
+    unsigned int iX;
+    unsigned int iY;
+    unsigned int iWidth;
+    unsigned int iHeight;
+    std::vector<CoarseCell> Cells;
+    float fRadialBinWidth;
+    std::vector<CoarseRadialBin> Radial;
+    uint64_t iNumParticles;
+};
+
+// Fills frame with the box of the non-empty cells of the iDim x iDim pCells and no
+// radial profile; the viewer's path from the GPU cells
+void CoarseGrainCrop( const CoarseCell* pCells, unsigned int iDim, float fCellSize, CoarseGrainFrame& frame );
+
+//--------------------------------------------------------------------------------------
+class CCoarseGrainer
+{
+public:
+    CCoarseGrainer();
+
+    CCoarseGrainer( const CCoarseGrainer& ) = delete;
+    CCoarseGrainer& operator=( const CCoarseGrainer& ) = delete;
+
+    void SetSettings( const CoarseGrainSettings& settings );
+    const CoarseGrainSettings& GetSettings() const { return m_Settings; }
+
+    // Reduces the particles of a step, in the grid order of pGridIndices (GRID_DIM^2
+    // ranges of grid cells fCellSize wide). With pSortedIds, particles whose unsorted
+    // index is iNumOwned or more are domain halos and are skipped. Rows of coarse cells
+    // are reduced in parallel and the radial profile sums the rows' partial bins in
+    // order, so the result does not depend on the thread count.
+    template <class T>
+    void Reduce( const TFluidParticle<T>* pSorted, const T* pDensities, const FluidCellRange* pGridIndices,
+                 const uint32_t* pSortedIds, size_t iNumOwned, float fCellSize, float fParticleMass );
+
+    // Fields of the last Reduce
+    const CoarseGrainFrame& GetFrame() const { return m_Frame; }
+    uint64_t GetNumReduced() const { return m_iNumReduced; }
+
+private:
+    struct RadialSum
+    {
+        double fCount;
+        double fDisplacement;
+        double fRadialVelocity;
+        double fKineticEnergy;
+        double fDensity;
+    };
+
+    CoarseGrainSettings                     m_Settings;
+    std::vector<CoarseCell>                 m_Cells;            // Every coarse cell
+    std::vector<RadialSum>                  m_RowRadial;        // Radial bins of every row of coarse cells
+    CoarseGrainFrame                        m_Frame;
+    uint64_t                                m_iNumReduced;
+};
+
+struct CoarseFieldReport
+{
+    uint64_t iFrames;
+    uint64_t iWrittenBytes;
+};
+
+//--------------------------------------------------------------------------------------
+// Writes CoarseGrainFrames to a field file. Little endian:
+//   char[8] "EWTCFLD1", uint32 version
+//   per frame: a 64 byte record header (step, time, the frame's box and sizes), the
+//   cells of the box, then the radial bins
+//--------------------------------------------------------------------------------------
+class CCoarseFieldWriter
+{
+public:
+    CCoarseFieldWriter();
+    ~CCoarseFieldWriter() { Close(); }
+
+    CCoarseFieldWriter( const CCoarseFieldWriter& ) = delete;
+    CCoarseFieldWriter& operator=( const CCoarseFieldWriter& ) = delete;
+
+    bool Open( const char* szPath );
+    bool IsOpen() const { return m_pFile != nullptr; }
+
+    bool Write( uint64_t iStep, double fTime, const CoarseGrainFrame& frame );
+
+    // False if any write failed
+    bool Close();
+
+    CoarseFieldReport GetReport() const { return m_Report; }
+
+private:
+    FILE*                                   m_pFile;
+    bool                                    m_bFailed;
+    CoarseFieldReport                       m_Report;
+};
@@ -0,0 +1,171 @@
+//--------------------------------------------------------------------------------------
+// File: DomainDecomposition.cpp
+//
+// Slab decomposition with halo exchange
+//--------------------------------------------------------------------------------------
+#include "DomainDecomposition.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+    double ElapsedMs( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CDomainWorker::CDomainWorker( IHaloTransport& Transport, float fMinX, float fMaxX ) :
+    m_Transport( Transport ),
+    m_Send( Transport.GetNumRanks() ),
+    m_Recv( Transport.GetNumRanks() ),
+    m_fMinX( fMinX ),
+    m_fSlabWidth( (fMaxX - fMinX) / (float)Transport.GetNumRanks() ),
+    m_iStep( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+unsigned int CDomainWorker::GetOwner( float x ) const
+{
+    const int iLast = (int)m_Transport.GetNumRanks() - 1;
+    int iSlab = (int)floorf( (x - m_fMinX) / m_fSlabWidth );
+    return (unsigned int)std::min( std::max( iSlab, 0 ), iLast );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CDomainWorker::SetParticles( const std::vector<FluidParticle>& All )
+{
+    const unsigned int iRank = m_Transport.GetRank();
+
+    m_Owned.clear();
+    for ( const FluidParticle& p : All )
+    {
+        if ( GetOwner( p.vPosition.x ) == iRank )
+            m_Owned.push_back( p );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// One step
+// A single exchange carries both migrants and halos. A particle leaving this slab is
+// sent to its new owner and also kept here as a halo particle, since it is still within
+// reach of the boundary; the new owner gets it as an owned particle.
+//--------------------------------------------------------------------------------------
+bool CDomainWorker::Step( const FluidParameters& params, DomainStepSummary* pSummary )
+{
+    const unsigned int iRank = m_Transport.GetRank();
+    const unsigned int iNumRanks = m_Transport.GetNumRanks();
+    const float fSlabMin = m_fMinX + m_fSlabWidth * (float)iRank;
+    const float fSlabMax = fSlabMin + m_fSlabWidth;
+    const float h = params.fSmoothlen;
+
+    auto exchangeStart = std::chrono::steady_clock::now();
+
+    for ( DomainMessage& message : m_Send )
+    {
+        message.Migrants.clear();
+        message.Halo.clear();
+    }
+
+    // Owned particles first so the simulator can tell them from the halo
+    std::vector<FluidParticle> localHalo;
+    m_Local.clear();
+    uint32_t iHaloSent = 0;
+    uint32_t iMigrantsSent = 0;
+    for ( const FluidParticle& p : m_Owned )
+    {
+        const float x = p.vPosition.x;
+        const unsigned int iOwner = GetOwner( x );
+        if ( iOwner != iRank )
+        {
+            m_Send[iOwner].Migrants.push_back( p );
+            iMigrantsSent++;
+            if ( x >= fSlabMin - h && x < fSlabMax + h )
+                localHalo.push_back( p );
+            continue;
+        }
+
+        m_Local.push_back( p );
+        if ( iRank > 0 && x < fSlabMin + h )
+        {
+            m_Send[iRank - 1].Halo.push_back( p );
+            iHaloSent++;
+        }
+        if ( iRank + 1 < iNumRanks && x >= fSlabMax - h )
+        {
+            m_Send[iRank + 1].Halo.push_back( p );
+            iHaloSent++;
+        }
+    }
+
+    if ( !m_Transport.Exchange( m_Send, m_Recv ) )
+        return false;
+
+    uint32_t iHaloReceived = (uint32_t)localHalo.size();
+    for ( const DomainMessage& message : m_Recv )
+    {
+        m_Local.insert( m_Local.end(), message.Migrants.begin(), message.Migrants.end() );
+        iHaloReceived += (uint32_t)message.Halo.size();
+    }
+    const size_t iNumOwned = m_Local.size();
+    m_Local.insert( m_Local.end(), localHalo.begin(), localHalo.end() );
+    for ( const DomainMessage& message : m_Recv )
+        m_Local.insert( m_Local.end(), message.Halo.begin(), message.Halo.end() );
+
+    double fExchangeMs = ElapsedMs( exchangeStart );
+
+    // Step owned + halo, keeping the owned particles only
+    auto computeStart = std::chrono::steady_clock::now();
+    m_Simulator.SetParticles( m_Local );
+    m_Simulator.Step( params, iNumOwned );
+    m_Owned = m_Simulator.GetParticles();
+    double fComputeMs = ElapsedMs( computeStart );
+
+    // Report
+    DomainStepReport report = {};
+    report.iStep = m_iStep;
+    report.iOwned = (uint32_t)m_Owned.size();
+    report.iHaloSent = iHaloSent;
+    report.iHaloReceived = iHaloReceived;
+    report.iMigrantsSent = iMigrantsSent;
+    report.fComputeMs = fComputeMs;
+    report.fExchangeMs = fExchangeMs;
+    if ( !m_Transport.AllGather( report, m_Reports ) )
+        return false;
+
+    if ( pSummary )
+    {
+        DomainStepSummary summary = {};
+        summary.iStep = m_iStep;
+        uint32_t iMaxOwned = 0;
+        double fTotalComputeMs = 0;
+        for ( const DomainStepReport& r : m_Reports )
+        {
+            summary.iTotalOwned += r.iOwned;
+            summary.iTotalHalo += r.iHaloSent;
+            summary.iTotalMigrants += r.iMigrantsSent;
+            iMaxOwned = std::max( iMaxOwned, r.iOwned );
+            fTotalComputeMs += r.fComputeMs;
+            summary.fMaxComputeMs = std::max( summary.fMaxComputeMs, r.fComputeMs );
+            summary.fMaxExchangeMs = std::max( summary.fMaxExchangeMs, r.fExchangeMs );
+        }
+        summary.iHaloBytes = (uint64_t)summary.iTotalHalo * sizeof( FluidParticle );
+
+        const float fMeanOwned = (float)summary.iTotalOwned / (float)iNumRanks;
+        const double fMeanComputeMs = fTotalComputeMs / (double)iNumRanks;
+        summary.fParticleImbalance = (fMeanOwned > 0) ? (float)iMaxOwned / fMeanOwned : 1.0f;
+        summary.fComputeImbalance = (fMeanComputeMs > 0) ? (float)(summary.fMaxComputeMs / fMeanComputeMs) : 1.0f;
+        *pSummary = summary;
+    }
+
+    m_iStep++;
+    return true;
+}
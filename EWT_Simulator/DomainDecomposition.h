@@ -0,0 +1,105 @@
+//--------------------------------------------------------------------------------------
+// File: DomainDecomposition.h
+//
+// Splits the simulation into vertical slabs, each owned by one worker (rank). Every
+// step a worker sends its neighbours copies of the particles within one smoothing
+// length of the shared boundary (the halo) and hands over the particles that crossed
+// into another slab (migrants). The exchange goes through IHaloTransport, so the
+// shared memory transport used for local processes can be replaced by MPI.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstdint>
+#include <vector>
+
+// What one rank sends another in a step
+struct DomainMessage
+{
+    std::vector<FluidParticle> Migrants;    // Ownership moves to the receiver
+    std::vector<FluidParticle> Halo;        // Read-only neighbours for this step
+};
+
+// Per rank numbers for one step, gathered on every rank
+struct DomainStepReport
+{
+    uint64_t iStep;
+    uint32_t iOwned;
+    uint32_t iHaloSent;
+    uint32_t iHaloReceived;
+    uint32_t iMigrantsSent;
+    double fComputeMs;          // CFluidSimulatorCPU::Step
+    double fExchangeMs;         // Packing plus the transport, including waiting for the others
+};
+
+// Whole domain numbers for one step
+struct DomainStepSummary
+{
+    uint64_t iStep;
+    uint32_t iTotalOwned;
+    uint32_t iTotalHalo;            // Halo particles sent by all ranks
+    uint64_t iHaloBytes;
+    uint32_t iTotalMigrants;
+    float fParticleImbalance;       // Max / mean owned particles
+    float fComputeImbalance;        // Max / mean compute time
+    double fMaxComputeMs;
+    double fMaxExchangeMs;
+};
+
+//--------------------------------------------------------------------------------------
+// Transport between ranks
+// Every rank must make the same sequence of calls; each call is collective.
+// An MPI implementation maps Exchange onto MPI_Alltoallv (or neighbour sends),
+// AllGather onto MPI_Allgather and Gather onto MPI_Gatherv.
+//--------------------------------------------------------------------------------------
+class IHaloTransport
+{
+public:
+    virtual ~IHaloTransport() {}
+
+    virtual unsigned int GetRank() const = 0;
+    virtual unsigned int GetNumRanks() const = 0;
+
+    // Send[r] is delivered to rank r, Recv[r] receives what rank r sent to this rank
+    virtual bool Exchange( const std::vector<DomainMessage>& Send, std::vector<DomainMessage>& Recv ) = 0;
+
+    // All[r] receives the report of rank r
+    virtual bool AllGather( const DomainStepReport& Local, std::vector<DomainStepReport>& All ) = 0;
+
+    // Concatenates every rank's particles, in rank order, on rank 0
+    virtual bool Gather( const std::vector<FluidParticle>& Local, std::vector<FluidParticle>& All ) = 0;
+};
+
+//--------------------------------------------------------------------------------------
+class CDomainWorker
+{
+public:
+    // Slabs split [fMinX, fMaxX) evenly along x; the first and last slab extend to
+    // infinity so no particle is ever left without an owner
+    CDomainWorker( IHaloTransport& Transport, float fMinX, float fMaxX );
+
+    // Keep the particles of the full set that fall in this rank's slab
+    void SetParticles( const std::vector<FluidParticle>& All );
+    const std::vector<FluidParticle>& GetOwnedParticles() const { return m_Owned; }
+
+    // Exchange halos and migrants, then step the owned particles
+    // Assumes slabs are at least two smoothing lengths wide and that nothing moves more
+    // than a smoothing length per step, so halos only ever come from adjacent slabs
+    bool Step( const FluidParameters& params, DomainStepSummary* pSummary );
+
+    unsigned int GetOwner( float x ) const;
+    CFluidSimulatorCPU& GetSimulator() { return m_Simulator; }
+
+private:
+    IHaloTransport&             m_Transport;
+    CFluidSimulatorCPU          m_Simulator;
+    std::vector<FluidParticle>  m_Owned;
+    std::vector<FluidParticle>  m_Local;        // Owned + halo handed to the simulator
+    std::vector<DomainMessage>  m_Send;
+    std::vector<DomainMessage>  m_Recv;
+    std::vector<DomainStepReport> m_Reports;
+    float                       m_fMinX;
+    float                       m_fSlabWidth;
+    uint64_t                    m_iStep;
+};
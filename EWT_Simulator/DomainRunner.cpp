@@ -0,0 +1,346 @@
+//--------------------------------------------------------------------------------------
+// File: DomainRunner.cpp
+//
+// Runs the CPU simulation split across N local processes that exchange halos through
+// shared memory, and prints the halo volume and load imbalance of every step.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread DomainRunner.cpp DomainDecomposition.cpp
+//       SharedMemoryTransport.cpp FluidCPU.cpp CoarseGrain.cpp BoundarySDF.cpp ParticleMesh.cpp
+//       FFT.cpp BarnesHut.cpp StageProfiler.cpp PerfCounters.cpp ThreadPool.cpp FluidAutotune.cpp
+//       -lrt
+//
+// Usage: DomainRunner [--ranks N] [--particles P] [--steps S] [--threads T]
+//                     [--capacity C] [--verify] [--trace PREFIX] [--counters]
+//                     [--autotune CACHE]
+//   --threads    worker threads per rank, hardware threads / ranks by default
+//   --capacity   particles one rank may send another in a step
+//   --verify     compare the result with a single process run
+//   --trace      time every stage, write PREFIX.rank<N>.json Chrome traces and print
+//                rank 0's per stage percentiles
+//   --counters   count cycles, instructions, cache and branch misses of every stage and
+//                thread with perf_event_open and print rank 0's per step averages
+//   --autotune   before the ranks start, tune grain, cell size, sort and threads (up to
+//                --threads) on one rank's share of the particles, or take the result
+//                for this machine and size from the CACHE file
+//--------------------------------------------------------------------------------------
+#include "DomainDecomposition.h"
+#include "FluidAutotune.h"
+#include "PerfCounters.h"
+#include "SharedMemoryTransport.h"
+#include "StageProfiler.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+    struct RunnerOptions
+    {
+        unsigned int iNumRanks = 4;
+        unsigned int iNumParticles = 16384;
+        unsigned int iNumSteps = 100;
+        unsigned int iNumThreads = 0;
+        size_t iCapacity = 0;
+        bool bVerify = false;
+        bool bCounters = false;
+        const char* szTracePrefix = nullptr;
+        const char* szAutotuneCache = nullptr;
+        bool bTuned = false;
+        FluidTuning Tuning = {};
+    };
+
+    bool ParseOptions( int argc, char** argv, RunnerOptions& options )
+    {
+        for ( int i = 1 ; i < argc ; i++ )
+        {
+            const char* szArg = argv[i];
+            const bool bHasValue = (i + 1 < argc);
+            if ( strcmp( szArg, "--verify" ) == 0 )
+                options.bVerify = true;
+            else if ( strcmp( szArg, "--counters" ) == 0 )
+                options.bCounters = true;
+            else if ( strcmp( szArg, "--ranks" ) == 0 && bHasValue )
+                options.iNumRanks = (unsigned int)atoi( argv[++i] );
+            else if ( strcmp( szArg, "--particles" ) == 0 && bHasValue )
+                options.iNumParticles = (unsigned int)atoi( argv[++i] );
+            else if ( strcmp( szArg, "--steps" ) == 0 && bHasValue )
+                options.iNumSteps = (unsigned int)atoi( argv[++i] );
+            else if ( strcmp( szArg, "--threads" ) == 0 && bHasValue )
+                options.iNumThreads = (unsigned int)atoi( argv[++i] );
+            else if ( strcmp( szArg, "--capacity" ) == 0 && bHasValue )
+                options.iCapacity = (size_t)atoll( argv[++i] );
+            else if ( strcmp( szArg, "--trace" ) == 0 && bHasValue )
+                options.szTracePrefix = argv[++i];
+            else if ( strcmp( szArg, "--autotune" ) == 0 && bHasValue )
+                options.szAutotuneCache = argv[++i];
+            else
+                return false;
+        }
+        return options.iNumRanks > 0 && options.iNumParticles > 0;
+    }
+
+    // The lattice with a gentle swirl, so particles cross slab boundaries
+    std::vector<FluidParticle> CreateInitialParticles( unsigned int iNumParticles, const FluidParameters& params )
+    {
+        std::vector<FluidParticle> particles = FluidCreateLattice( iNumParticles, params.fInitialParticleSpacing );
+        for ( FluidParticle& p : particles )
+        {
+            const float dx = p.vPosition.x - p.vCenter.x;
+            const float dy = p.vPosition.y - p.vCenter.y;
+            p.vVelocity = { -dy * 0.5f, dx * 0.5f };
+        }
+        return particles;
+    }
+
+    void GetExtentX( const std::vector<FluidParticle>& particles, float& fMinX, float& fMaxX )
+    {
+        fMinX = particles[0].vPosition.x;
+        fMaxX = fMinX;
+        for ( const FluidParticle& p : particles )
+        {
+            fMinX = std::min( fMinX, p.vPosition.x );
+            fMaxX = std::max( fMaxX, p.vPosition.x );
+        }
+    }
+
+    // Largest position difference between two runs, matched by rest position
+    float CompareRuns( const std::vector<FluidParticle>& Distributed, const std::vector<FluidParticle>& Reference, bool& bComplete )
+    {
+        auto key = []( const FluidParticle& p )
+        {
+            uint64_t x, y;
+            uint32_t ix, iy;
+            memcpy( &ix, &p.vIndex.x, sizeof( ix ) );
+            memcpy( &iy, &p.vIndex.y, sizeof( iy ) );
+            x = ix;
+            y = iy;
+            return (x << 32) | y;
+        };
+
+        std::unordered_map<uint64_t, const FluidParticle*> lookup;
+        for ( const FluidParticle& p : Reference )
+            lookup[key( p )] = &p;
+
+        bComplete = (Distributed.size() == Reference.size());
+        float fMaxError = 0;
+        for ( const FluidParticle& p : Distributed )
+        {
+            auto it = lookup.find( key( p ) );
+            if ( it == lookup.end() )
+            {
+                bComplete = false;
+                continue;
+            }
+            const float dx = p.vPosition.x - it->second->vPosition.x;
+            const float dy = p.vPosition.y - it->second->vPosition.y;
+            fMaxError = std::max( fMaxError, sqrtf( dx * dx + dy * dy ) );
+        }
+        return fMaxError;
+    }
+
+    unsigned int GetThreadsPerRank( const RunnerOptions& options )
+    {
+        if ( options.iNumThreads )
+            return options.iNumThreads;
+        return std::max( 1u, std::thread::hardware_concurrency() / options.iNumRanks );
+    }
+
+    // Tunes on one rank's share of the lattice, in this process before the ranks fork
+    void Autotune( RunnerOptions& options )
+    {
+        const FluidParameters params = FluidDefaultParameters();
+        const std::vector<FluidParticle> particles = CreateInitialParticles( options.iNumParticles / options.iNumRanks, params );
+
+        FluidAutotuneOptions tuneOptions = FluidDefaultAutotuneOptions();
+        tuneOptions.iMaxThreads = GetThreadsPerRank( options );
+        tuneOptions.szCachePath = options.szAutotuneCache;
+        tuneOptions.pLog = stdout;
+
+        bool bFromCache = false;
+        options.Tuning = FluidAutotune( particles, params, tuneOptions, &bFromCache );
+        options.bTuned = true;
+        printf( "%s: grain %zu, cells h/%u, %u threads, %s sort, %.3f ms per step\n\n", bFromCache ? "cached tuning" : "tuned",
+                options.Tuning.iGrain, options.Tuning.iCellSubdivision, options.Tuning.iNumThreads,
+                FluidSortAlgorithmName( options.Tuning.eSort ), options.Tuning.fStepMs );
+
+        // The pool's workers would not exist in the forked ranks
+        SetThreadPoolSize( 1 );
+    }
+
+    int RunRank( const char* szName, unsigned int iRank, const RunnerOptions& options )
+    {
+        CSharedMemoryTransport transport;
+        if ( !transport.Open( szName, iRank ) )
+            return 1;
+
+        SetThreadPoolSize( GetThreadsPerRank( options ) );
+
+        const FluidParameters params = FluidDefaultParameters();
+        const std::vector<FluidParticle> initial = CreateInitialParticles( options.iNumParticles, params );
+        float fMinX, fMaxX;
+        GetExtentX( initial, fMinX, fMaxX );
+
+        CDomainWorker worker( transport, fMinX, fMaxX + params.fInitialParticleSpacing );
+        worker.SetParticles( initial );
+        if ( options.bTuned )
+            FluidApplyTuning( options.Tuning, worker.GetSimulator() );
+        const unsigned int iNumThreads = GetThreadPool().GetNumThreads();
+
+        CStageProfiler& profiler = GetStageProfiler();
+        profiler.SetEnabled( options.szTracePrefix != nullptr );
+
+        // Without permission the run goes on uncounted and the reason is printed at the end
+        CPerfCounters& counters = GetPerfCounters();
+        if ( options.bCounters )
+            counters.SetEnabled( true );
+        double fParticles = 0, fInteractions = 0;
+
+        if ( iRank == 0 )
+            printf( "step   owned   halo  halo KB  migrants  particle imb  compute imb  compute ms  exchange ms\n" );
+
+        for ( unsigned int iStep = 0 ; iStep < options.iNumSteps ; iStep++ )
+        {
+            DomainStepSummary summary;
+            profiler.NextFrame();
+            if ( !worker.Step( params, &summary ) )
+                return 1;
+
+            if ( counters.IsEnabled() )
+            {
+                CFluidSimulatorCPU& simulator = worker.GetSimulator();
+                counters.NextStep();
+                fParticles += (double)simulator.GetNumParticles();
+                fInteractions += (double)simulator.GetBalanceReport().iInteractions;
+            }
+
+            if ( iRank == 0 )
+            {
+                printf( "%4llu  %6u  %5u  %7.1f  %8u  %12.3f  %11.3f  %10.3f  %11.3f\n",
+                        (unsigned long long)summary.iStep, summary.iTotalOwned, summary.iTotalHalo,
+                        summary.iHaloBytes / 1024.0, summary.iTotalMigrants,
+                        summary.fParticleImbalance, summary.fComputeImbalance,
+                        summary.fMaxComputeMs, summary.fMaxExchangeMs );
+            }
+        }
+
+        if ( options.szTracePrefix )
+        {
+            char szPath[512];
+            snprintf( szPath, sizeof( szPath ), "%s.rank%u.json", options.szTracePrefix, iRank );
+            if ( !profiler.WriteChromeTrace( szPath ) )
+                fprintf( stderr, "rank %u: cannot write %s\n", iRank, szPath );
+            if ( iRank == 0 )
+            {
+                printf( "\nrank 0 stages\n" );
+                profiler.PrintStatistics( stdout );
+            }
+            profiler.SetEnabled( false );
+        }
+
+        if ( options.bCounters && iRank == 0 )
+        {
+            const double fSteps = (double)std::max<uint64_t>( 1, counters.GetSteps() );
+            printf( "\nrank 0 counters per step, %u threads\n", iNumThreads );
+            counters.PrintTotals( stdout, fParticles / fSteps, fInteractions / fSteps );
+        }
+        counters.SetEnabled( false );
+
+        if ( !options.bVerify )
+            return 0;
+
+        std::vector<FluidParticle> gathered;
+        if ( !transport.Gather( worker.GetOwnedParticles(), gathered ) )
+            return 1;
+        if ( iRank != 0 )
+            return 0;
+
+        CFluidSimulatorCPU reference;
+        reference.SetParticles( initial );
+        for ( unsigned int iStep = 0 ; iStep < options.iNumSteps ; iStep++ )
+            reference.Step( params );
+
+        bool bComplete = false;
+        const float fMaxError = CompareRuns( gathered, reference.GetParticles(), bComplete );
+        const float fTolerance = params.fInitialParticleSpacing * 1e-3f;
+        const bool bPassed = bComplete && fMaxError <= fTolerance;
+        printf( "verify: %zu of %zu particles, max position error %g (tolerance %g): %s\n",
+                gathered.size(), reference.GetNumParticles(), fMaxError, fTolerance, bPassed ? "passed" : "FAILED" );
+        return bPassed ? 0 : 1;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char** argv )
+{
+    RunnerOptions options;
+    if ( !ParseOptions( argc, argv, options ) )
+    {
+        fprintf( stderr, "Usage: %s [--ranks N] [--particles P] [--steps S] [--threads T] [--capacity C] [--verify] [--trace PREFIX] [--counters] [--autotune CACHE]\n", argv[0] );
+        return 2;
+    }
+
+    // Default to room for a whole slab, which is far more than the halo ever needs
+    if ( options.iCapacity == 0 )
+        options.iCapacity = options.iNumParticles / options.iNumRanks + 1024;
+
+    if ( options.szAutotuneCache )
+        Autotune( options );
+
+    char szName[64];
+    snprintf( szName, sizeof( szName ), "/ewt_domain_%d", (int)getpid() );
+
+    CSharedMemoryTransport owner;
+    if ( !owner.Create( szName, options.iNumRanks, options.iCapacity, options.iNumParticles ) )
+        return 1;
+
+    // Flush before forking so buffered output is not duplicated in the children
+    fflush( stdout );
+
+    std::vector<pid_t> children;
+    for ( unsigned int iRank = 0 ; iRank < options.iNumRanks ; iRank++ )
+    {
+        pid_t pid = fork();
+        if ( pid == 0 )
+        {
+            int iResult = RunRank( szName, iRank, options );
+            fflush( stdout );
+            _exit( iResult );
+        }
+        if ( pid < 0 )
+        {
+            perror( "fork" );
+            break;
+        }
+        children.push_back( pid );
+    }
+
+    // A missing rank would leave the others waiting at the first barrier forever
+    if ( children.size() != options.iNumRanks )
+    {
+        for ( pid_t pid : children )
+            kill( pid, SIGKILL );
+    }
+
+    int iExitCode = (children.size() == options.iNumRanks) ? 0 : 1;
+    for ( pid_t pid : children )
+    {
+        int iStatus = 0;
+        waitpid( pid, &iStatus, 0 );
+        if ( !WIFEXITED( iStatus ) || WEXITSTATUS( iStatus ) != 0 )
+            iExitCode = 1;
+    }
+
+    CSharedMemoryTransport::Unlink( szName );
+    return iExitCode;
+}
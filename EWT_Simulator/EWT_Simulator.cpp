@@ -5,8 +5,25 @@
 #include "SDKmisc.h"
 #include "resource.h"
 #include "WaitDlg.h"
-
+#include "BoundarySDF.h"
+#include "CoarseGrain.h"
+#include "FluidConstants.h"
+#include "FluidParity.h"
+#include "FrameEncoder.h"
+#include "GPUReadback.h"
+#include "GPUStageTimer.h"
+#include "SPSCQueue.h"
+#include "StageProfiler.h"
+#include "TrajectoryStore.h"
+#include "TripleBuffer.h"
+
+#include <d3d10.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
 
 #pragma warning( disable : 4100 )
 
@@ -30,6 +47,23 @@ struct ParticleForces
     XMFLOAT2 vAcceleration;
 };
 
+// Per universe constants for the ensemble kernels
+// Must match UniverseConstants in FluidCS11.hlsl
+struct UniverseConstants
+{
+    FLOAT fSmoothlen;
+    FLOAT fPressureStiffness;
+    FLOAT fRestDensity;
+    FLOAT fDensityCoef;
+    FLOAT fGradPressureCoef;
+    FLOAT fLapViscosityCoef;
+    FLOAT fSpringK;
+    FLOAT fExternalK;
+    FLOAT fCollisionDistSq;
+    FLOAT fPadding[3];
+    XMFLOAT4 vGridDim;
+};
+
 struct UINT2
 {
 	UINT x;
@@ -62,7 +96,7 @@ UINT g_iNumParticles = NUM_PARTICLES_64K;
 
 // Particle Properties
 // These will control how the fluid behaves
-FLOAT g_fInitialParticleSpacing = 0.0045f;
+FLOAT g_fInitialParticleSpacing = FLUID_INITIAL_PARTICLE_SPACING;
 FLOAT g_fSmoothlen = 0.012f;			//0.012f //seems to affect grid splitting
 FLOAT g_fPressureStiffness = 390.0f;	//200.f
 FLOAT g_fRestDensity = 450.0f;			//1000.f
@@ -71,6 +105,11 @@ FLOAT g_fViscosity = 0.15f;				//0.1f
 FLOAT g_fMaxAllowableTimeStep = 0.005f;
 FLOAT g_fParticleRenderSize = 0.005f;	//0.003f
 
+// Constants hard-coded in ForceCS_Grid, used as the defaults of the ensemble sweep.
+// The spring constant is swept around g_fSpringK, from 0.7x to 1.4x
+FLOAT g_fSpringK = FLUID_SPRING_K;
+FLOAT g_fExternalK = FLUID_EXTERNAL_K;
+
 // Gravity Directions
 const XMFLOAT2A GRAVITY_DOWN(0, -0.5f);
 const XMFLOAT2A GRAVITY_UP(0, 0.5f);
@@ -94,6 +133,64 @@ XMFLOAT3A g_vPlanes[4] = {
     XMFLOAT3A(0, -1, g_fMapHeight)
 };
 
+// Boundary Signed Distance Field
+// Containers and obstacles are rasterised once into a grid that the integrate pass samples,
+// so arbitrary static geometry costs the same as the old four planes
+// The default set is the map box, matching g_vPlanes
+bool g_bBoundaries = false;
+FLOAT g_fBoundaryCellSize = 0.006f;		// g_fSmoothlen / 2
+FLOAT g_fBoundaryMargin = 0.06f;			// Field extends this far outside the map
+std::vector<SDFPolygon> g_BoundaryPolygons = {
+    CBoundarySDF::MakeBox( 0, 0, g_fMapWidth, g_fMapHeight, true )
+};
+CBoundarySDF g_BoundarySDF;
+
+// Neighbour Lists
+// The grid density pass records each particle's in-range neighbours so the force pass
+// does not walk the grid a second time. The density pass writes three UAVs, so the lists
+// need feature level 11. Must match NEIGHBOUR_LIST_SIZE in FluidCS11.hlsl
+const UINT NEIGHBOUR_LIST_SIZE = 32;
+bool g_bNeighbourLists = false;
+
+// Dynamic Particles
+// Emitters spawn granules at runtime and particles that leave the absorber rectangle are
+// removed by a prefix-sum compaction at the start of the next step. The live count stays
+// on the GPU, where it drives indirect dispatches and the draw, and is read back a few
+// frames late for the HUD and to decide when the buffers must grow
+// Only the single universe grid path supports it, and only at feature level 11: the
+// scans and the integration with alive flags bind more than one UAV
+struct ParticleEmitter
+{
+    XMFLOAT2 vPosition;
+    XMFLOAT2 vVelocity;
+    FLOAT fRate;                // Particles per second
+    FLOAT fRadius;              // Spawned uniformly over a disc of this radius
+};
+
+const UINT MAX_DYNAMIC_PARTICLES = NUM_PARTICLES_64K;  // 16-bit particle IDs in the grid keys
+const UINT MAX_SPAWN_PER_STEP = 4096;
+bool g_bDynamicParticles = false;
+std::vector<ParticleEmitter> g_Emitters = {
+    { XMFLOAT2( 0.05f, 0.6f ), XMFLOAT2( 0.5f, 0 ), 2000.0f, 0.02f }
+};
+FLOAT g_fAbsorbMargin = 0.06f;          // The absorber is the map grown by this margin
+UINT g_iNumLiveParticles = 0;           // Last count read back from the GPU
+FLOAT g_fSpawnAccumulator = 0;          // Fraction of a particle carried to the next step
+UINT64 g_iTotalSpawned = 0;
+UINT64 g_iReadbackSpawnMark = 0;        // g_iTotalSpawned when the pending readback was issued
+UINT64 g_iLiveSpawnMark = 0;            // g_iTotalSpawned when g_iNumLiveParticles was copied
+bool g_bCountReadbackPending = false;
+std::vector<ParticleData> g_SpawnScratch;
+std::mt19937 g_SpawnRandom;
+
+// Buffer Pool
+// The particle buffers hold g_iParticleCapacity slots, a power of two that only ever
+// grows, by doubling. Changing the particle count or resetting the simulation reuses them
+// and the live count can change every step without a single allocation
+const UINT MIN_PARTICLE_CAPACITY = NUM_PARTICLES_8K;   // Smallest size the bitonic sort handles
+UINT g_iParticleCapacity = 0;
+UINT g_iUniverseCapacity = 0;           // Universes the grid indices and constants hold
+
 // Simulation Algorithm
 enum eSimulationMode
 {
@@ -104,6 +201,27 @@ enum eSimulationMode
 
 eSimulationMode g_eSimMode = SIM_MODE_GRID;
 
+// Ensemble
+// Runs g_iNumUniverses independent copies of the g_iNumParticles lattice in the same
+// buffers, stepped together by the same dispatches. Each universe gets its own constants,
+// interpolated linearly from g_EnsembleSweepMin (first universe) to g_EnsembleSweepMax (last)
+struct EnsembleParameters
+{
+    FLOAT fSmoothlen;
+    FLOAT fPressureStiffness;
+    FLOAT fRestDensity;
+    FLOAT fParticleMass;
+    FLOAT fViscosity;
+    FLOAT fSpringK;
+    FLOAT fExternalK;
+};
+
+const UINT MAX_UNIVERSES = 64;
+UINT g_iNumUniverses = 1;
+UINT g_iViewUniverse = 0;
+EnsembleParameters g_EnsembleSweepMin = { g_fSmoothlen, g_fPressureStiffness, g_fRestDensity, g_fParticleMass, g_fViscosity, 0.7f * g_fSpringK, g_fExternalK };
+EnsembleParameters g_EnsembleSweepMax = { g_fSmoothlen, g_fPressureStiffness, g_fRestDensity, g_fParticleMass, g_fViscosity, 1.4f * g_fSpringK, g_fExternalK };
+
 //--------------------------------------------------------------------------------------
 // Direct3D11 Global variables
 //--------------------------------------------------------------------------------------
@@ -120,6 +238,272 @@ CDXUTDialog                         g_SampleUI;              // dialog for sampl
 // Resources
 CDXUTTextHelper*                    g_pTxtHelper = nullptr;
 
+// Stage Timings
+// Timestamp queries around every stage, exported by the Save Timings button
+CGPUStageTimer                      g_GPUStageTimer;
+const char* const                   TIMINGS_TRACE_PATH = "EWT_Trace.json";
+const char* const                   TIMINGS_TABLE_PATH = "EWT_Stages.txt";
+
+// Parity snapshots, checked offline against the CPU simulator with ParityCheck
+const char* const                   PARITY_SNAPSHOT_PATH = "EWT_Parity.snap";
+const UINT                          PARITY_STEPS = 16;
+
+// Recording
+// The scene (without the HUD) is copied out of the back buffer every frame through the
+// readback ring and encoded on the encoder's threads. A copy is mapped g_iCaptureLatency
+// frames after it was made, once its fence signalled, so the renderer never waits for
+// the GPU; more latency rides out longer GPU frames. Frames are dropped rather than
+// stalling the renderer while the ring or the encoder is full. A video keeps the size
+// of its first frame; frames after the window is resized are counted as errors.
+CFrameEncoder                       g_FrameEncoder;
+CGPUReadbackRing                    g_CaptureReadback;
+UINT                                g_iCaptureLatency = 2;             // Frames, the ring has one slot more
+const UINT                          MAX_CAPTURE_LATENCY = 7;
+const char* const                   RECORDING_PATH = "EWT_Recording.y4m";
+const UINT                          RECORDING_FRAME_RATE = 60;
+
+// Trajectory
+// Record Trajectory writes every step of the fixed count paths to TRAJECTORY_PATH. The
+// particles and densities come back through their own readback ring, which stalls the
+// simulation rather than dropping a step, and are written on the ring's worker. Replay
+// stops the simulation and plays the file back at the rate it was recorded, looping;
+// the slider seeks. Leaving the replay restarts the simulation from the lattice.
+CTrajectoryWriter                   g_TrajectoryWriter;
+CGPUReadbackRing                    g_TrajectoryReadback;
+std::vector<FluidParticle>          g_TrajectoryParticles;             // Worker only, until their densities arrive
+std::vector<float>                  g_TrajectoryDensities;
+CTrajectoryReader                   g_TrajectoryReader;
+std::vector<FluidParticle>          g_ReplayParticles;
+std::vector<float>                  g_ReplayDensities;
+bool                                g_bReplay = false;                 // Simulation thread
+double                              g_fReplayTime = 0;
+size_t                              g_iReplayFrame = 0;
+size_t                              g_iReplayUploaded = SIZE_MAX;      // Frame in g_pParticles
+UINT                                g_iReplayParticles = 0;
+const char* const                   TRAJECTORY_PATH = "EWT_Trajectory.traj";
+const UINT                          TRAJECTORY_KEYFRAME_INTERVAL = 32;
+const UINT                          TRAJECTORY_READBACK_LATENCY = 2;   // Steps
+const UINT                          REPLAY_SLIDER_RANGE = 1000;
+
+// Coarse Output
+// Coarse Output writes the coarse fields of every grid mode step to COARSE_FIELDS_PATH,
+// summed by CoarseGrainCS from the sorted cells before the integration, and the particles
+// of every COARSE_DUMP_INTERVAL-th step to COARSE_DUMP_PATH. Both come back through one
+// readback ring, which stalls rather than drops, and are written on its worker. The
+// radial profiles are left to the CPU reducer (CoarseGrain.h).
+CCoarseFieldWriter                  g_CoarseFieldWriter;
+CTrajectoryWriter                   g_CoarseDumpWriter;
+CGPUReadbackRing                    g_CoarseReadback;
+CoarseGrainFrame                    g_CoarseFrame;                     // Worker only
+std::vector<FluidParticle>          g_CoarseDumpParticles;             // Worker only, until their densities arrive
+std::vector<float>                  g_CoarseDumpDensities;
+ID3D11ComputeShader*                g_pCoarseGrainCS = nullptr;
+ID3D11Buffer*                       g_pCoarseCells = nullptr;
+ID3D11ShaderResourceView*           g_pCoarseCellsSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pCoarseCellsUAV = nullptr;
+const char* const                   COARSE_FIELDS_PATH = "EWT_Coarse.cfld";
+const char* const                   COARSE_DUMP_PATH = "EWT_Coarse.traj";
+const UINT                          COARSE_DUMP_INTERVAL = 256;        // Steps
+const UINT                          COARSE_CELL_BLOCK = 4;             // Must match COARSE_CELL_BLOCK in FluidCS11.hlsl
+const UINT                          COARSE_GRID_DIM = 256 / COARSE_CELL_BLOCK;
+const UINT                          COARSE_READBACK_LATENCY = 2;       // Steps
+
+// Step Statistics
+// With Step Statistics on, grid mode steps integrate with IntegrateStatisticsCS, which
+// also writes a StatisticsBlock per group of particles and the speed and density
+// histograms, so nothing passes over the particles again. Both come back through a
+// readback ring that drops rather than stalls; its worker sums the blocks into
+// g_StepStatistics for the HUD and logs every STATISTICS_LOG_INTERVAL-th step.
+struct StatisticsBlock
+{
+    UINT iCount;
+    FLOAT fKineticEnergy;                   // Per unit mass
+    FLOAT fElasticEnergy;
+    XMFLOAT2 vMomentum;
+    FLOAT fMaxSpeed;
+    FLOAT fMinDensity;
+    FLOAT fMaxDensity;
+};
+
+CGPUReadbackRing                    g_StatisticsReadback;
+bool                                g_bStatisticsIssued = false;       // The last step wrote the blocks
+FluidStepStatistics                 g_StatisticsBlocksSum;             // Worker only, until the histograms arrive
+UINT64                              g_iStatisticsBlocksStep = 0;
+std::mutex                          g_StatisticsMutex;
+FluidStepStatistics                 g_StepStatistics;                  // Guarded by g_StatisticsMutex
+UINT64                              g_iStepStatisticsStep = 0;         // Same, 0 before the first
+ID3D11ComputeShader*                g_pIntegrateStatisticsCS = nullptr;
+ID3D11Buffer*                       g_pStatisticsBlocks = nullptr;
+ID3D11ShaderResourceView*           g_pStatisticsBlocksSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pStatisticsBlocksUAV = nullptr;
+ID3D11Buffer*                       g_pStatisticsHistogram = nullptr;
+ID3D11ShaderResourceView*           g_pStatisticsHistogramSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pStatisticsHistogramUAV = nullptr;
+const UINT                          STATISTICS_READBACK_LATENCY = 2;   // Steps
+const UINT                          STATISTICS_LOG_INTERVAL = 256;     // Steps
+
+// Render Mode
+// The heatmap modes bin the particles into a grid of HEATMAP_BIN_SIZE pixel bins and
+// colour the bins, see HeatmapCS in FluidRender.hlsl. They need feature level 11; below
+// it the sprites are drawn in every mode.
+enum eRenderMode
+{
+    RENDER_MODE_SPRITES,
+    RENDER_MODE_HEATMAP_COUNT,
+    RENDER_MODE_HEATMAP_DENSITY,
+    RENDER_MODE_HEATMAP_DISPLACEMENT
+};
+
+eRenderMode                         g_eRenderMode = RENDER_MODE_SPRITES;
+const UINT                          HEATMAP_BIN_SIZE = 2;
+const UINT                          HEATMAP_BLOCK_SIZE = 256;          // HeatmapCS
+const FLOAT                         HEATMAP_DENSITY_SCALE = 16.0f;     // Fixed point of the summed quantities
+const FLOAT                         HEATMAP_DISPLACEMENT_SCALE = 65536.0f;
+const FLOAT                         HEATMAP_DISPLACEMENT_RANGE = 0.1f; // Colour ramp upper end
+ID3D11ComputeShader*                g_pHeatmapCS = nullptr;
+ID3D11VertexShader*                 g_pHeatmapVS = nullptr;
+ID3D11PixelShader*                  g_pHeatmapPS = nullptr;
+ID3D11Buffer*                       g_pHeatmap = nullptr;              // Count and sum of every bin
+ID3D11ShaderResourceView*           g_pHeatmapSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pHeatmapUAV = nullptr;
+UINT                                g_iHeatmapWidth = 0;
+UINT                                g_iHeatmapHeight = 0;
+
+// Camera
+// The view shows the map scaled by 1 / g_fCameraZoom around g_vCameraCenter. The right
+// mouse button pans, the wheel zooms around the cursor.
+XMFLOAT2                            g_vCameraCenter( g_fMapWidth / 2.0f, g_fMapHeight / 2.0f );
+FLOAT                               g_fCameraZoom = 1.0f;
+const FLOAT                         CAMERA_MIN_ZOOM = 1.0f / 16.0f;
+const FLOAT                         CAMERA_MAX_ZOOM = 256.0f;
+bool                                g_bCameraDrag = false;
+POINT                               g_ptCameraDrag = {};
+
+// Level of Detail
+// Nodes of 2^k x 2^k grid cells built from the sorted cell ranges of the grid mode, see
+// LodBuildCS in FluidRender.hlsl. Cells larger than LOD_SPLAT_PIXELS on screen draw the
+// particles of the visible cells, smaller ones a splat per visible node.
+struct LodNode
+{
+    XMFLOAT2 vPosition;
+    FLOAT fDensity;
+    FLOAT fRamp;
+    FLOAT fCount;
+};
+
+bool                                g_bLod = true;
+const UINT                          LOD_GRID_DIM = 256;                // Cells of the grid on a side
+const UINT                          LOD_LEVELS = 9;                    // 256 x 256 nodes down to 1
+const UINT                          LOD_NUM_NODES = (4 * 65536 - 1) / 3;
+const UINT                          LOD_BLOCK_SIZE = 256;
+const FLOAT                         LOD_SPLAT_PIXELS = 3.0f;
+INT                                 g_iLodLevel = -1;                  // Drawn by the last frame, -1 for particles
+ID3D11ComputeShader*                g_pLodBuildCS = nullptr;
+ID3D11ComputeShader*                g_pLodReduceCS = nullptr;
+ID3D11ComputeShader*                g_pLodCullCS = nullptr;
+ID3D11VertexShader*                 g_pParticleLodVS = nullptr;
+ID3D11VertexShader*                 g_pLodNodeVS = nullptr;
+ID3D11Buffer*                       g_pLodRows = nullptr;              // Visible rows, see LodCullCS
+ID3D11ShaderResourceView*           g_pLodRowsSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pLodRowsUAV = nullptr;
+ID3D11Buffer*                       g_pLodArgs = nullptr;              // Particles of the visible rows
+ID3D11ShaderResourceView*           g_pLodArgsSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pLodArgsUAV = nullptr;
+
+// Simulation Thread
+// SimulateFluid runs on its own thread, so a slow frame or a dragged, resized or
+// minimised window (DXUTPause) does not stall the physics. The thread owns the simulation
+// globals; the UI sends it changes through g_SimCommands and it hands every completed
+// step to the renderer through g_RenderStates, so the two run at independent rates.
+// Both share the immediate context under its lock (CContextLock), each holding it for
+// a whole step or frame.
+enum eSimCommand
+{
+    SIM_COMMAND_RESET,
+    SIM_COMMAND_NUM_PARTICLES,
+    SIM_COMMAND_NUM_UNIVERSES,
+    SIM_COMMAND_BOUNDARIES,
+    SIM_COMMAND_NEIGHBOUR_LISTS,
+    SIM_COMMAND_DYNAMIC_PARTICLES,
+    SIM_COMMAND_GRAVITY,
+    SIM_COMMAND_SIM_MODE,
+    SIM_COMMAND_PARITY_SNAPSHOT,
+    SIM_COMMAND_RECORD_TRAJECTORY,
+    SIM_COMMAND_REPLAY,
+    SIM_COMMAND_REPLAY_SEEK,
+    SIM_COMMAND_COARSE_OUTPUT,
+    SIM_COMMAND_STATISTICS
+};
+
+struct SimCommand
+{
+    eSimCommand eType;
+    UINT iValue;
+    XMFLOAT2 vValue;
+};
+
+// The particles of a completed step, copied out of the simulation buffers so the
+// renderer never binds a buffer a later step writes
+struct RenderState
+{
+    ID3D11Buffer* pParticles;
+    ID3D11ShaderResourceView* pParticlesSRV;
+    ID3D11Buffer* pDensity;
+    ID3D11ShaderResourceView* pDensitySRV;
+    ID3D11Buffer* pDrawArgs;                // Copy of g_pParticleCount for the indirect draw
+    ID3D11ShaderResourceView* pDrawArgsSRV; // Live count of the heatmap
+    ID3D11Buffer* pGridIndices;             // Copy of the cell ranges of g_pGridIndices
+    ID3D11ShaderResourceView* pGridIndicesSRV;
+    ID3D11Buffer* pLod;                     // Level of detail nodes of the particles
+    ID3D11ShaderResourceView* pLodSRV;
+    ID3D11UnorderedAccessView* pLodUAV;
+    UINT iCapacity;                         // Particles the buffers hold
+    UINT iNumParticles;                     // Per universe
+    UINT iNumUniverses;
+    UINT iNumLiveParticles;
+    UINT iDynamicSlots;
+    bool bDynamic;
+    bool bNeighbourLists;                   // Grid mode with neighbour lists
+    bool bLod;                              // The particles are sorted by cell and pLod holds their nodes
+    bool bRecordingTrajectory;
+    bool bCoarseOutput;
+    bool bStatistics;
+    bool bReplay;                           // The particles are a recorded frame
+    UINT iReplayFrame;
+    UINT iNumReplayFrames;
+    UINT64 iReplayStep;                     // Step of the recorded run
+    UINT64 iStep;                           // 0 until a step has been published
+};
+
+ID3D10Multithread*                  g_pMultithread = nullptr;
+std::thread                         g_SimulationThread;
+std::atomic<bool>                   g_bStopSimulation( false );
+CSPSCQueue< SimCommand, 64 >        g_SimCommands;
+CTripleBuffer< RenderState >        g_RenderStates;
+ID3D11Query*                        g_pStepDoneQuery = nullptr; // Keeps the thread one step ahead of the GPU
+UINT64                              g_iSimulationStep = 0;
+double                              g_fSimulationTime = 0;             // Simulated seconds, stored with the trajectory
+
+// Steps per second shown by the HUD, measured by the renderer
+double                              g_fRateTime = 0;
+UINT64                              g_iRateStep = 0;
+FLOAT                               g_fSimulationRate = 0;
+
+//--------------------------------------------------------------------------------------
+// Holds the immediate context's lock for a scope. It is the runtime's own lock
+// (ID3D10Multithread), so the calls DXUT makes outside the callbacks, such as Present,
+// are serialised with the simulation thread as well
+//--------------------------------------------------------------------------------------
+class CContextLock
+{
+public:
+    CContextLock() { if ( g_pMultithread ) g_pMultithread->Enter(); }
+    ~CContextLock() { if ( g_pMultithread ) g_pMultithread->Leave(); }
+
+    CContextLock( const CContextLock& ) = delete;
+    CContextLock& operator=( const CContextLock& ) = delete;
+};
+
 // Shaders
 ID3D11VertexShader*                 g_pParticleVS = nullptr;
 ID3D11GeometryShader*               g_pParticleGS = nullptr;
@@ -135,8 +519,22 @@ ID3D11ComputeShader*                g_pDensity_SharedCS = nullptr;
 ID3D11ComputeShader*                g_pForce_SharedCS = nullptr;
 ID3D11ComputeShader*                g_pDensity_GridCS = nullptr;
 ID3D11ComputeShader*                g_pForce_GridCS = nullptr;
+ID3D11ComputeShader*                g_pDensity_GridListCS = nullptr;
+ID3D11ComputeShader*                g_pForce_GridListCS = nullptr;
 ID3D11ComputeShader*                g_pIntegrateCS = nullptr;
 
+ID3D11ComputeShader*                g_pBuildGrid_EnsembleCS = nullptr;
+ID3D11ComputeShader*                g_pBuildGridIndices_EnsembleCS = nullptr;
+ID3D11ComputeShader*                g_pRearrangeParticles_EnsembleCS = nullptr;
+ID3D11ComputeShader*                g_pDensity_EnsembleCS = nullptr;
+ID3D11ComputeShader*                g_pForce_EnsembleCS = nullptr;
+
+ID3D11ComputeShader*                g_pIntegrateDynamicCS = nullptr;
+ID3D11ComputeShader*                g_pScanParticlesCS = nullptr;
+ID3D11ComputeShader*                g_pScanBlockSumsCS = nullptr;
+ID3D11ComputeShader*                g_pCompactParticlesCS = nullptr;
+ID3D11ComputeShader*                g_pSpawnParticlesCS = nullptr;
+
 ID3D11ComputeShader*                g_pSortBitonic = nullptr;
 ID3D11ComputeShader*                g_pSortTranspose = nullptr;
 
@@ -169,6 +567,46 @@ ID3D11Buffer*                       g_pGridIndices = nullptr;
 ID3D11ShaderResourceView*           g_pGridIndicesSRV = nullptr;
 ID3D11UnorderedAccessView*          g_pGridIndicesUAV = nullptr;
 
+ID3D11Buffer*                       g_pUniverses = nullptr;
+ID3D11ShaderResourceView*           g_pUniversesSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pUniversesUAV = nullptr;
+
+ID3D11Buffer*                       g_pBoundarySDF = nullptr;
+ID3D11ShaderResourceView*           g_pBoundarySDFSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pBoundarySDFUAV = nullptr;
+
+ID3D11Buffer*                       g_pNeighbourList = nullptr;
+ID3D11ShaderResourceView*           g_pNeighbourListSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pNeighbourListUAV = nullptr;
+
+ID3D11Buffer*                       g_pNeighbourCount = nullptr;
+ID3D11ShaderResourceView*           g_pNeighbourCountSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pNeighbourCountUAV = nullptr;
+
+ID3D11Buffer*                       g_pParticleAlive = nullptr;
+ID3D11ShaderResourceView*           g_pParticleAliveSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pParticleAliveUAV = nullptr;
+
+ID3D11Buffer*                       g_pParticleScan = nullptr;
+ID3D11ShaderResourceView*           g_pParticleScanSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pParticleScanUAV = nullptr;
+
+ID3D11Buffer*                       g_pBlockSums = nullptr;
+ID3D11ShaderResourceView*           g_pBlockSumsSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pBlockSumsUAV = nullptr;
+
+ID3D11Buffer*                       g_pSpawnParticles = nullptr;
+ID3D11ShaderResourceView*           g_pSpawnParticlesSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pSpawnParticlesUAV = nullptr;
+
+// Live count, draw arguments and dispatch arguments, see ParticleCountRW in FluidCS11.hlsl
+const UINT PARTICLE_COUNT_SIZE = 8;
+const UINT DISPATCH_ARGS_OFFSET = 4 * sizeof(UINT);
+ID3D11Buffer*                       g_pParticleCount = nullptr;
+ID3D11ShaderResourceView*           g_pParticleCountSRV = nullptr;
+ID3D11UnorderedAccessView*          g_pParticleCountUAV = nullptr;
+ID3D11Buffer*                       g_pParticleCountStaging = nullptr;
+
 //Blend state to render particles (with a touch of translucency)
 ID3D11BlendState*					g_pParticleBlendState = nullptr;
 
@@ -191,12 +629,47 @@ __declspec(align(16)) struct CBSimulationConstants
     XMFLOAT4A vGridDim;
 
     XMFLOAT3A vPlanes[4];
+
+    XMFLOAT4A vBoundaryDim;
+    UINT iBoundaryWidth;
+    UINT iBoundaryHeight;
+
+    UINT iDynamicParticles;
+    UINT iNumSpawn;
+    XMFLOAT4A vAbsorbBounds;
 };
 
 __declspec(align(16)) struct CBRenderConstants
 {
     XMFLOAT4X4 mViewProjection;
     FLOAT fParticleSize;
+    UINT iParticleOffset;
+
+    UINT iHeatmapWidth;
+    UINT iHeatmapHeight;
+    UINT iHeatmapBinSize;
+    UINT iHeatmapQuantity;
+    UINT iHeatmapParticles;
+    UINT iHeatmapDynamic;
+    FLOAT fHeatmapLower;
+    FLOAT fHeatmapUpper;
+    FLOAT fHeatmapScale;
+    FLOAT fScreenWidth;
+    FLOAT fScreenHeight;
+
+    UINT iLodX0;
+    UINT iLodY0;
+    UINT iLodX1;
+    UINT iLodY1;
+    UINT iLodOffset;
+    UINT iLodDim;
+};
+
+__declspec(align(16)) struct CBLodConstants
+{
+    UINT iLodSrcOffset;
+    UINT iLodDstOffset;
+    UINT iLodDstDim;
 };
 
 __declspec(align(16)) struct SortCB
@@ -211,6 +684,7 @@ __declspec(align(16)) struct SortCB
 // Constant Buffers
 ID3D11Buffer*                       g_pcbSimulationConstants = nullptr;
 ID3D11Buffer*                       g_pcbRenderConstants = nullptr;
+ID3D11Buffer*                       g_pcbLodConstants = nullptr;
 ID3D11Buffer*                       g_pSortCB = nullptr;
 
 //--------------------------------------------------------------------------------------
@@ -227,6 +701,23 @@ ID3D11Buffer*                       g_pSortCB = nullptr;
 #define IDC_SIMSIMPLE             9
 #define IDC_SIMSHARED             10
 #define IDC_SIMGRID               11
+#define IDC_BOUNDARIES            12
+#define IDC_NUMUNIVERSES          13
+#define IDC_VIEWUNIVERSE          14
+#define IDC_NEIGHBOURLISTS        15
+#define IDC_DYNAMICPARTICLES      16
+#define IDC_SAVETIMINGS           17
+#define IDC_PARITYSNAPSHOT        18
+#define IDC_RECORD                19
+#define IDC_RENDERMODE            20
+#define IDC_LOD                   21
+#define IDC_RESETVIEW             22
+#define IDC_CAPTURELATENCY        23
+#define IDC_RECORDTRAJECTORY      24
+#define IDC_REPLAY                25
+#define IDC_REPLAYSEEK            26
+#define IDC_COARSEOUTPUT          27
+#define IDC_STATISTICS            28
 
 //--------------------------------------------------------------------------------------
 // Forward declarations 
@@ -248,8 +739,32 @@ void CALLBACK OnD3D11FrameRender( ID3D11Device* pd3dDevice, ID3D11DeviceContext*
                                   float fElapsedTime, void* pUserContext );
 
 HRESULT CreateSimulationBuffers( ID3D11Device* pd3dDevice );
+HRESULT ReserveParticleBuffers( ID3D11Device* pd3dDevice, UINT iNumParticles );
+bool IsDynamicParticles();
+UINT GetDynamicParticleSlots();
+EnsembleParameters GetUniverseParameters( UINT iUniverse, UINT iNumUniverses );
+HRESULT CreateBoundaryBuffers( ID3D11Device* pd3dDevice );
 void InitApp();
-void RenderText();
+void RenderText( const RenderState& state );
+void SaveTimings();
+void SaveParitySnapshot();
+void StartRecording();
+void StopRecording();
+HRESULT CreateCaptureReadback( ID3D11Device* pd3dDevice );
+void CaptureFrame( ID3D11DeviceContext* pd3dImmediateContext );
+void StartTrajectory();
+void StopTrajectory( ID3D11DeviceContext* pd3dImmediateContext );
+void StartCoarseOutput();
+void StopCoarseOutput( ID3D11DeviceContext* pd3dImmediateContext );
+void CoarseGrainStep( ID3D11DeviceContext* pd3dImmediateContext, UINT64 iStep, double fTime );
+void StartStatistics();
+void StopStatistics( ID3D11DeviceContext* pd3dImmediateContext );
+void ReadStatisticsStep( ID3D11DeviceContext* pd3dImmediateContext );
+void StartReplay();
+void StopReplay( ID3D11Device* pd3dDevice );
+void StartSimulationThread();
+void StopSimulationThread();
+void PostSimCommand( eSimCommand eType, UINT iValue = 0, XMFLOAT2 vValue = XMFLOAT2( 0, 0 ) );
 
 //--------------------------------------------------------------------------------------
 // Entry point to the program. Initializes everything and goes into a message processing 
@@ -313,6 +828,38 @@ void InitApp()
     g_SampleUI.GetComboBox( IDC_NUMPARTICLES )->AddItem( L"64K Particles", UIntToPtr(NUM_PARTICLES_64K) );
     g_SampleUI.GetComboBox( IDC_NUMPARTICLES )->SetSelectedByData( UIntToPtr(g_iNumParticles) );
 
+    g_SampleUI.AddComboBox( IDC_NUMUNIVERSES, 0, iY += 26, 170, 22 );
+    g_SampleUI.GetComboBox( IDC_NUMUNIVERSES )->AddItem( L"1 Universe", UIntToPtr(1) );
+    g_SampleUI.GetComboBox( IDC_NUMUNIVERSES )->AddItem( L"4 Universes", UIntToPtr(4) );
+    g_SampleUI.GetComboBox( IDC_NUMUNIVERSES )->AddItem( L"16 Universes", UIntToPtr(16) );
+    g_SampleUI.GetComboBox( IDC_NUMUNIVERSES )->AddItem( L"64 Universes", UIntToPtr(MAX_UNIVERSES) );
+    g_SampleUI.GetComboBox( IDC_NUMUNIVERSES )->SetSelectedByData( UIntToPtr(g_iNumUniverses) );
+    g_SampleUI.AddSlider( IDC_VIEWUNIVERSE, 0, iY += 26, 170, 22, 0, g_iNumUniverses - 1, g_iViewUniverse );
+
+    g_SampleUI.AddCheckBox( IDC_BOUNDARIES, L"SDF Boundaries", 0, iY += 26, 170, 22, g_bBoundaries );
+    g_SampleUI.AddCheckBox( IDC_NEIGHBOURLISTS, L"Neighbour Lists", 0, iY += 26, 170, 22, g_bNeighbourLists );
+    g_SampleUI.AddCheckBox( IDC_DYNAMICPARTICLES, L"Emit / Absorb", 0, iY += 26, 170, 22, g_bDynamicParticles );
+    g_SampleUI.AddButton( IDC_SAVETIMINGS, L"Save Timings", 0, iY += 26, 170, 22 );
+    g_SampleUI.AddButton( IDC_PARITYSNAPSHOT, L"Parity Snapshot", 0, iY += 26, 170, 22 );
+    g_SampleUI.AddCheckBox( IDC_RECORD, L"Record Video", 0, iY += 26, 170, 22, false );
+    g_SampleUI.AddSlider( IDC_CAPTURELATENCY, 0, iY += 26, 170, 22, 1, MAX_CAPTURE_LATENCY, g_iCaptureLatency );
+    g_SampleUI.AddCheckBox( IDC_RECORDTRAJECTORY, L"Record Trajectory", 0, iY += 26, 170, 22, false );
+    g_SampleUI.AddCheckBox( IDC_REPLAY, L"Replay Trajectory", 0, iY += 26, 170, 22, false );
+    g_SampleUI.AddSlider( IDC_REPLAYSEEK, 0, iY += 26, 170, 22, 0, REPLAY_SLIDER_RANGE, 0 );
+    g_SampleUI.AddCheckBox( IDC_COARSEOUTPUT, L"Coarse Output", 0, iY += 26, 170, 22, false );
+    g_SampleUI.AddCheckBox( IDC_STATISTICS, L"Step Statistics", 0, iY += 26, 170, 22, false );
+
+    g_SampleUI.AddComboBox( IDC_RENDERMODE, 0, iY += 26, 170, 22 );
+    g_SampleUI.GetComboBox( IDC_RENDERMODE )->AddItem( L"Sprites", UIntToPtr(RENDER_MODE_SPRITES) );
+    g_SampleUI.GetComboBox( IDC_RENDERMODE )->AddItem( L"Heatmap: Count", UIntToPtr(RENDER_MODE_HEATMAP_COUNT) );
+    g_SampleUI.GetComboBox( IDC_RENDERMODE )->AddItem( L"Heatmap: Density", UIntToPtr(RENDER_MODE_HEATMAP_DENSITY) );
+    g_SampleUI.GetComboBox( IDC_RENDERMODE )->AddItem( L"Heatmap: Displacement", UIntToPtr(RENDER_MODE_HEATMAP_DISPLACEMENT) );
+    g_SampleUI.GetComboBox( IDC_RENDERMODE )->SetSelectedByData( UIntToPtr(g_eRenderMode) );
+    g_SampleUI.AddCheckBox( IDC_LOD, L"Level of Detail", 0, iY += 26, 170, 22, g_bLod );
+    g_SampleUI.AddButton( IDC_RESETVIEW, L"Reset View", 0, iY += 26, 170, 22 );
+
+    GetStageProfiler().SetEnabled( true );
+
     /*g_SampleUI.AddComboBox( IDC_GRAVITY, 0, iY += 26, 170, 22 );
     g_SampleUI.GetComboBox( IDC_GRAVITY )->AddItem( L"Gravity Down", (void*)&GRAVITY_DOWN );
     g_SampleUI.GetComboBox( IDC_GRAVITY )->AddItem( L"Gravity Up", (void*)&GRAVITY_UP );
@@ -335,17 +882,112 @@ bool CALLBACK ModifyDeviceSettings( DXUTDeviceSettings* pDeviceSettings, void* p
 }
 
 
+//--------------------------------------------------------------------------------------
+// Upper edge of the histogram bin where the count reaches fFraction of the total
+//--------------------------------------------------------------------------------------
+float StatisticsPercentile( const uint32_t* pHistogram, float fMin, float fMax, float fFraction )
+{
+    UINT64 iTotal = 0;
+    for ( UINT i = 0 ; i < FLUID_STATISTICS_BINS ; i++ )
+        iTotal += pHistogram[i];
+
+    UINT64 iCount = 0;
+    for ( UINT i = 0 ; i < FLUID_STATISTICS_BINS ; i++ )
+    {
+        iCount += pHistogram[i];
+        if ( iCount >= fFraction * iTotal )
+            return fMin + (i + 1) * (fMax - fMin) / FLUID_STATISTICS_BINS;
+    }
+    return fMax;
+}
+
+
 //--------------------------------------------------------------------------------------
 // Render the help and statistics text
 //--------------------------------------------------------------------------------------
-void RenderText()
+void RenderText( const RenderState& state )
 {
     g_pTxtHelper->Begin();
     g_pTxtHelper->SetInsertionPos( 2, 0 );
     g_pTxtHelper->SetForegroundColor( Colors::Yellow );
     g_pTxtHelper->DrawTextLine( DXUTGetFrameStats( DXUTIsVsyncEnabled() ) );
     g_pTxtHelper->DrawTextLine( DXUTGetDeviceStats() );
-    g_pTxtHelper->DrawFormattedTextLine( L"%i Particles", g_iNumParticles );
+    g_pTxtHelper->DrawFormattedTextLine( L"Simulation: %.0f steps/s", g_fSimulationRate );
+    if ( state.bDynamic )
+        g_pTxtHelper->DrawFormattedTextLine( L"%u Particles (%u slots)", state.iNumLiveParticles, state.iDynamicSlots );
+    else
+        g_pTxtHelper->DrawFormattedTextLine( L"%u Particles", state.iNumParticles );
+    if ( state.iNumUniverses > 1 )
+    {
+        const UINT iView = std::min( g_iViewUniverse, state.iNumUniverses - 1 );
+        EnsembleParameters params = GetUniverseParameters( iView, state.iNumUniverses );
+        g_pTxtHelper->DrawFormattedTextLine( L"Universe %u of %u: h = %.4f, B = %.1f, k = %.3f", iView + 1, state.iNumUniverses,
+                                             params.fSmoothlen, params.fPressureStiffness, params.fSpringK );
+    }
+    else if ( state.bNeighbourLists )
+    {
+        // Fixed size, the lists never grow
+        const FLOAT fListMB = state.iNumParticles * (NEIGHBOUR_LIST_SIZE * sizeof(UINT) * 2 + sizeof(UINT)) / (1024.0f * 1024.0f);
+        g_pTxtHelper->DrawFormattedTextLine( L"Neighbour lists: %.1f MB (%u per particle)", fListMB, NEIGHBOUR_LIST_SIZE );
+    }
+    if ( g_eRenderMode == RENDER_MODE_SPRITES && state.bLod && g_bLod )
+    {
+        if ( g_iLodLevel < 0 )
+            g_pTxtHelper->DrawFormattedTextLine( L"View: %.2fx, particles of the visible cells", g_fCameraZoom );
+        else
+            g_pTxtHelper->DrawFormattedTextLine( L"View: %.2fx, LOD level %d (%u x %u cells per splat)", g_fCameraZoom, g_iLodLevel,
+                                                 1u << g_iLodLevel, 1u << g_iLodLevel );
+    }
+    else
+    {
+        g_pTxtHelper->DrawFormattedTextLine( L"View: %.2fx", g_fCameraZoom );
+    }
+    if ( g_FrameEncoder.IsOpen() )
+    {
+        const FrameEncoderReport report = g_FrameEncoder.GetReport();
+        const GPUReadbackReport readback = g_CaptureReadback.GetReport();
+        g_pTxtHelper->DrawFormattedTextLine( L"Recording: %llu frames, %llu dropped (%llu in readback, %u frames latency)", report.iWritten,
+                                             report.iDropped + readback.iDropped, readback.iDropped, g_iCaptureLatency );
+    }
+    if ( state.bRecordingTrajectory )
+    {
+        // Particles and densities are two readbacks a step
+        const GPUReadbackReport readback = g_TrajectoryReadback.GetReport();
+        g_pTxtHelper->DrawFormattedTextLine( L"Recording trajectory: %llu steps, stalled %llu times (%.0f ms)", readback.iCompleted / 2,
+                                             readback.iStalled, readback.fStalledMs );
+    }
+    if ( state.bCoarseOutput )
+    {
+        // One readback a step, two more on the dump steps
+        const GPUReadbackReport readback = g_CoarseReadback.GetReport();
+        g_pTxtHelper->DrawFormattedTextLine( L"Coarse output: %llu readbacks, a dump every %u steps, stalled %llu times (%.0f ms)",
+                                             readback.iCompleted, COARSE_DUMP_INTERVAL, readback.iStalled, readback.fStalledMs );
+    }
+    if ( state.bStatistics )
+    {
+        FluidStepStatistics stats;
+        UINT64 iStep;
+        {
+            std::lock_guard<std::mutex> lock( g_StatisticsMutex );
+            stats = g_StepStatistics;
+            iStep = g_iStepStatisticsStep;
+        }
+        if ( iStep > 0 )
+        {
+            g_pTxtHelper->DrawFormattedTextLine( L"Step %llu: kinetic %.3e, elastic %.3e, total %.3e, momentum (%.2e, %.2e)", iStep,
+                                                 stats.fKineticEnergy, stats.fElasticEnergy, stats.fKineticEnergy + stats.fElasticEnergy,
+                                                 stats.fMomentumX, stats.fMomentumY );
+            g_pTxtHelper->DrawFormattedTextLine( L"Speed: 99%% below %.4f, max %.4f; density %.0f to %.0f",
+                                                 StatisticsPercentile( stats.SpeedHistogram, 0, FLUID_STATISTICS_MAX_SPEED, 0.99f ),
+                                                 stats.fMaxSpeed, stats.fMinDensity, stats.fMaxDensity );
+        }
+        else
+        {
+            g_pTxtHelper->DrawFormattedTextLine( L"Step statistics: grid mode, one universe only" );
+        }
+    }
+    if ( state.bReplay )
+        g_pTxtHelper->DrawFormattedTextLine( L"Replay: step %llu, frame %u of %u", state.iReplayStep, state.iReplayFrame + 1, state.iNumReplayFrames );
 
     g_pTxtHelper->End();
 }
@@ -377,12 +1019,55 @@ LRESULT CALLBACK MsgProc( HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, bo
     if( *pbNoFurtherProcessing )
         return 0;
 
+    // Camera
+    const DXGI_SURFACE_DESC* pBackBufferDesc = DXUTGetDXGIBackBufferSurfaceDesc();
+    const FLOAT fViewWidth = g_fMapWidth / g_fCameraZoom;
+    const FLOAT fViewHeight = g_fMapHeight / g_fCameraZoom;
+    if ( pBackBufferDesc->Width == 0 || pBackBufferDesc->Height == 0 )
+        return 0;
+    switch ( uMsg )
+    {
+        case WM_RBUTTONDOWN:
+            g_bCameraDrag = true;
+            g_ptCameraDrag = { (short)LOWORD( lParam ), (short)HIWORD( lParam ) };
+            SetCapture( hWnd );
+            break;
+        case WM_RBUTTONUP:
+            g_bCameraDrag = false;
+            ReleaseCapture();
+            break;
+        case WM_MOUSEMOVE:
+            if ( g_bCameraDrag )
+            {
+                const POINT pt = { (short)LOWORD( lParam ), (short)HIWORD( lParam ) };
+                g_vCameraCenter.x -= (pt.x - g_ptCameraDrag.x) * fViewWidth / pBackBufferDesc->Width;
+                g_vCameraCenter.y += (pt.y - g_ptCameraDrag.y) * fViewHeight / pBackBufferDesc->Height;
+                g_ptCameraDrag = pt;
+            }
+            break;
+        case WM_MOUSEWHEEL:
+        {
+            // Keep the point under the cursor in place
+            POINT pt = { (short)LOWORD( lParam ), (short)HIWORD( lParam ) };
+            ScreenToClient( hWnd, &pt );
+            const FLOAT fX = (FLOAT)pt.x / pBackBufferDesc->Width - 0.5f;
+            const FLOAT fY = 0.5f - (FLOAT)pt.y / pBackBufferDesc->Height;
+            const FLOAT fZoom = g_fCameraZoom * powf( 1.25f, (FLOAT)GET_WHEEL_DELTA_WPARAM( wParam ) / WHEEL_DELTA );
+            const FLOAT fNewZoom = std::min( std::max( fZoom, CAMERA_MIN_ZOOM ), CAMERA_MAX_ZOOM );
+            g_vCameraCenter.x += fX * (fViewWidth - g_fMapWidth / fNewZoom);
+            g_vCameraCenter.y += fY * (fViewHeight - g_fMapHeight / fNewZoom);
+            g_fCameraZoom = fNewZoom;
+            break;
+        }
+    }
+
     return 0;
 }
 
 
 //--------------------------------------------------------------------------------------
 // Handles the GUI events
+// Simulation changes are queued for the simulation thread, see ApplySimCommands
 //--------------------------------------------------------------------------------------
 void CALLBACK OnGUIEvent( UINT nEvent, int nControlID, CDXUTControl* pControl, void* pUserContext )
 {
@@ -396,19 +1081,94 @@ void CALLBACK OnGUIEvent( UINT nEvent, int nControlID, CDXUTControl* pControl, v
         case IDC_CHANGEDEVICE:
             g_D3DSettingsDlg.SetActive( !g_D3DSettingsDlg.IsActive() ); break;
         case IDC_RESETSIM:
-            CreateSimulationBuffers( DXUTGetD3D11Device() ); break;
+            PostSimCommand( SIM_COMMAND_RESET ); break;
         case IDC_NUMPARTICLES:
-            g_iNumParticles = PtrToUint( ((CDXUTComboBox*)pControl)->GetSelectedData() );
-            CreateSimulationBuffers( DXUTGetD3D11Device() );
+            PostSimCommand( SIM_COMMAND_NUM_PARTICLES, PtrToUint( ((CDXUTComboBox*)pControl)->GetSelectedData() ) ); break;
+        case IDC_NUMUNIVERSES:
+        {
+            const UINT iNumUniverses = PtrToUint( ((CDXUTComboBox*)pControl)->GetSelectedData() );
+            g_iViewUniverse = std::min( g_iViewUniverse, iNumUniverses - 1 );
+            g_SampleUI.GetSlider( IDC_VIEWUNIVERSE )->SetRange( 0, iNumUniverses - 1 );
+            PostSimCommand( SIM_COMMAND_NUM_UNIVERSES, iNumUniverses );
+            break;
+        }
+        case IDC_VIEWUNIVERSE:
+            g_iViewUniverse = ((CDXUTSlider*)pControl)->GetValue(); break;
+        case IDC_BOUNDARIES:
+            PostSimCommand( SIM_COMMAND_BOUNDARIES, ((CDXUTCheckBox*)pControl)->GetChecked() ); break;
+        case IDC_NEIGHBOURLISTS:
+            PostSimCommand( SIM_COMMAND_NEIGHBOUR_LISTS, ((CDXUTCheckBox*)pControl)->GetChecked() ); break;
+        case IDC_DYNAMICPARTICLES:
+            PostSimCommand( SIM_COMMAND_DYNAMIC_PARTICLES, ((CDXUTCheckBox*)pControl)->GetChecked() ); break;
+        case IDC_SAVETIMINGS:
+            SaveTimings(); break;
+        case IDC_PARITYSNAPSHOT:
+            PostSimCommand( SIM_COMMAND_PARITY_SNAPSHOT ); break;
+        case IDC_RENDERMODE:
+            g_eRenderMode = (eRenderMode)PtrToUint( ((CDXUTComboBox*)pControl)->GetSelectedData() ); break;
+        case IDC_LOD:
+            g_bLod = ((CDXUTCheckBox*)pControl)->GetChecked(); break;
+        case IDC_RESETVIEW:
+            g_vCameraCenter = XMFLOAT2( g_fMapWidth / 2.0f, g_fMapHeight / 2.0f );
+            g_fCameraZoom = 1.0f;
             break;
+        case IDC_RECORD:
+            if ( ((CDXUTCheckBox*)pControl)->GetChecked() )
+                StartRecording();
+            else
+                StopRecording();
+            break;
+        case IDC_RECORDTRAJECTORY:
+        {
+            // A file cannot be replayed while it is written, nor recorded while replayed
+            const bool bRecord = ((CDXUTCheckBox*)pControl)->GetChecked();
+            if ( bRecord && g_SampleUI.GetCheckBox( IDC_REPLAY )->GetChecked() )
+            {
+                g_SampleUI.GetCheckBox( IDC_REPLAY )->SetChecked( false );
+                PostSimCommand( SIM_COMMAND_REPLAY, false );
+            }
+            PostSimCommand( SIM_COMMAND_RECORD_TRAJECTORY, bRecord );
+            break;
+        }
+        case IDC_REPLAY:
+        {
+            const bool bReplay = ((CDXUTCheckBox*)pControl)->GetChecked();
+            if ( bReplay && g_SampleUI.GetCheckBox( IDC_RECORDTRAJECTORY )->GetChecked() )
+            {
+                g_SampleUI.GetCheckBox( IDC_RECORDTRAJECTORY )->SetChecked( false );
+                PostSimCommand( SIM_COMMAND_RECORD_TRAJECTORY, false );
+            }
+            PostSimCommand( SIM_COMMAND_REPLAY, bReplay );
+            break;
+        }
+        case IDC_REPLAYSEEK:
+            PostSimCommand( SIM_COMMAND_REPLAY_SEEK, ((CDXUTSlider*)pControl)->GetValue() ); break;
+        case IDC_COARSEOUTPUT:
+            PostSimCommand( SIM_COMMAND_COARSE_OUTPUT, ((CDXUTCheckBox*)pControl)->GetChecked() ); break;
+        case IDC_STATISTICS:
+            PostSimCommand( SIM_COMMAND_STATISTICS, ((CDXUTCheckBox*)pControl)->GetChecked() ); break;
+        case IDC_CAPTURELATENCY:
+        {
+            // The ring is rebuilt, a recording keeps going with the frames in flight lost
+            CContextLock lock;
+            g_iCaptureLatency = ((CDXUTSlider*)pControl)->GetValue();
+            g_CaptureReadback.Discard( DXUTGetD3D11DeviceContext() );
+            if ( FAILED( CreateCaptureReadback( DXUTGetD3D11Device() ) ) )
+                OutputDebugStringA( "Could not create the capture readback ring\n" );
+            break;
+        }
         case IDC_GRAVITY:
-            g_vGravity = *(const XMFLOAT2A*)((CDXUTComboBox*)pControl)->GetSelectedData(); break;
+        {
+            const XMFLOAT2A& vGravity = *(const XMFLOAT2A*)((CDXUTComboBox*)pControl)->GetSelectedData();
+            PostSimCommand( SIM_COMMAND_GRAVITY, 0, XMFLOAT2( vGravity.x, vGravity.y ) );
+            break;
+        }
         case IDC_SIMSIMPLE:
-            g_eSimMode = SIM_MODE_SIMPLE; break;
+            PostSimCommand( SIM_COMMAND_SIM_MODE, SIM_MODE_SIMPLE ); break;
         case IDC_SIMSHARED:
-            g_eSimMode = SIM_MODE_SHARED; break;
+            PostSimCommand( SIM_COMMAND_SIM_MODE, SIM_MODE_SHARED ); break;
         case IDC_SIMGRID:
-            g_eSimMode = SIM_MODE_GRID; break;
+            PostSimCommand( SIM_COMMAND_SIM_MODE, SIM_MODE_GRID ); break;
     }
 }
 
@@ -485,17 +1245,95 @@ HRESULT CreateStructuredBuffer(ID3D11Device* pd3dDevice, UINT iNumElements, ID3D
 
 
 //--------------------------------------------------------------------------------------
-// Create the buffers used for the simulation data
+// Replace a structured buffer with a larger one, keeping the old contents at the start
 //--------------------------------------------------------------------------------------
-HRESULT CreateSimulationBuffers( ID3D11Device* pd3dDevice )
+template <class T>
+HRESULT GrowStructuredBuffer(ID3D11Device* pd3dDevice, UINT iNumElements, ID3D11Buffer** ppBuffer, ID3D11ShaderResourceView** ppSRV, ID3D11UnorderedAccessView** ppUAV)
 {
     HRESULT hr = S_OK;
 
-    // Destroy the old buffers in case the number of particles has changed
-    SAFE_RELEASE( g_pParticles );
-    SAFE_RELEASE( g_pParticlesSRV );
-    SAFE_RELEASE( g_pParticlesUAV );
-    
+    ID3D11Buffer* pBuffer = nullptr;
+    ID3D11ShaderResourceView* pSRV = nullptr;
+    ID3D11UnorderedAccessView* pUAV = nullptr;
+    V_RETURN( CreateStructuredBuffer< T >( pd3dDevice, iNumElements, &pBuffer, &pSRV, &pUAV ) );
+
+    if ( *ppBuffer )
+    {
+        D3D11_BUFFER_DESC oldDesc;
+        (*ppBuffer)->GetDesc( &oldDesc );
+        D3D11_BOX box = { 0, 0, 0, oldDesc.ByteWidth, 1, 1 };
+        DXUTGetD3D11DeviceContext()->CopySubresourceRegion( pBuffer, 0, 0, 0, 0, *ppBuffer, 0, &box );
+    }
+
+    SAFE_RELEASE( *ppBuffer );
+    SAFE_RELEASE( *ppSRV );
+    SAFE_RELEASE( *ppUAV );
+    *ppBuffer = pBuffer;
+    *ppSRV = pSRV;
+    *ppUAV = pUAV;
+
+    return hr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Helper for creating a buffer of UINTs that is written by a compute shader and read as
+// draw or dispatch arguments
+//--------------------------------------------------------------------------------------
+HRESULT CreateIndirectArgsBuffer(ID3D11Device* pd3dDevice, UINT iNumElements, ID3D11Buffer** ppBuffer, ID3D11ShaderResourceView** ppSRV, ID3D11UnorderedAccessView** ppUAV)
+{
+    HRESULT hr = S_OK;
+
+    D3D11_BUFFER_DESC bufferDesc = {};
+    bufferDesc.ByteWidth = iNumElements * sizeof(UINT);
+    bufferDesc.Usage = D3D11_USAGE_DEFAULT;
+    bufferDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
+    bufferDesc.MiscFlags = D3D11_RESOURCE_MISC_DRAWINDIRECT_ARGS;
+    V_RETURN( pd3dDevice->CreateBuffer( &bufferDesc, nullptr, ppBuffer ) );
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+    srvDesc.Format = DXGI_FORMAT_R32_UINT;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+    srvDesc.Buffer.ElementWidth = iNumElements;
+    V_RETURN( pd3dDevice->CreateShaderResourceView( *ppBuffer, &srvDesc, ppSRV ) );
+
+    D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+    uavDesc.Format = DXGI_FORMAT_R32_UINT;
+    uavDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+    uavDesc.Buffer.NumElements = iNumElements;
+    V_RETURN( pd3dDevice->CreateUnorderedAccessView( *ppBuffer, &uavDesc, ppUAV ) );
+
+    return hr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Make room for at least iNumParticles particles
+// Every per particle buffer grows to the next power of two and is never shrunk. The
+// particles and their alive flags keep their contents; the other buffers are rebuilt
+// by every step anyway
+//--------------------------------------------------------------------------------------
+HRESULT ReserveParticleBuffers( ID3D11Device* pd3dDevice, UINT iNumParticles )
+{
+    HRESULT hr = S_OK;
+
+    if ( iNumParticles <= g_iParticleCapacity )
+        return S_OK;
+
+    UINT iCapacity = std::max( g_iParticleCapacity, MIN_PARTICLE_CAPACITY );
+    while ( iCapacity < iNumParticles )
+        iCapacity *= 2;
+
+    V_RETURN( GrowStructuredBuffer< ParticleData >( pd3dDevice, iCapacity, &g_pParticles, &g_pParticlesSRV, &g_pParticlesUAV ) );
+    DXUT_SetDebugName( g_pParticles, "Particles" );
+    DXUT_SetDebugName( g_pParticlesSRV, "Particles SRV" );
+    DXUT_SetDebugName( g_pParticlesUAV, "Particles UAV" );
+
+    V_RETURN( GrowStructuredBuffer< UINT >( pd3dDevice, iCapacity, &g_pParticleAlive, &g_pParticleAliveSRV, &g_pParticleAliveUAV ) );
+    DXUT_SetDebugName( g_pParticleAlive, "Alive" );
+    DXUT_SetDebugName( g_pParticleAliveSRV, "Alive SRV" );
+    DXUT_SetDebugName( g_pParticleAliveUAV, "Alive UAV" );
+
     SAFE_RELEASE( g_pSortedParticles );
     SAFE_RELEASE( g_pSortedParticlesSRV );
     SAFE_RELEASE( g_pSortedParticlesUAV );
@@ -516,68 +1354,209 @@ HRESULT CreateSimulationBuffers( ID3D11Device* pd3dDevice )
     SAFE_RELEASE( g_pGridPingPongUAV );
     SAFE_RELEASE( g_pGridPingPong );
 
-    SAFE_RELEASE( g_pGridIndicesSRV );
-    SAFE_RELEASE( g_pGridIndicesUAV );
-    SAFE_RELEASE( g_pGridIndices );
+    SAFE_RELEASE( g_pNeighbourList );
+    SAFE_RELEASE( g_pNeighbourListSRV );
+    SAFE_RELEASE( g_pNeighbourListUAV );
 
-    // Create the initial particle positions
-    // This is only used to populate the GPU buffers on creation
-	const UINT iStartingWidth = (UINT)sqrt((FLOAT)g_iNumParticles);
+    SAFE_RELEASE( g_pNeighbourCount );
+    SAFE_RELEASE( g_pNeighbourCountSRV );
+    SAFE_RELEASE( g_pNeighbourCountUAV );
 
-    auto particles = std::make_unique<ParticleData[]>(g_iNumParticles);
-    ZeroMemory( particles.get(), sizeof(ParticleData) * g_iNumParticles );
-    for ( UINT i = 0 ; i < g_iNumParticles ; i++ )
-    {
-        // Arrange the particles in a nice square
-        UINT x = i % iStartingWidth;
-        UINT y = i / iStartingWidth;
-        particles[ i ].vPosition = XMFLOAT2( g_fInitialParticleSpacing * (FLOAT)x, g_fInitialParticleSpacing * (FLOAT)(/*iStartingWidth - */y) );
-		//particles[ i ].vIndex.x = FLOAT(x);
-		//particles[ i ].vIndex.y = FLOAT(y);
-		particles[i].vIndex = particles[i].vPosition;
-		particles[i].vCenter = XMFLOAT2(g_fInitialParticleSpacing * iStartingWidth / 2.f, g_fInitialParticleSpacing * iStartingWidth / 2.f);
-    }
+    SAFE_RELEASE( g_pParticleScan );
+    SAFE_RELEASE( g_pParticleScanSRV );
+    SAFE_RELEASE( g_pParticleScanUAV );
 
-    // Create Structured Buffers
-    V_RETURN( CreateStructuredBuffer< ParticleData >( pd3dDevice, g_iNumParticles, &g_pParticles, &g_pParticlesSRV, &g_pParticlesUAV, particles.get() ) );
-    DXUT_SetDebugName( g_pParticles, "Particles" );
-    DXUT_SetDebugName( g_pParticlesSRV, "Particles SRV" );
-    DXUT_SetDebugName( g_pParticlesUAV, "Particles UAV" );
+    SAFE_RELEASE( g_pBlockSums );
+    SAFE_RELEASE( g_pBlockSumsSRV );
+    SAFE_RELEASE( g_pBlockSumsUAV );
 
-    V_RETURN( CreateStructuredBuffer< ParticleData >( pd3dDevice, g_iNumParticles, &g_pSortedParticles, &g_pSortedParticlesSRV, &g_pSortedParticlesUAV, particles.get()) );
+    V_RETURN( CreateStructuredBuffer< ParticleData >( pd3dDevice, iCapacity, &g_pSortedParticles, &g_pSortedParticlesSRV, &g_pSortedParticlesUAV ) );
     DXUT_SetDebugName( g_pSortedParticles, "Sorted" );
     DXUT_SetDebugName( g_pSortedParticlesSRV, "Sorted SRV" );
     DXUT_SetDebugName( g_pSortedParticlesUAV, "Sorted UAV" );
 
-    V_RETURN( CreateStructuredBuffer< ParticleForces >( pd3dDevice, g_iNumParticles, &g_pParticleForces, &g_pParticleForcesSRV, &g_pParticleForcesUAV ) );
+    V_RETURN( CreateStructuredBuffer< ParticleForces >( pd3dDevice, iCapacity, &g_pParticleForces, &g_pParticleForcesSRV, &g_pParticleForcesUAV ) );
     DXUT_SetDebugName( g_pParticleForces, "Forces" );
     DXUT_SetDebugName( g_pParticleForcesSRV, "Forces SRV" );
     DXUT_SetDebugName( g_pParticleForcesUAV, "Forces UAV" );
 
-    V_RETURN( CreateStructuredBuffer< ParticleDensity >( pd3dDevice, g_iNumParticles, &g_pParticleDensity, &g_pParticleDensitySRV, &g_pParticleDensityUAV ) );
+    V_RETURN( CreateStructuredBuffer< ParticleDensity >( pd3dDevice, iCapacity, &g_pParticleDensity, &g_pParticleDensitySRV, &g_pParticleDensityUAV ) );
     DXUT_SetDebugName( g_pParticleDensity, "Density" );
     DXUT_SetDebugName( g_pParticleDensitySRV, "Density SRV" );
     DXUT_SetDebugName( g_pParticleDensityUAV, "Density UAV" );
 
-    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, g_iNumParticles, &g_pGrid, &g_pGridSRV, &g_pGridUAV ) );
+    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, iCapacity, &g_pGrid, &g_pGridSRV, &g_pGridUAV ) );
     DXUT_SetDebugName( g_pGrid, "Grid" );
     DXUT_SetDebugName( g_pGridSRV, "Grid SRV" );
     DXUT_SetDebugName( g_pGridUAV, "Grid UAV" );
 
-    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, g_iNumParticles, &g_pGridPingPong, &g_pGridPingPongSRV, &g_pGridPingPongUAV ) );
+    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, iCapacity, &g_pGridPingPong, &g_pGridPingPongSRV, &g_pGridPingPongUAV ) );
     DXUT_SetDebugName( g_pGridPingPong, "PingPong" );
     DXUT_SetDebugName( g_pGridPingPongSRV, "PingPong SRV" );
     DXUT_SetDebugName( g_pGridPingPongUAV, "PingPong UAV" );
 
-    V_RETURN( CreateStructuredBuffer< UINT2 >( pd3dDevice, NUM_GRID_INDICES, &g_pGridIndices, &g_pGridIndicesSRV, &g_pGridIndicesUAV ) );
-    DXUT_SetDebugName( g_pGridIndices, "Indices" );
-    DXUT_SetDebugName( g_pGridIndicesSRV, "Indices SRV" );
-    DXUT_SetDebugName( g_pGridIndicesUAV, "Indices UAV" );
+    // Only the single universe grid path uses the neighbour lists and the compaction
+    const UINT iSingleCapacity = std::min( iCapacity, MAX_DYNAMIC_PARTICLES );
+
+    V_RETURN( CreateStructuredBuffer< UINT2 >( pd3dDevice, iSingleCapacity * NEIGHBOUR_LIST_SIZE, &g_pNeighbourList, &g_pNeighbourListSRV, &g_pNeighbourListUAV ) );
+    DXUT_SetDebugName( g_pNeighbourList, "NeighbourList" );
+    DXUT_SetDebugName( g_pNeighbourListSRV, "NeighbourList SRV" );
+    DXUT_SetDebugName( g_pNeighbourListUAV, "NeighbourList UAV" );
+
+    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, iSingleCapacity, &g_pNeighbourCount, &g_pNeighbourCountSRV, &g_pNeighbourCountUAV ) );
+    DXUT_SetDebugName( g_pNeighbourCount, "NeighbourCount" );
+    DXUT_SetDebugName( g_pNeighbourCountSRV, "NeighbourCount SRV" );
+    DXUT_SetDebugName( g_pNeighbourCountUAV, "NeighbourCount UAV" );
+
+    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, iSingleCapacity, &g_pParticleScan, &g_pParticleScanSRV, &g_pParticleScanUAV ) );
+    DXUT_SetDebugName( g_pParticleScan, "Scan" );
+    DXUT_SetDebugName( g_pParticleScanSRV, "Scan SRV" );
+    DXUT_SetDebugName( g_pParticleScanUAV, "Scan UAV" );
+
+    V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, iSingleCapacity / SIMULATION_BLOCK_SIZE, &g_pBlockSums, &g_pBlockSumsSRV, &g_pBlockSumsUAV ) );
+    DXUT_SetDebugName( g_pBlockSums, "BlockSums" );
+    DXUT_SetDebugName( g_pBlockSumsSRV, "BlockSums SRV" );
+    DXUT_SetDebugName( g_pBlockSumsUAV, "BlockSums UAV" );
+
+    g_iParticleCapacity = iCapacity;
+
+    return hr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Create the buffers used for the simulation data and reset the simulation
+// Buffers come from the pool and are only reallocated when the new count does not fit
+//--------------------------------------------------------------------------------------
+HRESULT CreateSimulationBuffers( ID3D11Device* pd3dDevice )
+{
+    HRESULT hr = S_OK;
+    auto pd3dImmediateContext = DXUTGetD3D11DeviceContext();
+
+    // Every universe of the ensemble starts from the same lattice; a replay uploads its
+    // frame again
+    const UINT iTotalParticles = g_iNumParticles * g_iNumUniverses;
+    g_iReplayUploaded = SIZE_MAX;
+
+    V_RETURN( ReserveParticleBuffers( pd3dDevice, iTotalParticles ) );
+
+    if ( g_iNumUniverses > g_iUniverseCapacity )
+    {
+        SAFE_RELEASE( g_pGridIndicesSRV );
+        SAFE_RELEASE( g_pGridIndicesUAV );
+        SAFE_RELEASE( g_pGridIndices );
+
+        SAFE_RELEASE( g_pUniverses );
+        SAFE_RELEASE( g_pUniversesSRV );
+        SAFE_RELEASE( g_pUniversesUAV );
+
+        V_RETURN( CreateStructuredBuffer< UINT2 >( pd3dDevice, NUM_GRID_INDICES * g_iNumUniverses, &g_pGridIndices, &g_pGridIndicesSRV, &g_pGridIndicesUAV ) );
+        DXUT_SetDebugName( g_pGridIndices, "Indices" );
+        DXUT_SetDebugName( g_pGridIndicesSRV, "Indices SRV" );
+        DXUT_SetDebugName( g_pGridIndicesUAV, "Indices UAV" );
+
+        V_RETURN( CreateStructuredBuffer< UniverseConstants >( pd3dDevice, g_iNumUniverses, &g_pUniverses, &g_pUniversesSRV, &g_pUniversesUAV ) );
+        DXUT_SetDebugName( g_pUniverses, "Universes" );
+        DXUT_SetDebugName( g_pUniversesSRV, "Universes SRV" );
+        DXUT_SetDebugName( g_pUniversesUAV, "Universes UAV" );
+
+        g_iUniverseCapacity = g_iNumUniverses;
+    }
+
+    // Fixed size buffers of the dynamic particles. The count is an indirect argument
+    // buffer with a typed UAV, which feature level 10 cannot create
+    if ( !g_pParticleCount && g_pIntegrateDynamicCS )
+    {
+        V_RETURN( CreateIndirectArgsBuffer( pd3dDevice, PARTICLE_COUNT_SIZE, &g_pParticleCount, &g_pParticleCountSRV, &g_pParticleCountUAV ) );
+        DXUT_SetDebugName( g_pParticleCount, "ParticleCount" );
+        DXUT_SetDebugName( g_pParticleCountSRV, "ParticleCount SRV" );
+        DXUT_SetDebugName( g_pParticleCountUAV, "ParticleCount UAV" );
+
+        D3D11_BUFFER_DESC stagingDesc = {};
+        stagingDesc.ByteWidth = PARTICLE_COUNT_SIZE * sizeof(UINT);
+        stagingDesc.Usage = D3D11_USAGE_STAGING;
+        stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        V_RETURN( pd3dDevice->CreateBuffer( &stagingDesc, nullptr, &g_pParticleCountStaging ) );
+        DXUT_SetDebugName( g_pParticleCountStaging, "ParticleCount Staging" );
+
+        V_RETURN( CreateStructuredBuffer< ParticleData >( pd3dDevice, MAX_SPAWN_PER_STEP, &g_pSpawnParticles, &g_pSpawnParticlesSRV, &g_pSpawnParticlesUAV ) );
+        DXUT_SetDebugName( g_pSpawnParticles, "Spawn" );
+        DXUT_SetDebugName( g_pSpawnParticlesSRV, "Spawn SRV" );
+        DXUT_SetDebugName( g_pSpawnParticlesUAV, "Spawn UAV" );
+    }
+
+    // Create the initial particle positions
+    // This is only used to populate the GPU buffers on creation
+	const UINT iStartingWidth = (UINT)sqrt((FLOAT)g_iNumParticles);
+
+    auto particles = std::make_unique<ParticleData[]>(iTotalParticles);
+    ZeroMemory( particles.get(), sizeof(ParticleData) * iTotalParticles );
+    for ( UINT i = 0 ; i < g_iNumParticles ; i++ )
+    {
+        // Arrange the particles in a nice square
+        UINT x = i % iStartingWidth;
+        UINT y = i / iStartingWidth;
+        particles[ i ].vPosition = XMFLOAT2( g_fInitialParticleSpacing * (FLOAT)x, g_fInitialParticleSpacing * (FLOAT)(/*iStartingWidth - */y) );
+		//particles[ i ].vIndex.x = FLOAT(x);
+		//particles[ i ].vIndex.y = FLOAT(y);
+		particles[i].vIndex = particles[i].vPosition;
+		particles[i].vCenter = XMFLOAT2(g_fInitialParticleSpacing * iStartingWidth / 2.f, g_fInitialParticleSpacing * iStartingWidth / 2.f);
+    }
+    for ( UINT u = 1 ; u < g_iNumUniverses ; u++ )
+    {
+        memcpy( &particles[u * g_iNumParticles], &particles[0], sizeof(ParticleData) * g_iNumParticles );
+    }
+
+    D3D11_BOX particlesBox = { 0, 0, 0, iTotalParticles * (UINT)sizeof(ParticleData), 1, 1 };
+    pd3dImmediateContext->UpdateSubresource( g_pParticles, 0, &particlesBox, particles.get(), 0, 0 );
+
+    // Every particle of the lattice is alive
+    std::vector<UINT> alive( iTotalParticles, 1 );
+    D3D11_BOX aliveBox = { 0, 0, 0, iTotalParticles * (UINT)sizeof(UINT), 1, 1 };
+    pd3dImmediateContext->UpdateSubresource( g_pParticleAlive, 0, &aliveBox, alive.data(), 0, 0 );
+
+    if ( g_pParticleCount )
+    {
+        const UINT count[PARTICLE_COUNT_SIZE] = { g_iNumParticles, 1, 0, 0, (g_iNumParticles + SIMULATION_BLOCK_SIZE - 1) / SIMULATION_BLOCK_SIZE, 1, 1, g_iNumParticles };
+        pd3dImmediateContext->UpdateSubresource( g_pParticleCount, 0, nullptr, count, 0, 0 );
+    }
+
+    g_iNumLiveParticles = g_iNumParticles;
+    g_fSpawnAccumulator = 0;
+    g_iTotalSpawned = 0;
+    g_iReadbackSpawnMark = 0;
+    g_iLiveSpawnMark = 0;
+    g_bCountReadbackPending = false;
 
     return S_OK;
 }
 
 
+//--------------------------------------------------------------------------------------
+// Build the boundary signed distance field and upload it
+// The field only depends on g_BoundaryPolygons, so this is done once per device
+//--------------------------------------------------------------------------------------
+HRESULT CreateBoundaryBuffers( ID3D11Device* pd3dDevice )
+{
+    HRESULT hr = S_OK;
+
+    SAFE_RELEASE( g_pBoundarySDF );
+    SAFE_RELEASE( g_pBoundarySDFSRV );
+    SAFE_RELEASE( g_pBoundarySDFUAV );
+
+    const UINT iWidth = (UINT)ceil( (g_fMapWidth + 2 * g_fBoundaryMargin) / g_fBoundaryCellSize ) + 1;
+    const UINT iHeight = (UINT)ceil( (g_fMapHeight + 2 * g_fBoundaryMargin) / g_fBoundaryCellSize ) + 1;
+    g_BoundarySDF.Build( g_BoundaryPolygons, -g_fBoundaryMargin, -g_fBoundaryMargin, g_fBoundaryCellSize, iWidth, iHeight );
+
+    V_RETURN( CreateStructuredBuffer< FLOAT >( pd3dDevice, iWidth * iHeight, &g_pBoundarySDF, &g_pBoundarySDFSRV, &g_pBoundarySDFUAV, g_BoundarySDF.GetData() ) );
+    DXUT_SetDebugName( g_pBoundarySDF, "BoundarySDF" );
+    DXUT_SetDebugName( g_pBoundarySDFSRV, "BoundarySDF SRV" );
+    DXUT_SetDebugName( g_pBoundarySDFUAV, "BoundarySDF UAV" );
+
+    return hr;
+}
+
+
 //--------------------------------------------------------------------------------------
 // Create any D3D11 resources that aren't dependant on the back buffer
 //--------------------------------------------------------------------------------------
@@ -610,6 +1589,54 @@ HRESULT CALLBACK OnD3D11CreateDevice( ID3D11Device* pd3dDevice, const DXGI_SURFA
     SAFE_RELEASE( pBlob );
     DXUT_SetDebugName( g_pParticlePS, "ParticlePS" );
 
+    if ( pd3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0 )
+    {
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "HeatmapCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pHeatmapCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pHeatmapCS, "HeatmapCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "HeatmapVS", "vs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateVertexShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pHeatmapVS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pHeatmapVS, "HeatmapVS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "HeatmapPS", "ps_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreatePixelShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pHeatmapPS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pHeatmapPS, "HeatmapPS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "LodBuildCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pLodBuildCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pLodBuildCS, "LodBuildCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "LodReduceCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pLodReduceCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pLodReduceCS, "LodReduceCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "LodCullCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pLodCullCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pLodCullCS, "LodCullCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "ParticleLodVS", "vs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateVertexShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pParticleLodVS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pParticleLodVS, "ParticleLodVS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidRender.hlsl", nullptr, "LodNodeVS", "vs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateVertexShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pLodNodeVS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pLodNodeVS, "LodNodeVS" );
+
+        V_RETURN( CreateStructuredBuffer< UINT2 >( pd3dDevice, LOD_GRID_DIM, &g_pLodRows, &g_pLodRowsSRV, &g_pLodRowsUAV ) );
+        V_RETURN( CreateIndirectArgsBuffer( pd3dDevice, 4, &g_pLodArgs, &g_pLodArgsSRV, &g_pLodArgsUAV ) );
+        DXUT_SetDebugName( g_pLodRows, "LOD Rows" );
+        DXUT_SetDebugName( g_pLodArgs, "LOD Draw Args" );
+    }
+
     // Compute Shaders
     const char* CSTarget = (pd3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0)? "cs_5_0" : "cs_4_0";
     
@@ -651,17 +1678,56 @@ HRESULT CALLBACK OnD3D11CreateDevice( ID3D11Device* pd3dDevice, const DXGI_SURFA
     SAFE_RELEASE( pBlob );
     DXUT_SetDebugName( g_pForce_GridCS, "ForceCS_Grid" );
 
-    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
-    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pBuildGridCS ) );
+    // cs_4_x binds a single UAV, so no neighbour lists below feature level 11
+    if ( pd3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0 )
+    {
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "DensityCS_GridList", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pDensity_GridListCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pDensity_GridListCS, "DensityCS_GridList" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ForceCS_GridList", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pForce_GridListCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pForce_GridListCS, "ForceCS_GridList" );
+    }
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridCS_Ensemble", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pBuildGrid_EnsembleCS ) );
     SAFE_RELEASE( pBlob );
-    DXUT_SetDebugName( g_pBuildGridCS, "BuildGridCS" );
+    DXUT_SetDebugName( g_pBuildGrid_EnsembleCS, "BuildGridCS_Ensemble" );
 
-    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ClearGridIndicesCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
-    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pClearGridIndicesCS ) );
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridIndicesCS_Ensemble", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pBuildGridIndices_EnsembleCS ) );
     SAFE_RELEASE( pBlob );
-    DXUT_SetDebugName( g_pClearGridIndicesCS, "ClearGridIndicesCS" );
+    DXUT_SetDebugName( g_pBuildGridIndices_EnsembleCS, "BuildGridIndicesCS_Ensemble" );
 
-    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridIndicesCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "RearrangeParticlesCS_Ensemble", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pRearrangeParticles_EnsembleCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pRearrangeParticles_EnsembleCS, "RearrangeParticlesCS_Ensemble" );
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "DensityCS_Ensemble", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pDensity_EnsembleCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pDensity_EnsembleCS, "DensityCS_Ensemble" );
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ForceCS_Ensemble", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pForce_EnsembleCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pForce_EnsembleCS, "ForceCS_Ensemble" );
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pBuildGridCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pBuildGridCS, "BuildGridCS" );
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ClearGridIndicesCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pClearGridIndicesCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pClearGridIndicesCS, "ClearGridIndicesCS" );
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "BuildGridIndicesCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
     V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pBuildGridIndicesCS ) );
     SAFE_RELEASE( pBlob );
     DXUT_SetDebugName( g_pBuildGridIndicesCS, "BuildGridIndicesCS" );
@@ -671,6 +1737,49 @@ HRESULT CALLBACK OnD3D11CreateDevice( ID3D11Device* pd3dDevice, const DXGI_SURFA
     SAFE_RELEASE( pBlob );
     DXUT_SetDebugName( g_pRearrangeParticlesCS, "RearrangeParticlesCS" );
 
+    // Emit / Absorb, see the Dynamic Particles kernels
+    if ( pd3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0 )
+    {
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "IntegrateDynamicCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pIntegrateDynamicCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pIntegrateDynamicCS, "IntegrateDynamicCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ScanParticlesCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pScanParticlesCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pScanParticlesCS, "ScanParticlesCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "ScanBlockSumsCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pScanBlockSumsCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pScanBlockSumsCS, "ScanBlockSumsCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "CompactParticlesCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pCompactParticlesCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pCompactParticlesCS, "CompactParticlesCS" );
+
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "SpawnParticlesCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pSpawnParticlesCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pSpawnParticlesCS, "SpawnParticlesCS" );
+    }
+
+    V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "CoarseGrainCS", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+    V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pCoarseGrainCS ) );
+    SAFE_RELEASE( pBlob );
+    DXUT_SetDebugName( g_pCoarseGrainCS, "CoarseGrainCS" );
+
+    // Three UAVs and groupshared atomics, so no step statistics below feature level 11
+    if ( pd3dDevice->GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0 )
+    {
+        V_RETURN( DXUTCompileFromFile( L"FluidCS11.hlsl", nullptr, "IntegrateStatisticsCS", "cs_5_0", D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
+        V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pIntegrateStatisticsCS ) );
+        SAFE_RELEASE( pBlob );
+        DXUT_SetDebugName( g_pIntegrateStatisticsCS, "IntegrateStatisticsCS" );
+    }
+
     // Sort Shaders
     V_RETURN( DXUTCompileFromFile( L"ComputeShaderSort11.hlsl", nullptr, "BitonicSort", CSTarget, D3DCOMPILE_ENABLE_STRICTNESS, 0, &pBlob ) );
     V_RETURN( pd3dDevice->CreateComputeShader( pBlob->GetBufferPointer(), pBlob->GetBufferSize(), nullptr, &g_pSortBitonic ) );
@@ -684,19 +1793,48 @@ HRESULT CALLBACK OnD3D11CreateDevice( ID3D11Device* pd3dDevice, const DXGI_SURFA
 
     CompilingShadersDlg.DestroyDialog();
 
+    // The simulation thread is not running yet; drop what this device cannot run
+    if ( !g_pDensity_GridListCS )
+        g_bNeighbourLists = false;
+    g_SampleUI.GetCheckBox( IDC_NEIGHBOURLISTS )->SetEnabled( g_pDensity_GridListCS != nullptr );
+    g_SampleUI.GetCheckBox( IDC_NEIGHBOURLISTS )->SetChecked( g_bNeighbourLists );
+    if ( !g_pIntegrateDynamicCS )
+        g_bDynamicParticles = false;
+    g_SampleUI.GetCheckBox( IDC_DYNAMICPARTICLES )->SetEnabled( g_pIntegrateDynamicCS != nullptr );
+    g_SampleUI.GetCheckBox( IDC_DYNAMICPARTICLES )->SetChecked( g_bDynamicParticles );
+
     // Create the Simulation Buffers
     V_RETURN( CreateSimulationBuffers( pd3dDevice ) );
+    V_RETURN( CreateBoundaryBuffers( pd3dDevice ) );
+    V_RETURN( CreateStructuredBuffer< CoarseCell >( pd3dDevice, COARSE_GRID_DIM * COARSE_GRID_DIM, &g_pCoarseCells, &g_pCoarseCellsSRV, &g_pCoarseCellsUAV ) );
+    DXUT_SetDebugName( g_pCoarseCells, "Coarse Cells" );
+    if ( g_pIntegrateStatisticsCS )
+    {
+        // A block per group of the largest single universe
+        V_RETURN( CreateStructuredBuffer< StatisticsBlock >( pd3dDevice, MAX_DYNAMIC_PARTICLES / SIMULATION_BLOCK_SIZE, &g_pStatisticsBlocks,
+                                                             &g_pStatisticsBlocksSRV, &g_pStatisticsBlocksUAV ) );
+        V_RETURN( CreateStructuredBuffer< UINT >( pd3dDevice, 2 * FLUID_STATISTICS_BINS, &g_pStatisticsHistogram,
+                                                  &g_pStatisticsHistogramSRV, &g_pStatisticsHistogramUAV ) );
+        DXUT_SetDebugName( g_pStatisticsBlocks, "Statistics Blocks" );
+        DXUT_SetDebugName( g_pStatisticsHistogram, "Statistics Histogram" );
+    }
 
     // Create Constant Buffers
     V_RETURN( CreateConstantBuffer< CBSimulationConstants >( pd3dDevice, &g_pcbSimulationConstants ) );
     V_RETURN( CreateConstantBuffer< CBRenderConstants >( pd3dDevice, &g_pcbRenderConstants ) );
+    V_RETURN( CreateConstantBuffer< CBLodConstants >( pd3dDevice, &g_pcbLodConstants ) );
 
     V_RETURN( CreateConstantBuffer< SortCB >( pd3dDevice, &g_pSortCB ) );
 
     DXUT_SetDebugName( g_pcbSimulationConstants, "Simluation" );
     DXUT_SetDebugName( g_pcbRenderConstants, "Render" );
+    DXUT_SetDebugName( g_pcbLodConstants, "LOD" );
     DXUT_SetDebugName( g_pSortCB, "Sort" );
 
+    // Stage Timer Queries
+    V_RETURN( g_GPUStageTimer.Create( pd3dDevice ) );
+    V_RETURN( CreateCaptureReadback( pd3dDevice ) );
+
 	//Blend state
 	D3D11_BLEND_DESC BSDesc = {};
 	BSDesc.RenderTarget[0].BlendEnable = TRUE;
@@ -712,6 +1850,16 @@ HRESULT CALLBACK OnD3D11CreateDevice( ID3D11Device* pd3dDevice, const DXGI_SURFA
 	V_RETURN(pd3dDevice->CreateBlendState(&BSDesc, &g_pParticleBlendState));
 	DXUT_SetDebugName(g_pParticleBlendState, "ParticleBlendState");
 
+    // Let the simulation thread share the immediate context, see CContextLock
+    V_RETURN( pd3dDevice->QueryInterface( __uuidof( ID3D10Multithread ), (void**)&g_pMultithread ) );
+    g_pMultithread->SetMultithreadProtected( TRUE );
+
+    D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_EVENT, 0 };
+    V_RETURN( pd3dDevice->CreateQuery( &queryDesc, &g_pStepDoneQuery ) );
+    DXUT_SetDebugName( g_pStepDoneQuery, "Step Done" );
+
+    StartSimulationThread();
+
     return S_OK;
 }
 
@@ -732,6 +1880,38 @@ HRESULT CALLBACK OnD3D11ResizedSwapChain( ID3D11Device* pd3dDevice, IDXGISwapCha
     g_SampleUI.SetLocation( pBackBufferSurfaceDesc->Width - 170, pBackBufferSurfaceDesc->Height - 400 );
     g_SampleUI.SetSize( 170, 300 );
 
+    // Heatmap bins covering the back buffer, a count and a sum of 32 bits each
+    if ( g_pHeatmapCS )
+    {
+        g_iHeatmapWidth = (pBackBufferSurfaceDesc->Width + HEATMAP_BIN_SIZE - 1) / HEATMAP_BIN_SIZE;
+        g_iHeatmapHeight = (pBackBufferSurfaceDesc->Height + HEATMAP_BIN_SIZE - 1) / HEATMAP_BIN_SIZE;
+        const UINT iNumWords = g_iHeatmapWidth * g_iHeatmapHeight * 2;
+
+        D3D11_BUFFER_DESC bufferDesc = {};
+        bufferDesc.ByteWidth = iNumWords * sizeof(UINT);
+        bufferDesc.Usage = D3D11_USAGE_DEFAULT;
+        bufferDesc.BindFlags = D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE;
+        bufferDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+        V_RETURN( pd3dDevice->CreateBuffer( &bufferDesc, nullptr, &g_pHeatmap ) );
+        DXUT_SetDebugName( g_pHeatmap, "Heatmap" );
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+        srvDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+        srvDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+        srvDesc.BufferEx.NumElements = iNumWords;
+        srvDesc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+        V_RETURN( pd3dDevice->CreateShaderResourceView( g_pHeatmap, &srvDesc, &g_pHeatmapSRV ) );
+        DXUT_SetDebugName( g_pHeatmapSRV, "Heatmap SRV" );
+
+        D3D11_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+        uavDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+        uavDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
+        uavDesc.Buffer.NumElements = iNumWords;
+        uavDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
+        V_RETURN( pd3dDevice->CreateUnorderedAccessView( g_pHeatmap, &uavDesc, &g_pHeatmapUAV ) );
+        DXUT_SetDebugName( g_pHeatmapUAV, "Heatmap UAV" );
+    }
+
     return S_OK;
 }
 
@@ -739,22 +1919,29 @@ HRESULT CALLBACK OnD3D11ResizedSwapChain( ID3D11Device* pd3dDevice, IDXGISwapCha
 //--------------------------------------------------------------------------------------
 // GPU Bitonic Sort
 // For more information, please see the ComputeShaderSort11 sample
+// Sorts every aligned run of iSegmentSize elements independently (the levels stop at the
+// segment size and the final level sorts every segment ascending). Both sizes are powers of 2.
 //--------------------------------------------------------------------------------------
-void GPUSort(ID3D11DeviceContext* pd3dImmediateContext,
+void GPUSort(ID3D11DeviceContext* pd3dImmediateContext, UINT iNumElements, UINT iSegmentSize,
              ID3D11UnorderedAccessView* inUAV, ID3D11ShaderResourceView* inSRV,
              ID3D11UnorderedAccessView* tempUAV, ID3D11ShaderResourceView* tempSRV)
 {
     pd3dImmediateContext->CSSetConstantBuffers( 0, 1, &g_pSortCB );
 
-    const UINT NUM_ELEMENTS = g_iNumParticles;
+    const UINT NUM_ELEMENTS = iNumElements;
+    const UINT SEGMENT_SIZE = iSegmentSize;
     const UINT MATRIX_WIDTH = BITONIC_BLOCK_SIZE;
     const UINT MATRIX_HEIGHT = NUM_ELEMENTS / BITONIC_BLOCK_SIZE;
 
     // Sort the data
     // First sort the rows for the levels <= to the block size
-    for( UINT level = 2 ; level <= BITONIC_BLOCK_SIZE ; level <<= 1 )
+    char szStage[32];
+    for( UINT level = 2 ; level <= std::min( BITONIC_BLOCK_SIZE, SEGMENT_SIZE ) ; level <<= 1 )
     {
-        SortCB constants = { level, level, MATRIX_HEIGHT, MATRIX_WIDTH };
+        sprintf_s( szStage, "Sort %u", level );
+        g_GPUStageTimer.Begin( pd3dImmediateContext, szStage );
+
+        SortCB constants = { level, level & ~SEGMENT_SIZE, MATRIX_HEIGHT, MATRIX_WIDTH };
         pd3dImmediateContext->UpdateSubresource( g_pSortCB, 0, nullptr, &constants, 0, 0 );
 
         // Sort the row data
@@ -762,13 +1949,18 @@ void GPUSort(ID3D11DeviceContext* pd3dImmediateContext,
         pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &inUAV, &UAVInitialCounts );
         pd3dImmediateContext->CSSetShader( g_pSortBitonic, nullptr, 0 );
         pd3dImmediateContext->Dispatch( NUM_ELEMENTS / BITONIC_BLOCK_SIZE, 1, 1 );
+
+        g_GPUStageTimer.End( pd3dImmediateContext );
     }
 
     // Then sort the rows and columns for the levels > than the block size
     // Transpose. Sort the Columns. Transpose. Sort the Rows.
-    for( UINT level = (BITONIC_BLOCK_SIZE << 1) ; level <= NUM_ELEMENTS ; level <<= 1 )
+    for( UINT level = (BITONIC_BLOCK_SIZE << 1) ; level <= SEGMENT_SIZE ; level <<= 1 )
     {
-        SortCB constants1 = { (level / BITONIC_BLOCK_SIZE), (level & ~NUM_ELEMENTS) / BITONIC_BLOCK_SIZE, MATRIX_WIDTH, MATRIX_HEIGHT };
+        sprintf_s( szStage, "Sort %u", level );
+        g_GPUStageTimer.Begin( pd3dImmediateContext, szStage );
+
+        SortCB constants1 = { (level / BITONIC_BLOCK_SIZE), (level & ~SEGMENT_SIZE) / BITONIC_BLOCK_SIZE, MATRIX_WIDTH, MATRIX_HEIGHT };
         pd3dImmediateContext->UpdateSubresource( g_pSortCB, 0, nullptr, &constants1, 0, 0 );
 
         // Transpose the data from buffer 1 into buffer 2
@@ -784,7 +1976,7 @@ void GPUSort(ID3D11DeviceContext* pd3dImmediateContext,
         pd3dImmediateContext->CSSetShader( g_pSortBitonic, nullptr, 0 );
         pd3dImmediateContext->Dispatch( NUM_ELEMENTS / BITONIC_BLOCK_SIZE, 1, 1 );
 
-        SortCB constants2 = { BITONIC_BLOCK_SIZE, level, MATRIX_HEIGHT, MATRIX_WIDTH };
+        SortCB constants2 = { BITONIC_BLOCK_SIZE, level & ~SEGMENT_SIZE, MATRIX_HEIGHT, MATRIX_WIDTH };
         pd3dImmediateContext->UpdateSubresource( g_pSortCB, 0, nullptr, &constants2, 0, 0 );
 
         // Transpose the data from buffer 2 back into buffer 1
@@ -797,6 +1989,8 @@ void GPUSort(ID3D11DeviceContext* pd3dImmediateContext,
         // Sort the row data
         pd3dImmediateContext->CSSetShader( g_pSortBitonic, nullptr, 0 );
         pd3dImmediateContext->Dispatch( NUM_ELEMENTS / BITONIC_BLOCK_SIZE, 1, 1 );
+
+        g_GPUStageTimer.End( pd3dImmediateContext );
     }
 }
 
@@ -813,23 +2007,29 @@ void SimulateFluid_Simple( ID3D11DeviceContext* pd3dImmediateContext )
     pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pParticlesSRV );
 
     // Density
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Density" );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticleDensityUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShader( g_pDensity_SimpleCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
 
     // Force
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Force" );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticleForcesUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShaderResources( 1, 1, &g_pParticleDensitySRV );
     pd3dImmediateContext->CSSetShader( g_pForce_SimpleCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
 
     // Integrate
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Integrate" );
     pd3dImmediateContext->CopyResource( g_pSortedParticles, g_pParticles );
     pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pSortedParticlesSRV );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticlesUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShaderResources( 2, 1, &g_pParticleForcesSRV );
     pd3dImmediateContext->CSSetShader( g_pIntegrateCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
 }
 
 
@@ -845,23 +2045,190 @@ void SimulateFluid_Shared( ID3D11DeviceContext* pd3dImmediateContext )
     pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pParticlesSRV );
 
     // Density
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Density" );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticleDensityUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShader( g_pDensity_SharedCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
 
     // Force
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Force" );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticleForcesUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShaderResources( 1, 1, &g_pParticleDensitySRV );
     pd3dImmediateContext->CSSetShader( g_pForce_SharedCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
 
     // Integrate
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Integrate" );
     pd3dImmediateContext->CopyResource( g_pSortedParticles, g_pParticles );
     pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pSortedParticlesSRV );
     pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pParticlesUAV, &UAVInitialCounts );
     pd3dImmediateContext->CSSetShaderResources( 2, 1, &g_pParticleForcesSRV );
     pd3dImmediateContext->CSSetShader( g_pIntegrateCS, nullptr, 0 );
     pd3dImmediateContext->Dispatch( g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Whether this frame runs with a GPU side particle count
+//--------------------------------------------------------------------------------------
+bool IsDynamicParticles()
+{
+    return g_bDynamicParticles && g_iNumUniverses == 1 && g_eSimMode == SIM_MODE_GRID;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Slots the dynamic particles use, the pool may be larger after running an ensemble
+//--------------------------------------------------------------------------------------
+UINT GetDynamicParticleSlots()
+{
+    return std::min( g_iParticleCapacity, MAX_DYNAMIC_PARTICLES );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Generate this step's particles from the emitters and upload them
+// The live count is only known a few frames late, so the buffers grow as soon as the
+// count it implies could overflow them. Returns the number of particles to spawn
+//--------------------------------------------------------------------------------------
+UINT EmitParticles( ID3D11DeviceContext* pd3dImmediateContext, FLOAT fTimeStep )
+{
+    for ( const ParticleEmitter& emitter : g_Emitters )
+        g_fSpawnAccumulator += emitter.fRate * fTimeStep;
+
+    // Upper bound of the live count when this step's spawn runs
+    const UINT iMaxLive = g_iNumLiveParticles + (UINT)(g_iTotalSpawned - g_iLiveSpawnMark);
+    const UINT iRoom = (iMaxLive < MAX_DYNAMIC_PARTICLES) ? MAX_DYNAMIC_PARTICLES - iMaxLive : 0;
+    UINT iNumSpawn = std::min( (UINT)g_fSpawnAccumulator, std::min( MAX_SPAWN_PER_STEP, iRoom ) );
+    g_fSpawnAccumulator -= (FLOAT)(UINT)g_fSpawnAccumulator;
+    if ( iNumSpawn == 0 )
+        return 0;
+
+    if ( FAILED( ReserveParticleBuffers( DXUTGetD3D11Device(), iMaxLive + iNumSpawn ) ) )
+        iNumSpawn = (iMaxLive < GetDynamicParticleSlots()) ? std::min( iNumSpawn, GetDynamicParticleSlots() - iMaxLive ) : 0;
+
+    // Spread the particles over the emitters by rate
+    FLOAT fTotalRate = 0;
+    for ( const ParticleEmitter& emitter : g_Emitters )
+        fTotalRate += emitter.fRate;
+
+    std::uniform_real_distribution<FLOAT> uniform( 0.0f, 1.0f );
+    g_SpawnScratch.resize( iNumSpawn );
+    for ( UINT i = 0 ; i < iNumSpawn ; i++ )
+    {
+        const FLOAT fPick = uniform( g_SpawnRandom ) * fTotalRate;
+        const ParticleEmitter* pEmitter = &g_Emitters.back();
+        FLOAT fSum = 0;
+        for ( const ParticleEmitter& emitter : g_Emitters )
+        {
+            fSum += emitter.fRate;
+            if ( fPick < fSum )
+            {
+                pEmitter = &emitter;
+                break;
+            }
+        }
+
+        const FLOAT fRadius = pEmitter->fRadius * sqrt( uniform( g_SpawnRandom ) );
+        const FLOAT fAngle = XM_2PI * uniform( g_SpawnRandom );
+        ParticleData& particle = g_SpawnScratch[i];
+        particle.vPosition = XMFLOAT2( pEmitter->vPosition.x + fRadius * cos( fAngle ), pEmitter->vPosition.y + fRadius * sin( fAngle ) );
+        particle.vVelocity = pEmitter->vVelocity;
+        particle.vIndex = particle.vPosition;
+        particle.vCenter = pEmitter->vPosition;
+    }
+
+    D3D11_BOX box = { 0, 0, 0, iNumSpawn * (UINT)sizeof(ParticleData), 1, 1 };
+    pd3dImmediateContext->UpdateSubresource( g_pSpawnParticles, 0, &box, g_SpawnScratch.data(), 0, 0 );
+
+    g_iTotalSpawned += iNumSpawn;
+    return iNumSpawn;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Remove the particles the last step absorbed and append the spawned ones
+// Scan: per block prefix sum of the alive flags
+// Scan Block Sums: block offsets, new count and indirect arguments
+// Compact, Spawn: into the sorted buffer, which then trades places with the particles
+//--------------------------------------------------------------------------------------
+void CompactParticles( ID3D11DeviceContext* pd3dImmediateContext, UINT iNumSpawn )
+{
+    UINT UAVInitialCounts[3] = { 0, 0, 0 };
+    const UINT iNumBlocks = GetDynamicParticleSlots() / SIMULATION_BLOCK_SIZE;
+
+    pd3dImmediateContext->CSSetConstantBuffers( 0, 1, &g_pcbSimulationConstants );
+
+    // Scan
+    ID3D11UnorderedAccessView* pScanUAVs[3] = { g_pParticleScanUAV, g_pBlockSumsUAV, nullptr };
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 3, pScanUAVs, UAVInitialCounts );
+    pd3dImmediateContext->CSSetShaderResources( 9, 1, &g_pParticleCountSRV );
+    pd3dImmediateContext->CSSetShaderResources( 10, 1, &g_pParticleAliveSRV );
+    pd3dImmediateContext->CSSetShader( g_pScanParticlesCS, nullptr, 0 );
+    pd3dImmediateContext->Dispatch( iNumBlocks, 1, 1 );
+
+    // Scan Block Sums
+    pd3dImmediateContext->CSSetShaderResources( 9, 1, &g_pNullSRV );
+    ID3D11UnorderedAccessView* pSumUAVs[3] = { nullptr, g_pBlockSumsUAV, g_pParticleCountUAV };
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 3, pSumUAVs, UAVInitialCounts );
+    pd3dImmediateContext->CSSetShader( g_pScanBlockSumsCS, nullptr, 0 );
+    pd3dImmediateContext->Dispatch( 1, 1, 1 );
+
+    // Compact
+    ID3D11UnorderedAccessView* pCompactUAVs[3] = { g_pSortedParticlesUAV, nullptr, nullptr };
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 3, pCompactUAVs, UAVInitialCounts );
+    ID3D11ShaderResourceView* pScanSRVs[2] = { g_pParticleScanSRV, g_pBlockSumsSRV };
+    pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pParticlesSRV );
+    pd3dImmediateContext->CSSetShaderResources( 11, 2, pScanSRVs );
+    pd3dImmediateContext->CSSetShader( g_pCompactParticlesCS, nullptr, 0 );
+    pd3dImmediateContext->Dispatch( iNumBlocks, 1, 1 );
+
+    // Spawn
+    if ( iNumSpawn > 0 )
+    {
+        pd3dImmediateContext->CSSetShaderResources( 9, 1, &g_pParticleCountSRV );
+        pd3dImmediateContext->CSSetShaderResources( 13, 1, &g_pSpawnParticlesSRV );
+        pd3dImmediateContext->CSSetShader( g_pSpawnParticlesCS, nullptr, 0 );
+        pd3dImmediateContext->Dispatch( (iNumSpawn + SIMULATION_BLOCK_SIZE - 1) / SIMULATION_BLOCK_SIZE, 1, 1 );
+    }
+
+    // Unset
+    ID3D11ShaderResourceView* pNullSRVs[5] = {};
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pNullUAV, UAVInitialCounts );
+    pd3dImmediateContext->CSSetShaderResources( 0, 1, &g_pNullSRV );
+    pd3dImmediateContext->CSSetShaderResources( 9, 5, pNullSRVs );
+
+    // Both have the pool's capacity and the sorted one is rebuilt by every step, so the
+    // buffers swap rather than copying every slot back
+    std::swap( g_pParticles, g_pSortedParticles );
+    std::swap( g_pParticlesSRV, g_pSortedParticlesSRV );
+    std::swap( g_pParticlesUAV, g_pSortedParticlesUAV );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Pick up the live count of an earlier frame, without waiting for the GPU
+//--------------------------------------------------------------------------------------
+void ReadParticleCount( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( g_bCountReadbackPending )
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if ( FAILED( pd3dImmediateContext->Map( g_pParticleCountStaging, 0, D3D11_MAP_READ, D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped ) ) )
+            return;
+
+        g_iNumLiveParticles = ((const UINT*)mapped.pData)[0];
+        g_iLiveSpawnMark = g_iReadbackSpawnMark;
+        pd3dImmediateContext->Unmap( g_pParticleCountStaging, 0 );
+        g_bCountReadbackPending = false;
+    }
+
+    pd3dImmediateContext->CopyResource( g_pParticleCountStaging, g_pParticleCount );
+    g_iReadbackSpawnMark = g_iTotalSpawned;
+    g_bCountReadbackPending = true;
 }
 
 
@@ -875,22 +2242,48 @@ void SimulateFluid_Shared( ID3D11DeviceContext* pd3dImmediateContext )
 //    Rearrange: Rearrange the particles into the same order as the grid for easy lookup
 //    Density, Force, Integrate: Perform the normal fluid simulation algorithm
 //        Except now, only calculate particles from the 8 adjacent cells + current cell
+//    Coarse Grain: With Coarse Output, before Integrate, sum the cells into coarse fields
+//        labelled with fStartTime, the simulated time the step starts from
 //--------------------------------------------------------------------------------------
-void SimulateFluid_Grid( ID3D11DeviceContext* pd3dImmediateContext )
+void SimulateFluid_Grid( ID3D11DeviceContext* pd3dImmediateContext, UINT iNumSpawn, double fStartTime )
 {
 	UINT UAVInitialCounts = 0;
 
+	// With dynamic particles the grid covers every slot, the dead ones sorting last, and
+	// the per particle passes are sized on the GPU from the live count
+	const bool bDynamic = IsDynamicParticles();
+	const UINT iNumSlots = bDynamic ? GetDynamicParticleSlots() : g_iNumParticles;
+	auto DispatchParticles = [&]()
+	{
+		if (bDynamic)
+			pd3dImmediateContext->DispatchIndirect(g_pParticleCount, DISPATCH_ARGS_OFFSET);
+		else
+			pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	};
+
+	if (bDynamic)
+	{
+		g_GPUStageTimer.Begin(pd3dImmediateContext, "Compact");
+		CompactParticles(pd3dImmediateContext, iNumSpawn);
+		g_GPUStageTimer.End(pd3dImmediateContext);
+		pd3dImmediateContext->CSSetShaderResources(9, 1, &g_pParticleCountSRV);
+	}
+
 	// Setup
 	pd3dImmediateContext->CSSetConstantBuffers(0, 1, &g_pcbSimulationConstants);
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pGridUAV, &UAVInitialCounts);
 	pd3dImmediateContext->CSSetShaderResources(0, 1, &g_pParticlesSRV);
 
 	// Build Grid
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Build Grid");
 	pd3dImmediateContext->CSSetShader(g_pBuildGridCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	pd3dImmediateContext->Dispatch(iNumSlots / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Sort Grid
-	GPUSort(pd3dImmediateContext, g_pGridUAV, g_pGridSRV, g_pGridPingPongUAV, g_pGridPingPongSRV);
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Sort Grid");
+	GPUSort(pd3dImmediateContext, iNumSlots, iNumSlots, g_pGridUAV, g_pGridSRV, g_pGridPingPongUAV, g_pGridPingPongSRV);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Setup
 	pd3dImmediateContext->CSSetConstantBuffers(0, 1, &g_pcbSimulationConstants);
@@ -898,10 +2291,12 @@ void SimulateFluid_Grid( ID3D11DeviceContext* pd3dImmediateContext )
 	pd3dImmediateContext->CSSetShaderResources(3, 1, &g_pGridSRV);
 
 	// Build Grid Indices
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Grid Indices");
 	pd3dImmediateContext->CSSetShader(g_pClearGridIndicesCS, nullptr, 0);
 	pd3dImmediateContext->Dispatch(NUM_GRID_INDICES / SIMULATION_BLOCK_SIZE, 1, 1);
 	pd3dImmediateContext->CSSetShader(g_pBuildGridIndicesCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	DispatchParticles();
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Setup
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pSortedParticlesUAV, &UAVInitialCounts);
@@ -909,8 +2304,181 @@ void SimulateFluid_Grid( ID3D11DeviceContext* pd3dImmediateContext )
 	pd3dImmediateContext->CSSetShaderResources(3, 1, &g_pGridSRV);
 
 	// Rearrange
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Rearrange");
 	pd3dImmediateContext->CSSetShader(g_pRearrangeParticlesCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	DispatchParticles();
+	g_GPUStageTimer.End(pd3dImmediateContext);
+
+	// Setup
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pNullUAV, &UAVInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(0, 1, &g_pNullSRV);
+	pd3dImmediateContext->CSSetShaderResources(0, 1, &g_pSortedParticlesSRV);
+	pd3dImmediateContext->CSSetShaderResources(3, 1, &g_pGridSRV);
+	pd3dImmediateContext->CSSetShaderResources(4, 1, &g_pGridIndicesSRV);
+
+	if (g_bNeighbourLists)
+	{
+		// Density, recording the neighbour lists
+		ID3D11UnorderedAccessView* pDensityUAVs[3] = { g_pParticleDensityUAV, g_pNeighbourListUAV, g_pNeighbourCountUAV };
+		UINT ListInitialCounts[3] = { 0, 0, 0 };
+		pd3dImmediateContext->CSSetUnorderedAccessViews(0, 3, pDensityUAVs, ListInitialCounts);
+		pd3dImmediateContext->CSSetShader(g_pDensity_GridListCS, nullptr, 0);
+		g_GPUStageTimer.Begin(pd3dImmediateContext, "Density");
+		DispatchParticles();
+		g_GPUStageTimer.End(pd3dImmediateContext);
+
+		// Force, reading the neighbour lists
+		ID3D11UnorderedAccessView* pForceUAVs[3] = { g_pParticleForcesUAV, nullptr, nullptr };
+		pd3dImmediateContext->CSSetUnorderedAccessViews(0, 3, pForceUAVs, ListInitialCounts);
+		ID3D11ShaderResourceView* pListSRVs[2] = { g_pNeighbourListSRV, g_pNeighbourCountSRV };
+		pd3dImmediateContext->CSSetShaderResources(7, 2, pListSRVs);
+		pd3dImmediateContext->CSSetShaderResources(1, 1, &g_pParticleDensitySRV);
+		pd3dImmediateContext->CSSetShader(g_pForce_GridListCS, nullptr, 0);
+		g_GPUStageTimer.Begin(pd3dImmediateContext, "Force");
+		DispatchParticles();
+		g_GPUStageTimer.End(pd3dImmediateContext);
+
+		ID3D11ShaderResourceView* pNullSRVs[2] = { nullptr, nullptr };
+		pd3dImmediateContext->CSSetShaderResources(7, 2, pNullSRVs);
+	}
+	else
+	{
+		// Density
+		pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pParticleDensityUAV, &UAVInitialCounts);
+		pd3dImmediateContext->CSSetShader(g_pDensity_GridCS, nullptr, 0);
+		g_GPUStageTimer.Begin(pd3dImmediateContext, "Density");
+		DispatchParticles();
+		g_GPUStageTimer.End(pd3dImmediateContext);
+
+		// Force
+		pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pParticleForcesUAV, &UAVInitialCounts);
+		pd3dImmediateContext->CSSetShaderResources(1, 1, &g_pParticleDensitySRV);
+		pd3dImmediateContext->CSSetShader(g_pForce_GridCS, nullptr, 0);
+		g_GPUStageTimer.Begin(pd3dImmediateContext, "Force");
+		DispatchParticles();
+		g_GPUStageTimer.End(pd3dImmediateContext);
+	}
+
+	// Coarse fields of the state the step started from
+	if (g_CoarseFieldWriter.IsOpen() && !bDynamic)
+		CoarseGrainStep(pd3dImmediateContext, g_iSimulationStep, fStartTime);
+
+	// Integrate, flagging the absorbed particles, and with statistics on reduce them too.
+	// A dynamic step may run fewer groups than last time, so the blocks are cleared.
+	// Below feature level 11 only the plain integration runs, with its single UAV
+	g_bStatisticsIssued = g_StatisticsReadback.IsCreated();
+	if (g_bStatisticsIssued)
+	{
+		const UINT ClearValues[4] = { 0, 0, 0, 0 };
+		pd3dImmediateContext->ClearUnorderedAccessViewUint(g_pStatisticsBlocksUAV, ClearValues);
+		pd3dImmediateContext->ClearUnorderedAccessViewUint(g_pStatisticsHistogramUAV, ClearValues);
+	}
+	ID3D11UnorderedAccessView* pIntegrateUAVs[4] = { g_pParticlesUAV, bDynamic ? g_pParticleAliveUAV : nullptr,
+		g_bStatisticsIssued ? g_pStatisticsBlocksUAV : nullptr, g_bStatisticsIssued ? g_pStatisticsHistogramUAV : nullptr };
+	const UINT iNumIntegrateUAVs = g_bStatisticsIssued ? 4 : bDynamic ? 2 : 1;
+	UINT IntegrateInitialCounts[4] = { 0, 0, 0, 0 };
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, iNumIntegrateUAVs, pIntegrateUAVs, IntegrateInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(2, 1, &g_pParticleForcesSRV);
+	pd3dImmediateContext->CSSetShader(g_bStatisticsIssued ? g_pIntegrateStatisticsCS : bDynamic ? g_pIntegrateDynamicCS : g_pIntegrateCS, nullptr, 0);
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Integrate");
+	DispatchParticles();
+	g_GPUStageTimer.End(pd3dImmediateContext);
+
+	ID3D11UnorderedAccessView* pNullUAVs[4] = { nullptr, nullptr, nullptr, nullptr };
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, iNumIntegrateUAVs, pNullUAVs, IntegrateInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(9, 1, &g_pNullSRV);
+}
+
+
+//--------------------------------------------------------------------------------------
+// Constants of one universe of the ensemble
+//--------------------------------------------------------------------------------------
+EnsembleParameters GetUniverseParameters( UINT iUniverse, UINT iNumUniverses )
+{
+    const FLOAT t = (iNumUniverses > 1) ? (FLOAT)iUniverse / (FLOAT)(iNumUniverses - 1) : 0.0f;
+    auto lerp = [t]( FLOAT a, FLOAT b ) { return a + (b - a) * t; };
+
+    EnsembleParameters params;
+    params.fSmoothlen = lerp( g_EnsembleSweepMin.fSmoothlen, g_EnsembleSweepMax.fSmoothlen );
+    params.fPressureStiffness = lerp( g_EnsembleSweepMin.fPressureStiffness, g_EnsembleSweepMax.fPressureStiffness );
+    params.fRestDensity = lerp( g_EnsembleSweepMin.fRestDensity, g_EnsembleSweepMax.fRestDensity );
+    params.fParticleMass = lerp( g_EnsembleSweepMin.fParticleMass, g_EnsembleSweepMax.fParticleMass );
+    params.fViscosity = lerp( g_EnsembleSweepMin.fViscosity, g_EnsembleSweepMax.fViscosity );
+    params.fSpringK = lerp( g_EnsembleSweepMin.fSpringK, g_EnsembleSweepMax.fSpringK );
+    params.fExternalK = lerp( g_EnsembleSweepMin.fExternalK, g_EnsembleSweepMax.fExternalK );
+    return params;
+}
+
+
+//--------------------------------------------------------------------------------------
+// GPU Fluid Simulation - Ensemble of independent universes
+// Same passes as SimulateFluid_Grid, but every dispatch covers all universes at once:
+// the grid keys are offset per universe, the sort is segmented per universe, and the
+// density/force kernels read their constants from the universe buffer
+//--------------------------------------------------------------------------------------
+void SimulateFluid_Ensemble( ID3D11DeviceContext* pd3dImmediateContext )
+{
+	UINT UAVInitialCounts = 0;
+	const UINT iTotalParticles = g_iNumParticles * g_iNumUniverses;
+
+	// Upload the per universe constants
+	UniverseConstants universes[MAX_UNIVERSES] = {};
+	for (UINT u = 0; u < g_iNumUniverses; u++)
+	{
+		EnsembleParameters params = GetUniverseParameters(u, g_iNumUniverses);
+		universes[u].fSmoothlen = params.fSmoothlen;
+		universes[u].fPressureStiffness = params.fPressureStiffness;
+		universes[u].fRestDensity = params.fRestDensity;
+		universes[u].fDensityCoef = params.fParticleMass * 315.0f / (64.0f * XM_PI * pow(params.fSmoothlen, 9));
+		universes[u].fGradPressureCoef = params.fParticleMass * -45.0f / (XM_PI * pow(params.fSmoothlen, 6));
+		universes[u].fLapViscosityCoef = params.fParticleMass * params.fViscosity * 45.0f / (XM_PI * pow(params.fSmoothlen, 6));
+		universes[u].fSpringK = params.fSpringK;
+		universes[u].fExternalK = params.fExternalK;
+		universes[u].fCollisionDistSq = g_fInitialParticleSpacing * g_fInitialParticleSpacing * FLUID_COLLISION_SCALE_SQ;
+		universes[u].vGridDim = XMFLOAT4(1.0f / params.fSmoothlen, 1.0f / params.fSmoothlen, 0, 0);
+	}
+	pd3dImmediateContext->UpdateSubresource(g_pUniverses, 0, nullptr, universes, 0, 0);
+
+	// Setup
+	pd3dImmediateContext->CSSetConstantBuffers(0, 1, &g_pcbSimulationConstants);
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pGridUAV, &UAVInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(0, 1, &g_pParticlesSRV);
+	pd3dImmediateContext->CSSetShaderResources(6, 1, &g_pUniversesSRV);
+
+	// Build Grid
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Build Grid");
+	pd3dImmediateContext->CSSetShader(g_pBuildGrid_EnsembleCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
+
+	// Sort Grid, one segment per universe
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Sort Grid");
+	GPUSort(pd3dImmediateContext, iTotalParticles, g_iNumParticles, g_pGridUAV, g_pGridSRV, g_pGridPingPongUAV, g_pGridPingPongSRV);
+	g_GPUStageTimer.End(pd3dImmediateContext);
+
+	// Setup
+	pd3dImmediateContext->CSSetConstantBuffers(0, 1, &g_pcbSimulationConstants);
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pGridIndicesUAV, &UAVInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(3, 1, &g_pGridSRV);
+
+	// Build Grid Indices
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Grid Indices");
+	pd3dImmediateContext->CSSetShader(g_pClearGridIndicesCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(NUM_GRID_INDICES * g_iNumUniverses / SIMULATION_BLOCK_SIZE, 1, 1);
+	pd3dImmediateContext->CSSetShader(g_pBuildGridIndices_EnsembleCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
+
+	// Setup
+	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pSortedParticlesUAV, &UAVInitialCounts);
+	pd3dImmediateContext->CSSetShaderResources(0, 1, &g_pParticlesSRV);
+	pd3dImmediateContext->CSSetShaderResources(3, 1, &g_pGridSRV);
+
+	// Rearrange
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Rearrange");
+	pd3dImmediateContext->CSSetShader(g_pRearrangeParticles_EnsembleCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Setup
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pNullUAV, &UAVInitialCounts);
@@ -921,20 +2489,26 @@ void SimulateFluid_Grid( ID3D11DeviceContext* pd3dImmediateContext )
 
 	// Density
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pParticleDensityUAV, &UAVInitialCounts);
-	pd3dImmediateContext->CSSetShader(g_pDensity_GridCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Density");
+	pd3dImmediateContext->CSSetShader(g_pDensity_EnsembleCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Force
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pParticleForcesUAV, &UAVInitialCounts);
 	pd3dImmediateContext->CSSetShaderResources(1, 1, &g_pParticleDensitySRV);
-	pd3dImmediateContext->CSSetShader(g_pForce_GridCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Force");
+	pd3dImmediateContext->CSSetShader(g_pForce_EnsembleCS, nullptr, 0);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 
 	// Integrate
 	pd3dImmediateContext->CSSetUnorderedAccessViews(0, 1, &g_pParticlesUAV, &UAVInitialCounts);
 	pd3dImmediateContext->CSSetShaderResources(2, 1, &g_pParticleForcesSRV);
+	g_GPUStageTimer.Begin(pd3dImmediateContext, "Integrate");
 	pd3dImmediateContext->CSSetShader(g_pIntegrateCS, nullptr, 0);
-	pd3dImmediateContext->Dispatch(g_iNumParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	pd3dImmediateContext->Dispatch(iTotalParticles / SIMULATION_BLOCK_SIZE, 1, 1);
+	g_GPUStageTimer.End(pd3dImmediateContext);
 }
 
 
@@ -948,10 +2522,17 @@ void SimulateFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTim
     // Update per-frame variables
     CBSimulationConstants pData = {};
 
+    // Emitters run before the constants are filled, they may grow the buffers
+    const FLOAT fTimeStep = std::min( g_fMaxAllowableTimeStep, fElapsedTime );
+    const bool bDynamic = IsDynamicParticles();
+    const double fStartTime = g_fSimulationTime;
+    g_fSimulationTime += fTimeStep;
+    const UINT iNumSpawn = bDynamic ? EmitParticles( pd3dImmediateContext, fTimeStep ) : 0;
+
     // Simulation Constants
-    pData.iNumParticles = g_iNumParticles;
+    pData.iNumParticles = bDynamic ? GetDynamicParticleSlots() : g_iNumParticles;
     // Clamp the time step when the simulation runs slowly to prevent numerical explosion
-    pData.fTimeStep = std::min( g_fMaxAllowableTimeStep, fElapsedTime );
+    pData.fTimeStep = fTimeStep;
     pData.fSmoothlen = g_fSmoothlen;
     pData.fPressureStiffness = g_fPressureStiffness;
     pData.fRestDensity = g_fRestDensity;
@@ -975,9 +2556,31 @@ void SimulateFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTim
     pData.vPlanes[2] = g_vPlanes[2];
     pData.vPlanes[3] = g_vPlanes[3];
 
+    // Boundary field, a zero width disables the lookup
+    if ( g_bBoundaries && !g_BoundarySDF.IsEmpty() )
+    {
+        pData.vBoundaryDim.x = 1.0f / g_BoundarySDF.GetCellSize();
+        pData.vBoundaryDim.y = 1.0f / g_BoundarySDF.GetCellSize();
+        pData.vBoundaryDim.z = -g_BoundarySDF.GetOriginX() / g_BoundarySDF.GetCellSize();
+        pData.vBoundaryDim.w = -g_BoundarySDF.GetOriginY() / g_BoundarySDF.GetCellSize();
+        pData.iBoundaryWidth = g_BoundarySDF.GetWidth();
+        pData.iBoundaryHeight = g_BoundarySDF.GetHeight();
+    }
+
+    // Dynamic particles
+    pData.iDynamicParticles = bDynamic ? 1 : 0;
+    pData.iNumSpawn = iNumSpawn;
+    pData.vAbsorbBounds = XMFLOAT4A( -g_fAbsorbMargin, -g_fAbsorbMargin, g_fMapWidth + g_fAbsorbMargin, g_fMapHeight + g_fAbsorbMargin );
+
     pd3dImmediateContext->UpdateSubresource( g_pcbSimulationConstants, 0, nullptr, &pData, 0, 0 );
+    pd3dImmediateContext->CSSetShaderResources( 5, 1, &g_pBoundarySDFSRV );
 
-    switch (g_eSimMode) {
+    // The ensemble always uses the grid algorithm
+    if ( g_iNumUniverses > 1 )
+    {
+        SimulateFluid_Ensemble( pd3dImmediateContext );
+    }
+    else switch (g_eSimMode) {
         // Simple N^2 Algorithm
         case SIM_MODE_SIMPLE:
             SimulateFluid_Simple( pd3dImmediateContext );
@@ -990,7 +2593,7 @@ void SimulateFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTim
 
         // Optimized Grid + Sort Algorithm
         case SIM_MODE_GRID:
-            SimulateFluid_Grid( pd3dImmediateContext );
+            SimulateFluid_Grid( pd3dImmediateContext, iNumSpawn, fStartTime );
             break;
     }
 
@@ -1002,17 +2605,174 @@ void SimulateFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTim
     pd3dImmediateContext->CSSetShaderResources( 3, 1, &g_pNullSRV );
     pd3dImmediateContext->CSSetShaderResources( 4, 1, &g_pNullSRV );
 	pd3dImmediateContext->CSSetShaderResources( 5, 1, &g_pNullSRV );
+	pd3dImmediateContext->CSSetShaderResources( 6, 1, &g_pNullSRV );
+
+    if ( bDynamic )
+        ReadParticleCount( pd3dImmediateContext );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Bin the particles of the universe on screen with HeatmapCS and colour the bins with a
+// screen covering triangle. The colour ramp spans twice the lattice's particles per bin,
+// the sprites' density range or HEATMAP_DISPLACEMENT_RANGE.
+//--------------------------------------------------------------------------------------
+void RenderHeatmap( ID3D11DeviceContext* pd3dImmediateContext, const RenderState& state, CBRenderConstants& pData )
+{
+    const DXGI_SURFACE_DESC* pBackBufferDesc = DXUTGetDXGIBackBufferSurfaceDesc();
+    const FLOAT fBinSize = g_fMapHeight / g_fCameraZoom * HEATMAP_BIN_SIZE / pBackBufferDesc->Height;
+
+    pData.iHeatmapWidth = g_iHeatmapWidth;
+    pData.iHeatmapHeight = g_iHeatmapHeight;
+    pData.iHeatmapBinSize = HEATMAP_BIN_SIZE;
+    pData.iHeatmapQuantity = g_eRenderMode - RENDER_MODE_HEATMAP_COUNT;
+    pData.iHeatmapParticles = state.bDynamic ? state.iDynamicSlots : state.iNumParticles;
+    pData.iHeatmapDynamic = state.bDynamic;
+    pData.fHeatmapLower = 0;
+    pData.fScreenWidth = (FLOAT)pBackBufferDesc->Width;
+    pData.fScreenHeight = (FLOAT)pBackBufferDesc->Height;
+    switch ( g_eRenderMode )
+    {
+        case RENDER_MODE_HEATMAP_COUNT:
+            pData.fHeatmapUpper = 2 * (fBinSize * fBinSize) / (g_fInitialParticleSpacing * g_fInitialParticleSpacing);
+            pData.fHeatmapScale = 1;
+            break;
+        case RENDER_MODE_HEATMAP_DENSITY:
+            pData.fHeatmapUpper = 650.0f;
+            pData.fHeatmapScale = HEATMAP_DENSITY_SCALE;
+            break;
+        default:
+            pData.fHeatmapUpper = HEATMAP_DISPLACEMENT_RANGE;
+            pData.fHeatmapScale = HEATMAP_DISPLACEMENT_SCALE;
+            break;
+    }
+    pd3dImmediateContext->UpdateSubresource( g_pcbRenderConstants, 0, nullptr, &pData, 0, 0 );
+
+    // Bin
+    const UINT ClearValues[4] = { 0, 0, 0, 0 };
+    pd3dImmediateContext->ClearUnorderedAccessViewUint( g_pHeatmapUAV, ClearValues );
+
+    ID3D11ShaderResourceView* aSRVs[3] = { state.pParticlesSRV, state.pDensitySRV, state.pDrawArgsSRV };
+    ID3D11ShaderResourceView* aNullSRVs[3] = { nullptr, nullptr, nullptr };
+    UINT UAVInitialCounts = 0;
+    pd3dImmediateContext->CSSetShader( g_pHeatmapCS, nullptr, 0 );
+    pd3dImmediateContext->CSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+    pd3dImmediateContext->CSSetShaderResources( 0, 3, aSRVs );
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pHeatmapUAV, &UAVInitialCounts );
+    pd3dImmediateContext->Dispatch( (pData.iHeatmapParticles + HEATMAP_BLOCK_SIZE - 1) / HEATMAP_BLOCK_SIZE, 1, 1 );
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pNullUAV, &UAVInitialCounts );
+    pd3dImmediateContext->CSSetShaderResources( 0, 3, aNullSRVs );
+
+    // Colour
+    pd3dImmediateContext->VSSetShader( g_pHeatmapVS, nullptr, 0 );
+    pd3dImmediateContext->GSSetShader( nullptr, nullptr, 0 );
+    pd3dImmediateContext->PSSetShader( g_pHeatmapPS, nullptr, 0 );
+    pd3dImmediateContext->PSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+    pd3dImmediateContext->PSSetShaderResources( 3, 1, &g_pHeatmapSRV );
+    pd3dImmediateContext->IASetVertexBuffers( 0, 1, &g_pNullBuffer, &g_iNullUINT, &g_iNullUINT );
+    pd3dImmediateContext->IASetPrimitiveTopology( D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST );
+
+    const float BlendFactor[4] = { 0, 0, 0, 0 };
+    pd3dImmediateContext->OMSetBlendState( g_pParticleBlendState, BlendFactor, 0xFFFFFFFF );
+    pd3dImmediateContext->Draw( 3, 0 );
+
+    pd3dImmediateContext->PSSetShaderResources( 3, 1, &g_pNullSRV );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Draw the visible part of a sorted state, choosing the level of detail from the size
+// of a grid cell on screen. Nodes are culled a node beyond the view, the particles may
+// have left their cell since the sort. The edge cells also hold the particles outside
+// the grid and are kept whenever the view reaches past them.
+//--------------------------------------------------------------------------------------
+void RenderFluidLod( ID3D11DeviceContext* pd3dImmediateContext, const RenderState& state, CBRenderConstants& pData )
+{
+    const DXGI_SURFACE_DESC* pBackBufferDesc = DXUTGetDXGIBackBufferSurfaceDesc();
+    const FLOAT fViewWidth = g_fMapWidth / g_fCameraZoom;
+    const FLOAT fViewHeight = g_fMapHeight / g_fCameraZoom;
+    const FLOAT fCellPixels = g_fSmoothlen * pBackBufferDesc->Height / fViewHeight;
+
+    // Largest nodes at most LOD_SPLAT_PIXELS on screen, particles if cells are larger
+    g_iLodLevel = -1;
+    if ( fCellPixels <= LOD_SPLAT_PIXELS )
+        g_iLodLevel = std::min( (INT)floorf( log2f( LOD_SPLAT_PIXELS / fCellPixels ) ), (INT)LOD_LEVELS - 1 );
+
+    const UINT iLevel = std::max( g_iLodLevel, 0 );
+    const UINT iDim = LOD_GRID_DIM >> iLevel;
+    const FLOAT fNodeSize = g_fSmoothlen * (1 << iLevel);
+    auto NodeOf = [&]( FLOAT fCoord, FLOAT fPad )
+    {
+        return (UINT)std::min( std::max( floorf( fCoord / fNodeSize + fPad ), 0.0f ), (FLOAT)(iDim - 1) );
+    };
+    pData.iLodX0 = NodeOf( g_vCameraCenter.x - fViewWidth / 2, -1 );
+    pData.iLodX1 = NodeOf( g_vCameraCenter.x + fViewWidth / 2, 1 );
+    pData.iLodY0 = NodeOf( g_vCameraCenter.y - fViewHeight / 2, -1 );
+    pData.iLodY1 = NodeOf( g_vCameraCenter.y + fViewHeight / 2, 1 );
+    pData.iLodDim = iDim;
+    pData.iLodOffset = 0;
+    for ( UINT i = 0 ; i < iLevel ; i++ )
+        pData.iLodOffset += (LOD_GRID_DIM >> i) * (LOD_GRID_DIM >> i);
+
+    // Aggregated splats cover their node
+    if ( g_iLodLevel >= 0 )
+        pData.fParticleSize = std::max( fNodeSize / 2, g_fParticleRenderSize );
+    pd3dImmediateContext->UpdateSubresource( g_pcbRenderConstants, 0, nullptr, &pData, 0, 0 );
+
+    if ( g_iLodLevel < 0 )
+    {
+        // Particle ranges of the visible rows
+        UINT UAVInitialCounts[2] = { 0, 0 };
+        ID3D11UnorderedAccessView* aUAVs[2] = { g_pLodRowsUAV, g_pLodArgsUAV };
+        ID3D11UnorderedAccessView* aNullUAVs[2] = { nullptr, nullptr };
+        pd3dImmediateContext->CSSetShader( g_pLodCullCS, nullptr, 0 );
+        pd3dImmediateContext->CSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+        pd3dImmediateContext->CSSetShaderResources( 4, 1, &state.pGridIndicesSRV );
+        pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 2, aUAVs, UAVInitialCounts );
+        pd3dImmediateContext->Dispatch( 1, 1, 1 );
+        pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 2, aNullUAVs, UAVInitialCounts );
+        pd3dImmediateContext->CSSetShaderResources( 4, 1, &g_pNullSRV );
+
+        pd3dImmediateContext->VSSetShader( g_pParticleLodVS, nullptr, 0 );
+        pd3dImmediateContext->VSSetShaderResources( 0, 1, &state.pParticlesSRV );
+        pd3dImmediateContext->VSSetShaderResources( 1, 1, &state.pDensitySRV );
+        pd3dImmediateContext->VSSetShaderResources( 6, 1, &g_pLodRowsSRV );
+    }
+    else
+    {
+        pd3dImmediateContext->VSSetShader( g_pLodNodeVS, nullptr, 0 );
+        pd3dImmediateContext->VSSetShaderResources( 5, 1, &state.pLodSRV );
+    }
+
+    pd3dImmediateContext->GSSetShader( g_pParticleGS, nullptr, 0 );
+    pd3dImmediateContext->PSSetShader( g_pParticlePS, nullptr, 0 );
+    pd3dImmediateContext->VSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+    pd3dImmediateContext->GSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+    pd3dImmediateContext->PSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
+    pd3dImmediateContext->IASetVertexBuffers( 0, 1, &g_pNullBuffer, &g_iNullUINT, &g_iNullUINT );
+    pd3dImmediateContext->IASetPrimitiveTopology( D3D11_PRIMITIVE_TOPOLOGY_POINTLIST );
+
+    const float BlendFactor[4] = { 0, 0, 0, 0 };
+    pd3dImmediateContext->OMSetBlendState( g_pParticleBlendState, BlendFactor, 0xFFFFFFFF );
+
+    if ( g_iLodLevel < 0 )
+        pd3dImmediateContext->DrawInstancedIndirect( g_pLodArgs, 0 );
+    else
+        pd3dImmediateContext->Draw( (pData.iLodX1 - pData.iLodX0 + 1) * (pData.iLodY1 - pData.iLodY0 + 1), 0 );
+
+    ID3D11ShaderResourceView* aNullSRVs[7] = {};
+    pd3dImmediateContext->VSSetShaderResources( 0, 7, aNullSRVs );
 }
 
 
 //--------------------------------------------------------------------------------------
 // GPU Fluid Rendering
 //--------------------------------------------------------------------------------------
-void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime )
+void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, const RenderState& state )
 {
-    // Simple orthographic projection to display the entire map
-    XMMATRIX mView = XMMatrixTranslation( -g_fMapWidth / 2.0f, -g_fMapHeight / 2.0f, 0 );
-    XMMATRIX mProjection = XMMatrixOrthographicLH( g_fMapWidth, g_fMapHeight, 0, 1 );
+    // Orthographic projection of the camera's view of the map
+    XMMATRIX mView = XMMatrixTranslation( -g_vCameraCenter.x, -g_vCameraCenter.y, 0 );
+    XMMATRIX mProjection = XMMatrixOrthographicLH( g_fMapWidth / g_fCameraZoom, g_fMapHeight / g_fCameraZoom, 0, 1 );
     XMMATRIX mViewProjection = mView * mProjection;
 
     // Update Constants
@@ -1020,6 +2780,19 @@ void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime
 
     XMStoreFloat4x4( &pData.mViewProjection, XMMatrixTranspose( mViewProjection ) );
     pData.fParticleSize = g_fParticleRenderSize;
+    pData.iParticleOffset = std::min( g_iViewUniverse, state.iNumUniverses - 1 ) * state.iNumParticles;
+
+    if ( g_eRenderMode != RENDER_MODE_SPRITES && g_pHeatmapUAV )
+    {
+        RenderHeatmap( pd3dImmediateContext, state, pData );
+        return;
+    }
+
+    if ( state.bLod && g_bLod )
+    {
+        RenderFluidLod( pd3dImmediateContext, state, pData );
+        return;
+    }
 
     pd3dImmediateContext->UpdateSubresource( g_pcbRenderConstants, 0, nullptr, &pData, 0, 0 );
 
@@ -1034,8 +2807,8 @@ void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime
     pd3dImmediateContext->PSSetConstantBuffers( 0, 1, &g_pcbRenderConstants );
 
     // Setup the particles buffer and IA
-    pd3dImmediateContext->VSSetShaderResources( 0, 1, &g_pParticlesSRV );
-    pd3dImmediateContext->VSSetShaderResources( 1, 1, &g_pParticleDensitySRV );
+    pd3dImmediateContext->VSSetShaderResources( 0, 1, &state.pParticlesSRV );
+    pd3dImmediateContext->VSSetShaderResources( 1, 1, &state.pDensitySRV );
     pd3dImmediateContext->IASetVertexBuffers( 0, 1, &g_pNullBuffer, &g_iNullUINT, &g_iNullUINT );
     pd3dImmediateContext->IASetPrimitiveTopology( D3D11_PRIMITIVE_TOPOLOGY_POINTLIST );
 
@@ -1044,7 +2817,10 @@ void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime
 	pd3dImmediateContext->OMSetBlendState(g_pParticleBlendState, BlendFactor, 0xFFFFFFFF);
 
     // Draw the mesh
-    pd3dImmediateContext->Draw( g_iNumParticles, 0 );
+    if ( state.bDynamic )
+        pd3dImmediateContext->DrawInstancedIndirect( state.pDrawArgs, 0 );
+    else
+        pd3dImmediateContext->Draw( state.iNumParticles, 0 );
 
     // Unset the particles buffer
     pd3dImmediateContext->VSSetShaderResources( 0, 1, &g_pNullSRV );
@@ -1058,6 +2834,8 @@ void RenderFluid( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime
 void CALLBACK OnD3D11FrameRender( ID3D11Device* pd3dDevice, ID3D11DeviceContext* pd3dImmediateContext, double fTime,
                                   float fElapsedTime, void* pUserContext )
 {
+    CContextLock lock;
+
     // If the settings dialog is being shown, then render it instead of rendering the app's scene
     if( g_D3DSettingsDlg.IsActive() )
     {
@@ -1071,16 +2849,911 @@ void CALLBACK OnD3D11FrameRender( ID3D11Device* pd3dDevice, ID3D11DeviceContext*
     auto pDSV = DXUTGetD3D11DepthStencilView();
     pd3dImmediateContext->ClearDepthStencilView( pDSV, D3D11_CLEAR_DEPTH, 1.0, 0 );
 
-    SimulateFluid( pd3dImmediateContext, fElapsedTime );
+    GetStageProfiler().NextFrame();
+    g_GPUStageTimer.BeginFrame( pd3dImmediateContext );
+
+    // The newest step the simulation thread completed, or the one drawn last frame
+    g_RenderStates.Acquire();
+    const RenderState& state = g_RenderStates.GetFront();
+
+    if ( fTime - g_fRateTime >= 0.5 )
+    {
+        g_fSimulationRate = (FLOAT)((double)(state.iStep - g_iRateStep) / (fTime - g_fRateTime));
+        g_iRateStep = state.iStep;
+        g_fRateTime = fTime;
+    }
 
-    RenderFluid( pd3dImmediateContext, fElapsedTime );
+    if ( state.iStep > 0 )
+    {
+        CScopedStageTimer timer( "Render" );
+        g_GPUStageTimer.Begin( pd3dImmediateContext, "Render" );
+        RenderFluid( pd3dImmediateContext, state );
+        g_GPUStageTimer.End( pd3dImmediateContext );
+    }
+
+    {
+        CScopedStageTimer timer( "Capture" );
+        if ( g_FrameEncoder.IsOpen() )
+            CaptureFrame( pd3dImmediateContext );
+        g_CaptureReadback.Update( pd3dImmediateContext );
+    }
 
     // Render the HUD
-    DXUT_BeginPerfEvent( DXUT_PERFEVENTCOLOR, L"HUD / Stats" );
-    g_HUD.OnRender( fElapsedTime );
-    g_SampleUI.OnRender( fElapsedTime );
-    RenderText();
-    DXUT_EndPerfEvent();
+    {
+        CScopedStageTimer timer( "HUD" );
+        g_GPUStageTimer.Begin( pd3dImmediateContext, "HUD" );
+        DXUT_BeginPerfEvent( DXUT_PERFEVENTCOLOR, L"HUD / Stats" );
+        g_HUD.OnRender( fElapsedTime );
+        g_SampleUI.OnRender( fElapsedTime );
+        RenderText( state );
+        DXUT_EndPerfEvent();
+        g_GPUStageTimer.End( pd3dImmediateContext );
+    }
+
+    g_GPUStageTimer.EndFrame( pd3dImmediateContext );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Write the stage timings held by the profiler as a Chrome trace and a percentile table
+//--------------------------------------------------------------------------------------
+void SaveTimings()
+{
+    CStageProfiler& profiler = GetStageProfiler();
+    const bool bTrace = profiler.WriteChromeTrace( TIMINGS_TRACE_PATH );
+
+    FILE* pFile = nullptr;
+    const bool bTable = fopen_s( &pFile, TIMINGS_TABLE_PATH, "w" ) == 0;
+    if ( bTable )
+    {
+        profiler.PrintStatistics( pFile );
+        fclose( pFile );
+    }
+
+    if ( !bTrace || !bTable )
+        OutputDebugStringA( "Could not save the stage timings\n" );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Copy the live particles back to the CPU
+//--------------------------------------------------------------------------------------
+bool ReadParticles( ID3D11DeviceContext* pd3dImmediateContext, ID3D11Buffer* pStaging, std::vector<FluidParticle>& Particles )
+{
+    static_assert( sizeof( ParticleData ) == sizeof( FluidParticle ), "ParticleData and FluidParticle must match" );
+
+    const D3D11_BOX box = { 0, 0, 0, g_iNumParticles * sizeof( ParticleData ), 1, 1 };
+    pd3dImmediateContext->CopySubresourceRegion( pStaging, 0, 0, 0, 0, g_pParticles, 0, &box );
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if ( FAILED( pd3dImmediateContext->Map( pStaging, 0, D3D11_MAP_READ, 0, &mapped ) ) )
+        return false;
+    Particles.resize( g_iNumParticles );
+    memcpy( Particles.data(), mapped.pData, g_iNumParticles * sizeof( ParticleData ) );
+    pd3dImmediateContext->Unmap( pStaging, 0 );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Read back the current state, run PARITY_STEPS fixed steps of the grid path and write
+// both states so ParityCheck can replay them on the CPU simulator. Only the single
+// universe grid path without emitters or boundaries has a CPU equivalent
+//--------------------------------------------------------------------------------------
+void SaveParitySnapshot()
+{
+    if ( g_eSimMode != SIM_MODE_GRID || g_iNumUniverses != 1 || g_bDynamicParticles || g_bBoundaries )
+    {
+        OutputDebugStringA( "Parity snapshots need the grid mode with one universe, no emitters and no boundaries\n" );
+        return;
+    }
+
+    ID3D11Device* pd3dDevice = DXUTGetD3D11Device();
+    ID3D11DeviceContext* pd3dImmediateContext = DXUTGetD3D11DeviceContext();
+
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = g_iNumParticles * sizeof( ParticleData );
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    ID3D11Buffer* pStaging = nullptr;
+    if ( FAILED( pd3dDevice->CreateBuffer( &desc, nullptr, &pStaging ) ) )
+    {
+        OutputDebugStringA( "Could not create the parity snapshot staging buffer\n" );
+        return;
+    }
+    DXUT_SetDebugName( pStaging, "Parity Staging" );
+
+    // ForceCS_Grid and ForceCS_GridList use the shared constants, not the ensemble sweep
+    FluidSnapshot snapshot;
+    snapshot.Parameters.fTimeStep = g_fMaxAllowableTimeStep;
+    snapshot.Parameters.fSmoothlen = g_fSmoothlen;
+    snapshot.Parameters.fParticleMass = g_fParticleMass;
+    snapshot.Parameters.fInitialParticleSpacing = g_fInitialParticleSpacing;
+    snapshot.Parameters.fSpringK = FLUID_SPRING_K;
+    snapshot.Parameters.fExternalK = FLUID_EXTERNAL_K;
+    snapshot.Parameters.fWallStiffness = g_fWallStiffness;
+    snapshot.Parameters.pBoundary = nullptr;
+    snapshot.Parameters.pParticleMesh = nullptr;
+    snapshot.Parameters.pWaveCentres = nullptr;
+    snapshot.Parameters.pCoarseGrainer = nullptr;
+    snapshot.iSteps = PARITY_STEPS;
+    snapshot.Source = g_bNeighbourLists ? "gpu grid lists" : "gpu grid";
+
+    bool bOk = ReadParticles( pd3dImmediateContext, pStaging, snapshot.Initial );
+    for ( UINT i = 0 ; bOk && i < PARITY_STEPS ; i++ )
+        SimulateFluid( pd3dImmediateContext, g_fMaxAllowableTimeStep );
+    bOk = bOk && ReadParticles( pd3dImmediateContext, pStaging, snapshot.Final );
+    SAFE_RELEASE( pStaging );
+
+    if ( !bOk || !FluidWriteSnapshot( PARITY_SNAPSHOT_PATH, snapshot ) )
+        OutputDebugStringA( "Could not save the parity snapshot\n" );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Start a Y4M video of the scene, see CaptureFrame
+//--------------------------------------------------------------------------------------
+void StartRecording()
+{
+    FrameEncoderOptions options = FrameDefaultEncoderOptions();
+    options.eFormat = FRAME_FORMAT_Y4M;
+    options.szPath = RECORDING_PATH;
+    options.iFrameRate = RECORDING_FRAME_RATE;
+    options.bBlockWhenFull = false;
+    if ( !g_FrameEncoder.Open( options ) )
+    {
+        OutputDebugStringA( "Could not start the recording\n" );
+        g_SampleUI.GetCheckBox( IDC_RECORD )->SetChecked( false );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Finish the frames in flight and report what the recording lost
+//--------------------------------------------------------------------------------------
+void StopRecording()
+{
+    if ( !g_FrameEncoder.IsOpen() )
+        return;
+
+    // The frames in flight make it into the video
+    {
+        CContextLock lock;
+        g_CaptureReadback.Flush( DXUTGetD3D11DeviceContext() );
+    }
+
+    const bool bOk = g_FrameEncoder.Close();
+    const FrameEncoderReport report = g_FrameEncoder.GetReport();
+    char szReport[256];
+    sprintf_s( szReport, "Recording %s: %llu frames written, %llu dropped, %llu errors\n", bOk ? "saved" : "failed",
+               report.iWritten, report.iDropped, report.iErrors );
+    OutputDebugStringA( szReport );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Capture readback ring of g_iCaptureLatency + 1 slots
+//--------------------------------------------------------------------------------------
+HRESULT CreateCaptureReadback( ID3D11Device* pd3dDevice )
+{
+    GPUReadbackOptions options = GPUReadbackDefaultOptions();
+    options.iNumSlots = g_iCaptureLatency + 1;
+    options.iLatencyFrames = g_iCaptureLatency;
+    options.bStallWhenFull = false;
+    return g_CaptureReadback.Create( pd3dDevice, options );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Copy the back buffer into the readback ring; the worker submits it to the encoder.
+// Only 8 bit RGBA / BGRA back buffers without multisampling are captured.
+//--------------------------------------------------------------------------------------
+void CaptureFrame( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    ID3D11Resource* pBackBuffer = nullptr;
+    DXUTGetD3D11RenderTargetView()->GetResource( &pBackBuffer );
+
+    D3D11_TEXTURE2D_DESC desc;
+    ((ID3D11Texture2D*)pBackBuffer)->GetDesc( &desc );
+    const bool bRGBA = desc.Format == DXGI_FORMAT_R8G8B8A8_UNORM || desc.Format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+    const bool bBGRA = desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM || desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB;
+    if ( (bRGBA || bBGRA) && desc.SampleDesc.Count == 1 )
+    {
+        g_CaptureReadback.Readback( pd3dImmediateContext, pBackBuffer, nullptr, [bBGRA]( const GPUReadbackData& data )
+        {
+            g_FrameEncoder.Submit( data.pData, data.iWidth, data.iHeight, data.iRowPitch, bBGRA );
+        } );
+    }
+    SAFE_RELEASE( pBackBuffer );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Start writing every step to TRAJECTORY_PATH, on the simulation thread
+//--------------------------------------------------------------------------------------
+void StartTrajectory()
+{
+    if ( g_TrajectoryWriter.IsOpen() )
+        return;
+
+    // Two readbacks a step, a step's densities are written with its particles
+    GPUReadbackOptions options = GPUReadbackDefaultOptions();
+    options.iNumSlots = 2 * (TRAJECTORY_READBACK_LATENCY + 1);
+    options.iLatencyFrames = TRAJECTORY_READBACK_LATENCY;
+    options.bStallWhenFull = true;
+    if ( FAILED( g_TrajectoryReadback.Create( DXUTGetD3D11Device(), options ) ) ||
+         !g_TrajectoryWriter.Open( TRAJECTORY_PATH, TRAJECTORY_KEYFRAME_INTERVAL ) )
+    {
+        g_TrajectoryReadback.Destroy();
+        OutputDebugStringA( "Could not start the trajectory recording\n" );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Write the steps in flight and the index
+//--------------------------------------------------------------------------------------
+void StopTrajectory( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !g_TrajectoryWriter.IsOpen() )
+        return;
+
+    g_TrajectoryReadback.Flush( pd3dImmediateContext );
+    g_TrajectoryReadback.Destroy();
+
+    const bool bOk = g_TrajectoryWriter.Close();
+    const TrajectoryWriterReport report = g_TrajectoryWriter.GetReport();
+    char szReport[256];
+    sprintf_s( szReport, "Trajectory %s: %llu steps, %llu keyframes, %.1f MB of %.1f MB\n", bOk ? "saved" : "failed",
+               report.iFrames, report.iKeyframes, report.iWrittenBytes / (1024.0 * 1024.0), report.iRawBytes / (1024.0 * 1024.0) );
+    OutputDebugStringA( szReport );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Read back the step just simulated; the worker gets the particles, then the densities,
+// and writes the step
+//--------------------------------------------------------------------------------------
+void RecordTrajectoryStep( ID3D11DeviceContext* pd3dImmediateContext, UINT iNumParticles )
+{
+    static_assert( sizeof( ParticleDensity ) == sizeof( float ), "ParticleDensity must be a float" );
+
+    const UINT64 iStep = g_iSimulationStep;
+    const double fTime = g_fSimulationTime;
+
+    const D3D11_BOX particlesBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleData), 1, 1 };
+    g_TrajectoryReadback.Readback( pd3dImmediateContext, g_pParticles, &particlesBox, []( const GPUReadbackData& data )
+    {
+        const FluidParticle* pParticles = (const FluidParticle*)data.pData;
+        g_TrajectoryParticles.assign( pParticles, pParticles + data.iWidth / sizeof( FluidParticle ) );
+    } );
+
+    const D3D11_BOX densityBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleDensity), 1, 1 };
+    g_TrajectoryReadback.Readback( pd3dImmediateContext, g_pParticleDensity, &densityBox, [iStep, fTime]( const GPUReadbackData& data )
+    {
+        // A failed write fails the whole file, reported when it closes
+        const float* pDensities = (const float*)data.pData;
+        g_TrajectoryDensities.assign( pDensities, pDensities + data.iWidth / sizeof( float ) );
+        g_TrajectoryWriter.Write( iStep, fTime, g_TrajectoryParticles, g_TrajectoryDensities );
+    } );
+
+    g_TrajectoryReadback.Update( pd3dImmediateContext );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Start writing the coarse fields and the dumps, on the simulation thread
+//--------------------------------------------------------------------------------------
+void StartCoarseOutput()
+{
+    if ( g_CoarseFieldWriter.IsOpen() )
+        return;
+
+    // One readback a step, three on the dump steps
+    GPUReadbackOptions options = GPUReadbackDefaultOptions();
+    options.iNumSlots = 3 * (COARSE_READBACK_LATENCY + 1);
+    options.iLatencyFrames = COARSE_READBACK_LATENCY;
+    options.bStallWhenFull = true;
+    if ( FAILED( g_CoarseReadback.Create( DXUTGetD3D11Device(), options ) ) ||
+         !g_CoarseFieldWriter.Open( COARSE_FIELDS_PATH ) ||
+         !g_CoarseDumpWriter.Open( COARSE_DUMP_PATH, TRAJECTORY_KEYFRAME_INTERVAL ) )
+    {
+        g_CoarseReadback.Destroy();
+        g_CoarseFieldWriter.Close();
+        g_CoarseDumpWriter.Close();
+        OutputDebugStringA( "Could not start the coarse output\n" );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Write the steps in flight and the dumps' index
+//--------------------------------------------------------------------------------------
+void StopCoarseOutput( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !g_CoarseFieldWriter.IsOpen() )
+        return;
+
+    g_CoarseReadback.Flush( pd3dImmediateContext );
+    g_CoarseReadback.Destroy();
+
+    const bool bFieldsOk = g_CoarseFieldWriter.Close();
+    const bool bOk = g_CoarseDumpWriter.Close() && bFieldsOk;
+    const CoarseFieldReport fields = g_CoarseFieldWriter.GetReport();
+    const TrajectoryWriterReport dumps = g_CoarseDumpWriter.GetReport();
+    char szReport[256];
+    sprintf_s( szReport, "Coarse output %s: %llu steps in %.2f MB, %llu dumps in %.1f MB\n", bOk ? "saved" : "failed",
+               fields.iFrames, fields.iWrittenBytes / (1024.0 * 1024.0), dumps.iFrames, dumps.iWrittenBytes / (1024.0 * 1024.0) );
+    OutputDebugStringA( szReport );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Sum the sorted cells into g_pCoarseCells and read them back; called by
+// SimulateFluid_Grid before the integration, with the sorted particles, the densities
+// and the cell ranges bound
+//--------------------------------------------------------------------------------------
+void CoarseGrainStep( ID3D11DeviceContext* pd3dImmediateContext, UINT64 iStep, double fTime )
+{
+    UINT UAVInitialCounts = 0;
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pCoarseCellsUAV, &UAVInitialCounts );
+    pd3dImmediateContext->CSSetShader( g_pCoarseGrainCS, nullptr, 0 );
+    g_GPUStageTimer.Begin( pd3dImmediateContext, "Coarse Grain" );
+    pd3dImmediateContext->Dispatch( COARSE_GRID_DIM * COARSE_GRID_DIM / SIMULATION_BLOCK_SIZE, 1, 1 );
+    g_GPUStageTimer.End( pd3dImmediateContext );
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pNullUAV, &UAVInitialCounts );
+
+    const FLOAT fCellSize = g_fSmoothlen * COARSE_CELL_BLOCK;
+    const FLOAT fParticleMass = g_fParticleMass;
+    g_CoarseReadback.Readback( pd3dImmediateContext, g_pCoarseCells, nullptr, [iStep, fTime, fCellSize, fParticleMass]( const GPUReadbackData& data )
+    {
+        CoarseGrainCrop( (const CoarseCell*)data.pData, COARSE_GRID_DIM, fCellSize, g_CoarseFrame );
+        for ( CoarseCell& cell : g_CoarseFrame.Cells )
+            cell.fKineticEnergy *= fParticleMass;
+        g_CoarseFieldWriter.Write( iStep, fTime, g_CoarseFrame );
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Read back the step just simulated into the dumps, as RecordTrajectoryStep
+//--------------------------------------------------------------------------------------
+void DumpCoarseStep( ID3D11DeviceContext* pd3dImmediateContext, UINT iNumParticles )
+{
+    const UINT64 iStep = g_iSimulationStep;
+    const double fTime = g_fSimulationTime;
+
+    const D3D11_BOX particlesBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleData), 1, 1 };
+    g_CoarseReadback.Readback( pd3dImmediateContext, g_pParticles, &particlesBox, []( const GPUReadbackData& data )
+    {
+        const FluidParticle* pParticles = (const FluidParticle*)data.pData;
+        g_CoarseDumpParticles.assign( pParticles, pParticles + data.iWidth / sizeof( FluidParticle ) );
+    } );
+
+    const D3D11_BOX densityBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleDensity), 1, 1 };
+    g_CoarseReadback.Readback( pd3dImmediateContext, g_pParticleDensity, &densityBox, [iStep, fTime]( const GPUReadbackData& data )
+    {
+        const float* pDensities = (const float*)data.pData;
+        g_CoarseDumpDensities.assign( pDensities, pDensities + data.iWidth / sizeof( float ) );
+        g_CoarseDumpWriter.Write( iStep, fTime, g_CoarseDumpParticles, g_CoarseDumpDensities );
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Start reading the step statistics back, on the simulation thread
+//--------------------------------------------------------------------------------------
+void StartStatistics()
+{
+    if ( g_StatisticsReadback.IsCreated() )
+        return;
+    if ( !g_pIntegrateStatisticsCS )
+    {
+        OutputDebugStringA( "Step statistics need feature level 11\n" );
+        return;
+    }
+
+    // Two readbacks a step; the HUD only wants the latest, so a late step is dropped
+    GPUReadbackOptions options = GPUReadbackDefaultOptions();
+    options.iNumSlots = 2 * (STATISTICS_READBACK_LATENCY + 1);
+    options.iLatencyFrames = STATISTICS_READBACK_LATENCY;
+    options.bStallWhenFull = false;
+    if ( FAILED( g_StatisticsReadback.Create( DXUTGetD3D11Device(), options ) ) )
+    {
+        OutputDebugStringA( "Could not start the step statistics\n" );
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock( g_StatisticsMutex );
+    g_iStepStatisticsStep = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Finish the steps in flight
+//--------------------------------------------------------------------------------------
+void StopStatistics( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !g_StatisticsReadback.IsCreated() )
+        return;
+
+    g_StatisticsReadback.Flush( pd3dImmediateContext );
+    g_StatisticsReadback.Destroy();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Read back the blocks and histograms IntegrateStatisticsCS wrote for the step just
+// simulated. The blocks are summed on the readback worker and published with the
+// histograms, which come back next
+//--------------------------------------------------------------------------------------
+void ReadStatisticsStep( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    const UINT64 iStep = g_iSimulationStep;
+    const double fParticleMass = g_fParticleMass;
+
+    g_StatisticsReadback.Readback( pd3dImmediateContext, g_pStatisticsBlocks, nullptr, [iStep, fParticleMass]( const GPUReadbackData& data )
+    {
+        const StatisticsBlock* pBlocks = (const StatisticsBlock*)data.pData;
+        FluidStepStatistics& sum = g_StatisticsBlocksSum;
+        FluidResetStatistics( sum );
+        for ( UINT i = 0 ; i < data.iWidth / sizeof( StatisticsBlock ) ; i++ )
+        {
+            const StatisticsBlock& block = pBlocks[i];
+            if ( block.iCount == 0 )
+                continue;
+            sum.iNumParticles += block.iCount;
+            sum.fKineticEnergy += block.fKineticEnergy;
+            sum.fElasticEnergy += block.fElasticEnergy;
+            sum.fMomentumX += block.vMomentum.x;
+            sum.fMomentumY += block.vMomentum.y;
+            sum.fMaxSpeed = std::max( sum.fMaxSpeed, block.fMaxSpeed );
+            sum.fMinDensity = std::min( sum.fMinDensity, block.fMinDensity );
+            sum.fMaxDensity = std::max( sum.fMaxDensity, block.fMaxDensity );
+        }
+
+        // The blocks already hold the 0.5 and the spring constant
+        sum.fKineticEnergy *= fParticleMass;
+        sum.fElasticEnergy *= fParticleMass;
+        sum.fMomentumX *= fParticleMass;
+        sum.fMomentumY *= fParticleMass;
+        g_iStatisticsBlocksStep = iStep;
+    } );
+
+    g_StatisticsReadback.Readback( pd3dImmediateContext, g_pStatisticsHistogram, nullptr, [iStep]( const GPUReadbackData& data )
+    {
+        // The ring dropped this step's blocks
+        if ( g_iStatisticsBlocksStep != iStep )
+            return;
+
+        FluidStepStatistics& sum = g_StatisticsBlocksSum;
+        const UINT* pHistogram = (const UINT*)data.pData;
+        memcpy( sum.SpeedHistogram, pHistogram, sizeof( sum.SpeedHistogram ) );
+        memcpy( sum.DensityHistogram, pHistogram + FLUID_STATISTICS_BINS, sizeof( sum.DensityHistogram ) );
+        {
+            std::lock_guard<std::mutex> lock( g_StatisticsMutex );
+            g_StepStatistics = sum;
+            g_iStepStatisticsStep = iStep;
+        }
+
+        if ( iStep % STATISTICS_LOG_INTERVAL == 0 )
+        {
+            char szReport[256];
+            sprintf_s( szReport, "Step %llu: %llu particles, kinetic %.4e, elastic %.4e, momentum (%.3e, %.3e), max speed %.4f, density %.1f to %.1f\n",
+                       iStep, sum.iNumParticles, sum.fKineticEnergy, sum.fElasticEnergy, sum.fMomentumX, sum.fMomentumY, sum.fMaxSpeed,
+                       sum.fMinDensity, sum.fMaxDensity );
+            OutputDebugStringA( szReport );
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Stop simulating and play TRAJECTORY_PATH back. The emitters' changing particle count
+// has no replay
+//--------------------------------------------------------------------------------------
+void StartReplay()
+{
+    if ( g_bReplay )
+        return;
+    if ( IsDynamicParticles() )
+    {
+        OutputDebugStringA( "Replays need the fixed particle count, turn Emit / Absorb off\n" );
+        return;
+    }
+    if ( !g_TrajectoryReader.Open( TRAJECTORY_PATH ) || g_TrajectoryReader.GetNumFrames() == 0 )
+    {
+        g_TrajectoryReader.Close();
+        OutputDebugStringA( "Could not open the trajectory\n" );
+        return;
+    }
+    if ( g_TrajectoryReader.IsRecovered() )
+        OutputDebugStringA( "The trajectory has no index, it was rebuilt from its frames\n" );
+
+    g_fReplayTime = g_TrajectoryReader.GetFrameInfo( 0 ).fTime;
+    g_iReplayFrame = 0;
+    g_iReplayUploaded = SIZE_MAX;
+    g_bReplay = true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void StopReplay( ID3D11Device* pd3dDevice )
+{
+    if ( !g_bReplay )
+        return;
+    g_bReplay = false;
+    g_TrajectoryReader.Close();
+    CreateSimulationBuffers( pd3dDevice );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Jump to iValue / REPLAY_SLIDER_RANGE of the way through the recorded time
+//--------------------------------------------------------------------------------------
+void SeekReplay( UINT iValue )
+{
+    if ( !g_bReplay )
+        return;
+    const double fFirst = g_TrajectoryReader.GetFrameInfo( 0 ).fTime;
+    const double fLast = g_TrajectoryReader.GetFrameInfo( g_TrajectoryReader.GetNumFrames() - 1 ).fTime;
+    g_fReplayTime = fFirst + (fLast - fFirst) * iValue / REPLAY_SLIDER_RANGE;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Advance the replay by the clamped elapsed time, as SimulateFluid advances the
+// simulation, and upload the frame it reached into the particle buffers
+//--------------------------------------------------------------------------------------
+HRESULT ReplayStep( ID3D11DeviceContext* pd3dImmediateContext, float fElapsedTime )
+{
+    HRESULT hr = S_OK;
+
+    const double fFirst = g_TrajectoryReader.GetFrameInfo( 0 ).fTime;
+    const double fLast = g_TrajectoryReader.GetFrameInfo( g_TrajectoryReader.GetNumFrames() - 1 ).fTime;
+    g_fReplayTime += std::min( g_fMaxAllowableTimeStep, fElapsedTime );
+    if ( g_fReplayTime > fLast )
+        g_fReplayTime = fFirst;
+
+    g_iReplayFrame = g_TrajectoryReader.FindTime( g_fReplayTime );
+    if ( g_iReplayFrame == g_iReplayUploaded )
+        return S_OK;
+    if ( !g_TrajectoryReader.ReadFrame( g_iReplayFrame, g_ReplayParticles, g_ReplayDensities ) )
+    {
+        OutputDebugStringA( "Could not read a trajectory frame\n" );
+        return E_FAIL;
+    }
+
+    const UINT iNumParticles = (UINT)g_ReplayParticles.size();
+    V_RETURN( ReserveParticleBuffers( DXUTGetD3D11Device(), iNumParticles ) );
+    if ( g_ReplayDensities.empty() )
+        g_ReplayDensities.assign( iNumParticles, 0.0f );
+    if ( iNumParticles > 0 )
+    {
+        const D3D11_BOX particlesBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleData), 1, 1 };
+        pd3dImmediateContext->UpdateSubresource( g_pParticles, 0, &particlesBox, g_ReplayParticles.data(), 0, 0 );
+        const D3D11_BOX densityBox = { 0, 0, 0, iNumParticles * (UINT)sizeof(ParticleDensity), 1, 1 };
+        pd3dImmediateContext->UpdateSubresource( g_pParticleDensity, 0, &densityBox, g_ReplayDensities.data(), 0, 0 );
+    }
+    g_iReplayParticles = iNumParticles;
+    g_iReplayUploaded = g_iReplayFrame;
+    return hr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Queue a change for the simulation thread. Nothing waits: if the thread has fallen 64
+// changes behind, the change is dropped
+//--------------------------------------------------------------------------------------
+void PostSimCommand( eSimCommand eType, UINT iValue, XMFLOAT2 vValue )
+{
+    const SimCommand command = { eType, iValue, vValue };
+    if ( !g_SimCommands.TryPush( command ) )
+        OutputDebugStringA( "Simulation command queue full, change dropped\n" );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Apply the changes the UI queued since the last step, on the simulation thread
+//--------------------------------------------------------------------------------------
+void ApplySimCommands()
+{
+    ID3D11Device* pd3dDevice = DXUTGetD3D11Device();
+
+    SimCommand command;
+    while ( g_SimCommands.TryPop( command ) )
+    {
+        switch ( command.eType )
+        {
+            case SIM_COMMAND_RESET:
+                CreateSimulationBuffers( pd3dDevice ); break;
+            case SIM_COMMAND_NUM_PARTICLES:
+                g_iNumParticles = command.iValue;
+                CreateSimulationBuffers( pd3dDevice );
+                break;
+            case SIM_COMMAND_NUM_UNIVERSES:
+                g_iNumUniverses = command.iValue;
+                CreateSimulationBuffers( pd3dDevice );
+                break;
+            case SIM_COMMAND_BOUNDARIES:
+                g_bBoundaries = command.iValue != 0; break;
+            case SIM_COMMAND_NEIGHBOUR_LISTS:
+                g_bNeighbourLists = command.iValue != 0; break;
+            case SIM_COMMAND_DYNAMIC_PARTICLES:
+                // The fixed count paths need a full lattice back
+                g_bDynamicParticles = command.iValue != 0;
+                CreateSimulationBuffers( pd3dDevice );
+                break;
+            case SIM_COMMAND_GRAVITY:
+                g_vGravity = XMFLOAT2A( command.vValue.x, command.vValue.y ); break;
+            case SIM_COMMAND_SIM_MODE:
+                g_eSimMode = (eSimulationMode)command.iValue; break;
+            case SIM_COMMAND_PARITY_SNAPSHOT:
+                SaveParitySnapshot(); break;
+            case SIM_COMMAND_RECORD_TRAJECTORY:
+                if ( command.iValue )
+                    StartTrajectory();
+                else
+                    StopTrajectory( DXUTGetD3D11DeviceContext() );
+                break;
+            case SIM_COMMAND_REPLAY:
+                if ( command.iValue )
+                    StartReplay();
+                else
+                    StopReplay( pd3dDevice );
+                break;
+            case SIM_COMMAND_REPLAY_SEEK:
+                SeekReplay( command.iValue ); break;
+            case SIM_COMMAND_COARSE_OUTPUT:
+                if ( command.iValue )
+                    StartCoarseOutput();
+                else
+                    StopCoarseOutput( DXUTGetD3D11DeviceContext() );
+                break;
+            case SIM_COMMAND_STATISTICS:
+                if ( command.iValue )
+                    StartStatistics();
+                else
+                    StopStatistics( DXUTGetD3D11DeviceContext() );
+                break;
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void ReleaseRenderState( RenderState& state )
+{
+    SAFE_RELEASE( state.pParticles );
+    SAFE_RELEASE( state.pParticlesSRV );
+    SAFE_RELEASE( state.pDensity );
+    SAFE_RELEASE( state.pDensitySRV );
+    SAFE_RELEASE( state.pDrawArgs );
+    SAFE_RELEASE( state.pDrawArgsSRV );
+    SAFE_RELEASE( state.pGridIndices );
+    SAFE_RELEASE( state.pGridIndicesSRV );
+    SAFE_RELEASE( state.pLod );
+    SAFE_RELEASE( state.pLodSRV );
+    SAFE_RELEASE( state.pLodUAV );
+    state = RenderState();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Sum the particles of every cell into the finest nodes of the state's LOD, then every
+// 2x2 nodes into the next level. The particles are in the order of the grid sort that
+// built the cell ranges; they moved by one step since, which the culling allows for.
+//--------------------------------------------------------------------------------------
+void BuildLod( ID3D11DeviceContext* pd3dImmediateContext, const RenderState& state )
+{
+    UINT UAVInitialCounts = 0;
+    ID3D11ShaderResourceView* aSRVs[2] = { state.pParticlesSRV, state.pDensitySRV };
+    ID3D11ShaderResourceView* aNullSRVs[2] = { nullptr, nullptr };
+
+    pd3dImmediateContext->CSSetShaderResources( 0, 2, aSRVs );
+    pd3dImmediateContext->CSSetShaderResources( 4, 1, &state.pGridIndicesSRV );
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &state.pLodUAV, &UAVInitialCounts );
+    pd3dImmediateContext->CSSetShader( g_pLodBuildCS, nullptr, 0 );
+    pd3dImmediateContext->Dispatch( NUM_GRID_INDICES / LOD_BLOCK_SIZE, 1, 1 );
+
+    pd3dImmediateContext->CSSetShader( g_pLodReduceCS, nullptr, 0 );
+    pd3dImmediateContext->CSSetConstantBuffers( 1, 1, &g_pcbLodConstants );
+    CBLodConstants lod = {};
+    UINT iDim = LOD_GRID_DIM;
+    for ( UINT iLevel = 1 ; iLevel < LOD_LEVELS ; iLevel++ )
+    {
+        lod.iLodSrcOffset = lod.iLodDstOffset;
+        lod.iLodDstOffset += iDim * iDim;
+        iDim /= 2;
+        lod.iLodDstDim = iDim;
+        pd3dImmediateContext->UpdateSubresource( g_pcbLodConstants, 0, nullptr, &lod, 0, 0 );
+        pd3dImmediateContext->Dispatch( (iDim * iDim + LOD_BLOCK_SIZE - 1) / LOD_BLOCK_SIZE, 1, 1 );
+    }
+
+    pd3dImmediateContext->CSSetUnorderedAccessViews( 0, 1, &g_pNullUAV, &UAVInitialCounts );
+    pd3dImmediateContext->CSSetShaderResources( 0, 2, aNullSRVs );
+    pd3dImmediateContext->CSSetShaderResources( 4, 1, &g_pNullSRV );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Copy the particles of the step just submitted into the back render state and publish
+// it. The copies grow with the particle buffers and are never shrunk either
+//--------------------------------------------------------------------------------------
+HRESULT PublishRenderState( ID3D11Device* pd3dDevice, ID3D11DeviceContext* pd3dImmediateContext )
+{
+    HRESULT hr = S_OK;
+    RenderState& state = g_RenderStates.GetBack();
+
+    if ( state.iCapacity < g_iParticleCapacity )
+    {
+        ReleaseRenderState( state );
+
+        ID3D11UnorderedAccessView* pUAV = nullptr;
+        V_RETURN( CreateStructuredBuffer< ParticleData >( pd3dDevice, g_iParticleCapacity, &state.pParticles, &state.pParticlesSRV, &pUAV ) );
+        SAFE_RELEASE( pUAV );
+        V_RETURN( CreateStructuredBuffer< ParticleDensity >( pd3dDevice, g_iParticleCapacity, &state.pDensity, &state.pDensitySRV, &pUAV ) );
+        SAFE_RELEASE( pUAV );
+        if ( g_pParticleCount )
+        {
+            V_RETURN( CreateIndirectArgsBuffer( pd3dDevice, PARTICLE_COUNT_SIZE, &state.pDrawArgs, &state.pDrawArgsSRV, &pUAV ) );
+            SAFE_RELEASE( pUAV );
+            DXUT_SetDebugName( state.pDrawArgs, "Render Draw Args" );
+        }
+        DXUT_SetDebugName( state.pParticles, "Render Particles" );
+        DXUT_SetDebugName( state.pParticlesSRV, "Render Particles SRV" );
+        DXUT_SetDebugName( state.pDensity, "Render Density" );
+        DXUT_SetDebugName( state.pDensitySRV, "Render Density SRV" );
+        state.iCapacity = g_iParticleCapacity;
+    }
+
+    if ( g_pLodBuildCS && !state.pLod )
+    {
+        ID3D11UnorderedAccessView* pUAV = nullptr;
+        V_RETURN( CreateStructuredBuffer< UINT2 >( pd3dDevice, NUM_GRID_INDICES, &state.pGridIndices, &state.pGridIndicesSRV, &pUAV ) );
+        SAFE_RELEASE( pUAV );
+        V_RETURN( CreateStructuredBuffer< LodNode >( pd3dDevice, LOD_NUM_NODES, &state.pLod, &state.pLodSRV, &state.pLodUAV ) );
+        DXUT_SetDebugName( state.pGridIndices, "Render Grid Indices" );
+        DXUT_SetDebugName( state.pLod, "Render LOD" );
+    }
+
+    const bool bDynamic = !g_bReplay && IsDynamicParticles();
+    const UINT iNumCopied = g_bReplay ? g_iReplayParticles : bDynamic ? GetDynamicParticleSlots() : g_iNumParticles * g_iNumUniverses;
+
+    const D3D11_BOX particlesBox = { 0, 0, 0, iNumCopied * (UINT)sizeof(ParticleData), 1, 1 };
+    pd3dImmediateContext->CopySubresourceRegion( state.pParticles, 0, 0, 0, 0, g_pParticles, 0, &particlesBox );
+    const D3D11_BOX densityBox = { 0, 0, 0, iNumCopied * (UINT)sizeof(ParticleDensity), 1, 1 };
+    pd3dImmediateContext->CopySubresourceRegion( state.pDensity, 0, 0, 0, 0, g_pParticleDensity, 0, &densityBox );
+    if ( state.pDrawArgs )
+        pd3dImmediateContext->CopyResource( state.pDrawArgs, g_pParticleCount );
+
+    state.iNumParticles = g_bReplay ? g_iReplayParticles : g_iNumParticles;
+    state.iNumUniverses = g_bReplay ? 1 : g_iNumUniverses;
+    state.iNumLiveParticles = g_iNumLiveParticles;
+    state.iDynamicSlots = bDynamic ? GetDynamicParticleSlots() : 0;
+    state.bDynamic = bDynamic;
+    state.bNeighbourLists = !g_bReplay && g_bNeighbourLists && g_eSimMode == SIM_MODE_GRID && g_iNumUniverses == 1;
+    // Replayed particles are in their keyframe's order, not sorted by cell
+    state.bLod = !g_bReplay && state.pLod && g_eSimMode == SIM_MODE_GRID && g_iNumUniverses == 1;
+    state.bRecordingTrajectory = g_TrajectoryWriter.IsOpen();
+    state.bCoarseOutput = g_CoarseFieldWriter.IsOpen();
+    state.bStatistics = g_StatisticsReadback.IsCreated();
+    state.bReplay = g_bReplay;
+    state.iReplayFrame = g_bReplay ? (UINT)g_iReplayFrame : 0;
+    state.iNumReplayFrames = g_bReplay ? (UINT)g_TrajectoryReader.GetNumFrames() : 0;
+    state.iReplayStep = g_bReplay ? g_TrajectoryReader.GetFrameInfo( g_iReplayFrame ).iStep : 0;
+    state.iStep = ++g_iSimulationStep;
+
+    if ( g_TrajectoryWriter.IsOpen() && !g_bReplay && !bDynamic )
+        RecordTrajectoryStep( pd3dImmediateContext, iNumCopied );
+
+    // The steps SimulateFluid_Grid coarse grained, whose fields are already in the ring
+    if ( g_CoarseFieldWriter.IsOpen() && !g_bReplay && !bDynamic && g_eSimMode == SIM_MODE_GRID && g_iNumUniverses == 1 )
+    {
+        if ( g_iSimulationStep % COARSE_DUMP_INTERVAL == 0 )
+            DumpCoarseStep( pd3dImmediateContext, iNumCopied );
+        g_CoarseReadback.Update( pd3dImmediateContext );
+    }
+
+    // Set by SimulateFluid_Grid, never for a replayed frame
+    if ( g_StatisticsReadback.IsCreated() )
+    {
+        if ( g_bStatisticsIssued )
+            ReadStatisticsStep( pd3dImmediateContext );
+        g_bStatisticsIssued = false;
+        g_StatisticsReadback.Update( pd3dImmediateContext );
+    }
+
+    if ( state.bLod )
+    {
+        const D3D11_BOX gridBox = { 0, 0, 0, NUM_GRID_INDICES * (UINT)sizeof(UINT2), 1, 1 };
+        pd3dImmediateContext->CopySubresourceRegion( state.pGridIndices, 0, 0, 0, 0, g_pGridIndices, 0, &gridBox );
+        g_GPUStageTimer.Begin( pd3dImmediateContext, "Build LOD" );
+        BuildLod( pd3dImmediateContext, state );
+        g_GPUStageTimer.End( pd3dImmediateContext );
+    }
+
+    g_RenderStates.Publish();
+    return hr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Simulation thread
+// Steps as fast as the GPU completes the steps: the event query ending the previous
+// step is polled between steps, so one step at most is queued and the renderer's frames
+// get the context in between. The time step follows the wall clock and SimulateFluid
+// clamps it to g_fMaxAllowableTimeStep, as when it ran once per frame.
+//--------------------------------------------------------------------------------------
+void SimulationThreadMain()
+{
+    ID3D11Device* pd3dDevice = DXUTGetD3D11Device();
+    ID3D11DeviceContext* pd3dImmediateContext = DXUTGetD3D11DeviceContext();
+    auto lastStep = std::chrono::steady_clock::now();
+    bool bStepPending = false;
+
+    while ( !g_bStopSimulation.load( std::memory_order_acquire ) )
+    {
+        if ( bStepPending )
+        {
+            BOOL bDone = FALSE;
+            HRESULT hrDone;
+            {
+                CContextLock lock;
+                hrDone = pd3dImmediateContext->GetData( g_pStepDoneQuery, &bDone, sizeof( bDone ), 0 );
+            }
+            if ( hrDone == S_FALSE )
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            bStepPending = false;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const float fElapsedTime = std::chrono::duration<float>( now - lastStep ).count();
+        lastStep = now;
+
+        CContextLock lock;
+        ApplySimCommands();
+
+        g_GPUStageTimer.BeginFrame( pd3dImmediateContext );
+        if ( g_bReplay )
+        {
+            CScopedStageTimer timer( "Replay" );
+            ReplayStep( pd3dImmediateContext, fElapsedTime );
+        }
+        else
+        {
+            CScopedStageTimer timer( "Simulate" );
+            SimulateFluid( pd3dImmediateContext, fElapsedTime );
+        }
+        if ( FAILED( PublishRenderState( pd3dDevice, pd3dImmediateContext ) ) )
+            OutputDebugStringA( "Could not publish the particles to the renderer\n" );
+        pd3dImmediateContext->End( g_pStepDoneQuery );
+        g_GPUStageTimer.EndFrame( pd3dImmediateContext );
+        bStepPending = true;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void StartSimulationThread()
+{
+    g_bStopSimulation.store( false, std::memory_order_release );
+    g_SimulationThread = std::thread( SimulationThreadMain );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Queued changes stay queued and are applied once the thread runs again
+//--------------------------------------------------------------------------------------
+void StopSimulationThread()
+{
+    if ( !g_SimulationThread.joinable() )
+        return;
+    g_bStopSimulation.store( true, std::memory_order_release );
+    g_SimulationThread.join();
 }
 
 
@@ -1089,6 +3762,9 @@ void CALLBACK OnD3D11FrameRender( ID3D11Device* pd3dDevice, ID3D11DeviceContext*
 //--------------------------------------------------------------------------------------
 void CALLBACK OnD3D11ReleasingSwapChain( void* pUserContext )
 {
+    SAFE_RELEASE( g_pHeatmap );
+    SAFE_RELEASE( g_pHeatmapSRV );
+    SAFE_RELEASE( g_pHeatmapUAV );
     g_DialogResourceManager.OnD3D11ReleasingSwapChain();
 }
 
@@ -1098,18 +3774,54 @@ void CALLBACK OnD3D11ReleasingSwapChain( void* pUserContext )
 //--------------------------------------------------------------------------------------
 void CALLBACK OnD3D11DestroyDevice( void* pUserContext )
 {
+    // Before anything it uses goes away
+    StopSimulationThread();
+    for ( UINT i = 0 ; i < CTripleBuffer< RenderState >::NUM_SLOTS ; i++ )
+        ReleaseRenderState( g_RenderStates.GetSlot( i ) );
+    SAFE_RELEASE( g_pStepDoneQuery );
+    SAFE_RELEASE( g_pMultithread );
+    StopRecording();
+    g_CaptureReadback.Discard( DXUTGetD3D11DeviceContext() );
+    g_CaptureReadback.Destroy();
+    StopTrajectory( DXUTGetD3D11DeviceContext() );
+    g_TrajectoryReader.Close();
+    g_bReplay = false;
+    StopCoarseOutput( DXUTGetD3D11DeviceContext() );
+    StopStatistics( DXUTGetD3D11DeviceContext() );
+    g_SampleUI.GetCheckBox( IDC_RECORDTRAJECTORY )->SetChecked( false );
+    g_SampleUI.GetCheckBox( IDC_REPLAY )->SetChecked( false );
+    g_SampleUI.GetCheckBox( IDC_COARSEOUTPUT )->SetChecked( false );
+    g_SampleUI.GetCheckBox( IDC_STATISTICS )->SetChecked( false );
+
     g_DialogResourceManager.OnD3D11DestroyDevice();
     g_D3DSettingsDlg.OnD3D11DestroyDevice();
     DXUTGetGlobalResourceCache().OnDestroyDevice();
     SAFE_DELETE( g_pTxtHelper );
 
+    g_GPUStageTimer.Destroy();
+
     SAFE_RELEASE( g_pcbSimulationConstants );
     SAFE_RELEASE( g_pcbRenderConstants );
+    SAFE_RELEASE( g_pcbLodConstants );
     SAFE_RELEASE( g_pSortCB );
 
     SAFE_RELEASE( g_pParticleVS );
     SAFE_RELEASE( g_pParticleGS );
     SAFE_RELEASE( g_pParticlePS );
+    SAFE_RELEASE( g_pHeatmapCS );
+    SAFE_RELEASE( g_pHeatmapVS );
+    SAFE_RELEASE( g_pHeatmapPS );
+    SAFE_RELEASE( g_pLodBuildCS );
+    SAFE_RELEASE( g_pLodReduceCS );
+    SAFE_RELEASE( g_pLodCullCS );
+    SAFE_RELEASE( g_pParticleLodVS );
+    SAFE_RELEASE( g_pLodNodeVS );
+    SAFE_RELEASE( g_pLodRows );
+    SAFE_RELEASE( g_pLodRowsSRV );
+    SAFE_RELEASE( g_pLodRowsUAV );
+    SAFE_RELEASE( g_pLodArgs );
+    SAFE_RELEASE( g_pLodArgsSRV );
+    SAFE_RELEASE( g_pLodArgsUAV );
 
     SAFE_RELEASE( g_pIntegrateCS );
     SAFE_RELEASE( g_pDensity_SimpleCS );
@@ -1122,6 +3834,20 @@ void CALLBACK OnD3D11DestroyDevice( void* pUserContext )
     SAFE_RELEASE( g_pClearGridIndicesCS );
     SAFE_RELEASE( g_pBuildGridIndicesCS );
     SAFE_RELEASE( g_pRearrangeParticlesCS );
+    SAFE_RELEASE( g_pBuildGrid_EnsembleCS );
+    SAFE_RELEASE( g_pBuildGridIndices_EnsembleCS );
+    SAFE_RELEASE( g_pRearrangeParticles_EnsembleCS );
+    SAFE_RELEASE( g_pDensity_EnsembleCS );
+    SAFE_RELEASE( g_pForce_EnsembleCS );
+    SAFE_RELEASE( g_pDensity_GridListCS );
+    SAFE_RELEASE( g_pForce_GridListCS );
+    SAFE_RELEASE( g_pIntegrateDynamicCS );
+    SAFE_RELEASE( g_pScanParticlesCS );
+    SAFE_RELEASE( g_pScanBlockSumsCS );
+    SAFE_RELEASE( g_pCompactParticlesCS );
+    SAFE_RELEASE( g_pSpawnParticlesCS );
+    SAFE_RELEASE( g_pCoarseGrainCS );
+    SAFE_RELEASE( g_pIntegrateStatisticsCS );
     SAFE_RELEASE( g_pSortBitonic );
     SAFE_RELEASE( g_pSortTranspose );
 
@@ -1153,5 +3879,57 @@ void CALLBACK OnD3D11DestroyDevice( void* pUserContext )
     SAFE_RELEASE( g_pGridIndicesUAV );
     SAFE_RELEASE( g_pGridIndices );
 
+    SAFE_RELEASE( g_pUniverses );
+    SAFE_RELEASE( g_pUniversesSRV );
+    SAFE_RELEASE( g_pUniversesUAV );
+
+    SAFE_RELEASE( g_pBoundarySDF );
+    SAFE_RELEASE( g_pBoundarySDFSRV );
+    SAFE_RELEASE( g_pBoundarySDFUAV );
+
+    SAFE_RELEASE( g_pCoarseCells );
+    SAFE_RELEASE( g_pCoarseCellsSRV );
+    SAFE_RELEASE( g_pCoarseCellsUAV );
+
+    SAFE_RELEASE( g_pStatisticsBlocks );
+    SAFE_RELEASE( g_pStatisticsBlocksSRV );
+    SAFE_RELEASE( g_pStatisticsBlocksUAV );
+    SAFE_RELEASE( g_pStatisticsHistogram );
+    SAFE_RELEASE( g_pStatisticsHistogramSRV );
+    SAFE_RELEASE( g_pStatisticsHistogramUAV );
+
+    SAFE_RELEASE( g_pNeighbourList );
+    SAFE_RELEASE( g_pNeighbourListSRV );
+    SAFE_RELEASE( g_pNeighbourListUAV );
+
+    SAFE_RELEASE( g_pNeighbourCount );
+    SAFE_RELEASE( g_pNeighbourCountSRV );
+    SAFE_RELEASE( g_pNeighbourCountUAV );
+
+    SAFE_RELEASE( g_pParticleAlive );
+    SAFE_RELEASE( g_pParticleAliveSRV );
+    SAFE_RELEASE( g_pParticleAliveUAV );
+
+    SAFE_RELEASE( g_pParticleScan );
+    SAFE_RELEASE( g_pParticleScanSRV );
+    SAFE_RELEASE( g_pParticleScanUAV );
+
+    SAFE_RELEASE( g_pBlockSums );
+    SAFE_RELEASE( g_pBlockSumsSRV );
+    SAFE_RELEASE( g_pBlockSumsUAV );
+
+    SAFE_RELEASE( g_pSpawnParticles );
+    SAFE_RELEASE( g_pSpawnParticlesSRV );
+    SAFE_RELEASE( g_pSpawnParticlesUAV );
+
+    SAFE_RELEASE( g_pParticleCount );
+    SAFE_RELEASE( g_pParticleCountSRV );
+    SAFE_RELEASE( g_pParticleCountUAV );
+    SAFE_RELEASE( g_pParticleCountStaging );
+
+    // The pool is empty again
+    g_iParticleCapacity = 0;
+    g_iUniverseCapacity = 0;
+
 	SAFE_RELEASE(g_pParticleBlendState);
 }
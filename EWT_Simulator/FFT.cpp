@@ -0,0 +1,130 @@
+//--------------------------------------------------------------------------------------
+// File: FFT.cpp
+//
+// Radix-2 complex FFT
+//--------------------------------------------------------------------------------------
+#include "FFT.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+//--------------------------------------------------------------------------------------
+CFFTPlan::CFFTPlan() :
+    m_iSize( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+CFFTPlan::CFFTPlan( size_t iSize ) :
+    m_iSize( 0 )
+{
+    Init( iSize );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFFTPlan::Init( size_t iSize )
+{
+    assert( IsPowerOfTwo( iSize ) );
+    m_iSize = iSize;
+
+    // Twiddles in double so large sizes keep full float precision
+    const double PI = 3.14159265358979323846;
+    m_Twiddles.resize( iSize / 2 );
+    for ( size_t k = 0 ; k < iSize / 2 ; k++ )
+    {
+        double fAngle = -2.0 * PI * (double)k / (double)iSize;
+        m_Twiddles[k] = FFTComplex( (float)cos( fAngle ), (float)sin( fAngle ) );
+    }
+
+    size_t iBits = 0;
+    while ( ((size_t)1 << iBits) < iSize )
+        iBits++;
+
+    m_BitReverse.resize( iSize );
+    for ( size_t i = 0 ; i < iSize ; i++ )
+    {
+        size_t r = 0;
+        for ( size_t b = 0 ; b < iBits ; b++ )
+            r |= ((i >> b) & 1) << (iBits - 1 - b);
+        m_BitReverse[i] = r;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Iterative Cooley-Tukey, decimation in time
+//--------------------------------------------------------------------------------------
+void CFFTPlan::Transform( FFTComplex* pData, bool bInverse ) const
+{
+    const size_t N = m_iSize;
+
+    for ( size_t i = 0 ; i < N ; i++ )
+    {
+        size_t r = m_BitReverse[i];
+        if ( i < r )
+            std::swap( pData[i], pData[r] );
+    }
+
+    for ( size_t iHalf = 1 ; iHalf < N ; iHalf <<= 1 )
+    {
+        const size_t iStride = N / (iHalf * 2);
+        for ( size_t iBlock = 0 ; iBlock < N ; iBlock += iHalf * 2 )
+        {
+            for ( size_t k = 0 ; k < iHalf ; k++ )
+            {
+                FFTComplex w = m_Twiddles[k * iStride];
+                if ( bInverse )
+                    w = std::conj( w );
+
+                FFTComplex a = pData[iBlock + k];
+                FFTComplex b = pData[iBlock + k + iHalf] * w;
+                pData[iBlock + k] = a + b;
+                pData[iBlock + k + iHalf] = a - b;
+            }
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFFT2D::Init( size_t iWidth, size_t iHeight )
+{
+    m_Rows.Init( iWidth );
+    m_Columns.Init( iHeight );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Rows in place, then columns through a per chunk scratch copy
+//--------------------------------------------------------------------------------------
+void CFFT2D::Transform( FFTComplex* pData, bool bInverse ) const
+{
+    const size_t iWidth = m_Rows.GetSize();
+    const size_t iHeight = m_Columns.GetSize();
+
+    GetThreadPool().ParallelFor( iHeight, 8, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t y = iBegin ; y < iEnd ; y++ )
+            m_Rows.Transform( pData + y * iWidth, bInverse );
+    } );
+
+    const float fScale = bInverse ? 1.0f / (float)(iWidth * iHeight) : 1.0f;
+    GetThreadPool().ParallelFor( iWidth, 8, [&]( size_t iBegin, size_t iEnd )
+    {
+        std::vector<FFTComplex> column( iHeight );
+        for ( size_t x = iBegin ; x < iEnd ; x++ )
+        {
+            for ( size_t y = 0 ; y < iHeight ; y++ )
+                column[y] = pData[y * iWidth + x];
+
+            m_Columns.Transform( column.data(), bInverse );
+
+            for ( size_t y = 0 ; y < iHeight ; y++ )
+                pData[y * iWidth + x] = column[y] * fScale;
+        }
+    } );
+}
@@ -0,0 +1,61 @@
+//--------------------------------------------------------------------------------------
+// File: FFT.h
+//
+// Radix-2 complex FFT used by the particle-mesh solver. 2D transforms run their rows,
+// then their columns, on the shared thread pool.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+typedef std::complex<float> FFTComplex;
+
+//--------------------------------------------------------------------------------------
+// Twiddles and bit reversal table for one power of two size
+//--------------------------------------------------------------------------------------
+class CFFTPlan
+{
+public:
+    CFFTPlan();
+    explicit CFFTPlan( size_t iSize );
+
+    void Init( size_t iSize );
+    size_t GetSize() const { return m_iSize; }
+
+    // In place, unscaled in both directions (forward uses e^-i)
+    void Transform( FFTComplex* pData, bool bInverse ) const;
+
+private:
+    size_t                      m_iSize;
+    std::vector<FFTComplex>     m_Twiddles;     // e^(-2 pi i k / N), k < N / 2
+    std::vector<size_t>         m_BitReverse;
+};
+
+//--------------------------------------------------------------------------------------
+// 2D FFT of a row-major iWidth x iHeight grid, both powers of two
+//--------------------------------------------------------------------------------------
+class CFFT2D
+{
+public:
+    void Init( size_t iWidth, size_t iHeight );
+
+    // The inverse divides by iWidth * iHeight, so Inverse( Forward( x ) ) == x
+    void Forward( FFTComplex* pData ) const { Transform( pData, false ); }
+    void Inverse( FFTComplex* pData ) const { Transform( pData, true ); }
+
+    size_t GetWidth() const { return m_Rows.GetSize(); }
+    size_t GetHeight() const { return m_Columns.GetSize(); }
+
+private:
+    void Transform( FFTComplex* pData, bool bInverse ) const;
+
+    CFFTPlan    m_Rows;
+    CFFTPlan    m_Columns;
+};
+
+inline bool IsPowerOfTwo( size_t iValue )
+{
+    return iValue && !(iValue & (iValue - 1));
+}
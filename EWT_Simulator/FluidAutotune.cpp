@@ -0,0 +1,306 @@
+//--------------------------------------------------------------------------------------
+// File: FluidAutotune.cpp
+//
+// Candidate timing, the coordinate descent and the tuning cache
+//--------------------------------------------------------------------------------------
+#include "FluidAutotune.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace
+{
+    const size_t GRAIN_CANDIDATES[] = { 256, 1024, 4096, 16384 };
+    const unsigned int MAX_CELL_SUBDIVISION = 2;
+
+    FILE* OpenFile( const char* szPath, const char* szMode )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, szMode ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, szMode );
+#endif
+    }
+
+    // The 48 character brand string of CPUID leaves 0x80000002-4, empty if unsupported
+    std::string CpuBrand()
+    {
+        char szBrand[49] = {};
+#if defined(_MSC_VER)
+        int regs[4];
+        __cpuid( regs, 0x80000000 );
+        if ( (unsigned int)regs[0] >= 0x80000004 )
+        {
+            for ( int i = 0 ; i < 3 ; i++ )
+            {
+                __cpuid( regs, 0x80000002 + i );
+                memcpy( szBrand + 16 * i, regs, 16 );
+            }
+        }
+#elif defined(__x86_64__) || defined(__i386__)
+        unsigned int regs[4];
+        if ( __get_cpuid_max( 0x80000000, nullptr ) >= 0x80000004 )
+        {
+            for ( unsigned int i = 0 ; i < 3 ; i++ )
+            {
+                __get_cpuid( 0x80000002 + i, &regs[0], &regs[1], &regs[2], &regs[3] );
+                memcpy( szBrand + 16 * i, regs, 16 );
+            }
+        }
+#endif
+        return szBrand;
+    }
+
+    std::string CacheKey( unsigned int iNumParticles, unsigned int iMaxThreads )
+    {
+        return FluidHardwareKey() + " " + std::to_string( iNumParticles ) + " " + std::to_string( iMaxThreads );
+    }
+
+    // One line per tuning: hardware particles max_threads grain subdivision threads sort ms
+    bool ParseCacheLine( const char* szLine, std::string& Key, FluidTuning& tuning )
+    {
+        char szHardware[256], szSort[32];
+        unsigned int iNumParticles, iMaxThreads, iSubdivision, iNumThreads;
+        unsigned long long iGrain;
+        double fStepMs;
+        if ( sscanf( szLine, "%255s %u %u %llu %u %u %31s %lf", szHardware, &iNumParticles, &iMaxThreads, &iGrain,
+                     &iSubdivision, &iNumThreads, szSort, &fStepMs ) != 8 )
+            return false;
+
+        int iSort = 0;
+        while ( iSort < FLUID_SORT_COUNT && strcmp( szSort, FluidSortAlgorithmName( (FluidSortAlgorithm)iSort ) ) != 0 )
+            iSort++;
+        if ( iSort == FLUID_SORT_COUNT || iGrain == 0 || iNumThreads == 0 )
+            return false;
+
+        Key = std::string( szHardware ) + " " + std::to_string( iNumParticles ) + " " + std::to_string( iMaxThreads );
+        tuning.iGrain = (size_t)iGrain;
+        tuning.iCellSubdivision = std::min( std::max( iSubdivision, 1u ), MAX_CELL_SUBDIVISION );
+        tuning.iNumThreads = iNumThreads;
+        tuning.eSort = (FluidSortAlgorithm)iSort;
+        tuning.fStepMs = fStepMs;
+        return true;
+    }
+
+    bool ReadCache( const char* szPath, const std::string& Key, FluidTuning& tuning )
+    {
+        FILE* pFile = OpenFile( szPath, "r" );
+        if ( !pFile )
+            return false;
+
+        bool bFound = false;
+        char szLine[512];
+        while ( !bFound && fgets( szLine, sizeof( szLine ), pFile ) )
+        {
+            std::string LineKey;
+            FluidTuning entry;
+            bFound = szLine[0] != '#' && ParseCacheLine( szLine, LineKey, entry ) && LineKey == Key;
+            if ( bFound )
+                tuning = entry;
+        }
+        fclose( pFile );
+        return bFound;
+    }
+
+    // Replaces the entry of Key, keeping the entries of other machines and sizes
+    bool WriteCache( const char* szPath, const std::string& Key, const FluidTuning& tuning )
+    {
+        std::vector<std::string> lines;
+        if ( FILE* pFile = OpenFile( szPath, "r" ) )
+        {
+            char szLine[512];
+            while ( fgets( szLine, sizeof( szLine ), pFile ) )
+            {
+                std::string LineKey;
+                FluidTuning other;
+                if ( szLine[0] != '#' && ParseCacheLine( szLine, LineKey, other ) && LineKey != Key )
+                    lines.push_back( szLine );
+            }
+            fclose( pFile );
+        }
+
+        FILE* pFile = OpenFile( szPath, "w" );
+        if ( !pFile )
+            return false;
+        fprintf( pFile, "# hardware particles max_threads grain subdivision threads sort step_ms\n" );
+        for ( const std::string& Line : lines )
+            fputs( Line.c_str(), pFile );
+        fprintf( pFile, "%s %llu %u %u %s %.4f\n", Key.c_str(), (unsigned long long)tuning.iGrain, tuning.iCellSubdivision,
+                 tuning.iNumThreads, FluidSortAlgorithmName( tuning.eSort ), tuning.fStepMs );
+        return fclose( pFile ) == 0;
+    }
+
+    double MedianStepMs( const FluidTuning& candidate, const std::vector<FluidParticle>& Particles, const FluidParameters& params,
+                         const FluidAutotuneOptions& options )
+    {
+        CFluidSimulatorCPU simulator;
+        FluidApplyTuning( candidate, simulator );
+        simulator.SetParticles( Particles );
+
+        for ( unsigned int i = 0 ; i < options.iWarmupSteps ; i++ )
+            simulator.Step( params );
+
+        std::vector<double> times( std::max( 1u, options.iTimedSteps ) );
+        for ( double& fMs : times )
+        {
+            auto start = std::chrono::steady_clock::now();
+            simulator.Step( params );
+            fMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        }
+        std::nth_element( times.begin(), times.begin() + times.size() / 2, times.end() );
+        return times[times.size() / 2];
+    }
+
+    bool SameSettings( const FluidTuning& a, const FluidTuning& b )
+    {
+        return a.iGrain == b.iGrain && a.iCellSubdivision == b.iCellSubdivision && a.iNumThreads == b.iNumThreads && a.eSort == b.eSort;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidAutotuneOptions FluidDefaultAutotuneOptions()
+{
+    FluidAutotuneOptions options;
+    options.iMaxThreads = 0;
+    options.iWarmupSteps = 2;
+    options.iTimedSteps = 5;
+    options.szCachePath = "EWT_Autotune.txt";
+    options.bRetune = false;
+    options.pLog = nullptr;
+    return options;
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidTuning FluidDefaultTuning()
+{
+    CFluidSimulatorCPU simulator;
+    FluidTuning tuning;
+    tuning.iGrain = simulator.GetGrainSize();
+    tuning.iCellSubdivision = simulator.GetCellSubdivision();
+    tuning.iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    tuning.eSort = simulator.GetSortAlgorithm();
+    tuning.fStepMs = 0;
+    return tuning;
+}
+
+
+//--------------------------------------------------------------------------------------
+std::string FluidHardwareKey()
+{
+    std::string Key;
+    for ( char c : CpuBrand() )
+    {
+        const bool bWord = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        if ( bWord || c == '.' || c == '-' )
+            Key += c;
+        else if ( !Key.empty() && Key.back() != '_' )
+            Key += '_';
+    }
+    while ( !Key.empty() && Key.back() == '_' )
+        Key.pop_back();
+    if ( Key.empty() )
+        Key = "unknown_cpu";
+    return Key + "_x" + std::to_string( std::max( 1u, std::thread::hardware_concurrency() ) );
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidTuning FluidAutotune( const std::vector<FluidParticle>& Particles, const FluidParameters& params,
+                           const FluidAutotuneOptions& options, bool* pbFromCache )
+{
+    const unsigned int iMaxThreads = options.iMaxThreads ? options.iMaxThreads : std::max( 1u, std::thread::hardware_concurrency() );
+    const std::string Key = CacheKey( (unsigned int)Particles.size(), iMaxThreads );
+
+    FluidTuning best = FluidDefaultTuning();
+    best.iNumThreads = iMaxThreads;
+
+    if ( pbFromCache )
+        *pbFromCache = false;
+    if ( options.szCachePath && !options.bRetune && ReadCache( options.szCachePath, Key, best ) )
+    {
+        if ( pbFromCache )
+            *pbFromCache = true;
+        SetThreadPoolSize( best.iNumThreads );
+        return best;
+    }
+
+    if ( Particles.empty() )
+        return best;
+
+    auto Try = [&]( FluidTuning candidate )
+    {
+        if ( SameSettings( candidate, best ) && best.fStepMs > 0 )
+            return;
+        candidate.fStepMs = MedianStepMs( candidate, Particles, params, options );
+        if ( options.pLog )
+        {
+            fprintf( options.pLog, "autotune: grain %6zu  cells h/%u  threads %3u  sort %-8s  %9.3f ms\n", candidate.iGrain,
+                     candidate.iCellSubdivision, candidate.iNumThreads, FluidSortAlgorithmName( candidate.eSort ), candidate.fStepMs );
+        }
+        if ( best.fStepMs <= 0 || candidate.fStepMs < best.fStepMs )
+            best = candidate;
+    };
+
+    Try( best );
+
+    for ( int iSort = 0 ; iSort < FLUID_SORT_COUNT ; iSort++ )
+    {
+        FluidTuning candidate = best;
+        candidate.eSort = (FluidSortAlgorithm)iSort;
+        Try( candidate );
+    }
+
+    for ( unsigned int iSubdivision = 1 ; iSubdivision <= MAX_CELL_SUBDIVISION ; iSubdivision++ )
+    {
+        FluidTuning candidate = best;
+        candidate.iCellSubdivision = iSubdivision;
+        Try( candidate );
+    }
+
+    for ( size_t iGrain : GRAIN_CANDIDATES )
+    {
+        if ( iGrain > std::max<size_t>( Particles.size(), GRAIN_CANDIDATES[0] ) )
+            break;
+        FluidTuning candidate = best;
+        candidate.iGrain = iGrain;
+        Try( candidate );
+    }
+
+    for ( unsigned int iNumThreads = 1 ; ; iNumThreads = std::min( iNumThreads * 2, iMaxThreads ) )
+    {
+        FluidTuning candidate = best;
+        candidate.iNumThreads = iNumThreads;
+        Try( candidate );
+        if ( iNumThreads == iMaxThreads )
+            break;
+    }
+
+    if ( options.szCachePath && !WriteCache( options.szCachePath, Key, best ) && options.pLog )
+        fprintf( options.pLog, "autotune: cannot write %s\n", options.szCachePath );
+
+    SetThreadPoolSize( best.iNumThreads );
+    return best;
+}
+
+
+//--------------------------------------------------------------------------------------
+void FluidApplyTuning( const FluidTuning& tuning, CFluidSimulatorCPU& simulator )
+{
+    if ( GetThreadPool().GetNumThreads() != tuning.iNumThreads )
+        SetThreadPoolSize( tuning.iNumThreads );
+    simulator.SetGrainSize( tuning.iGrain );
+    simulator.SetCellSubdivision( tuning.iCellSubdivision );
+    simulator.SetSortAlgorithm( tuning.eSort );
+}
@@ -0,0 +1,53 @@
+//--------------------------------------------------------------------------------------
+// File: FluidAutotune.h
+//
+// Startup tuning of the CPU simulator. The grain size, cell size, thread count and sort
+// algorithm it defaults to were chosen on one machine; the tuner times short runs of
+// candidate settings on the caller's particles and keeps the fastest. Results are
+// cached in a text file keyed by CPU, particle count and thread limit, so only the first
+// start with a given machine and problem size pays for the search.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct FluidTuning
+{
+    size_t iGrain;                  // SetGrainSize
+    unsigned int iCellSubdivision;  // SetCellSubdivision, 1 (h, 3x3) or 2 (h/2, 5x5)
+    unsigned int iNumThreads;       // SetThreadPoolSize
+    FluidSortAlgorithm eSort;       // SetSortAlgorithm
+    double fStepMs;                 // Median step time the search measured
+};
+
+struct FluidAutotuneOptions
+{
+    unsigned int iMaxThreads;       // Largest thread count tried, 0 = every hardware thread
+    unsigned int iWarmupSteps;      // Untimed steps of every candidate
+    unsigned int iTimedSteps;       // Timed steps of every candidate, the median counts
+    const char* szCachePath;        // nullptr neither reads nor writes a cache
+    bool bRetune;                   // Search even if the cache has a result
+    FILE* pLog;                     // Every candidate's time, nullptr for none
+};
+
+FluidAutotuneOptions FluidDefaultAutotuneOptions();
+
+// The simulator's own defaults, with every thread of the pool
+FluidTuning FluidDefaultTuning();
+
+// CPU brand string and hardware thread count, without spaces
+std::string FluidHardwareKey();
+
+// Returns the cached tuning for this machine, particle count and thread limit, or
+// searches one and stores it in the cache. The search is a coordinate descent from the
+// defaults: sort algorithm, cell size, grain size, then thread count, each with the
+// best of the settings before it. It leaves the thread pool at the tuned size.
+FluidTuning FluidAutotune( const std::vector<FluidParticle>& Particles, const FluidParameters& params,
+                           const FluidAutotuneOptions& options, bool* pbFromCache = nullptr );
+
+// Sizes the shared thread pool and sets up the simulator
+void FluidApplyTuning( const FluidTuning& tuning, CFluidSimulatorCPU& simulator );
@@ -0,0 +1,1344 @@
+//--------------------------------------------------------------------------------------
+// File: FluidCPU.cpp
+//
+// CPU implementation of the grid + sort simulation in FluidCS11.hlsl
+//--------------------------------------------------------------------------------------
+#include "FluidCPU.h"
+#include "BarnesHut.h"
+#include "BoundarySDF.h"
+#include "CoarseGrain.h"
+#include "FluidConstants.h"
+#include "ParticleMesh.h"
+#include "PerfCounters.h"
+#include "StageProfiler.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+
+namespace
+{
+    const float PI = 3.14159265f;
+
+    // Marks a particle without a neighbour list
+    const uint32_t NEIGHBOUR_OVERFLOW = UINT32_MAX;
+
+    // Entries a thread takes from the arena at a time
+    const size_t NEIGHBOUR_BLOCK_SIZE = 1024;
+
+    // Digit of the radix sort, one cell coordinate
+    const unsigned int RADIX_BITS = 8;
+    const size_t RADIX_BINS = (size_t)1 << RADIX_BITS;
+
+    //----------------------------------------------------------------------------------
+    // Appends the lists of consecutive particles to the shared arena. Each writer owns
+    // a block of the arena at a time; a list that does not fit in the rest of the block
+    // moves to a new one, so every list stays contiguous.
+    //----------------------------------------------------------------------------------
+    template <class T>
+    class CNeighbourWriter
+    {
+    public:
+        CNeighbourWriter( std::vector<TFluidNeighbour<T>>& Arena, std::atomic<size_t>& iNextBlock ) :
+            m_Arena( Arena ), m_iNextBlock( iNextBlock ),
+            m_iCursor( 0 ), m_iBlockEnd( 0 ), m_iListStart( 0 ), m_bOverflow( false )
+        {
+        }
+
+        void Begin()
+        {
+            m_iListStart = m_iCursor;
+            m_bOverflow = false;
+        }
+
+        void Push( uint32_t iIndex, T fDistanceSq )
+        {
+            if ( m_bOverflow )
+                return;
+
+            if ( m_iCursor == m_iBlockEnd )
+            {
+                const size_t iLength = m_iCursor - m_iListStart;
+                const size_t iBlock = m_iNextBlock.fetch_add( NEIGHBOUR_BLOCK_SIZE, std::memory_order_relaxed );
+                if ( iLength >= NEIGHBOUR_BLOCK_SIZE || iBlock + NEIGHBOUR_BLOCK_SIZE > m_Arena.size() )
+                {
+                    m_bOverflow = true;
+                    return;
+                }
+
+                if ( iLength > 0 )
+                    memcpy( &m_Arena[iBlock], &m_Arena[m_iListStart], iLength * sizeof( TFluidNeighbour<T> ) );
+                m_iListStart = iBlock;
+                m_iCursor = iBlock + iLength;
+                m_iBlockEnd = iBlock + NEIGHBOUR_BLOCK_SIZE;
+            }
+
+            m_Arena[m_iCursor++] = { iIndex, fDistanceSq };
+        }
+
+        // Returns false if the list did not fit
+        bool End( FluidCellRange& range )
+        {
+            if ( m_bOverflow )
+            {
+                m_iCursor = m_iListStart;
+                range = { NEIGHBOUR_OVERFLOW, NEIGHBOUR_OVERFLOW };
+                return false;
+            }
+            range = { (uint32_t)m_iListStart, (uint32_t)m_iCursor };
+            return true;
+        }
+
+    private:
+        std::vector<TFluidNeighbour<T>>& m_Arena;
+        std::atomic<size_t>&            m_iNextBlock;
+        size_t                          m_iCursor;
+        size_t                          m_iBlockEnd;
+        size_t                          m_iListStart;
+        bool                            m_bOverflow;
+    };
+
+    // IEEE 754 half of a float, rounding to nearest even
+    uint16_t FloatToHalf( float f )
+    {
+        uint32_t x;
+        memcpy( &x, &f, sizeof( x ) );
+        const uint32_t sign = (x >> 16) & 0x8000;
+        const uint32_t absx = x & 0x7FFFFFFF;
+
+        // Inf and NaN, and values that round past the largest half, 65504
+        if ( absx >= 0x7F800000 )
+            return (uint16_t)(sign | 0x7C00 | ((absx > 0x7F800000) ? 0x200 : 0));
+        if ( absx >= 0x477FF000 )
+            return (uint16_t)(sign | 0x7C00);
+
+        // Subnormal halves are multiples of 2^-24
+        if ( absx < 0x38800000 )
+        {
+            float fAbs;
+            memcpy( &fAbs, &absx, sizeof( fAbs ) );
+            return (uint16_t)(sign | (uint32_t)nearbyintf( fAbs * 16777216.0f ));
+        }
+
+        // Rebias the exponent and round away the low 13 bits of the mantissa
+        uint32_t h = (absx - 0x38000000) >> 13;
+        const uint32_t iRest = absx & 0x1FFF;
+        if ( iRest > 0x1000 || (iRest == 0x1000 && (h & 1)) )
+            h++;
+        return (uint16_t)(sign | h);
+    }
+
+    float HalfToFloat( uint16_t h )
+    {
+        const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        const uint32_t exponent = (h >> 10) & 0x1F;
+        const uint32_t mantissa = h & 0x3FF;
+
+        uint32_t x;
+        if ( exponent == 0 )
+        {
+            const float fAbs = (float)mantissa * (1.0f / 16777216.0f);
+            memcpy( &x, &fAbs, sizeof( x ) );
+            x |= sign;
+        }
+        else if ( exponent == 31 )
+            x = sign | 0x7F800000 | (mantissa << 13);
+        else
+            x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+        float f;
+        memcpy( &f, &x, sizeof( f ) );
+        return f;
+    }
+
+    //----------------------------------------------------------------------------------
+    // Neighbour reads of the density and force loops, from the sorted particles or from
+    // their packed copy. SetCell names the cell the following reads belong to; packed
+    // positions are decoded relative to its origin.
+    //----------------------------------------------------------------------------------
+    template <class T>
+    struct FullNeighbours
+    {
+        const TFluidParticle<T>* pParticles;
+
+        void SetCell( int, int ) {}
+        TFluidFloat2<T> Position( uint32_t i ) const { return pParticles[i].vPosition; }
+        TFluidFloat2<T> Velocity( uint32_t i ) const { return pParticles[i].vVelocity; }
+        static size_t Bytes() { return sizeof( TFluidParticle<T> ); }
+    };
+
+    template <class T>
+    struct PackedNeighbours
+    {
+        PackedNeighbours( const FluidPackedParticle* pPacked, T fCellSize ) :
+            pPacked( pPacked ), fCellSize( fCellSize ), fStep( fCellSize / FLUID_OFFSET_SCALE ),
+            fOriginX( 0 ), fOriginY( 0 )
+        {
+        }
+
+        void SetCell( int X, int Y )
+        {
+            fOriginX = (T)X * fCellSize;
+            fOriginY = (T)Y * fCellSize;
+        }
+        TFluidFloat2<T> Position( uint32_t i ) const
+        {
+            return { fOriginX + (T)pPacked[i].iOffsetX * fStep, fOriginY + (T)pPacked[i].iOffsetY * fStep };
+        }
+        TFluidFloat2<T> Velocity( uint32_t i ) const
+        {
+            return { (T)HalfToFloat( pPacked[i].iVelocityX ), (T)HalfToFloat( pPacked[i].iVelocityY ) };
+        }
+        static size_t Bytes() { return sizeof( FluidPackedParticle ); }
+
+        const FluidPackedParticle* pPacked;
+        T fCellSize;
+        T fStep;
+        T fOriginX;
+        T fOriginY;
+    };
+
+    // The particle mesh and the wave centres work in float
+    const FluidParticle* AsFloatParticles( const std::vector<FluidParticle>& Particles, std::vector<FluidParticle>& )
+    {
+        return Particles.data();
+    }
+
+    template <class T>
+    const FluidParticle* AsFloatParticles( const std::vector<TFluidParticle<T>>& Particles, std::vector<FluidParticle>& Scratch )
+    {
+        Scratch = FluidConvertParticles<float>( Particles );
+        return Scratch.data();
+    }
+
+    template <class T>
+    FluidFloat2 ToFloat( const TFluidFloat2<T>& v )
+    {
+        return { (float)v.x, (float)v.y };
+    }
+
+    // Max / mean of a set of chunk costs
+    double Imbalance( const double* pCosts, size_t iCount )
+    {
+        double fMax = 0, fTotal = 0;
+        for ( size_t i = 0 ; i < iCount ; i++ )
+        {
+            fMax = std::max( fMax, pCosts[i] );
+            fTotal += pCosts[i];
+        }
+        return (fTotal > 0) ? fMax * (double)iCount / fTotal : 1.0;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidParameters FluidDefaultParameters()
+{
+    FluidParameters params;
+    params.fTimeStep = 0.005f;                  // g_fMaxAllowableTimeStep
+    params.fSmoothlen = 0.012f;
+    params.fParticleMass = 0.00005f;
+    params.fInitialParticleSpacing = FLUID_INITIAL_PARTICLE_SPACING;
+    params.fSpringK = FLUID_SPRING_K;
+    params.fExternalK = FLUID_EXTERNAL_K;
+    params.fWallStiffness = 1000.0f;
+    params.pBoundary = nullptr;
+    params.pParticleMesh = nullptr;
+    params.pWaveCentres = nullptr;
+    params.pCoarseGrainer = nullptr;
+    return params;
+}
+
+
+//--------------------------------------------------------------------------------------
+void FluidResetStatistics( FluidStepStatistics& stats )
+{
+    memset( &stats, 0, sizeof( stats ) );
+    stats.fMinDensity = FLT_MAX;
+    stats.fMaxDensity = -FLT_MAX;
+}
+
+
+//--------------------------------------------------------------------------------------
+void FluidMergeStatistics( FluidStepStatistics& total, const FluidStepStatistics& part )
+{
+    total.iNumParticles += part.iNumParticles;
+    total.fKineticEnergy += part.fKineticEnergy;
+    total.fElasticEnergy += part.fElasticEnergy;
+    total.fMomentumX += part.fMomentumX;
+    total.fMomentumY += part.fMomentumY;
+    total.fMaxSpeed = std::max( total.fMaxSpeed, part.fMaxSpeed );
+    total.fMinDensity = std::min( total.fMinDensity, part.fMinDensity );
+    total.fMaxDensity = std::max( total.fMaxDensity, part.fMaxDensity );
+    for ( unsigned int i = 0 ; i < FLUID_STATISTICS_BINS ; i++ )
+    {
+        total.SpeedHistogram[i] += part.SpeedHistogram[i];
+        total.DensityHistogram[i] += part.DensityHistogram[i];
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+const char* FluidSortAlgorithmName( FluidSortAlgorithm eSort )
+{
+    switch ( eSort )
+    {
+        case FLUID_SORT_COUNTING: return "counting";
+        case FLUID_SORT_RADIX: return "radix";
+        case FLUID_SORT_MERGE: return "merge";
+        default: return "unknown";
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Arrange the particles in a square, each anchored to its start position and pulled
+// towards the middle of the square, as CreateSimulationBuffers does
+//--------------------------------------------------------------------------------------
+template <class T>
+std::vector<TFluidParticle<T>> FluidCreateLattice( unsigned int iNumParticles, float fSpacing )
+{
+    const unsigned int iStartingWidth = (unsigned int)sqrtf( (float)iNumParticles );
+    const T fCenter = (T)fSpacing * iStartingWidth / 2;
+
+    std::vector<TFluidParticle<T>> particles( iNumParticles );
+    for ( unsigned int i = 0 ; i < iNumParticles ; i++ )
+    {
+        unsigned int x = i % iStartingWidth;
+        unsigned int y = i / iStartingWidth;
+        particles[i].vPosition = { (T)fSpacing * (T)x, (T)fSpacing * (T)y };
+        particles[i].vVelocity = { 0, 0 };
+        particles[i].vIndex = particles[i].vPosition;
+        particles[i].vCenter = { fCenter, fCenter };
+    }
+    return particles;
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+TFluidSimulatorCPU<TReal, TSum>::TFluidSimulatorCPU() :
+    m_GridIndices( NUM_GRID_INDICES ),
+    m_iNumSortChunks( 0 ),
+    m_iGrain( 1024 ),
+    m_fCellSize( 0 ),
+    m_iCellSubdivision( 1 ),
+    m_eSort( FLUID_SORT_COUNTING ),
+    m_CellCost( NUM_GRID_INDICES ),
+    m_CellCostStamp( NUM_GRID_INDICES ),
+    m_iCostStamp( 0 ),
+    m_fMeanCost( 0 ),
+    m_bLoadBalancing( true ),
+    m_iNumBalanceChunks( 0 ),
+    m_BalanceReport(),
+    m_iNeighbourBudget( 32 ),
+    m_bNeighbourLists( false ),
+    m_NeighbourReport(),
+    m_bCompressed( false ),
+    m_StorageReport(),
+    m_bStatistics( false )
+{
+    FluidResetStatistics( m_Statistics );
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SetCellSubdivision( unsigned int iSubdivision )
+{
+    m_iCellSubdivision = std::max( 1u, iSubdivision );
+
+    // Measured cell costs and neighbour lists belong to the old cells
+    m_iCostStamp = 0;
+    m_fMeanCost = 0;
+    m_ChunkStarts.clear();
+    m_NeighbourRanges.clear();
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SetCompressedStorage( bool bEnable )
+{
+    m_bCompressed = bEnable;
+    m_StorageReport = FluidStorageReport();
+    if ( !bEnable )
+        std::vector<FluidPackedParticle>().swap( m_Packed );
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SetNeighbourLists( bool bEnable, size_t iBudgetPerParticle )
+{
+    m_bNeighbourLists = bEnable;
+    m_iNeighbourBudget = iBudgetPerParticle;
+    m_NeighbourRanges.clear();
+    m_NeighbourReport = FluidNeighbourReport();
+    if ( !bEnable )
+        std::vector<Neighbour>().swap( m_NeighbourArena );
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SetLoadBalancing( bool bEnable, unsigned int iNumChunks )
+{
+    m_bLoadBalancing = bEnable;
+    m_iNumBalanceChunks = iNumChunks;
+    m_BalanceReport = FluidBalanceReport();
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SetParticles( const std::vector<Particle>& Particles )
+{
+    m_Particles = Particles;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Same clamp as GridCalculateCell, cells are m_fCellSize wide
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+unsigned int TFluidSimulatorCPU<TReal, TSum>::CalculateCell( const Float2& position, TReal fInvCellSize ) const
+{
+    TReal x = std::min( std::max( position.x * fInvCellSize, (TReal)0 ), (TReal)(GRID_DIM - 1) );
+    TReal y = std::min( std::max( position.y * fInvCellSize, (TReal)0 ), (TReal)(GRID_DIM - 1) );
+    return (unsigned int)y * GRID_DIM + (unsigned int)x;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Build Grid
+// Computes the cell of every particle and counts the cells (or, for the radix sort,
+// the low digits) of each sort chunk, which the scatter needs before it can start
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::BuildGrid( const FluidParameters& params )
+{
+    const size_t iNumParticles = m_Particles.size();
+    const TReal fInvCellSize = (TReal)m_iCellSubdivision / (TReal)params.fSmoothlen;
+    const size_t iNumBins = (m_eSort == FLUID_SORT_COUNTING) ? NUM_GRID_INDICES : (m_eSort == FLUID_SORT_RADIX) ? RADIX_BINS : 0;
+    const uint32_t iBinMask = (uint32_t)iNumBins - 1;
+
+    m_fCellSize = (TReal)params.fSmoothlen / (TReal)m_iCellSubdivision;
+    m_Cells.resize( iNumParticles );
+    m_iNumSortChunks = (unsigned int)std::max<size_t>( 1, std::min<size_t>( GetThreadPool().GetNumThreads(), iNumParticles / m_iGrain ) );
+    m_ChunkHistograms.assign( (size_t)m_iNumSortChunks * iNumBins, 0 );
+
+    const size_t iChunkSize = (iNumParticles + m_iNumSortChunks - 1) / m_iNumSortChunks;
+    GetThreadPool().ParallelFor( m_iNumSortChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+        {
+            uint32_t* pHistogram = m_ChunkHistograms.data() + c * iNumBins;
+            size_t iLast = std::min( (c + 1) * iChunkSize, iNumParticles );
+            for ( size_t i = c * iChunkSize ; i < iLast ; i++ )
+            {
+                uint32_t cell = CalculateCell( m_Particles[i].vPosition, fInvCellSize );
+                m_Cells[i] = cell;
+                if ( iNumBins )
+                    pHistogram[cell & iBinMask]++;
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Sort Grid
+// Stable sort of the particle ids by cell, with the algorithm set by SetSortAlgorithm.
+// The counting sort scatters once by the whole cell; the radix sort scatters by x,
+// counts the y digits of the result and scatters by y.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SortGrid()
+{
+    const size_t iNumParticles = m_Particles.size();
+
+    m_SortedIds.resize( iNumParticles );
+    m_SortedCells.resize( iNumParticles );
+
+    if ( m_eSort == FLUID_SORT_MERGE )
+    {
+        SortMerge();
+        return;
+    }
+
+    if ( m_eSort == FLUID_SORT_COUNTING )
+    {
+        ScatterByDigit( nullptr, m_Cells.data(), m_SortedIds.data(), m_SortedCells.data(), 0, NUM_GRID_INDICES );
+        return;
+    }
+
+    m_SortScratchIds.resize( iNumParticles );
+    m_SortScratchCells.resize( iNumParticles );
+    ScatterByDigit( nullptr, m_Cells.data(), m_SortScratchIds.data(), m_SortScratchCells.data(), 0, RADIX_BINS );
+
+    const size_t iChunkSize = (iNumParticles + m_iNumSortChunks - 1) / m_iNumSortChunks;
+    m_ChunkHistograms.assign( (size_t)m_iNumSortChunks * RADIX_BINS, 0 );
+    GetThreadPool().ParallelFor( m_iNumSortChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+        {
+            uint32_t* pHistogram = &m_ChunkHistograms[c * RADIX_BINS];
+            size_t iLast = std::min( (c + 1) * iChunkSize, iNumParticles );
+            for ( size_t i = c * iChunkSize ; i < iLast ; i++ )
+                pHistogram[m_SortScratchCells[i] >> RADIX_BITS]++;
+        }
+    } );
+
+    ScatterByDigit( m_SortScratchIds.data(), m_SortScratchCells.data(), m_SortedIds.data(), m_SortedCells.data(), RADIX_BITS, RADIX_BINS );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Turns the per chunk digit counts in m_ChunkHistograms into write offsets (digit
+// major, chunk minor) and lets every chunk scatter its particles independently.
+// pSourceIds == nullptr scatters the unsorted particles, whose ids are their indices.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::ScatterByDigit( const uint32_t* pSourceIds, const uint32_t* pSourceCells, uint32_t* pDestIds,
+                                                      uint32_t* pDestCells, unsigned int iShift, size_t iNumBins )
+{
+    const size_t iNumParticles = m_Particles.size();
+    const uint32_t iBinMask = (uint32_t)iNumBins - 1;
+
+    uint32_t iOffset = 0;
+    for ( size_t bin = 0 ; bin < iNumBins ; bin++ )
+    {
+        for ( size_t c = 0 ; c < m_iNumSortChunks ; c++ )
+        {
+            uint32_t& count = m_ChunkHistograms[c * iNumBins + bin];
+            uint32_t iChunkCount = count;
+            count = iOffset;
+            iOffset += iChunkCount;
+        }
+    }
+
+    const size_t iChunkSize = (iNumParticles + m_iNumSortChunks - 1) / m_iNumSortChunks;
+    GetThreadPool().ParallelFor( m_iNumSortChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+        {
+            uint32_t* pOffsets = &m_ChunkHistograms[c * iNumBins];
+            size_t iLast = std::min( (c + 1) * iChunkSize, iNumParticles );
+            for ( size_t i = c * iChunkSize ; i < iLast ; i++ )
+            {
+                uint32_t cell = pSourceCells[i];
+                uint32_t iDest = pOffsets[(cell >> iShift) & iBinMask]++;
+                pDestIds[iDest] = pSourceIds ? pSourceIds[i] : (uint32_t)i;
+                pDestCells[iDest] = cell;
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Every chunk sorts its (cell, index) keys, then pairs of sorted runs are merged in
+// parallel until one run is left. The index in the key keeps equal cells in order.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::SortMerge()
+{
+    const size_t iNumParticles = m_Particles.size();
+    const size_t iChunkSize = (iNumParticles + m_iNumSortChunks - 1) / m_iNumSortChunks;
+
+    m_SortKeys.resize( iNumParticles );
+    m_SortScratchKeys.resize( iNumParticles );
+
+    GetThreadPool().ParallelFor( m_iNumSortChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+        {
+            size_t iFirst = std::min( c * iChunkSize, iNumParticles );
+            size_t iLast = std::min( (c + 1) * iChunkSize, iNumParticles );
+            for ( size_t i = iFirst ; i < iLast ; i++ )
+                m_SortKeys[i] = ((uint64_t)m_Cells[i] << 32) | i;
+            std::sort( m_SortKeys.begin() + iFirst, m_SortKeys.begin() + iLast );
+        }
+    } );
+
+    for ( size_t iRun = iChunkSize ; iRun < iNumParticles ; iRun *= 2 )
+    {
+        const size_t iNumPairs = (iNumParticles + 2 * iRun - 1) / (2 * iRun);
+        GetThreadPool().ParallelFor( iNumPairs, 1, [&]( size_t iBegin, size_t iEnd )
+        {
+            for ( size_t k = iBegin ; k < iEnd ; k++ )
+            {
+                size_t iFirst = k * 2 * iRun;
+                size_t iMiddle = std::min( iFirst + iRun, iNumParticles );
+                size_t iLast = std::min( iFirst + 2 * iRun, iNumParticles );
+                std::merge( m_SortKeys.begin() + iFirst, m_SortKeys.begin() + iMiddle, m_SortKeys.begin() + iMiddle,
+                            m_SortKeys.begin() + iLast, m_SortScratchKeys.begin() + iFirst );
+            }
+        } );
+        m_SortKeys.swap( m_SortScratchKeys );
+    }
+
+    GetThreadPool().ParallelFor( iNumParticles, m_iGrain, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            m_SortedIds[i] = (uint32_t)m_SortKeys[i];
+            m_SortedCells[i] = (uint32_t)(m_SortKeys[i] >> 32);
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Build Grid Indices
+// Same as BuildGridIndicesCS: every particle that starts or ends a run of equal cells
+// writes the run boundary
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::BuildGridIndices()
+{
+    const size_t iNumParticles = m_SortedCells.size();
+
+    std::fill( m_GridIndices.begin(), m_GridIndices.end(), FluidCellRange{ 0, 0 } );
+
+    GetThreadPool().ParallelFor( iNumParticles, m_iGrain, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            uint32_t cell = m_SortedCells[i];
+            if ( i == 0 || cell != m_SortedCells[i - 1] )
+                m_GridIndices[cell].iStart = (uint32_t)i;
+            if ( i == iNumParticles - 1 || cell != m_SortedCells[i + 1] )
+                m_GridIndices[cell].iEnd = (uint32_t)(i + 1);
+        }
+    } );
+
+    if ( m_bLoadBalancing )
+        BalanceChunks();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Rearrange Particles
+// With compressed storage, also packs the sorted particles for the neighbour loops
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::RearrangeParticles()
+{
+    const size_t iNumParticles = m_Particles.size();
+    const TReal fOffsetScale = FLUID_OFFSET_SCALE / m_fCellSize;
+    const bool bPack = m_bCompressed;
+    std::atomic<uint32_t> iClamped( 0 );
+
+    m_Sorted.resize( iNumParticles );
+    if ( bPack )
+        m_Packed.resize( iNumParticles );
+
+    GetThreadPool().ParallelFor( iNumParticles, m_iGrain, [&]( size_t iBegin, size_t iEnd )
+    {
+        uint32_t iChunkClamped = 0;
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            const Particle& particle = m_Particles[m_SortedIds[i]];
+            m_Sorted[i] = particle;
+            if ( !bPack )
+                continue;
+
+            const uint32_t cell = m_SortedCells[i];
+            const float fOffsetX = nearbyintf( (float)((particle.vPosition.x - (TReal)(cell % GRID_DIM) * m_fCellSize) * fOffsetScale) );
+            const float fOffsetY = nearbyintf( (float)((particle.vPosition.y - (TReal)(cell / GRID_DIM) * m_fCellSize) * fOffsetScale) );
+            const float fClampedX = std::min( std::max( fOffsetX, -32768.0f ), 32767.0f );
+            const float fClampedY = std::min( std::max( fOffsetY, -32768.0f ), 32767.0f );
+            if ( fClampedX != fOffsetX || fClampedY != fOffsetY )
+                iChunkClamped++;
+
+            FluidPackedParticle& packed = m_Packed[i];
+            packed.iOffsetX = (int16_t)fClampedX;
+            packed.iOffsetY = (int16_t)fClampedY;
+            packed.iVelocityX = FloatToHalf( (float)particle.vVelocity.x );
+            packed.iVelocityY = FloatToHalf( (float)particle.vVelocity.y );
+        }
+        iClamped.fetch_add( iChunkClamped, std::memory_order_relaxed );
+    } );
+
+    // Per particle traffic outside the neighbour loops, whole particles (P) where a pass
+    // touches any of their fields, R the scalar size:
+    //   build grid     particle read, cell write               P + 4
+    //   sort           cell read, id and cell write            4 + 8
+    //   grid indices   cell read                               4
+    //   rearrange      id read, particle read and write        4 + 2P (+ 8 packed)
+    //   density        density and interaction count write     R + 4
+    //   force          own particle and density read, write    P + R + 2R
+    //   integrate      particle read and write, force read     2P + 2R
+    const uint64_t P = sizeof( Particle ), R = sizeof( TReal );
+    const uint64_t iBytesPerParticle = (P + 4) + 12 + 4 + (4 + 2 * P) + (bPack ? sizeof( FluidPackedParticle ) : 0) + (R + 4) + (P + 3 * R) + (2 * P + 2 * R);
+    m_StorageReport.iStreamBytes = iBytesPerParticle * iNumParticles;
+    m_StorageReport.iClampedOffsets = iClamped.load();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Balance Chunks
+// Predicts the cost of every sorted particle from the cost per particle its cell
+// measured in the previous step, prefix sums the predictions and cuts the sorted
+// sequence where the prefix crosses each multiple of total / chunks. Cuts snap to the
+// nearer edge of the cell they fall in, so a cell is never split between chunks.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::BalanceChunks()
+{
+    const size_t iNumParticles = m_SortedCells.size();
+    const size_t iNumChunks = std::min<size_t>( iNumParticles,
+        m_iNumBalanceChunks ? m_iNumBalanceChunks : GetThreadPool().GetNumThreads() );
+    const float fFallbackCost = (m_fMeanCost > 0) ? m_fMeanCost : 1.0f;
+
+    // Block-wise inclusive scan: every block scans locally, the block totals are
+    // scanned serially, then every block adds the total of the blocks before it
+    const size_t iNumBlocks = std::max<size_t>( 1, std::min<size_t>( GetThreadPool().GetNumThreads(), iNumParticles / m_iGrain ) );
+    const size_t iBlockSize = (iNumParticles + iNumBlocks - 1) / iNumBlocks;
+    m_CostPrefix.resize( iNumParticles + 1 );
+    m_BlockCosts.assign( iNumBlocks + 1, 0.0 );
+    m_CostPrefix[0] = 0;
+
+    GetThreadPool().ParallelFor( iNumBlocks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t b = iBegin ; b < iEnd ; b++ )
+        {
+            double fSum = 0;
+            size_t iLast = std::min( (b + 1) * iBlockSize, iNumParticles );
+            for ( size_t i = b * iBlockSize ; i < iLast ; i++ )
+            {
+                uint32_t cell = m_SortedCells[i];
+                fSum += (m_iCostStamp > 0 && m_CellCostStamp[cell] == m_iCostStamp) ? m_CellCost[cell] : fFallbackCost;
+                m_CostPrefix[i + 1] = fSum;
+            }
+            m_BlockCosts[b + 1] = fSum;
+        }
+    } );
+
+    for ( size_t b = 1 ; b <= iNumBlocks ; b++ )
+        m_BlockCosts[b] += m_BlockCosts[b - 1];
+
+    GetThreadPool().ParallelFor( iNumBlocks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t b = iBegin ; b < iEnd ; b++ )
+        {
+            size_t iLast = std::min( (b + 1) * iBlockSize, iNumParticles );
+            for ( size_t i = b * iBlockSize ; i < iLast ; i++ )
+                m_CostPrefix[i + 1] += m_BlockCosts[b];
+        }
+    } );
+
+    // Cut
+    const double fTotalCost = m_CostPrefix[iNumParticles];
+    m_ChunkStarts.resize( iNumChunks + 1 );
+    m_ChunkStarts[0] = 0;
+    m_ChunkStarts[iNumChunks] = iNumParticles;
+    for ( size_t k = 1 ; k < iNumChunks ; k++ )
+    {
+        const double fTarget = fTotalCost * (double)k / (double)iNumChunks;
+        size_t i = std::lower_bound( m_CostPrefix.begin() + 1, m_CostPrefix.end(), fTarget ) - m_CostPrefix.begin();
+        const FluidCellRange range = m_GridIndices[m_SortedCells[std::min( i, iNumParticles ) - 1]];
+        size_t iCut = (fTarget - m_CostPrefix[range.iStart] < m_CostPrefix[range.iEnd] - fTarget) ? range.iStart : range.iEnd;
+        m_ChunkStarts[k] = std::max( iCut, m_ChunkStarts[k - 1] );
+    }
+
+    // Predicted imbalance of this split and of an equal particle count split
+    std::vector<double> costs( iNumChunks );
+    for ( size_t k = 0 ; k < iNumChunks ; k++ )
+        costs[k] = m_CostPrefix[m_ChunkStarts[k + 1]] - m_CostPrefix[m_ChunkStarts[k]];
+    m_BalanceReport.iNumChunks = (unsigned int)iNumChunks;
+    m_BalanceReport.fPredictedImbalance = (float)Imbalance( costs.data(), iNumChunks );
+
+    for ( size_t k = 0 ; k < iNumChunks ; k++ )
+        costs[k] = m_CostPrefix[(k + 1) * iNumParticles / iNumChunks] - m_CostPrefix[k * iNumParticles / iNumChunks];
+    m_BalanceReport.fEqualCountImbalance = (float)Imbalance( costs.data(), iNumChunks );
+
+    m_ChunkMs.assign( iNumChunks, 0.0 );
+}
+
+
+//--------------------------------------------------------------------------------------
+// The chunks are only valid for the grid they were cut from
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+bool TFluidSimulatorCPU<TReal, TSum>::HasBalancedChunks() const
+{
+    return m_bLoadBalancing && !m_ChunkStarts.empty() && m_ChunkStarts.back() == m_SortedCells.size();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Runs a pass over the sorted particles, either on the balanced chunks (timing each
+// chunk) or on fixed size pieces
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::RunNeighbourPass( const std::function<void( size_t, size_t )>& Func )
+{
+    if ( !HasBalancedChunks() )
+    {
+        GetThreadPool().ParallelFor( m_SortedCells.size(), m_iGrain, Func );
+        return;
+    }
+
+    GetThreadPool().ParallelFor( m_ChunkStarts.size() - 1, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t k = iBegin ; k < iEnd ; k++ )
+        {
+            auto start = std::chrono::steady_clock::now();
+            Func( m_ChunkStarts[k], m_ChunkStarts[k + 1] );
+            m_ChunkMs[k] += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Record Cell Costs
+// Turns the neighbour counts of the density pass into a cost per particle for every
+// occupied cell, for the next step to balance on. Chunks never split a cell, so each
+// chunk writes its own cells.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::RecordCellCosts()
+{
+    const size_t iNumChunks = m_ChunkStarts.size() - 1;
+    const uint32_t iStamp = m_iCostStamp + 1;
+    std::vector<uint64_t> chunkInteractions( iNumChunks, 0 );
+
+    GetThreadPool().ParallelFor( iNumChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t k = iBegin ; k < iEnd ; k++ )
+        {
+            uint64_t iTotal = 0;
+            size_t i = m_ChunkStarts[k];
+            while ( i < m_ChunkStarts[k + 1] )
+            {
+                const uint32_t cell = m_SortedCells[i];
+                const size_t iCellEnd = m_GridIndices[cell].iEnd;
+                uint64_t iCellTotal = 0;
+                for ( size_t j = i ; j < iCellEnd ; j++ )
+                    iCellTotal += m_Interactions[j];
+
+                m_CellCost[cell] = (float)iCellTotal / (float)(iCellEnd - i);
+                m_CellCostStamp[cell] = iStamp;
+                iTotal += iCellTotal;
+                i = iCellEnd;
+            }
+            chunkInteractions[k] = iTotal;
+        }
+    } );
+
+    uint64_t iInteractions = 0;
+    for ( uint64_t iChunk : chunkInteractions )
+        iInteractions += iChunk;
+
+    m_iCostStamp = iStamp;
+    m_fMeanCost = (float)iInteractions / (float)std::max<size_t>( 1, m_SortedCells.size() );
+    m_BalanceReport.iInteractions = iInteractions;
+    m_BalanceReport.fMeasuredImbalance = (float)Imbalance( m_ChunkMs.data(), iNumChunks );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Density, same as DensityCS_Grid
+// With neighbour lists on, every in-range neighbour is also appended to the arena
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::Density( const FluidParameters& params )
+{
+    if ( m_bCompressed && m_Packed.size() == m_Sorted.size() )
+        DensityPass( params, PackedNeighbours<TReal>( m_Packed.data(), m_fCellSize ) );
+    else
+        DensityPass( params, FullNeighbours<TReal>{ m_Sorted.data() } );
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+template <class TNeighbours>
+void TFluidSimulatorCPU<TReal, TSum>::DensityPass( const FluidParameters& params, const TNeighbours& Neighbours )
+{
+    const size_t iNumParticles = m_Sorted.size();
+    const TReal h = params.fSmoothlen;
+    const TReal h_sq = h * h;
+    // W_poly6(r, h) = 315 / (64 * pi * h^9) * (h^2 - r^2)^3
+    const TReal fDensityCoef = (TReal)params.fParticleMass * 315 / (64 * (TReal)PI * pow( h, (TReal)9 ));
+    const bool bLists = m_bNeighbourLists;
+    const int R = (int)m_iCellSubdivision;          // Stencil radius in cells
+
+    m_Density.resize( iNumParticles );
+    m_Interactions.resize( iNumParticles );
+
+    std::atomic<size_t> iNextBlock( 0 );
+    std::atomic<size_t> iUsedEntries( 0 );
+    std::atomic<uint32_t> iOverflow( 0 );
+    std::atomic<uint64_t> iTotalInteractions( 0 );
+    if ( bLists )
+    {
+        m_NeighbourArena.resize( std::max( m_iNeighbourBudget * iNumParticles, NEIGHBOUR_BLOCK_SIZE ) );
+        m_NeighbourRanges.resize( iNumParticles );
+    }
+
+    RunNeighbourPass( [&]( size_t iBegin, size_t iEnd )
+    {
+        CNeighbourWriter<TReal> writer( m_NeighbourArena, iNextBlock );
+        TNeighbours reader = Neighbours;
+        size_t iUsed = 0;
+        uint32_t iOverflowed = 0;
+        uint64_t iChunkInteractions = 0;
+
+        for ( size_t P_ID = iBegin ; P_ID < iEnd ; P_ID++ )
+        {
+            const uint32_t cell = m_SortedCells[P_ID];
+            const int G_X = (int)(cell % GRID_DIM);
+            const int G_Y = (int)(cell / GRID_DIM);
+            reader.SetCell( G_X, G_Y );
+            const Float2 P_position = reader.Position( (uint32_t)P_ID );
+
+            TSum density;
+            uint32_t iInteractions = 0;
+            if ( bLists )
+                writer.Begin();
+            for ( int Y = std::max( G_Y - R, 0 ) ; Y <= std::min( G_Y + R, (int)GRID_DIM - 1 ) ; Y++ )
+            {
+                for ( int X = std::max( G_X - R, 0 ) ; X <= std::min( G_X + R, (int)GRID_DIM - 1 ) ; X++ )
+                {
+                    const FluidCellRange range = m_GridIndices[Y * GRID_DIM + X];
+                    iInteractions += range.iEnd - range.iStart;
+                    reader.SetCell( X, Y );
+                    for ( uint32_t N_ID = range.iStart ; N_ID < range.iEnd ; N_ID++ )
+                    {
+                        const Float2 N_position = reader.Position( N_ID );
+                        TReal dx = N_position.x - P_position.x;
+                        TReal dy = N_position.y - P_position.y;
+                        TReal r_sq = dx * dx + dy * dy;
+                        if ( r_sq < h_sq )
+                        {
+                            TReal w = h_sq - r_sq;
+                            density += fDensityCoef * w * w * w;
+                            if ( bLists )
+                                writer.Push( N_ID, r_sq );
+                        }
+                    }
+                }
+            }
+
+            m_Density[P_ID] = density;
+            m_Interactions[P_ID] = iInteractions;
+            iChunkInteractions += iInteractions;
+
+            if ( bLists )
+            {
+                FluidCellRange& list = m_NeighbourRanges[P_ID];
+                if ( writer.End( list ) )
+                    iUsed += list.iEnd - list.iStart;
+                else
+                    iOverflowed++;
+            }
+        }
+
+        iUsedEntries.fetch_add( iUsed, std::memory_order_relaxed );
+        iOverflow.fetch_add( iOverflowed, std::memory_order_relaxed );
+        iTotalInteractions.fetch_add( iChunkInteractions, std::memory_order_relaxed );
+    } );
+
+    m_StorageReport.iNeighbourBytes = iTotalInteractions.load() * TNeighbours::Bytes();
+
+    if ( bLists )
+    {
+        m_NeighbourReport.iCapacityBytes = m_NeighbourArena.size() * sizeof( Neighbour ) + m_NeighbourRanges.size() * sizeof( FluidCellRange );
+        m_NeighbourReport.iUsedBytes = iUsedEntries.load() * sizeof( Neighbour );
+        m_NeighbourReport.iOverflowParticles = iOverflow.load();
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Force, same terms as ForceCS_Grid plus the optional particle-mesh field and the short
+// range of it the mesh filters out, summed over the cells within its radius
+// Particles with a neighbour list read it instead of walking the grid. The list holds
+// the same neighbours in the same order, so both paths give identical results.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::Force( const FluidParameters& params )
+{
+    if ( m_bCompressed && m_Packed.size() == m_Sorted.size() )
+        ForcePass( params, PackedNeighbours<TReal>( m_Packed.data(), m_fCellSize ) );
+    else
+        ForcePass( params, FullNeighbours<TReal>{ m_Sorted.data() } );
+}
+
+
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+template <class TNeighbours>
+void TFluidSimulatorCPU<TReal, TSum>::ForcePass( const FluidParameters& params, const TNeighbours& Neighbours )
+{
+    const size_t iNumParticles = m_Sorted.size();
+    const TReal h_sq = (TReal)params.fSmoothlen * params.fSmoothlen;
+    const TReal fCollisionDistSq = (TReal)params.fInitialParticleSpacing * params.fInitialParticleSpacing * (TReal)FLUID_COLLISION_SCALE_SQ;
+    const TReal fInvTimeStep = 1 / (TReal)params.fTimeStep;
+    const bool bLists = m_bNeighbourLists && m_NeighbourRanges.size() == iNumParticles;
+    const int R = (int)m_iCellSubdivision;
+    const CParticleMesh* pMesh = params.pParticleMesh;
+    const int iMeshReach = pMesh ? (int)ceil( pMesh->GetShortRangeRadius() / m_fCellSize ) : 0;
+    const TReal fMeshReachSq = pMesh ? (TReal)pMesh->GetShortRangeRadius() * pMesh->GetShortRangeRadius() : 0;
+    const CBarnesHut* pWaveCentres = params.pWaveCentres;
+
+    m_Acceleration.resize( iNumParticles );
+
+    if ( params.pParticleMesh )
+        params.pParticleMesh->Solve( AsFloatParticles( m_Sorted, m_MeshScratch ), iNumParticles );
+
+    std::atomic<uint64_t> iTotalReads( 0 );
+
+    RunNeighbourPass( [&]( size_t iBegin, size_t iEnd )
+    {
+        TNeighbours reader = Neighbours;
+        uint64_t iReads = 0;
+
+        for ( size_t P_ID = iBegin ; P_ID < iEnd ; P_ID++ )
+        {
+            // The collision term differences velocities, so the particle's own velocity
+            // is read in the same precision as its neighbours'
+            const Particle& P = m_Sorted[P_ID];
+            const uint32_t cell = m_SortedCells[P_ID];
+            const int G_X = (int)(cell % GRID_DIM);
+            const int G_Y = (int)(cell / GRID_DIM);
+            reader.SetCell( G_X, G_Y );
+            const Float2 P_position = reader.Position( (uint32_t)P_ID );
+            const Float2 P_velocity = reader.Velocity( (uint32_t)P_ID );
+            TSum sum_x, sum_y;
+
+            const FluidCellRange list = bLists ? m_NeighbourRanges[P_ID] : FluidCellRange{ NEIGHBOUR_OVERFLOW, NEIGHBOUR_OVERFLOW };
+            if ( list.iStart != NEIGHBOUR_OVERFLOW )
+            {
+                iReads += list.iEnd - list.iStart;
+                for ( uint32_t i = list.iStart ; i < list.iEnd ; i++ )
+                {
+                    const Neighbour neighbour = m_NeighbourArena[i];
+
+                    // Ellastic collision (conservation of impulse)
+                    if ( neighbour.fDistanceSq <= fCollisionDistSq && neighbour.iIndex != P_ID )
+                    {
+                        const Float2 N_velocity = reader.Velocity( neighbour.iIndex );
+                        sum_x += (N_velocity.x - P_velocity.x) * fInvTimeStep;
+                        sum_y += (N_velocity.y - P_velocity.y) * fInvTimeStep;
+                    }
+                }
+            }
+            else
+            {
+                iReads += m_Interactions[P_ID];
+                for ( int Y = std::max( G_Y - R, 0 ) ; Y <= std::min( G_Y + R, (int)GRID_DIM - 1 ) ; Y++ )
+                {
+                    for ( int X = std::max( G_X - R, 0 ) ; X <= std::min( G_X + R, (int)GRID_DIM - 1 ) ; X++ )
+                    {
+                        const FluidCellRange range = m_GridIndices[Y * GRID_DIM + X];
+                        reader.SetCell( X, Y );
+                        for ( uint32_t N_ID = range.iStart ; N_ID < range.iEnd ; N_ID++ )
+                        {
+                            const Float2 N_position = reader.Position( N_ID );
+                            TReal dx = N_position.x - P_position.x;
+                            TReal dy = N_position.y - P_position.y;
+                            TReal r_sq = dx * dx + dy * dy;
+
+                            // Ellastic collision (conservation of impulse)
+                            if ( r_sq < h_sq && r_sq <= fCollisionDistSq && N_ID != P_ID )
+                            {
+                                const Float2 N_velocity = reader.Velocity( N_ID );
+                                sum_x += (N_velocity.x - P_velocity.x) * fInvTimeStep;
+                                sum_y += (N_velocity.y - P_velocity.y) * fInvTimeStep;
+                            }
+                        }
+                    }
+                }
+            }
+
+            const TReal fInvDensity = 1 / m_Density[P_ID];
+            TReal ax = (TReal)sum_x * fInvDensity;
+            TReal ay = (TReal)sum_y * fInvDensity;
+
+            // Elastic force
+            TReal dx0 = P.vIndex.x - P.vPosition.x;
+            TReal dy0 = P.vIndex.y - P.vPosition.y;
+            ax += (TReal)params.fSpringK * dx0;
+            ay += (TReal)params.fSpringK * dy0;
+
+            // External force
+            if ( dx0 * dx0 + dy0 * dy0 <= fCollisionDistSq )
+            {
+                ax += (TReal)params.fExternalK * (P.vCenter.x - P.vPosition.x);
+                ay += (TReal)params.fExternalK * (P.vCenter.y - P.vPosition.y);
+            }
+
+            // Long-range field
+            if ( pMesh )
+            {
+                FluidFloat2 field = pMesh->Interpolate( ToFloat( P.vPosition ) );
+                ax += field.x;
+                ay += field.y;
+
+                for ( int Y = std::max( G_Y - iMeshReach, 0 ) ; Y <= std::min( G_Y + iMeshReach, (int)GRID_DIM - 1 ) ; Y++ )
+                {
+                    for ( int X = std::max( G_X - iMeshReach, 0 ) ; X <= std::min( G_X + iMeshReach, (int)GRID_DIM - 1 ) ; X++ )
+                    {
+                        const FluidCellRange range = m_GridIndices[Y * GRID_DIM + X];
+                        reader.SetCell( X, Y );
+                        iReads += range.iEnd - range.iStart;
+                        for ( uint32_t N_ID = range.iStart ; N_ID < range.iEnd ; N_ID++ )
+                        {
+                            const Float2 N_position = reader.Position( N_ID );
+                            TReal dx = N_position.x - P_position.x;
+                            TReal dy = N_position.y - P_position.y;
+                            TReal r_sq = dx * dx + dy * dy;
+
+                            if ( r_sq > 0 && r_sq < fMeshReachSq )
+                            {
+                                const TReal f = (TReal)pMesh->ShortRangeFactor( (float)r_sq );
+                                ax += f * dx;
+                                ay += f * dy;
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Wave centres
+            if ( pWaveCentres )
+            {
+                FluidFloat2 field = pWaveCentres->Evaluate( ToFloat( P.vPosition ) );
+                ax += field.x;
+                ay += field.y;
+            }
+
+            m_Acceleration[P_ID] = { ax, ay };
+        }
+
+        iTotalReads.fetch_add( iReads, std::memory_order_relaxed );
+    } );
+
+    m_StorageReport.iNeighbourBytes += iTotalReads.load() * TNeighbours::Bytes();
+
+    if ( HasBalancedChunks() )
+        RecordCellCosts();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Integrate, same as IntegrateCS
+// The integrated particles stay in grid order, like the GPU path writing the sorted
+// particles back into the particle buffer. With statistics on, every particle is reduced
+// while it is still in registers, like IntegrateStatisticsCS.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::Integrate( const FluidParameters& params, size_t iNumOwned )
+{
+    const size_t iNumParticles = m_Sorted.size();
+    const TReal dt = params.fTimeStep;
+    const CBoundarySDF* pBoundary = (params.pBoundary && !params.pBoundary->IsEmpty()) ? params.pBoundary : nullptr;
+    const bool bHalos = iNumOwned < iNumParticles;
+
+    // One slot per m_iGrain particles. A pool without workers runs the whole range as
+    // one chunk, which then moves through the slots itself
+    if ( m_bStatistics )
+    {
+        m_ChunkStatistics.resize( (iNumParticles + m_iGrain - 1) / m_iGrain );
+        for ( FluidStepStatistics& part : m_ChunkStatistics )
+            FluidResetStatistics( part );
+    }
+
+    GetThreadPool().ParallelFor( iNumParticles, m_iGrain, [&]( size_t iBegin, size_t iEnd )
+    {
+        // Sums of the current slot stay in TReal locals and go into the slot's doubles
+        // when the chunk leaves it
+        FluidStepStatistics* pStats = m_bStatistics ? &m_ChunkStatistics[iBegin / m_iGrain] : nullptr;
+        size_t iSlotEnd = iBegin + m_iGrain;
+        uint32_t iCount = 0;
+        TReal fKinetic = 0, fElastic = 0, fMomentumX = 0, fMomentumY = 0;
+        TReal fMaxSpeedSq = 0;
+        float fMinDensity = FLT_MAX, fMaxDensity = -FLT_MAX;
+        auto Flush = [&]()
+        {
+            pStats->iNumParticles = iCount;
+            pStats->fKineticEnergy = (double)fKinetic;
+            pStats->fElasticEnergy = (double)fElastic;
+            pStats->fMomentumX = (double)fMomentumX;
+            pStats->fMomentumY = (double)fMomentumY;
+            pStats->fMaxSpeed = (float)sqrt( fMaxSpeedSq );
+            pStats->fMinDensity = fMinDensity;
+            pStats->fMaxDensity = fMaxDensity;
+            iCount = 0;
+            fKinetic = fElastic = fMomentumX = fMomentumY = fMaxSpeedSq = 0;
+            fMinDensity = FLT_MAX;
+            fMaxDensity = -FLT_MAX;
+        };
+
+        for ( size_t P_ID = iBegin ; P_ID < iEnd ; P_ID++ )
+        {
+            Particle& P = m_Sorted[P_ID];
+            Float2 acceleration = m_Acceleration[P_ID];
+
+            // Apply the forces from the map walls and obstacles
+            if ( pBoundary )
+            {
+                float gx, gy;
+                float dist = pBoundary->Sample( (float)P.vPosition.x, (float)P.vPosition.y, &gx, &gy );
+                float len = sqrtf( gx * gx + gy * gy );
+                if ( dist < 0 && len > 0 )
+                {
+                    acceleration.x += (TReal)(dist * -params.fWallStiffness * gx / len);
+                    acceleration.y += (TReal)(dist * -params.fWallStiffness * gy / len);
+                }
+            }
+
+            P.vVelocity.x += dt * acceleration.x;
+            P.vVelocity.y += dt * acceleration.y;
+            P.vPosition.x += dt * P.vVelocity.x;
+            P.vPosition.y += dt * P.vVelocity.y;
+
+            if ( !pStats || (bHalos && m_SortedIds[P_ID] >= iNumOwned) )
+                continue;
+            while ( P_ID >= iSlotEnd )
+            {
+                Flush();
+                pStats++;
+                iSlotEnd += m_iGrain;
+            }
+
+            const TReal dx0 = P.vIndex.x - P.vPosition.x;
+            const TReal dy0 = P.vIndex.y - P.vPosition.y;
+            const TReal fSpeedSq = P.vVelocity.x * P.vVelocity.x + P.vVelocity.y * P.vVelocity.y;
+            const float fDensity = (float)m_Density[P_ID];
+            iCount++;
+            fKinetic += fSpeedSq;
+            fElastic += dx0 * dx0 + dy0 * dy0;
+            fMomentumX += P.vVelocity.x;
+            fMomentumY += P.vVelocity.y;
+            fMaxSpeedSq = std::max( fMaxSpeedSq, fSpeedSq );
+            fMinDensity = std::min( fMinDensity, fDensity );
+            fMaxDensity = std::max( fMaxDensity, fDensity );
+            pStats->SpeedHistogram[FluidStatisticsBin( (float)sqrt( fSpeedSq ), 0, FLUID_STATISTICS_MAX_SPEED )]++;
+            pStats->DensityHistogram[FluidStatisticsBin( fDensity, FLUID_STATISTICS_MIN_DENSITY, FLUID_STATISTICS_MAX_DENSITY )]++;
+        }
+
+        if ( pStats )
+            Flush();
+    } );
+
+    // The slots sum v^2, |diff0|^2 and v; the mass and spring terms are applied once
+    if ( m_bStatistics )
+    {
+        FluidResetStatistics( m_Statistics );
+        for ( const FluidStepStatistics& part : m_ChunkStatistics )
+            FluidMergeStatistics( m_Statistics, part );
+        m_Statistics.fKineticEnergy *= 0.5 * params.fParticleMass;
+        m_Statistics.fElasticEnergy *= 0.5 * params.fParticleMass * params.fSpringK;
+        m_Statistics.fMomentumX *= params.fParticleMass;
+        m_Statistics.fMomentumY *= params.fParticleMass;
+    }
+
+    if ( iNumOwned >= iNumParticles )
+    {
+        m_Particles.swap( m_Sorted );
+        return;
+    }
+
+    // Drop the halo particles, keeping the owned ones in grid order
+    m_Particles.clear();
+    size_t iKept = 0;
+    for ( size_t i = 0 ; i < iNumParticles ; i++ )
+    {
+        if ( m_SortedIds[i] < iNumOwned )
+        {
+            m_Particles.push_back( m_Sorted[i] );
+            m_Density[iKept++] = m_Density[i];
+        }
+    }
+    m_Density.resize( iKept );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Coarse Grain
+// The positions, velocities and densities of m_Sorted are all those of the start of the
+// step and every particle sits in the cell the grid sort gave it
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::CoarseGrain( const FluidParameters& params, size_t iNumOwned )
+{
+    if ( !params.pCoarseGrainer || m_Sorted.empty() )
+        return;
+
+    const bool bHalos = iNumOwned < m_Sorted.size();
+    params.pCoarseGrainer->Reduce( m_Sorted.data(), m_Density.data(), m_GridIndices.data(), bHalos ? m_SortedIds.data() : nullptr,
+                                   iNumOwned, (float)m_fCellSize, params.fParticleMass );
+}
+
+
+//--------------------------------------------------------------------------------------
+// One step of the grid + sort algorithm, see SimulateFluid_Grid
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum>
+void TFluidSimulatorCPU<TReal, TSum>::Step( const FluidParameters& params, size_t iNumOwned )
+{
+    if ( m_Particles.empty() )
+        return;
+
+    {
+        CScopedStageTimer timer( "Build Grid" );
+        CScopedPerfStage counters( "Build Grid" );
+        BuildGrid( params );
+    }
+    {
+        CScopedStageTimer timer( "Sort Grid" );
+        CScopedPerfStage counters( "Sort Grid" );
+        SortGrid();
+    }
+    {
+        CScopedStageTimer timer( "Grid Indices" );
+        CScopedPerfStage counters( "Grid Indices" );
+        BuildGridIndices();
+    }
+    {
+        CScopedStageTimer timer( "Rearrange" );
+        CScopedPerfStage counters( "Rearrange" );
+        RearrangeParticles();
+    }
+    {
+        CScopedStageTimer timer( "Density" );
+        CScopedPerfStage counters( "Density" );
+        Density( params );
+    }
+    {
+        CScopedStageTimer timer( "Force" );
+        CScopedPerfStage counters( "Force" );
+        Force( params );
+    }
+    if ( params.pCoarseGrainer )
+    {
+        CScopedStageTimer timer( "Coarse Grain" );
+        CScopedPerfStage counters( "Coarse Grain" );
+        CoarseGrain( params, iNumOwned );
+    }
+    {
+        CScopedStageTimer timer( "Integrate" );
+        CScopedPerfStage counters( "Integrate" );
+        Integrate( params, iNumOwned );
+    }
+}
+
+
+template std::vector<TFluidParticle<float>> FluidCreateLattice<float>( unsigned int, float );
+template std::vector<TFluidParticle<double>> FluidCreateLattice<double>( unsigned int, float );
+
+template class TFluidSimulatorCPU<float>;
+template class TFluidSimulatorCPU<double>;
+template class TFluidSimulatorCPU<float, FluidCompensatedSum<float>>;
+template class TFluidSimulatorCPU<double, FluidCompensatedSum<double>>;
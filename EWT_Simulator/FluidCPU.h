@@ -0,0 +1,388 @@
+//--------------------------------------------------------------------------------------
+// File: FluidCPU.h
+//
+// CPU implementation of the grid + sort simulation in FluidCS11.hlsl. It runs the same
+// passes (build grid, sort, grid indices, rearrange, density, force, integrate) on the
+// shared thread pool, with no dependency on Direct3D, so the simulation can be stepped
+// on machines without a GPU and inside worker processes.
+//
+// The simulator is a template on its scalar type and on the accumulator of the density
+// and force sums. CFluidSimulatorCPU is the float version matching the GPU; double
+// and compensated sums trade speed for less drift over long runs.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidConstants.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class CBoundarySDF;
+class CParticleMesh;
+class CBarnesHut;
+class CCoarseGrainer;
+
+template <class T>
+struct TFluidFloat2
+{
+    T x;
+    T y;
+};
+
+// Same layout as ParticleData in EWT_Simulator.cpp and FluidCS11.hlsl
+typedef TFluidFloat2<float> FluidFloat2;
+
+// Range of sorted particles in one grid cell, [iStart, iEnd)
+struct FluidCellRange
+{
+    uint32_t iStart;
+    uint32_t iEnd;
+};
+
+template <class T>
+struct TFluidParticle
+{
+    TFluidFloat2<T> vPosition;
+    TFluidFloat2<T> vVelocity;
+    TFluidFloat2<T> vIndex;     // Rest position
+    TFluidFloat2<T> vCenter;
+};
+
+typedef TFluidParticle<float> FluidParticle;
+
+// Inputs of one step, the CPU equivalent of CBSimulationConstants plus the constants
+// that ForceCS_Grid hard-codes
+struct FluidParameters
+{
+    float fTimeStep;
+    float fSmoothlen;
+    float fParticleMass;
+    float fInitialParticleSpacing;
+    float fSpringK;
+    float fExternalK;
+    float fWallStiffness;
+    const CBoundarySDF* pBoundary;  // Optional, nullptr disables the wall term
+    CParticleMesh* pParticleMesh;   // Optional long-range field, solved from the particles
+                                    // being stepped, so only valid without domain halos.
+                                    // The force pass adds its short range over the cells
+                                    // within GetShortRangeRadius(), 5.3 rs
+    const CBarnesHut* pWaveCentres; // Optional field of many wave centres, built by the caller
+    CCoarseGrainer* pCoarseGrainer; // Optional in-situ reducer, fed the sorted cells of the
+                                    // state the step starts from, before it is integrated
+};
+
+// Load balance of the neighbour passes (density and force) in the last step
+struct FluidBalanceReport
+{
+    unsigned int iNumChunks;
+    uint64_t iInteractions;         // Neighbour candidates visited by the density pass
+    float fPredictedImbalance;      // Max / mean predicted chunk cost of the cost balanced split
+    float fEqualCountImbalance;     // Same, for a split into equal particle counts
+    float fMeasuredImbalance;       // Max / mean measured chunk time
+};
+
+// One entry of a neighbour list
+template <class T>
+struct TFluidNeighbour
+{
+    uint32_t iIndex;            // Sorted particle index
+    T fDistanceSq;
+};
+
+typedef TFluidNeighbour<float> FluidNeighbour;
+
+// Neighbour list memory of the last step
+struct FluidNeighbourReport
+{
+    size_t iCapacityBytes;          // Arena plus per particle ranges, fixed by the budget
+    size_t iUsedBytes;              // Entries written
+    uint32_t iOverflowParticles;    // Particles that did not fit and walked the grid again
+};
+
+// Particle as the neighbour loops read it with compressed storage, 8 bytes instead of
+// the 32 of a FluidParticle. The position is relative to the origin of the particle's
+// grid cell, which the loops know from the cell range they walk, so 16 bits resolve it
+// to cell size / FLUID_OFFSET_SCALE, smoothlen / 16384 when cells are subdivided in two.
+struct FluidPackedParticle
+{
+    int16_t iOffsetX;           // (position - cell origin) * FLUID_OFFSET_SCALE / cell size
+    int16_t iOffsetY;
+    uint16_t iVelocityX;        // IEEE 754 half
+    uint16_t iVelocityY;
+};
+
+// Offsets cover [-4, 4) cells, so particles clamped into the edge cells still fit
+const float FLUID_OFFSET_SCALE = 8192.0f;
+
+// Memory traffic of the last step
+struct FluidStorageReport
+{
+    uint64_t iNeighbourBytes;       // Particle data the density and force loops read
+    uint64_t iStreamBytes;          // Per particle reads and writes of the other passes
+    uint32_t iClampedOffsets;       // Positions saturated by the packed offset range
+};
+
+// Reductions of the integrated state of a step, gathered by the integrate pass itself.
+// Positions and velocities are the integrated ones, densities those the step computed.
+struct FluidStepStatistics
+{
+    uint64_t iNumParticles;
+    double fKineticEnergy;          // Sum of 0.5 m |v|^2
+    double fElasticEnergy;          // Sum of 0.5 m k |position - rest position|^2
+    double fMomentumX;              // Sum of m v
+    double fMomentumY;
+    float fMaxSpeed;
+    float fMinDensity;
+    float fMaxDensity;
+    uint32_t SpeedHistogram[FLUID_STATISTICS_BINS];
+    uint32_t DensityHistogram[FLUID_STATISTICS_BINS];
+};
+
+// Empty statistics, ready to merge into
+void FluidResetStatistics( FluidStepStatistics& stats );
+
+// Adds the particles of part to total
+void FluidMergeStatistics( FluidStepStatistics& total, const FluidStepStatistics& part );
+
+// Histogram bin of value in [fMin, fMax), clamped to the end bins; same as
+// StatisticsBin in FluidCS11.hlsl
+inline unsigned int FluidStatisticsBin( float fValue, float fMin, float fMax )
+{
+    float fBin = (fValue - fMin) * ((float)FLUID_STATISTICS_BINS / (fMax - fMin));
+    fBin = (fBin > 0) ? fBin : 0;
+    return (fBin < FLUID_STATISTICS_BINS - 1) ? (unsigned int)fBin : FLUID_STATISTICS_BINS - 1;
+}
+
+// Ways SortGrid can order the particles by cell. All of them are stable, so they give
+// the same order and bit identical steps; only their speed depends on the machine,
+// the particle count and the thread count.
+enum FluidSortAlgorithm
+{
+    FLUID_SORT_COUNTING,        // One scatter pass over per chunk counts of every cell
+    FLUID_SORT_RADIX,           // Two scatter passes over 8 bit digits, small counts
+    FLUID_SORT_MERGE,           // Chunks sorted by (cell, index) key, merged pairwise
+    FLUID_SORT_COUNT
+};
+
+const char* FluidSortAlgorithmName( FluidSortAlgorithm eSort );
+
+//--------------------------------------------------------------------------------------
+// Accumulators of the density and force sums
+//--------------------------------------------------------------------------------------
+template <class T>
+struct FluidPlainSum
+{
+    FluidPlainSum() : fSum( 0 ) {}
+
+    FluidPlainSum& operator+=( T x ) { fSum += x; return *this; }
+    operator T() const { return fSum; }
+
+    T fSum;
+};
+
+// Neumaier's compensated sum: the rounding error of every addition is carried in a
+// second term, so thousands of small neighbour contributions lose no more than one
+// rounding. Only exact if the compiler keeps IEEE semantics, not with -ffast-math.
+template <class T>
+struct FluidCompensatedSum
+{
+    FluidCompensatedSum() : fSum( 0 ), fCompensation( 0 ) {}
+
+    FluidCompensatedSum& operator+=( T x )
+    {
+        const T t = fSum + x;
+        if ( (fSum >= 0 ? fSum : -fSum) >= (x >= 0 ? x : -x) )
+            fCompensation += (fSum - t) + x;
+        else
+            fCompensation += (x - t) + fSum;
+        fSum = t;
+        return *this;
+    }
+    operator T() const { return fSum + fCompensation; }
+
+    T fSum;
+    T fCompensation;
+};
+
+// Defaults matching the values used by the GPU path
+FluidParameters FluidDefaultParameters();
+
+// The square lattice CreateSimulationBuffers starts from
+template <class T = float>
+std::vector<TFluidParticle<T>> FluidCreateLattice( unsigned int iNumParticles, float fSpacing );
+
+// The same particles in another precision
+template <class TTo, class TFrom>
+std::vector<TFluidParticle<TTo>> FluidConvertParticles( const std::vector<TFluidParticle<TFrom>>& Particles )
+{
+    std::vector<TFluidParticle<TTo>> converted( Particles.size() );
+    for ( size_t i = 0 ; i < Particles.size() ; i++ )
+    {
+        const TFluidParticle<TFrom>& p = Particles[i];
+        converted[i].vPosition = { (TTo)p.vPosition.x, (TTo)p.vPosition.y };
+        converted[i].vVelocity = { (TTo)p.vVelocity.x, (TTo)p.vVelocity.y };
+        converted[i].vIndex = { (TTo)p.vIndex.x, (TTo)p.vIndex.y };
+        converted[i].vCenter = { (TTo)p.vCenter.x, (TTo)p.vCenter.y };
+    }
+    return converted;
+}
+
+//--------------------------------------------------------------------------------------
+// TReal is the type of the particle state and of every pass's arithmetic, TSum
+// accumulates the neighbour sums. FluidParameters stay float in every version.
+//--------------------------------------------------------------------------------------
+template <class TReal, class TSum = FluidPlainSum<TReal>>
+class TFluidSimulatorCPU
+{
+public:
+    typedef TFluidFloat2<TReal> Float2;
+    typedef TFluidParticle<TReal> Particle;
+    typedef TFluidNeighbour<TReal> Neighbour;
+
+    // Grid cell key size, 8-bits for x and y as on the GPU
+    static const unsigned int GRID_DIM = 256;
+    static const unsigned int NUM_GRID_INDICES = GRID_DIM * GRID_DIM;
+
+    TFluidSimulatorCPU();
+
+    void SetParticles( const std::vector<Particle>& Particles );
+    const std::vector<Particle>& GetParticles() const { return m_Particles; }
+    size_t GetNumParticles() const { return m_Particles.size(); }
+
+    // Density of GetParticles()[i] as computed by the last step
+    const std::vector<TReal>& GetDensities() const { return m_Density; }
+
+    // Grid of the last step
+    const std::vector<FluidCellRange>& GetGridIndices() const { return m_GridIndices; }
+
+    // One full step
+    // Only the first iNumOwned particles are integrated. The others are read-only
+    // neighbours (halo particles owned by another domain) and are dropped from the
+    // particle set afterwards, so GetParticles() holds the owned particles only.
+    void Step( const FluidParameters& params, size_t iNumOwned = SIZE_MAX );
+
+    // Individual passes, in the order Step runs them
+    void BuildGrid( const FluidParameters& params );
+    void SortGrid();
+    void BuildGridIndices();
+    void RearrangeParticles();
+    void Density( const FluidParameters& params );
+    void Force( const FluidParameters& params );
+    void CoarseGrain( const FluidParameters& params, size_t iNumOwned = SIZE_MAX );
+    void Integrate( const FluidParameters& params, size_t iNumOwned = SIZE_MAX );
+
+    // Number of particles handed to a thread at a time
+    void SetGrainSize( size_t iGrain ) { m_iGrain = iGrain; }
+    size_t GetGrainSize() const { return m_iGrain; }
+
+    // Cells smoothlen / iSubdivision wide, searched with a (2 * iSubdivision + 1)^2
+    // stencil. 1 is the GPU grid; 2 visits fewer candidates outside the smoothing radius
+    // at the price of more, smaller cell ranges.
+    void SetCellSubdivision( unsigned int iSubdivision );
+    unsigned int GetCellSubdivision() const { return m_iCellSubdivision; }
+
+    void SetSortAlgorithm( FluidSortAlgorithm eSort ) { m_eSort = eSort; }
+    FluidSortAlgorithm GetSortAlgorithm() const { return m_eSort; }
+
+    // Split the density and force passes into cell aligned chunks of equal predicted
+    // cost, using the neighbour counts each cell measured in the previous step.
+    // iNumChunks == 0 uses one chunk per pool thread.
+    void SetLoadBalancing( bool bEnable, unsigned int iNumChunks = 0 );
+    bool GetLoadBalancing() const { return m_bLoadBalancing; }
+    const FluidBalanceReport& GetBalanceReport() const { return m_BalanceReport; }
+
+    // Let the density pass record the in-range neighbours (index and r^2) of every
+    // particle so the force pass can read them instead of walking the grid again.
+    // The arena holds iBudgetPerParticle entries per particle on average; particles
+    // that do not fit fall back to the grid walk.
+    void SetNeighbourLists( bool bEnable, size_t iBudgetPerParticle = 32 );
+    bool GetNeighbourLists() const { return m_bNeighbourLists; }
+    const FluidNeighbourReport& GetNeighbourReport() const { return m_NeighbourReport; }
+
+    // Let the density and force loops read their neighbours from a packed copy of the
+    // sorted particles (FluidPackedParticle) written by the rearrange pass. A particle's
+    // own position and velocity come from the same copy, so a pair sees one difference
+    // with either sign. Arithmetic stays in fp32 and the integration reads and writes
+    // full precision, so the error does not accumulate in the stored state.
+    void SetCompressedStorage( bool bEnable );
+    bool GetCompressedStorage() const { return m_bCompressed; }
+    const FluidStorageReport& GetStorageReport() const { return m_StorageReport; }
+
+    // Let the integrate pass reduce the particles it writes into FluidStepStatistics.
+    // Every grain of particles is summed on its own and the partial sums are merged in
+    // order, so the result does not depend on the thread count. Domain halos are left out.
+    void SetStatistics( bool bEnable ) { m_bStatistics = bEnable; }
+    bool GetStatistics() const { return m_bStatistics; }
+    const FluidStepStatistics& GetStepStatistics() const { return m_Statistics; }
+
+private:
+    unsigned int CalculateCell( const Float2& position, TReal fInvCellSize ) const;
+    void BalanceChunks();
+    bool HasBalancedChunks() const;
+    void RecordCellCosts();
+    void ScatterByDigit( const uint32_t* pSourceIds, const uint32_t* pSourceCells, uint32_t* pDestIds, uint32_t* pDestCells,
+                         unsigned int iShift, size_t iNumBins );
+    void SortMerge();
+    void RunNeighbourPass( const std::function<void( size_t, size_t )>& Func );
+    template <class TNeighbours> void DensityPass( const FluidParameters& params, const TNeighbours& Neighbours );
+    template <class TNeighbours> void ForcePass( const FluidParameters& params, const TNeighbours& Neighbours );
+
+    std::vector<Particle>       m_Particles;        // Unsorted input / integrated output
+    std::vector<Particle>       m_Sorted;           // Particles in grid order
+    std::vector<uint32_t>       m_Cells;            // Cell of each unsorted particle
+    std::vector<uint32_t>       m_SortedIds;        // Unsorted index of each sorted particle
+    std::vector<uint32_t>       m_SortedCells;      // Cell of each sorted particle
+    std::vector<FluidCellRange> m_GridIndices;      // Sorted range of each cell
+    std::vector<uint32_t>       m_ChunkHistograms;  // Per chunk cell counts for the parallel sort
+    std::vector<TReal>          m_Density;
+    std::vector<Float2>         m_Acceleration;
+    unsigned int                m_iNumSortChunks;
+    size_t                      m_iGrain;
+    TReal                       m_fCellSize;
+    unsigned int                m_iCellSubdivision;
+    FluidSortAlgorithm          m_eSort;
+    std::vector<uint32_t>       m_SortScratchIds;   // First radix pass
+    std::vector<uint32_t>       m_SortScratchCells;
+    std::vector<uint64_t>       m_SortKeys;         // Merge sort, (cell << 32) | index
+    std::vector<uint64_t>       m_SortScratchKeys;
+
+    // Load balancing
+    std::vector<uint32_t>       m_Interactions;     // Neighbour candidates of each sorted particle
+    std::vector<float>          m_CellCost;         // Measured cost per particle of each cell
+    std::vector<uint32_t>       m_CellCostStamp;    // Step that measured m_CellCost
+    std::vector<double>         m_CostPrefix;       // Predicted cost of the sorted particles before i
+    std::vector<double>         m_BlockCosts;
+    std::vector<size_t>         m_ChunkStarts;      // Sorted particle range of each chunk
+    std::vector<double>         m_ChunkMs;
+    uint32_t                    m_iCostStamp;
+    float                       m_fMeanCost;        // Fallback for cells without a measurement
+    bool                        m_bLoadBalancing;
+    unsigned int                m_iNumBalanceChunks;
+    FluidBalanceReport          m_BalanceReport;
+
+    // Neighbour lists
+    std::vector<Neighbour>      m_NeighbourArena;
+    std::vector<FluidCellRange> m_NeighbourRanges;  // Arena range of each sorted particle
+    size_t                      m_iNeighbourBudget;
+    bool                        m_bNeighbourLists;
+    FluidNeighbourReport        m_NeighbourReport;
+
+    // Compressed storage
+    std::vector<FluidPackedParticle> m_Packed;      // m_Sorted for the neighbour loops
+    bool                        m_bCompressed;
+    FluidStorageReport          m_StorageReport;
+    std::vector<FluidParticle>  m_MeshScratch;      // m_Sorted in float for the particle mesh
+
+    // Step statistics
+    bool                        m_bStatistics;
+    std::vector<FluidStepStatistics> m_ChunkStatistics; // Partial sums of each integrate chunk
+    FluidStepStatistics         m_Statistics;
+};
+
+// Instantiated in FluidCPU.cpp
+typedef TFluidSimulatorCPU<float> CFluidSimulatorCPU;
+typedef TFluidSimulatorCPU<double> CFluidSimulatorCPUDouble;
+typedef TFluidSimulatorCPU<float, FluidCompensatedSum<float>> CFluidSimulatorCPUCompensated;
+typedef TFluidSimulatorCPU<double, FluidCompensatedSum<double>> CFluidSimulatorCPUDoubleCompensated;
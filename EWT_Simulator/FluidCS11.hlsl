@@ -16,6 +16,8 @@
 // Scott Le Grand
 //--------------------------------------------------------------------------------------
 
+#include "FluidConstants.h"
+
 struct ParticleData
 {
     float2 position;
@@ -34,6 +36,23 @@ struct ParticleDensity
     float density;
 };
 
+// Per universe constants for the ensemble kernels
+// Must match UniverseConstants in EWT_Simulator.cpp
+struct UniverseConstants
+{
+    float smoothlen;
+    float pressure_stiffness;
+    float rest_density;
+    float density_coef;
+    float grad_pressure_coef;
+    float lap_viscosity_coef;
+    float spring_k;
+    float external_k;
+    float collision_dist_sq;
+    float3 padding;
+    float4 grid_dim;
+};
+
 cbuffer cbSimulationConstants : register( b0 )
 {
     uint g_iNumParticles;
@@ -49,6 +68,14 @@ cbuffer cbSimulationConstants : register( b0 )
     float4 g_vGravity;
     float4 g_vGridDim;
     float3 g_vPlanes[4];
+
+    float4 g_vBoundaryDim;      // xy = 1 / cell size, zw = -origin / cell size
+    uint g_iBoundaryWidth;      // 0 when no boundary field is bound
+    uint g_iBoundaryHeight;
+
+    uint g_iDynamicParticles;   // Live count in ParticleCountRO, g_iNumParticles is the capacity
+    uint g_iNumSpawn;           // Particles in SpawnRO this step
+    float4 g_vAbsorbBounds;     // xy = min, zw = max, particles leaving it are removed
 };
 
 //--------------------------------------------------------------------------------------
@@ -75,6 +102,40 @@ StructuredBuffer<unsigned int> GridRO : register( t3 );
 RWStructuredBuffer<uint2> GridIndicesRW : register( u0 );
 StructuredBuffer<uint2> GridIndicesRO : register( t4 );
 
+StructuredBuffer<float> BoundarySDFRO : register( t5 );
+
+StructuredBuffer<UniverseConstants> UniversesRO : register( t6 );
+
+// Neighbour lists, NEIGHBOUR_LIST_SIZE (index, asuint(r^2)) slots per particle
+RWStructuredBuffer<uint2> NeighbourListRW : register( u1 );
+StructuredBuffer<uint2> NeighbourListRO : register( t7 );
+
+RWStructuredBuffer<uint> NeighbourCountRW : register( u2 );
+StructuredBuffer<uint> NeighbourCountRO : register( t8 );
+
+// Dynamic particles
+// [0] live count, [0..3] draw arguments, [4..6] dispatch arguments, [7] survivors of the
+// last compaction (first spawned slot)
+RWBuffer<uint> ParticleCountRW : register( u2 );
+Buffer<uint> ParticleCountRO : register( t9 );
+
+RWStructuredBuffer<uint> ParticleAliveRW : register( u1 );
+StructuredBuffer<uint> ParticleAliveRO : register( t10 );
+
+RWStructuredBuffer<uint> ScanRW : register( u0 );
+StructuredBuffer<uint> ScanRO : register( t11 );
+
+RWStructuredBuffer<uint> BlockSumsRW : register( u1 );
+StructuredBuffer<uint> BlockSumsRO : register( t12 );
+
+StructuredBuffer<ParticleData> SpawnRO : register( t13 );
+
+// Particles stepped by the grid kernels. With dynamic particles the count lives on the GPU
+uint GetNumLiveParticles()
+{
+    return g_iDynamicParticles ? ParticleCountRO[0] : g_iNumParticles;
+}
+
 
 //--------------------------------------------------------------------------------------
 // Grid Construction
@@ -124,6 +185,13 @@ void BuildGridCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint
 {
     const unsigned int P_ID = DTid.x; // Particle ID to operate on
     
+    // Empty slots sort after every live particle
+    if (P_ID >= GetNumLiveParticles())
+    {
+        GridRW[P_ID] = 0xFFFFFFFF;
+        return;
+    }
+
     float2 position = ParticlesRO[P_ID].position;
     float2 grid_xy = GridCalculateCell( position );
     
@@ -145,8 +213,10 @@ void ClearGridIndicesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadI
 void BuildGridIndicesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
 {
     const unsigned int G_ID = DTid.x; // Grid ID to operate on
-    unsigned int G_ID_PREV = (G_ID == 0)? g_iNumParticles : G_ID; G_ID_PREV--;
-    unsigned int G_ID_NEXT = G_ID + 1; if (G_ID_NEXT == g_iNumParticles) { G_ID_NEXT = 0; }
+    const unsigned int iNumLive = GetNumLiveParticles();
+    if (G_ID >= iNumLive) return;
+    unsigned int G_ID_PREV = (G_ID == 0)? iNumLive : G_ID; G_ID_PREV--;
+    unsigned int G_ID_NEXT = G_ID + 1; if (G_ID_NEXT == iNumLive) { G_ID_NEXT = 0; }
     
     unsigned int cell = GridGetKey( GridRO[G_ID] );
     unsigned int cell_prev = GridGetKey( GridRO[G_ID_PREV] );
@@ -172,6 +242,7 @@ void BuildGridIndicesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadI
 void RearrangeParticlesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
 {
     const unsigned int ID = DTid.x; // Particle ID to operate on
+    if (ID >= GetNumLiveParticles()) return;
     const unsigned int G_ID = GridGetValue( GridRO[ ID ] );
 	ParticlesRW[ID] = ParticlesRO[G_ID];
     /*ParticlesRW[ID].position = ParticlesRO[G_ID].position;
@@ -276,6 +347,7 @@ void DensityCS_Shared( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID,
 void DensityCS_Grid( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
 {
     const unsigned int P_ID = DTid.x;
+    if (P_ID >= GetNumLiveParticles()) return;
     const float h_sq = g_fSmoothlen * g_fSmoothlen;
     float2 P_position = ParticlesRO[P_ID].position;
     
@@ -465,9 +537,10 @@ void ForceCS_Shared( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, u
 void ForceCS_Grid( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
 {
     const unsigned int P_ID = DTid.x; // Particle ID to operate on
-	const float g_fInitialParticleSpacing = 0.0045f;	//this is also in c++ so be careful to sync
-	const float g_fInitialParticleSpacing_Sq = g_fInitialParticleSpacing * g_fInitialParticleSpacing * 1.44;
-	const float k = 7.15f;
+    if (P_ID >= GetNumLiveParticles()) return;
+	const float g_fInitialParticleSpacing = FLUID_INITIAL_PARTICLE_SPACING;
+	const float g_fInitialParticleSpacing_Sq = g_fInitialParticleSpacing * g_fInitialParticleSpacing * FLUID_COLLISION_SCALE_SQ;
+	const float k = FLUID_SPRING_K;
     
     float2 P_position = ParticlesRO[P_ID].position;
     float2 P_velocity = ParticlesRO[P_ID].velocity;
@@ -530,34 +603,400 @@ void ForceCS_Grid( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uin
 	if (dot(diff0, diff0) <= g_fInitialParticleSpacing_Sq)
 	{
 		float2 diffEx = (P_center - P_position);
-		acceleration = 0.95f * diffEx;
+		acceleration = FLUID_EXTERNAL_K * diffEx;
 		ParticlesForcesRW[P_ID].acceleration += acceleration;
 	}
 }
 
 
 //--------------------------------------------------------------------------------------
-// Integration
+// Grid + Sort with Neighbour Lists
+// The density pass records the in-range neighbours of every particle, the force pass
+// reads them back instead of walking the 9 cells again. The live force terms only need
+// r^2, so the list stores r^2 and no sqrt is taken. A particle with more neighbours
+// than the list holds stores its full count and the force pass walks the grid for it.
+// The density pass writes three UAVs, so both kernels are compiled for cs_5_0 only.
 //--------------------------------------------------------------------------------------
 
+#define NEIGHBOUR_LIST_SIZE 32
+
 [numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
-void IntegrateCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+void DensityCS_GridList( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+    if (P_ID >= GetNumLiveParticles()) return;
+    const float h_sq = g_fSmoothlen * g_fSmoothlen;
+    const unsigned int LIST_START = P_ID * NEIGHBOUR_LIST_SIZE;
+    float2 P_position = ParticlesRO[P_ID].position;
+
+    float density = 0;
+    unsigned int count = 0;
+
+    // Calculate the density based on neighbors from the 8 adjacent cells + current cell
+    int2 G_XY = (int2)GridCalculateCell( P_position );
+    for (int Y = max(G_XY.y - 1, 0) ; Y <= min(G_XY.y + 1, 255) ; Y++)
+    {
+        for (int X = max(G_XY.x - 1, 0) ; X <= min(G_XY.x + 1, 255) ; X++)
+        {
+            unsigned int G_CELL = GridConstuctKey(uint2(X, Y));
+            uint2 G_START_END = GridIndicesRO[G_CELL];
+            for (unsigned int N_ID = G_START_END.x ; N_ID < G_START_END.y ; N_ID++)
+            {
+                float2 N_position = ParticlesRO[N_ID].position;
+
+                float2 diff = N_position - P_position;
+                float r_sq = dot(diff, diff);
+                if (r_sq < h_sq)
+                {
+                    density += CalculateDensity(r_sq);
+                    if (count < NEIGHBOUR_LIST_SIZE)
+                    {
+                        NeighbourListRW[LIST_START + count] = uint2(N_ID, asuint(r_sq));
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    ParticlesDensityRW[P_ID].density = density;
+    NeighbourCountRW[P_ID] = count;
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void ForceCS_GridList( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
 {
     const unsigned int P_ID = DTid.x; // Particle ID to operate on
+    if (P_ID >= GetNumLiveParticles()) return;
+	const float g_fInitialParticleSpacing = FLUID_INITIAL_PARTICLE_SPACING;
+	const float g_fInitialParticleSpacing_Sq = g_fInitialParticleSpacing * g_fInitialParticleSpacing * FLUID_COLLISION_SCALE_SQ;
+	const float k = FLUID_SPRING_K;
+    const unsigned int LIST_START = P_ID * NEIGHBOUR_LIST_SIZE;
+    const unsigned int count = NeighbourCountRO[P_ID];
+
+    float2 P_position = ParticlesRO[P_ID].position;
+    float2 P_velocity = ParticlesRO[P_ID].velocity;
+    float P_density = ParticlesDensityRO[P_ID].density;
+	float2 P_position0 = ParticlesRO[P_ID].index;
+	float2 P_center = ParticlesRO[P_ID].center;
+
+    const float h_sq = g_fSmoothlen * g_fSmoothlen;
+
+    float2 acceleration = float2(0, 0);
+
+    if (count <= NEIGHBOUR_LIST_SIZE)
+    {
+        for (unsigned int i = 0 ; i < count ; i++)
+        {
+            uint2 neighbour = NeighbourListRO[LIST_START + i];
+            unsigned int N_ID = neighbour.x;
+            float r_sq = asfloat(neighbour.y);
+
+            //Ellastic collision (conservation of impulse)
+            if (r_sq <= g_fInitialParticleSpacing_Sq && P_ID != N_ID)
+            {
+                acceleration += (ParticlesRO[N_ID].velocity - P_velocity) / (g_fTimeStep);
+            }
+        }
+    }
+    else
+    {
+        // The list overflowed, walk the 8 adjacent cells + current cell
+        int2 G_XY = (int2)GridCalculateCell( P_position );
+        for (int Y = max(G_XY.y - 1, 0) ; Y <= min(G_XY.y + 1, 255) ; Y++)
+        {
+            for (int X = max(G_XY.x - 1, 0) ; X <= min(G_XY.x + 1, 255) ; X++)
+            {
+                unsigned int G_CELL = GridConstuctKey(uint2(X, Y));
+                uint2 G_START_END = GridIndicesRO[G_CELL];
+                for (unsigned int N_ID = G_START_END.x ; N_ID < G_START_END.y ; N_ID++)
+                {
+                    float2 diff = ParticlesRO[N_ID].position - P_position;
+                    float r_sq = dot(diff, diff);
+                    if (r_sq < h_sq && r_sq <= g_fInitialParticleSpacing_Sq && P_ID != N_ID)
+                    {
+                        acceleration += (ParticlesRO[N_ID].velocity - P_velocity) / (g_fTimeStep);
+                    }
+                }
+            }
+        }
+    }
+
+	acceleration /= P_density;
+
+	//Elastic force
+	float2 diff0 = (P_position0 - P_position);
+	acceleration += (k * diff0);
+
+	//External force
+	if (dot(diff0, diff0) <= g_fInitialParticleSpacing_Sq)
+	{
+		acceleration += FLUID_EXTERNAL_K * (P_center - P_position);
+	}
+
+	ParticlesForcesRW[P_ID].acceleration = acceleration;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Ensemble
+// Many independent universes of g_iNumParticles particles packed back to back in the
+// same buffers. Universe U owns particles [U * g_iNumParticles, (U + 1) * g_iNumParticles)
+// and grid cells [U * 65536, (U + 1) * 65536). The sort is segmented per universe so the
+// 16-bit particle value in the key is the index local to the universe.
+//--------------------------------------------------------------------------------------
+
+#define GRID_CELLS_PER_UNIVERSE 65536
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void BuildGridCS_Ensemble( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x; // Particle ID to operate on
+    const unsigned int U = P_ID / g_iNumParticles;
+    const float4 grid_dim = UniversesRO[U].grid_dim;
     
+    float2 position = ParticlesRO[P_ID].position;
+    float2 grid_xy = clamp(position * grid_dim.xy + grid_dim.zw, float2(0, 0), float2(255, 255));
+    
+    GridRW[P_ID] = GridConstuctKeyValuePair((uint2)grid_xy, P_ID - U * g_iNumParticles);
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void BuildGridIndicesCS_Ensemble( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int G_ID = DTid.x; // Grid ID to operate on
+    const unsigned int U = G_ID / g_iNumParticles;
+    const unsigned int G_LOCAL = G_ID - U * g_iNumParticles;
+    
+    // The first and last entries of each universe always open and close a cell
+    unsigned int G_ID_PREV = (G_LOCAL == 0)? G_ID : G_ID - 1;
+    unsigned int G_ID_NEXT = (G_LOCAL == g_iNumParticles - 1)? G_ID : G_ID + 1;
+    
+    unsigned int cell = GridGetKey( GridRO[G_ID] );
+    unsigned int cell_prev = GridGetKey( GridRO[G_ID_PREV] );
+    unsigned int cell_next = GridGetKey( GridRO[G_ID_NEXT] );
+    bool bStart = (G_ID_PREV == G_ID) || (cell != cell_prev);
+    bool bEnd = (G_ID_NEXT == G_ID) || (cell != cell_next);
+    if (bStart)
+    {
+        GridIndicesRW[U * GRID_CELLS_PER_UNIVERSE + cell].x = G_ID;
+    }
+    if (bEnd)
+    {
+        GridIndicesRW[U * GRID_CELLS_PER_UNIVERSE + cell].y = G_ID + 1;
+    }
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void RearrangeParticlesCS_Ensemble( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int ID = DTid.x; // Particle ID to operate on
+    const unsigned int U = ID / g_iNumParticles;
+    const unsigned int G_ID = U * g_iNumParticles + GridGetValue( GridRO[ ID ] );
+    ParticlesRW[ID] = ParticlesRO[G_ID];
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void DensityCS_Ensemble( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+    const unsigned int U = P_ID / g_iNumParticles;
+    const UniverseConstants uc = UniversesRO[U];
+    const float h_sq = uc.smoothlen * uc.smoothlen;
+    float2 P_position = ParticlesRO[P_ID].position;
+    
+    float density = 0;
+    
+    // Calculate the density based on neighbors from the 8 adjacent cells + current cell
+    int2 G_XY = (int2)clamp(P_position * uc.grid_dim.xy + uc.grid_dim.zw, float2(0, 0), float2(255, 255));
+    for (int Y = max(G_XY.y - 1, 0) ; Y <= min(G_XY.y + 1, 255) ; Y++)
+    {
+        for (int X = max(G_XY.x - 1, 0) ; X <= min(G_XY.x + 1, 255) ; X++)
+        {
+            unsigned int G_CELL = U * GRID_CELLS_PER_UNIVERSE + GridConstuctKey(uint2(X, Y));
+            uint2 G_START_END = GridIndicesRO[G_CELL];
+            for (unsigned int N_ID = G_START_END.x ; N_ID < G_START_END.y ; N_ID++)
+            {
+                float2 N_position = ParticlesRO[N_ID].position;
+                
+                float2 diff = N_position - P_position;
+                float r_sq = dot(diff, diff);
+                if (r_sq < h_sq)
+                {
+                    density += uc.density_coef * (h_sq - r_sq) * (h_sq - r_sq) * (h_sq - r_sq);
+                }
+            }
+        }
+    }
+    
+    ParticlesDensityRW[P_ID].density = density;
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void ForceCS_Ensemble( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x; // Particle ID to operate on
+    const unsigned int U = P_ID / g_iNumParticles;
+    const UniverseConstants uc = UniversesRO[U];
+    
+    float2 P_position = ParticlesRO[P_ID].position;
+    float2 P_velocity = ParticlesRO[P_ID].velocity;
+    float P_density = ParticlesDensityRO[P_ID].density;
+	float2 P_position0 = ParticlesRO[P_ID].index;
+	float2 P_center = ParticlesRO[P_ID].center;
+    
+    const float h_sq = uc.smoothlen * uc.smoothlen;
+    
+    float2 acceleration = float2(0, 0);
+    
+    // Same terms as ForceCS_Grid, with the constants taken from the universe
+    // The pressure and viscosity terms are disabled there too (EWT)
+    int2 G_XY = (int2)clamp(P_position * uc.grid_dim.xy + uc.grid_dim.zw, float2(0, 0), float2(255, 255));
+    for (int Y = max(G_XY.y - 1, 0) ; Y <= min(G_XY.y + 1, 255) ; Y++)
+    {
+        for (int X = max(G_XY.x - 1, 0) ; X <= min(G_XY.x + 1, 255) ; X++)
+        {
+            unsigned int G_CELL = U * GRID_CELLS_PER_UNIVERSE + GridConstuctKey(uint2(X, Y));
+            uint2 G_START_END = GridIndicesRO[G_CELL];
+            for (unsigned int N_ID = G_START_END.x ; N_ID < G_START_END.y ; N_ID++)
+            {
+                float2 N_position = ParticlesRO[N_ID].position;
+                
+                float2 diff = N_position - P_position;
+                float r_sq = dot(diff, diff);
+                if (r_sq < h_sq && P_ID != N_ID)
+                {
+					//Ellastic collision (conservation of impulse)
+					if (r_sq <= uc.collision_dist_sq)
+					{
+						float2 N_velocity = ParticlesRO[N_ID].velocity;
+						acceleration += (N_velocity - P_velocity) / (g_fTimeStep);
+					}
+                }
+            }
+        }
+    }
+
+	ParticlesForcesRW[P_ID].acceleration = acceleration / P_density;
+
+	//Elastic force
+	float2 diff0 = (P_position0 - P_position);
+	ParticlesForcesRW[P_ID].acceleration += uc.spring_k * diff0;
+
+	//External force
+	if (dot(diff0, diff0) <= uc.collision_dist_sq)
+	{
+		ParticlesForcesRW[P_ID].acceleration += uc.external_k * (P_center - P_position);
+	}
+}
+
+
+//--------------------------------------------------------------------------------------
+// Boundaries
+//--------------------------------------------------------------------------------------
+
+// Bilinear lookup into the precomputed signed distance field
+// Returns the distance (negative inside solid) and the normalized gradient of the
+// bilinear patch, which points away from the nearest solid
+// Kept in step with CBoundarySDF::Sample
+float SampleBoundarySDF(float2 position, out float2 normal)
+{
+    float2 max_xy = float2(g_iBoundaryWidth - 1, g_iBoundaryHeight - 1);
+    float2 g = clamp(position * g_vBoundaryDim.xy + g_vBoundaryDim.zw, float2(0, 0), max_xy);
+    uint2 xy0 = min((uint2)g, (uint2)max_xy - 1);
+    float2 f = g - xy0;
+
+    unsigned int i00 = xy0.y * g_iBoundaryWidth + xy0.x;
+    unsigned int i01 = i00 + g_iBoundaryWidth;
+    float d00 = BoundarySDFRO[i00];
+    float d10 = BoundarySDFRO[i00 + 1];
+    float d01 = BoundarySDFRO[i01];
+    float d11 = BoundarySDFRO[i01 + 1];
+
+    float2 grad = float2(lerp(d10 - d00, d11 - d01, f.y), lerp(d01 - d00, d11 - d10, f.x));
+    normal = (dot(grad, grad) > 0) ? normalize(grad) : float2(0, 0);
+    return lerp(lerp(d00, d10, f.x), lerp(d01, d11, f.x), f.y);
+}
+
+
+//--------------------------------------------------------------------------------------
+// Coarse Graining
+// One thread per coarse cell of COARSE_CELL_BLOCK x COARSE_CELL_BLOCK grid cells sums the
+// particles of their ranges, run between the force and the integration so the sorted
+// particles, their densities and cells all belong to the state the step started from.
+// Same fields as CCoarseGrainer in CoarseGrain.cpp, but the kinetic energy is per unit
+// mass; the viewer scales it when the cells come back.
+//--------------------------------------------------------------------------------------
+
+#define COARSE_CELL_BLOCK 4
+#define COARSE_GRID_DIM (256 / COARSE_CELL_BLOCK)
+
+// Must match CoarseCell in CoarseGrain.h
+struct CoarseCell
+{
+    uint count;
+    float2 displacement;
+    float kinetic_energy;
+    float density;
+};
+
+RWStructuredBuffer<CoarseCell> CoarseCellsRW : register( u0 );
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void CoarseGrainCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const uint2 origin = uint2(DTid.x % COARSE_GRID_DIM, DTid.x / COARSE_GRID_DIM) * COARSE_CELL_BLOCK;
+
+    uint count = 0;
+    float2 displacement = float2(0, 0);
+    float energy = 0;
+    float density = 0;
+    for (uint y = 0; y < COARSE_CELL_BLOCK; y++)
+    {
+        for (uint x = 0; x < COARSE_CELL_BLOCK; x++)
+        {
+            const uint2 range = GridIndicesRO[GridConstuctKey(origin + uint2(x, y))];
+            for (uint i = range.x; i < range.y; i++)
+            {
+                const float2 velocity = ParticlesRO[i].velocity;
+                displacement += ParticlesRO[i].position - ParticlesRO[i].index;
+                energy += 0.5f * dot(velocity, velocity);
+                density += ParticlesDensityRO[i].density;
+                count++;
+            }
+        }
+    }
+
+    const float inv_count = count ? 1.0f / count : 0;
+    CoarseCell cell;
+    cell.count = count;
+    cell.displacement = displacement * inv_count;
+    cell.kinetic_energy = energy;
+    cell.density = density * inv_count;
+    CoarseCellsRW[DTid.x] = cell;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Integration
+//--------------------------------------------------------------------------------------
+
+// Integrates particle P_ID into ParticlesRW and returns what it wrote
+ParticleData IntegrateParticle(unsigned int P_ID)
+{
     float2 position = ParticlesRO[P_ID].position;
     float2 velocity = ParticlesRO[P_ID].velocity;
     float2 acceleration = ParticlesForcesRO[P_ID].acceleration;
 	float2 position0 = ParticlesRO[P_ID].index;
 	float2 center = ParticlesRO[P_ID].center;
     
-    // Apply the forces from the map walls
-    [unroll]
-    //for (unsigned int i = 0 ; i < 4 ; i++)
-    //{
-    //    float dist = dot(float3(position, 1), g_vPlanes[i]);
-    //    acceleration += min(dist, 0) * -g_fWallStiffness * g_vPlanes[i].xy;	//EWT
-    //}
+    // Apply the forces from the map walls and obstacles
+    if (g_iBoundaryWidth > 0)
+    {
+        float2 normal;
+        float dist = SampleBoundarySDF(position, normal);
+        acceleration += min(dist, 0) * -g_fWallStiffness * normal;
+    }
     
     // Apply gravity
     //acceleration += g_vGravity.xy;	//EWT
@@ -571,4 +1010,247 @@ void IntegrateCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint
     ParticlesRW[P_ID].velocity = velocity;
 	ParticlesRW[P_ID].index = position0;
 	ParticlesRW[P_ID].center = center;
+
+    ParticleData P;
+    P.position = position;
+    P.velocity = velocity;
+    P.index = position0;
+    P.center = center;
+    return P;
+}
+
+// Absorbed particles are removed by the next compaction
+void FlagAbsorbed(unsigned int P_ID, float2 position)
+{
+    ParticleAliveRW[P_ID] = (all(position >= g_vAbsorbBounds.xy) && all(position <= g_vAbsorbBounds.zw)) ? 1 : 0;
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void IntegrateCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x; // Particle ID to operate on
+
+    IntegrateParticle(P_ID);
+}
+
+// IntegrateCS for dynamic particles: the count is on the GPU and the alive flags are a
+// second UAV, so this one is compiled for cs_5_0 only
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void IntegrateDynamicCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+    if (P_ID >= ParticleCountRO[0]) return;
+
+    const ParticleData P = IntegrateParticle(P_ID);
+    FlagAbsorbed(P_ID, P.position);
+}
+
+
+//--------------------------------------------------------------------------------------
+// Step Statistics
+// IntegrateStatisticsCS integrates like IntegrateCS and reduces the particles it has just
+// written while they are still in registers: each group sums its particles in groupshared
+// memory into one StatisticsBlock and bins their speeds and densities into groupshared
+// histograms, added to StatisticsHistogramRW once per group. The viewer sums the blocks
+// when they come back, into the FluidStepStatistics the CPU simulator also gathers
+// (FluidCPU.h). Energies and momentum are per unit mass; the viewer scales them.
+//--------------------------------------------------------------------------------------
+
+// Must match StatisticsBlock in EWT_Simulator.cpp
+struct StatisticsBlock
+{
+    uint count;
+    float kinetic_energy;       // Sum of 0.5 |v|^2
+    float elastic_energy;       // Sum of 0.5 k |position - rest position|^2
+    float2 momentum;            // Sum of v
+    float max_speed;
+    float min_density;
+    float max_density;
+};
+
+RWStructuredBuffer<StatisticsBlock> StatisticsBlocksRW : register( u2 );
+
+// FLUID_STATISTICS_BINS speed bins, then as many density bins
+RWStructuredBuffer<uint> StatisticsHistogramRW : register( u3 );
+
+groupshared float4 statistics_sums[SIMULATION_BLOCK_SIZE];      // Kinetic, elastic, momentum
+groupshared float4 statistics_extremes[SIMULATION_BLOCK_SIZE];  // Count, max speed, min and max density
+groupshared uint statistics_histogram[2 * FLUID_STATISTICS_BINS];
+
+// Same as FluidStatisticsBin in FluidCPU.h
+uint StatisticsBin(float value, float min_value, float max_value)
+{
+    float bin = max((value - min_value) * (FLUID_STATISTICS_BINS / (max_value - min_value)), 0);
+    return (bin < FLUID_STATISTICS_BINS - 1) ? (uint)bin : FLUID_STATISTICS_BINS - 1;
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void IntegrateStatisticsCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+
+    // No early out, every thread of the group takes part in the reduction
+    if (GI < 2 * FLUID_STATISTICS_BINS)
+    {
+        statistics_histogram[GI] = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    float4 sums = float4(0, 0, 0, 0);
+    float4 extremes = float4(0, 0, 3.402823466e+38f, -3.402823466e+38f);
+    if (!g_iDynamicParticles || P_ID < ParticleCountRO[0])
+    {
+        const ParticleData P = IntegrateParticle(P_ID);
+        if (g_iDynamicParticles)
+        {
+            FlagAbsorbed(P_ID, P.position);
+        }
+        const float density = ParticlesDensityRO[P_ID].density;
+        const float2 diff0 = P.index - P.position;
+        const float speed_sq = dot(P.velocity, P.velocity);
+        const float speed = sqrt(speed_sq);
+
+        sums = float4(0.5f * speed_sq, 0.5f * FLUID_SPRING_K * dot(diff0, diff0), P.velocity);
+        extremes = float4(1, speed, density, density);
+        InterlockedAdd(statistics_histogram[StatisticsBin(speed, 0, FLUID_STATISTICS_MAX_SPEED)], 1);
+        InterlockedAdd(statistics_histogram[FLUID_STATISTICS_BINS + StatisticsBin(density, FLUID_STATISTICS_MIN_DENSITY, FLUID_STATISTICS_MAX_DENSITY)], 1);
+    }
+    statistics_sums[GI] = sums;
+    statistics_extremes[GI] = extremes;
+    GroupMemoryBarrierWithGroupSync();
+
+    [unroll]
+    for (uint stride = SIMULATION_BLOCK_SIZE / 2 ; stride > 0 ; stride >>= 1)
+    {
+        if (GI < stride)
+        {
+            const float4 a = statistics_extremes[GI];
+            const float4 b = statistics_extremes[GI + stride];
+            statistics_sums[GI] += statistics_sums[GI + stride];
+            statistics_extremes[GI] = float4(a.x + b.x, max(a.y, b.y), min(a.z, b.z), max(a.w, b.w));
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    if (GI == 0)
+    {
+        StatisticsBlock block;
+        block.count = (uint)statistics_extremes[0].x;
+        block.kinetic_energy = statistics_sums[0].x;
+        block.elastic_energy = statistics_sums[0].y;
+        block.momentum = statistics_sums[0].zw;
+        block.max_speed = statistics_extremes[0].y;
+        block.min_density = statistics_extremes[0].z;
+        block.max_density = statistics_extremes[0].w;
+        StatisticsBlocksRW[Gid.x] = block;
+    }
+    if (GI < 2 * FLUID_STATISTICS_BINS && statistics_histogram[GI] > 0)
+    {
+        InterlockedAdd(StatisticsHistogramRW[GI], statistics_histogram[GI]);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Dynamic Particles
+// Runs before the grid is built. Survivors of the last step are compacted to the front
+// of the buffer in their current order, then the spawned particles are appended:
+//    Scan: exclusive prefix sum of the alive flags within each block
+//    Scan Block Sums: one group scans the block totals and writes the new count and
+//        the indirect draw and dispatch arguments
+//    Compact: every survivor moves to its block offset + local offset
+//    Spawn: the emitted particles fill the slots after the survivors
+// A block covers SIMULATION_BLOCK_SIZE particles and the block sums are scanned by a
+// single group, so the capacity is at most SIMULATION_BLOCK_SIZE^2 = 64K particles,
+// the same limit as the 16-bit particle IDs of the grid keys. The scans bind two UAVs and
+// a typed one, so all of these are compiled for cs_5_0 only
+//--------------------------------------------------------------------------------------
+
+// Set on the scan entries of particles that survive
+#define SCAN_KEEP 0x80000000
+
+groupshared uint scan_shared_data[SIMULATION_BLOCK_SIZE];
+
+// Exclusive prefix sum of one value per thread of the group
+uint GroupExclusiveScan(uint GI, uint value, out uint total)
+{
+    scan_shared_data[GI] = value;
+    GroupMemoryBarrierWithGroupSync();
+
+    [unroll]
+    for (uint offset = 1 ; offset < SIMULATION_BLOCK_SIZE ; offset <<= 1)
+    {
+        uint sum = (GI >= offset) ? scan_shared_data[GI - offset] : 0;
+        GroupMemoryBarrierWithGroupSync();
+        scan_shared_data[GI] += sum;
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    total = scan_shared_data[SIMULATION_BLOCK_SIZE - 1];
+    return scan_shared_data[GI] - value;
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void ScanParticlesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+    const unsigned int keep = (P_ID < ParticleCountRO[0] && ParticleAliveRO[P_ID]) ? 1 : 0;
+
+    uint total;
+    uint offset = GroupExclusiveScan(GI, keep, total);
+
+    ScanRW[P_ID] = keep ? (offset | SCAN_KEEP) : offset;
+    if (GI == 0)
+    {
+        BlockSumsRW[Gid.x] = total;
+    }
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void ScanBlockSumsCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int iNumBlocks = g_iNumParticles / SIMULATION_BLOCK_SIZE;
+    const unsigned int sum = (GI < iNumBlocks) ? BlockSumsRW[GI] : 0;
+
+    uint survivors;
+    uint offset = GroupExclusiveScan(GI, sum, survivors);
+
+    if (GI < iNumBlocks)
+    {
+        BlockSumsRW[GI] = offset;
+    }
+    if (GI == 0)
+    {
+        const unsigned int count = min(survivors + g_iNumSpawn, g_iNumParticles);
+        ParticleCountRW[0] = count;
+        ParticleCountRW[1] = 1;
+        ParticleCountRW[2] = 0;
+        ParticleCountRW[3] = 0;
+        ParticleCountRW[4] = (count + SIMULATION_BLOCK_SIZE - 1) / SIMULATION_BLOCK_SIZE;
+        ParticleCountRW[5] = 1;
+        ParticleCountRW[6] = 1;
+        ParticleCountRW[7] = survivors;
+    }
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void CompactParticlesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int P_ID = DTid.x;
+    const unsigned int entry = ScanRO[P_ID];
+    if (entry & SCAN_KEEP)
+    {
+        ParticlesRW[BlockSumsRO[Gid.x] + (entry & ~SCAN_KEEP)] = ParticlesRO[P_ID];
+    }
+}
+
+[numthreads(SIMULATION_BLOCK_SIZE, 1, 1)]
+void SpawnParticlesCS( uint3 Gid : SV_GroupID, uint3 DTid : SV_DispatchThreadID, uint3 GTid : SV_GroupThreadID, uint GI : SV_GroupIndex )
+{
+    const unsigned int S_ID = DTid.x;
+    const unsigned int P_ID = ParticleCountRO[7] + S_ID;
+    if (S_ID < g_iNumSpawn && P_ID < g_iNumParticles)
+    {
+        ParticlesRW[P_ID] = SpawnRO[S_ID];
+    }
 }
@@ -0,0 +1,33 @@
+//--------------------------------------------------------------------------------------
+// File: FluidConstants.h
+//
+// Constants of the force model that the GPU kernels hard-code, shared by FluidCS11.hlsl
+// and the C++ side (EWT_Simulator.cpp, the CPU simulator) so the two cannot drift apart.
+// Included from HLSL, so only #defines and comments belong here.
+//--------------------------------------------------------------------------------------
+#ifndef FLUID_CONSTANTS_H
+#define FLUID_CONSTANTS_H
+
+// Rest distance of the starting lattice
+#define FLUID_INITIAL_PARTICLE_SPACING      0.0045f
+
+// Neighbours closer than spacing^2 * FLUID_COLLISION_SCALE_SQ collide elastically, and
+// particles within that distance of their rest position feel the external force
+#define FLUID_COLLISION_SCALE_SQ            1.44f
+
+// Spring pulling every particle back to its rest position (ForceCS_Grid / _GridList)
+#define FLUID_SPRING_K                      7.15f
+
+// Pull towards the centre of the lattice
+#define FLUID_EXTERNAL_K                    0.95f
+
+// Fixed bins of the step statistics histograms (IntegrateStatisticsCS and the CPU
+// simulator's integrate pass): speeds over [0, FLUID_STATISTICS_MAX_SPEED) and densities
+// over [FLUID_STATISTICS_MIN_DENSITY, FLUID_STATISTICS_MAX_DENSITY); values outside the
+// range land in the end bins
+#define FLUID_STATISTICS_BINS               64
+#define FLUID_STATISTICS_MAX_SPEED          0.25f
+#define FLUID_STATISTICS_MIN_DENSITY        0.0f
+#define FLUID_STATISTICS_MAX_DENSITY        1000.0f
+
+#endif
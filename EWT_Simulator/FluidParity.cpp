@@ -0,0 +1,190 @@
+//--------------------------------------------------------------------------------------
+// File: FluidParity.cpp
+//
+// Snapshot files and the per particle comparison of two states
+//--------------------------------------------------------------------------------------
+#include "FluidParity.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+namespace
+{
+    // Little endian, as written by both the viewer and the POSIX tools
+    const char SNAPSHOT_MAGIC[8] = { 'E', 'W', 'T', 'S', 'N', 'A', 'P', '1' };
+
+    struct SnapshotHeader
+    {
+        char Magic[8];
+        uint32_t iNumInitial;
+        uint32_t iNumFinal;
+        uint32_t iSteps;
+        uint32_t iSourceLength;
+        float fTimeStep;
+        float fSmoothlen;
+        float fParticleMass;
+        float fInitialParticleSpacing;
+        float fSpringK;
+        float fExternalK;
+        float fWallStiffness;
+        uint32_t iReserved;
+    };
+
+    FILE* OpenFile( const char* szPath, const char* szMode )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, szMode ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, szMode );
+#endif
+    }
+
+    uint64_t RestKey( const FluidParticle& p )
+    {
+        uint32_t x, y;
+        memcpy( &x, &p.vIndex.x, sizeof( x ) );
+        memcpy( &y, &p.vIndex.y, sizeof( y ) );
+        return ((uint64_t)x << 32) | y;
+    }
+
+    // Monotonic integer of a float, so neighbouring floats are one apart
+    int64_t OrderedBits( float f )
+    {
+        int32_t i;
+        memcpy( &i, &f, sizeof( i ) );
+        return (i < 0) ? (int64_t)INT32_MIN - i : (int64_t)i;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+bool FluidWriteSnapshot( const char* szPath, const FluidSnapshot& snapshot )
+{
+    FILE* pFile = OpenFile( szPath, "wb" );
+    if ( !pFile )
+        return false;
+
+    const FluidParameters& params = snapshot.Parameters;
+    SnapshotHeader header = {};
+    memcpy( header.Magic, SNAPSHOT_MAGIC, sizeof( header.Magic ) );
+    header.iNumInitial = (uint32_t)snapshot.Initial.size();
+    header.iNumFinal = (uint32_t)snapshot.Final.size();
+    header.iSteps = snapshot.iSteps;
+    header.iSourceLength = (uint32_t)snapshot.Source.size();
+    header.fTimeStep = params.fTimeStep;
+    header.fSmoothlen = params.fSmoothlen;
+    header.fParticleMass = params.fParticleMass;
+    header.fInitialParticleSpacing = params.fInitialParticleSpacing;
+    header.fSpringK = params.fSpringK;
+    header.fExternalK = params.fExternalK;
+    header.fWallStiffness = params.fWallStiffness;
+
+    bool bOk = fwrite( &header, sizeof( header ), 1, pFile ) == 1;
+    bOk = bOk && fwrite( snapshot.Source.data(), 1, snapshot.Source.size(), pFile ) == snapshot.Source.size();
+    bOk = bOk && fwrite( snapshot.Initial.data(), sizeof( FluidParticle ), snapshot.Initial.size(), pFile ) == snapshot.Initial.size();
+    bOk = bOk && fwrite( snapshot.Final.data(), sizeof( FluidParticle ), snapshot.Final.size(), pFile ) == snapshot.Final.size();
+    return (fclose( pFile ) == 0) && bOk;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool FluidReadSnapshot( const char* szPath, FluidSnapshot& snapshot )
+{
+    FILE* pFile = OpenFile( szPath, "rb" );
+    if ( !pFile )
+        return false;
+
+    SnapshotHeader header;
+    bool bOk = fread( &header, sizeof( header ), 1, pFile ) == 1 &&
+               !memcmp( header.Magic, SNAPSHOT_MAGIC, sizeof( header.Magic ) ) && header.iSourceLength < 256;
+    if ( bOk )
+    {
+        FluidParameters params = {};
+        params.fTimeStep = header.fTimeStep;
+        params.fSmoothlen = header.fSmoothlen;
+        params.fParticleMass = header.fParticleMass;
+        params.fInitialParticleSpacing = header.fInitialParticleSpacing;
+        params.fSpringK = header.fSpringK;
+        params.fExternalK = header.fExternalK;
+        params.fWallStiffness = header.fWallStiffness;
+        snapshot.Parameters = params;
+        snapshot.iSteps = header.iSteps;
+
+        snapshot.Source.resize( header.iSourceLength );
+        snapshot.Initial.resize( header.iNumInitial );
+        snapshot.Final.resize( header.iNumFinal );
+        bOk = fread( &snapshot.Source[0], 1, header.iSourceLength, pFile ) == header.iSourceLength &&
+              fread( snapshot.Initial.data(), sizeof( FluidParticle ), header.iNumInitial, pFile ) == header.iNumInitial &&
+              fread( snapshot.Final.data(), sizeof( FluidParticle ), header.iNumFinal, pFile ) == header.iNumFinal;
+    }
+
+    fclose( pFile );
+    return bOk;
+}
+
+
+//--------------------------------------------------------------------------------------
+uint64_t FluidUlpDistance( float a, float b )
+{
+    const int64_t d = OrderedBits( a ) - OrderedBits( b );
+    return (uint64_t)((d < 0) ? -d : d);
+}
+
+
+//--------------------------------------------------------------------------------------
+FluidParityReport FluidCompareParticles( const std::vector<FluidParticle>& Reference, const std::vector<FluidParticle>& Tested,
+                                         const FluidParityTolerance& tolerance )
+{
+    std::unordered_map<uint64_t, const FluidParticle*> lookup;
+    lookup.reserve( Tested.size() );
+    for ( const FluidParticle& p : Tested )
+        lookup[RestKey( p )] = &p;
+
+    FluidParityReport report = {};
+    double fWorst = -1;
+    for ( const FluidParticle& r : Reference )
+    {
+        auto it = lookup.find( RestKey( r ) );
+        if ( it == lookup.end() )
+        {
+            report.iMissing++;
+            continue;
+        }
+
+        const FluidParticle& t = *it->second;
+        const float A[4] = { r.vPosition.x, r.vPosition.y, r.vVelocity.x, r.vVelocity.y };
+        const float B[4] = { t.vPosition.x, t.vPosition.y, t.vVelocity.x, t.vVelocity.y };
+
+        bool bFailed = false;
+        double fParticleRelative = 0;
+        for ( int c = 0 ; c < 4 ; c++ )
+        {
+            const uint64_t iUlps = FluidUlpDistance( A[c], B[c] );
+            const double fAbsolute = fabs( (double)A[c] - (double)B[c] );
+            const double fScale = std::max( fabs( (double)A[c] ), fabs( (double)B[c] ) );
+            const double fRelative = (fScale > 0) ? fAbsolute / fScale : 0.0;
+
+            report.iMaxUlps = std::max( report.iMaxUlps, iUlps );
+            report.fMaxRelative = std::max( report.fMaxRelative, fRelative );
+            report.fMaxAbsolute = std::max( report.fMaxAbsolute, fAbsolute );
+            fParticleRelative = std::max( fParticleRelative, fRelative );
+
+            if ( iUlps > tolerance.iMaxUlps && fRelative > tolerance.fRelative && fAbsolute > tolerance.fAbsolute )
+                bFailed = true;
+        }
+
+        if ( bFailed )
+            report.iFailed++;
+        if ( fParticleRelative > fWorst )
+        {
+            fWorst = fParticleRelative;
+            report.vWorstRestPosition = r.vIndex;
+        }
+        report.iCompared++;
+    }
+    return report;
+}
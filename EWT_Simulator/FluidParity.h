@@ -0,0 +1,54 @@
+//--------------------------------------------------------------------------------------
+// File: FluidParity.h
+//
+// Snapshots for checking a simulator against a reference. A snapshot holds the
+// parameters, a start state and the state the reference reached K steps later; the
+// viewer writes them from the GPU path (Parity Snapshot button) and ParityCheck writes
+// golden ones from the CPU path. ParityCheck then steps the CPU simulator from the start
+// state and compares every particle, so kernels can be validated without a GPU.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <string>
+#include <vector>
+
+struct FluidSnapshot
+{
+    FluidParameters Parameters;         // Pointers are not stored and read back as nullptr
+    unsigned int iSteps;                // Steps from Initial to Final
+    std::string Source;                 // What produced Final, e.g. "gpu grid" or "cpu grid"
+    std::vector<FluidParticle> Initial;
+    std::vector<FluidParticle> Final;
+};
+
+bool FluidWriteSnapshot( const char* szPath, const FluidSnapshot& snapshot );
+bool FluidReadSnapshot( const char* szPath, FluidSnapshot& snapshot );
+
+// A component passes when any of the three bounds holds
+struct FluidParityTolerance
+{
+    uint32_t iMaxUlps;                  // Distance in representable floats
+    float fRelative;                    // |a - b| / max(|a|, |b|)
+    float fAbsolute;                    // |a - b|
+};
+
+struct FluidParityReport
+{
+    size_t iCompared;
+    size_t iMissing;                    // Particles of the reference without a match
+    size_t iFailed;                     // Particles with a component outside the tolerance
+    uint64_t iMaxUlps;                  // Worst of position and velocity components
+    double fMaxRelative;
+    double fMaxAbsolute;
+    FluidFloat2 vWorstRestPosition;     // Identifies the particle with the largest error
+};
+
+// Pairs the particles up by their exact rest position, as the two sides keep them in
+// different grid orders, and compares position and velocity
+FluidParityReport FluidCompareParticles( const std::vector<FluidParticle>& Reference, const std::vector<FluidParticle>& Tested,
+                                         const FluidParityTolerance& tolerance );
+
+// Distance between two floats in units in the last place, across zero as well
+uint64_t FluidUlpDistance( float a, float b );
@@ -26,6 +26,28 @@ cbuffer cbRenderConstants : register( b0 )
 {
     matrix g_mViewProjection;
     float g_fParticleSize;
+    uint g_iParticleOffset;     // First particle of the universe on screen (ensemble mode)
+
+    // Heatmap
+    uint g_iHeatmapWidth;       // Bins
+    uint g_iHeatmapHeight;
+    uint g_iHeatmapBinSize;     // Pixels on a side of a bin
+    uint g_iHeatmapQuantity;    // HEATMAP_COUNT, HEATMAP_DENSITY or HEATMAP_DISPLACEMENT
+    uint g_iHeatmapParticles;   // Particles of the universe, or slots with dynamic particles
+    uint g_iHeatmapDynamic;     // Live count in ParticleCountRO
+    float g_fHeatmapLower;      // Colour ramp range
+    float g_fHeatmapUpper;
+    float g_fHeatmapScale;      // Fixed point scale of the summed quantity
+    float g_fScreenWidth;       // Pixels
+    float g_fScreenHeight;
+
+    // Level of detail
+    uint g_iLodX0;              // Visible nodes of the level drawn, inclusive
+    uint g_iLodY0;
+    uint g_iLodX1;
+    uint g_iLodY1;
+    uint g_iLodOffset;          // First node of the level in LodRO
+    uint g_iLodDim;             // Nodes on a side of the level
 };
 
 struct VSParticleOut
@@ -61,19 +83,28 @@ float4 VisualizeNumber(float n, float lower, float upper)
     return VisualizeNumber( saturate( (n - lower) / (upper - lower) ) );
 }
 
+// Range of the density colours
+#define DENSITY_LOWER 0.0f
+#define DENSITY_UPPER 650.0f
+
 
 //--------------------------------------------------------------------------------------
 // Vertex Shader
 //--------------------------------------------------------------------------------------
 
-VSParticleOut ParticleVS(uint ID : SV_VertexID)
+VSParticleOut ParticleOut(uint ID)
 {
     VSParticleOut Out = (VSParticleOut)0;
 	Out.position = ParticlesRO[ID].position;	//DEBUG//
-    Out.color = VisualizeNumber(ParticleDensityRO[ID].density, 00.0f, 650.0f);
+    Out.color = VisualizeNumber(ParticleDensityRO[ID].density, DENSITY_LOWER, DENSITY_UPPER);
     return Out;
 }
 
+VSParticleOut ParticleVS(uint ID : SV_VertexID)
+{
+    return ParticleOut(ID + g_iParticleOffset);
+}
+
 
 //--------------------------------------------------------------------------------------
 // Particle Geometry Shader
@@ -107,3 +138,229 @@ float4 ParticlePS(GSParticleOut In) : SV_Target
 {
     return In.color;
 }
+
+
+//--------------------------------------------------------------------------------------
+// Density Heatmap
+// With millions of particles the sprites overdraw each other many times and the picture
+// is mostly noise. The heatmap bins the particles into a screen resolution grid instead,
+// one atomic add per particle, and colours each bin once with VisualizeNumber, so it
+// costs O(particles + pixels). Needs cs_5_0 for the atomics.
+//--------------------------------------------------------------------------------------
+
+#define HEATMAP_COUNT 0
+#define HEATMAP_DENSITY 1
+#define HEATMAP_DISPLACEMENT 2
+#define HEATMAP_BLOCK_SIZE 256
+
+// Two uints per bin: particle count and the fixed point sum of the quantity
+RWByteAddressBuffer HeatmapRW : register( u0 );
+ByteAddressBuffer HeatmapRO : register( t3 );
+Buffer<uint> ParticleCountRO : register( t2 );
+
+[numthreads(HEATMAP_BLOCK_SIZE, 1, 1)]
+void HeatmapCS( uint3 DTid : SV_DispatchThreadID )
+{
+    const uint iNumParticles = g_iHeatmapDynamic ? ParticleCountRO[0] : g_iHeatmapParticles;
+    if ( DTid.x >= iNumParticles )
+        return;
+
+    const uint ID = DTid.x + g_iParticleOffset;
+    const ParticleData particle = ParticlesRO[ID];
+    const float4 clip = mul( float4(particle.position, 0, 1), g_mViewProjection );
+    const float2 pixel = float2(clip.x * 0.5 + 0.5, 0.5 - clip.y * 0.5) * float2(g_fScreenWidth, g_fScreenHeight);
+    const float2 bin = floor( pixel / g_iHeatmapBinSize );
+    if ( any( bin < 0 ) || bin.x >= g_iHeatmapWidth || bin.y >= g_iHeatmapHeight )
+        return;
+
+    const uint iAddress = ((uint)bin.y * g_iHeatmapWidth + (uint)bin.x) * 8;
+    HeatmapRW.InterlockedAdd( iAddress, 1 );
+
+    float fValue = 0;
+    if ( g_iHeatmapQuantity == HEATMAP_DENSITY )
+        fValue = ParticleDensityRO[ID].density;
+    else if ( g_iHeatmapQuantity == HEATMAP_DISPLACEMENT )
+        fValue = length( particle.position - particle.index );
+    if ( fValue > 0 )
+        HeatmapRW.InterlockedAdd( iAddress + 4, (uint)(fValue * g_fHeatmapScale + 0.5) );
+}
+
+float4 HeatmapVS( uint ID : SV_VertexID ) : SV_Position
+{
+    // One triangle covering the screen
+    const float2 uv = float2((ID << 1) & 2, ID & 2);
+    return float4(uv * float2(2, -2) + float2(-1, 1), 0, 1);
+}
+
+float4 HeatmapPS( float4 position : SV_Position ) : SV_Target
+{
+    const uint2 bin = (uint2)position.xy / g_iHeatmapBinSize;
+    const uint2 data = HeatmapRO.Load2( (bin.y * g_iHeatmapWidth + bin.x) * 8 );
+    if ( data.x == 0 )
+        discard;
+
+    const float fValue = (g_iHeatmapQuantity == HEATMAP_COUNT) ? (float)data.x : data.y / (g_fHeatmapScale * data.x);
+    return VisualizeNumber( fValue, g_fHeatmapLower, g_fHeatmapUpper );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Level of Detail
+// The grid sort leaves the particles ordered by cell, GridIndices holding the range of
+// every cell, and a cell's key is y * 256 + x, so the particles of a row of cells are
+// contiguous. LodBuildCS sums every cell's particles into a node and LodReduceCS sums
+// 2x2 nodes into the next level up to a single node, once per step.
+// When the cells are bigger than a few pixels the particles are drawn, but only those of
+// the visible cells: LodCullCS finds the range of each visible row and ParticleLodVS
+// maps the vertex ID into the rows. When they are smaller, one splat is drawn per
+// visible node of the level whose nodes cover about LOD_SPLAT_PIXELS on screen, at the
+// mean position of its particles and with their mean colour, so the cost follows the
+// pixels and not the particles.
+//--------------------------------------------------------------------------------------
+
+#define LOD_BLOCK_SIZE 256
+#define LOD_GRID_DIM 256
+
+// Sums over the particles of a node
+struct LodNode
+{
+    float2 position;
+    float density;
+    float ramp;                 // Position in the colour ramp, its mean is the mean colour
+    float count;
+};
+
+cbuffer cbLodConstants : register( b1 )
+{
+    uint g_iLodSrcOffset;       // Level reduced by LodReduceCS
+    uint g_iLodDstOffset;
+    uint g_iLodDstDim;
+};
+
+StructuredBuffer<uint2> GridIndicesRO : register( t4 );
+StructuredBuffer<LodNode> LodRO : register( t5 );
+StructuredBuffer<uint2> LodRowsRO : register( t6 );
+RWStructuredBuffer<LodNode> LodRW : register( u0 );
+RWStructuredBuffer<uint2> LodRowsRW : register( u0 );
+RWBuffer<uint> LodArgsRW : register( u1 );
+
+[numthreads(LOD_BLOCK_SIZE, 1, 1)]
+void LodBuildCS( uint3 DTid : SV_DispatchThreadID )
+{
+    const uint2 range = GridIndicesRO[DTid.x];
+
+    LodNode node = (LodNode)0;
+    for ( uint i = range.x ; i < range.y ; i++ )
+    {
+        const float density = ParticleDensityRO[i].density;
+        node.position += ParticlesRO[i].position;
+        node.density += density;
+        node.ramp += saturate( (density - DENSITY_LOWER) / (DENSITY_UPPER - DENSITY_LOWER) );
+        node.count += 1;
+    }
+    LodRW[DTid.x] = node;
+}
+
+[numthreads(LOD_BLOCK_SIZE, 1, 1)]
+void LodReduceCS( uint3 DTid : SV_DispatchThreadID )
+{
+    if ( DTid.x >= g_iLodDstDim * g_iLodDstDim )
+        return;
+
+    const uint2 xy = uint2(DTid.x % g_iLodDstDim, DTid.x / g_iLodDstDim) * 2;
+    const uint iSrcDim = g_iLodDstDim * 2;
+
+    LodNode node = (LodNode)0;
+    [unroll]
+    for ( uint i = 0 ; i < 4 ; i++ )
+    {
+        const LodNode child = LodRW[g_iLodSrcOffset + (xy.y + i / 2) * iSrcDim + xy.x + i % 2];
+        node.position += child.position;
+        node.density += child.density;
+        node.ramp += child.ramp;
+        node.count += child.count;
+    }
+    LodRW[g_iLodDstOffset + DTid.x] = node;
+}
+
+// Row i of the visible rows starts at vertex LodRowsRW[i].x with particle LodRowsRW[i].y
+groupshared uint s_iRowVertices[LOD_GRID_DIM];
+
+[numthreads(LOD_GRID_DIM, 1, 1)]
+void LodCullCS( uint GI : SV_GroupIndex )
+{
+    // Particles of the row's visible cells, empty cells have an empty range
+    const uint iRow = g_iLodY0 + GI;
+    uint2 range = uint2(0, 0);
+    if ( iRow <= g_iLodY1 )
+    {
+        for ( uint x = g_iLodX0 ; x <= g_iLodX1 ; x++ )
+        {
+            const uint2 cell = GridIndicesRO[iRow * LOD_GRID_DIM + x];
+            if ( cell.y > cell.x )
+            {
+                range.x = (range.y == 0) ? cell.x : range.x;
+                range.y = cell.y;
+            }
+        }
+    }
+    const uint iCount = range.y - range.x;
+
+    // Inclusive scan of the counts
+    s_iRowVertices[GI] = iCount;
+    GroupMemoryBarrierWithGroupSync();
+    [unroll]
+    for ( uint d = 1 ; d < LOD_GRID_DIM ; d <<= 1 )
+    {
+        const uint iAdd = (GI >= d) ? s_iRowVertices[GI - d] : 0;
+        GroupMemoryBarrierWithGroupSync();
+        s_iRowVertices[GI] += iAdd;
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    LodRowsRW[GI] = uint2(s_iRowVertices[GI] - iCount, range.x);
+    if ( GI == LOD_GRID_DIM - 1 )
+    {
+        LodArgsRW[0] = s_iRowVertices[GI];
+        LodArgsRW[1] = 1;
+        LodArgsRW[2] = 0;
+        LodArgsRW[3] = 0;
+    }
+}
+
+VSParticleOut ParticleLodVS(uint ID : SV_VertexID)
+{
+    // Last row starting at or before the vertex, empty rows start where the next begins
+    uint lo = 0;
+    uint hi = g_iLodY1 - g_iLodY0;
+    while ( lo < hi )
+    {
+        const uint mid = (lo + hi + 1) / 2;
+        if ( LodRowsRO[mid].x <= ID )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const uint2 row = LodRowsRO[lo];
+    return ParticleOut(row.y + ID - row.x);
+}
+
+VSParticleOut LodNodeVS(uint ID : SV_VertexID)
+{
+    const uint iWidth = g_iLodX1 - g_iLodX0 + 1;
+    const uint2 xy = uint2(g_iLodX0 + ID % iWidth, g_iLodY0 + ID / iWidth);
+    const LodNode node = LodRO[g_iLodOffset + xy.y * g_iLodDim + xy.x];
+
+    VSParticleOut Out = (VSParticleOut)0;
+    if ( node.count > 0 )
+    {
+        Out.position = node.position / node.count;
+        Out.color = VisualizeNumber(node.ramp / node.count);
+    }
+    else
+    {
+        // Empty node, its sprite is clipped
+        Out.position = float2(-1e30, -1e30);
+    }
+    return Out;
+}
@@ -0,0 +1,739 @@
+//--------------------------------------------------------------------------------------
+// File: FrameEncoder.cpp
+//
+// Frame pipeline stages, the colour conversions and the PNG encoder. PNG data is
+// compressed with a small LZ77 + fixed Huffman deflate, so no zlib is needed.
+//--------------------------------------------------------------------------------------
+#include "FrameEncoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+namespace
+{
+    FILE* OpenFile( const char* szPath, const char* szMode )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, szMode ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, szMode );
+#endif
+    }
+
+    //----------------------------------------------------------------------------------
+    // Checksums of PNG chunks and of the zlib stream
+    //----------------------------------------------------------------------------------
+    struct CrcTable
+    {
+        uint32_t Entries[256];
+
+        CrcTable()
+        {
+            for ( uint32_t n = 0 ; n < 256 ; n++ )
+            {
+                uint32_t c = n;
+                for ( int k = 0 ; k < 8 ; k++ )
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                Entries[n] = c;
+            }
+        }
+    };
+
+    uint32_t Crc32( const uint8_t* pData, size_t iSize, uint32_t iCrc = 0 )
+    {
+        static const CrcTable table;
+        iCrc = ~iCrc;
+        for ( size_t i = 0 ; i < iSize ; i++ )
+            iCrc = table.Entries[(iCrc ^ pData[i]) & 0xFF] ^ (iCrc >> 8);
+        return ~iCrc;
+    }
+
+    uint32_t Adler32( const uint8_t* pData, size_t iSize )
+    {
+        // 5552 is the most bytes whose sums cannot overflow before the modulo
+        uint32_t a = 1, b = 0;
+        while ( iSize > 0 )
+        {
+            const size_t iBlock = std::min<size_t>( iSize, 5552 );
+            for ( size_t i = 0 ; i < iBlock ; i++ )
+            {
+                a += pData[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            pData += iBlock;
+            iSize -= iBlock;
+        }
+        return (b << 16) | a;
+    }
+
+    //----------------------------------------------------------------------------------
+    // Deflate (RFC 1951) with one block of the fixed Huffman codes and greedy LZ77
+    // matches found through hash chains
+    //----------------------------------------------------------------------------------
+    const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+                                       131, 163, 195, 227, 258 };
+    const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+                                         2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    const uint8_t DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    const int WINDOW_BITS = 15;
+    const int WINDOW_SIZE = 1 << WINDOW_BITS;
+    const int HASH_BITS = 15;
+    const int MIN_MATCH = 3;
+    const int MAX_MATCH = 258;
+    const int MAX_CHAIN = 16;               // Candidates tried per position
+
+    class CBitWriter
+    {
+    public:
+        explicit CBitWriter( std::vector<uint8_t>& Out ) : m_Out( Out ), m_iBits( 0 ), m_iNumBits( 0 ) {}
+
+        // Least significant bit first, as deflate packs everything but Huffman codes
+        void Put( uint32_t iValue, int iNumBits )
+        {
+            m_iBits |= iValue << m_iNumBits;
+            m_iNumBits += iNumBits;
+            while ( m_iNumBits >= 8 )
+            {
+                m_Out.push_back( (uint8_t)m_iBits );
+                m_iBits >>= 8;
+                m_iNumBits -= 8;
+            }
+        }
+
+        // Huffman codes go most significant bit first
+        void PutCode( uint32_t iCode, int iLength )
+        {
+            uint32_t iReversed = 0;
+            for ( int i = 0 ; i < iLength ; i++ )
+                iReversed |= ((iCode >> i) & 1) << (iLength - 1 - i);
+            Put( iReversed, iLength );
+        }
+
+        void Flush()
+        {
+            if ( m_iNumBits > 0 )
+                m_Out.push_back( (uint8_t)m_iBits );
+            m_iBits = 0;
+            m_iNumBits = 0;
+        }
+
+    private:
+        std::vector<uint8_t>&   m_Out;
+        uint32_t                m_iBits;
+        int                     m_iNumBits;
+    };
+
+    void PutLiteralLength( CBitWriter& bits, int iSymbol )
+    {
+        if ( iSymbol < 144 )
+            bits.PutCode( 0x30 + iSymbol, 8 );
+        else if ( iSymbol < 256 )
+            bits.PutCode( 0x190 + iSymbol - 144, 9 );
+        else if ( iSymbol < 280 )
+            bits.PutCode( iSymbol - 256, 7 );
+        else
+            bits.PutCode( 0xC0 + iSymbol - 280, 8 );
+    }
+
+    void PutMatch( CBitWriter& bits, int iLength, int iDistance )
+    {
+        int i = 28;
+        while ( LENGTH_BASE[i] > iLength )
+            i--;
+        PutLiteralLength( bits, 257 + i );
+        bits.Put( iLength - LENGTH_BASE[i], LENGTH_EXTRA[i] );
+
+        int j = 29;
+        while ( DISTANCE_BASE[j] > iDistance )
+            j--;
+        bits.PutCode( j, 5 );
+        bits.Put( iDistance - DISTANCE_BASE[j], DISTANCE_EXTRA[j] );
+    }
+
+    inline uint32_t Hash( const uint8_t* p )
+    {
+        return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << HASH_BITS) - 1);
+    }
+
+    void Deflate( const uint8_t* pData, size_t iSize, std::vector<uint8_t>& Out )
+    {
+        CBitWriter bits( Out );
+        bits.Put( 1, 1 );       // Final block
+        bits.Put( 1, 2 );       // Fixed Huffman codes
+
+        std::vector<int32_t> head( (size_t)1 << HASH_BITS, -1 );
+        std::vector<int32_t> prev( WINDOW_SIZE, -1 );
+        auto Insert = [&]( size_t iPos )
+        {
+            if ( iPos + MIN_MATCH <= iSize )
+            {
+                const uint32_t h = Hash( pData + iPos );
+                prev[iPos & (WINDOW_SIZE - 1)] = head[h];
+                head[h] = (int32_t)iPos;
+            }
+        };
+
+        size_t i = 0;
+        while ( i < iSize )
+        {
+            int iBestLength = 0;
+            int iBestDistance = 0;
+            if ( i + MIN_MATCH <= iSize )
+            {
+                const int iMaxLength = (int)std::min<size_t>( MAX_MATCH, iSize - i );
+                int32_t iCandidate = head[Hash( pData + i )];
+                for ( int iChain = 0 ; iChain < MAX_CHAIN && iCandidate >= 0 && i - iCandidate <= (size_t)WINDOW_SIZE ; iChain++ )
+                {
+                    const uint8_t* p = pData + iCandidate;
+                    const uint8_t* q = pData + i;
+                    if ( p[iBestLength] == q[iBestLength] )
+                    {
+                        int iLength = 0;
+                        while ( iLength < iMaxLength && p[iLength] == q[iLength] )
+                            iLength++;
+                        if ( iLength > iBestLength )
+                        {
+                            iBestLength = iLength;
+                            iBestDistance = (int)(i - iCandidate);
+                            if ( iLength == iMaxLength )
+                                break;
+                        }
+                    }
+                    const int32_t iNext = prev[iCandidate & (WINDOW_SIZE - 1)];
+                    if ( iNext >= iCandidate )
+                        break;
+                    iCandidate = iNext;
+                }
+            }
+
+            if ( iBestLength >= MIN_MATCH )
+            {
+                PutMatch( bits, iBestLength, iBestDistance );
+                for ( int k = 0 ; k < iBestLength ; k++ )
+                    Insert( i + k );
+                i += iBestLength;
+            }
+            else
+            {
+                PutLiteralLength( bits, pData[i] );
+                Insert( i );
+                i++;
+            }
+        }
+
+        PutLiteralLength( bits, 256 );
+        bits.Flush();
+    }
+
+    //----------------------------------------------------------------------------------
+    // PNG
+    //----------------------------------------------------------------------------------
+    void PutBigEndian( std::vector<uint8_t>& Out, uint32_t iValue )
+    {
+        Out.push_back( (uint8_t)(iValue >> 24) );
+        Out.push_back( (uint8_t)(iValue >> 16) );
+        Out.push_back( (uint8_t)(iValue >> 8) );
+        Out.push_back( (uint8_t)iValue );
+    }
+
+    void PutChunk( std::vector<uint8_t>& Out, const char* szType, const uint8_t* pData, size_t iSize )
+    {
+        PutBigEndian( Out, (uint32_t)iSize );
+        const size_t iTypeStart = Out.size();
+        Out.insert( Out.end(), szType, szType + 4 );
+        Out.insert( Out.end(), pData, pData + iSize );
+        PutBigEndian( Out, Crc32( &Out[iTypeStart], iSize + 4 ) );
+    }
+
+    inline uint8_t Paeth( int a, int b, int c )
+    {
+        const int p = a + b - c;
+        const int pa = abs( p - a ), pb = abs( p - b ), pc = abs( p - c );
+        return (uint8_t)((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+    }
+
+    // Each row with the filter whose output has the smallest sum of absolute values,
+    // the heuristic libpng uses
+    void FilterRows( const uint8_t* pRGB, unsigned int iWidth, unsigned int iHeight, std::vector<uint8_t>& Filtered )
+    {
+        const size_t iStride = (size_t)iWidth * 3;
+        Filtered.resize( (iStride + 1) * iHeight );
+        std::vector<uint8_t> candidate( iStride );
+        std::vector<uint8_t> zero( iStride, 0 );
+
+        for ( unsigned int y = 0 ; y < iHeight ; y++ )
+        {
+            const uint8_t* pRow = pRGB + y * iStride;
+            const uint8_t* pUp = y ? pRow - iStride : zero.data();
+            uint8_t* pOut = &Filtered[y * (iStride + 1)];
+
+            uint64_t iBestCost = UINT64_MAX;
+            for ( uint8_t iFilter = 0 ; iFilter <= 4 ; iFilter++ )
+            {
+                uint64_t iCost = 0;
+                for ( size_t x = 0 ; x < iStride ; x++ )
+                {
+                    const int a = (x >= 3) ? pRow[x - 3] : 0;
+                    const int b = pUp[x];
+                    const int c = (x >= 3) ? pUp[x - 3] : 0;
+                    uint8_t iPredicted = 0;
+                    switch ( iFilter )
+                    {
+                        case 1: iPredicted = (uint8_t)a; break;
+                        case 2: iPredicted = (uint8_t)b; break;
+                        case 3: iPredicted = (uint8_t)((a + b) / 2); break;
+                        case 4: iPredicted = Paeth( a, b, c ); break;
+                    }
+                    candidate[x] = (uint8_t)(pRow[x] - iPredicted);
+                    iCost += (uint64_t)abs( (int8_t)candidate[x] );
+                }
+                if ( iCost < iBestCost )
+                {
+                    iBestCost = iCost;
+                    pOut[0] = iFilter;
+                    memcpy( pOut + 1, candidate.data(), iStride );
+                }
+            }
+        }
+    }
+
+    //----------------------------------------------------------------------------------
+    // BT.601 limited range, in 8.8 fixed point
+    //----------------------------------------------------------------------------------
+    inline uint8_t ToY( int r, int g, int b ) { return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16); }
+    inline uint8_t ToU( int r, int g, int b ) { return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128); }
+    inline uint8_t ToV( int r, int g, int b ) { return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128); }
+}
+
+
+//--------------------------------------------------------------------------------------
+void FrameEncodePNG( const uint8_t* pRGB, unsigned int iWidth, unsigned int iHeight, std::vector<uint8_t>& PNG )
+{
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    std::vector<uint8_t> filtered;
+    FilterRows( pRGB, iWidth, iHeight, filtered );
+
+    // zlib stream: header without preset dictionary, deflate data, Adler-32
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    Deflate( filtered.data(), filtered.size(), zlib );
+    PutBigEndian( zlib, Adler32( filtered.data(), filtered.size() ) );
+
+    std::vector<uint8_t> header;
+    PutBigEndian( header, iWidth );
+    PutBigEndian( header, iHeight );
+    header.push_back( 8 );      // Bits per channel
+    header.push_back( 2 );      // RGB
+    header.push_back( 0 );      // Deflate
+    header.push_back( 0 );      // Adaptive filtering
+    header.push_back( 0 );      // Not interlaced
+
+    PNG.assign( SIGNATURE, SIGNATURE + 8 );
+    PutChunk( PNG, "IHDR", header.data(), header.size() );
+    PutChunk( PNG, "IDAT", zlib.data(), zlib.size() );
+    PutChunk( PNG, "IEND", nullptr, 0 );
+}
+
+
+//--------------------------------------------------------------------------------------
+FrameEncoderOptions FrameDefaultEncoderOptions()
+{
+    FrameEncoderOptions options;
+    options.eFormat = FRAME_FORMAT_PNG;
+    options.szPath = "frame";
+    options.iQueueFrames = 8;
+    options.iCompressThreads = 2;
+    options.iFrameRate = 30;
+    options.bBlockWhenFull = true;
+    return options;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::CFrameQueue::Push( Frame* pFrame )
+{
+    {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        m_Frames.push_back( pFrame );
+    }
+    m_CV.notify_one();
+}
+
+
+//--------------------------------------------------------------------------------------
+CFrameEncoder::Frame* CFrameEncoder::CFrameQueue::Pop()
+{
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_CV.wait( lock, [this] { return !m_Frames.empty() || m_bClosed; } );
+    if ( m_Frames.empty() )
+        return nullptr;
+    Frame* pFrame = m_Frames.front();
+    m_Frames.pop_front();
+    return pFrame;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::CFrameQueue::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        m_bClosed = true;
+    }
+    m_CV.notify_all();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::CFrameQueue::Reopen()
+{
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    m_Frames.clear();
+    m_bClosed = false;
+}
+
+
+//--------------------------------------------------------------------------------------
+CFrameEncoder::CFrameEncoder() :
+    m_Options( FrameDefaultEncoderOptions() ),
+    m_bOpen( false ),
+    m_pFile( nullptr ),
+    m_iVideoWidth( 0 ),
+    m_iVideoHeight( 0 ),
+    m_iNextIndex( 0 ),
+    m_iSubmitted( 0 ),
+    m_iWritten( 0 ),
+    m_iDropped( 0 ),
+    m_iBlocked( 0 ),
+    m_iBlockedUs( 0 ),
+    m_iBytesWritten( 0 ),
+    m_iErrors( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CFrameEncoder::Open( const FrameEncoderOptions& options )
+{
+    Close();
+    if ( !options.szPath )
+        return false;
+
+    m_Options = options;
+    m_Options.iQueueFrames = std::max( options.iQueueFrames, 1u );
+    m_Options.iCompressThreads = std::max( options.iCompressThreads, 1u );
+    m_Options.iFrameRate = std::max( options.iFrameRate, 1u );
+
+    if ( m_Options.eFormat != FRAME_FORMAT_PNG )
+    {
+        m_pFile = OpenFile( m_Options.szPath, "wb" );
+        if ( !m_pFile )
+            return false;
+    }
+
+    m_iVideoWidth = 0;
+    m_iVideoHeight = 0;
+    m_iNextIndex = 0;
+    m_iSubmitted = 0;
+    m_iWritten = 0;
+    m_iDropped = 0;
+    m_iBlocked = 0;
+    m_iBlockedUs = 0;
+    m_iBytesWritten = 0;
+    m_iErrors = 0;
+
+    m_Frames.clear();
+    m_Frames.resize( m_Options.iQueueFrames );
+    m_FreeFrames.clear();
+    for ( Frame& frame : m_Frames )
+        m_FreeFrames.push_back( &frame );
+
+    m_ConvertQueue.Reopen();
+    m_CompressQueue.Reopen();
+    m_WriteQueue.Reopen();
+    m_ConvertThread = std::thread( &CFrameEncoder::ConvertLoop, this );
+    for ( unsigned int i = 0 ; i < m_Options.iCompressThreads ; i++ )
+        m_CompressThreads.emplace_back( &CFrameEncoder::CompressLoop, this );
+    m_WriterThread = std::thread( &CFrameEncoder::WriterLoop, this );
+
+    m_bOpen = true;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CFrameEncoder::Submit( const void* pPixels, unsigned int iWidth, unsigned int iHeight, size_t iRowPitch, bool bBGRA )
+{
+    m_iSubmitted++;
+    if ( !m_bOpen || !pPixels || iWidth == 0 || iHeight == 0 )
+    {
+        m_iErrors++;
+        return false;
+    }
+
+    Frame* pFrame = nullptr;
+    {
+        std::unique_lock<std::mutex> lock( m_FreeMutex );
+
+        // A video has one frame size
+        if ( m_Options.eFormat != FRAME_FORMAT_PNG )
+        {
+            if ( m_iVideoWidth == 0 )
+            {
+                m_iVideoWidth = iWidth;
+                m_iVideoHeight = iHeight;
+            }
+            else if ( iWidth != m_iVideoWidth || iHeight != m_iVideoHeight )
+            {
+                m_iErrors++;
+                return false;
+            }
+        }
+
+        if ( m_FreeFrames.empty() )
+        {
+            if ( !m_Options.bBlockWhenFull )
+            {
+                m_iDropped++;
+                return false;
+            }
+            m_iBlocked++;
+            auto start = std::chrono::steady_clock::now();
+            m_FreeCV.wait( lock, [this] { return !m_FreeFrames.empty(); } );
+            m_iBlockedUs += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+        }
+
+        pFrame = m_FreeFrames.back();
+        m_FreeFrames.pop_back();
+        pFrame->iIndex = m_iNextIndex++;
+    }
+
+    pFrame->iWidth = iWidth;
+    pFrame->iHeight = iHeight;
+    pFrame->Pixels.resize( (size_t)iWidth * iHeight * 4 );
+    for ( unsigned int y = 0 ; y < iHeight ; y++ )
+    {
+        const uint8_t* pSource = (const uint8_t*)pPixels + y * iRowPitch;
+        uint8_t* pDest = &pFrame->Pixels[(size_t)y * iWidth * 4];
+        if ( !bBGRA )
+        {
+            memcpy( pDest, pSource, (size_t)iWidth * 4 );
+            continue;
+        }
+        for ( unsigned int x = 0 ; x < iWidth ; x++, pSource += 4, pDest += 4 )
+        {
+            pDest[0] = pSource[2];
+            pDest[1] = pSource[1];
+            pDest[2] = pSource[0];
+            pDest[3] = pSource[3];
+        }
+    }
+
+    m_ConvertQueue.Push( pFrame );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Each stage is closed once the one before it has finished, so every frame submitted
+// before Close is written
+//--------------------------------------------------------------------------------------
+bool CFrameEncoder::Close()
+{
+    if ( !m_bOpen )
+        return false;
+
+    m_ConvertQueue.Close();
+    m_ConvertThread.join();
+    m_CompressQueue.Close();
+    for ( std::thread& thread : m_CompressThreads )
+        thread.join();
+    m_CompressThreads.clear();
+    m_WriteQueue.Close();
+    m_WriterThread.join();
+
+    if ( m_pFile && fclose( m_pFile ) != 0 )
+        m_iErrors++;
+    m_pFile = nullptr;
+    m_bOpen = false;
+    return m_iErrors == 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+FrameEncoderReport CFrameEncoder::GetReport() const
+{
+    FrameEncoderReport report;
+    report.iSubmitted = m_iSubmitted;
+    report.iWritten = m_iWritten;
+    report.iDropped = m_iDropped;
+    report.iBlocked = m_iBlocked;
+    report.fBlockedMs = m_iBlockedUs / 1000.0;
+    report.iBytesWritten = m_iBytesWritten;
+    report.iErrors = m_iErrors;
+    return report;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::ConvertLoop()
+{
+    while ( Frame* pFrame = m_ConvertQueue.Pop() )
+    {
+        Convert( *pFrame );
+        m_CompressQueue.Push( pFrame );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::CompressLoop()
+{
+    while ( Frame* pFrame = m_CompressQueue.Pop() )
+    {
+        Compress( *pFrame );
+        m_WriteQueue.Push( pFrame );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Frames leave the compression threads in any order and are written in submission
+// order, then handed back to Submit
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::WriterLoop()
+{
+    std::map<uint64_t, Frame*> pending;
+    uint64_t iNext = 0;
+
+    while ( Frame* pFrame = m_WriteQueue.Pop() )
+    {
+        pending[pFrame->iIndex] = pFrame;
+        while ( !pending.empty() && pending.begin()->first == iNext )
+        {
+            Frame* pNext = pending.begin()->second;
+            pending.erase( pending.begin() );
+            if ( Write( *pNext ) )
+                m_iWritten++;
+            else
+                m_iErrors++;
+            iNext++;
+
+            {
+                std::lock_guard<std::mutex> lock( m_FreeMutex );
+                m_FreeFrames.push_back( pNext );
+            }
+            m_FreeCV.notify_one();
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// RGBA to planar YUV 4:2:0 for Y4M, chroma averaged over 2x2 pixels, or to packed RGB
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::Convert( Frame& frame ) const
+{
+    const unsigned int w = frame.iWidth, h = frame.iHeight;
+    const uint8_t* pPixels = frame.Pixels.data();
+
+    if ( m_Options.eFormat != FRAME_FORMAT_Y4M )
+    {
+        frame.Converted.resize( (size_t)w * h * 3 );
+        uint8_t* pOut = frame.Converted.data();
+        for ( size_t i = 0 ; i < (size_t)w * h ; i++, pOut += 3 )
+        {
+            pOut[0] = pPixels[i * 4 + 0];
+            pOut[1] = pPixels[i * 4 + 1];
+            pOut[2] = pPixels[i * 4 + 2];
+        }
+        return;
+    }
+
+    const unsigned int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    frame.Converted.resize( (size_t)w * h + 2 * (size_t)cw * ch );
+    uint8_t* pY = frame.Converted.data();
+    uint8_t* pU = pY + (size_t)w * h;
+    uint8_t* pV = pU + (size_t)cw * ch;
+
+    for ( size_t i = 0 ; i < (size_t)w * h ; i++ )
+        pY[i] = ToY( pPixels[i * 4 + 0], pPixels[i * 4 + 1], pPixels[i * 4 + 2] );
+
+    for ( unsigned int cy = 0 ; cy < ch ; cy++ )
+    {
+        for ( unsigned int cx = 0 ; cx < cw ; cx++ )
+        {
+            int r = 0, g = 0, b = 0;
+            for ( unsigned int dy = 0 ; dy < 2 ; dy++ )
+            {
+                for ( unsigned int dx = 0 ; dx < 2 ; dx++ )
+                {
+                    const unsigned int x = std::min( cx * 2 + dx, w - 1 ), y = std::min( cy * 2 + dy, h - 1 );
+                    const uint8_t* p = pPixels + ((size_t)y * w + x) * 4;
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                }
+            }
+            pU[(size_t)cy * cw + cx] = ToU( (r + 2) / 4, (g + 2) / 4, (b + 2) / 4 );
+            pV[(size_t)cy * cw + cx] = ToV( (r + 2) / 4, (g + 2) / 4, (b + 2) / 4 );
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CFrameEncoder::Compress( Frame& frame ) const
+{
+    if ( m_Options.eFormat == FRAME_FORMAT_PNG )
+        FrameEncodePNG( frame.Converted.data(), frame.iWidth, frame.iHeight, frame.Encoded );
+    else
+        frame.Encoded.swap( frame.Converted );
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CFrameEncoder::Write( Frame& frame )
+{
+    size_t iBytes = frame.Encoded.size();
+    bool bOk = true;
+
+    if ( m_Options.eFormat == FRAME_FORMAT_PNG )
+    {
+        char szPath[1024];
+        snprintf( szPath, sizeof( szPath ), "%s%05llu.png", m_Options.szPath, (unsigned long long)frame.iIndex );
+        FILE* pFile = OpenFile( szPath, "wb" );
+        if ( !pFile )
+            return false;
+        bOk = fwrite( frame.Encoded.data(), 1, iBytes, pFile ) == iBytes;
+        bOk = (fclose( pFile ) == 0) && bOk;
+    }
+    else
+    {
+        if ( m_Options.eFormat == FRAME_FORMAT_Y4M )
+        {
+            if ( frame.iIndex == 0 )
+            {
+                const int iHeader = fprintf( m_pFile, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", frame.iWidth, frame.iHeight,
+                                             m_Options.iFrameRate );
+                bOk = iHeader > 0;
+                iBytes += (size_t)std::max( iHeader, 0 );
+            }
+            bOk = (fputs( "FRAME\n", m_pFile ) >= 0) && bOk;
+            iBytes += 6;
+        }
+        bOk = (fwrite( frame.Encoded.data(), 1, frame.Encoded.size(), m_pFile ) == frame.Encoded.size()) && bOk;
+    }
+
+    if ( bOk )
+        m_iBytesWritten += iBytes;
+    return bOk;
+}
@@ -0,0 +1,143 @@
+//--------------------------------------------------------------------------------------
+// File: FrameEncoder.h
+//
+// Asynchronous output of rendered frames as a Y4M video, a raw RGB stream or a PNG
+// sequence. Submit copies a frame into one of a fixed number of frame buffers and
+// returns; the frame then goes through three stages on their own threads: colour
+// conversion (to YUV 4:2:0 or RGB), compression (PNG filtering and deflate, a copy for
+// the other formats) and a writer that puts the frames on disk in submission order.
+// The frame buffers bound the memory and the work in flight: when all of them are
+// taken Submit either waits for one or drops the frame, and both are counted.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum FrameFormat
+{
+    FRAME_FORMAT_Y4M,               // One file, 8 bit YUV 4:2:0 (BT.601, limited range)
+    FRAME_FORMAT_RAW,               // One file of RGB24 frames, e.g. ffmpeg -f rawvideo -pix_fmt rgb24
+    FRAME_FORMAT_PNG                // PATH00000.png, PATH00001.png, ...
+};
+
+struct FrameEncoderOptions
+{
+    FrameFormat eFormat;
+    const char* szPath;             // File of Y4M and RAW, file name prefix of PNG
+    unsigned int iQueueFrames;      // Frame buffers, the frames that can be in flight
+    unsigned int iCompressThreads;
+    unsigned int iFrameRate;        // Frames per second stored in the Y4M header
+    bool bBlockWhenFull;            // Submit waits for a free buffer instead of dropping
+};
+
+FrameEncoderOptions FrameDefaultEncoderOptions();
+
+struct FrameEncoderReport
+{
+    uint64_t iSubmitted;            // Frames given to Submit
+    uint64_t iWritten;
+    uint64_t iDropped;              // Every buffer was taken and bBlockWhenFull was off
+    uint64_t iBlocked;              // Submit had to wait for a buffer
+    double fBlockedMs;              // Total time Submit waited
+    uint64_t iBytesWritten;
+    uint64_t iErrors;               // Frames of the wrong size, failed writes
+};
+
+//--------------------------------------------------------------------------------------
+class CFrameEncoder
+{
+public:
+    CFrameEncoder();
+    ~CFrameEncoder() { Close(); }
+
+    CFrameEncoder( const CFrameEncoder& ) = delete;
+    CFrameEncoder& operator=( const CFrameEncoder& ) = delete;
+
+    // Opens the output and starts the stage threads
+    bool Open( const FrameEncoderOptions& options );
+    bool IsOpen() const { return m_bOpen; }
+
+    // 8 bit RGBA pixels, or BGRA, top row first, iRowPitch bytes apart. A video's frames
+    // all have the size of its first one. Returns false if the frame was dropped.
+    bool Submit( const void* pPixels, unsigned int iWidth, unsigned int iHeight, size_t iRowPitch, bool bBGRA = false );
+
+    // Writes the frames in flight, stops the threads and closes the output. True if no
+    // frame was lost to an error; frames dropped while the queue was full are not errors.
+    bool Close();
+
+    FrameEncoderReport GetReport() const;
+
+private:
+    struct Frame
+    {
+        uint64_t iIndex;
+        unsigned int iWidth;
+        unsigned int iHeight;
+        std::vector<uint8_t> Pixels;        // RGBA
+        std::vector<uint8_t> Converted;     // YUV or RGB
+        std::vector<uint8_t> Encoded;       // As written
+    };
+
+    // Frames waiting for a stage. Pop returns nullptr once the queue is closed and empty.
+    class CFrameQueue
+    {
+    public:
+        CFrameQueue() : m_bClosed( false ) {}
+        void Push( Frame* pFrame );
+        Frame* Pop();
+        void Close();
+        void Reopen();
+
+    private:
+        std::mutex                  m_Mutex;
+        std::condition_variable     m_CV;
+        std::deque<Frame*>          m_Frames;
+        bool                        m_bClosed;
+    };
+
+    void ConvertLoop();
+    void CompressLoop();
+    void WriterLoop();
+    void Convert( Frame& frame ) const;
+    void Compress( Frame& frame ) const;
+    bool Write( Frame& frame );
+
+    FrameEncoderOptions         m_Options;
+    bool                        m_bOpen;
+    FILE*                       m_pFile;            // Y4M and RAW
+    unsigned int                m_iVideoWidth;      // Size of the first frame
+    unsigned int                m_iVideoHeight;
+
+    std::vector<Frame>          m_Frames;
+    std::vector<Frame*>         m_FreeFrames;
+    std::mutex                  m_FreeMutex;
+    std::condition_variable     m_FreeCV;
+    uint64_t                    m_iNextIndex;       // Guarded by m_FreeMutex
+
+    CFrameQueue                 m_ConvertQueue;
+    CFrameQueue                 m_CompressQueue;
+    CFrameQueue                 m_WriteQueue;
+    std::thread                 m_ConvertThread;
+    std::vector<std::thread>    m_CompressThreads;
+    std::thread                 m_WriterThread;
+
+    std::atomic<uint64_t>       m_iSubmitted;
+    std::atomic<uint64_t>       m_iWritten;
+    std::atomic<uint64_t>       m_iDropped;
+    std::atomic<uint64_t>       m_iBlocked;
+    std::atomic<uint64_t>       m_iBlockedUs;
+    std::atomic<uint64_t>       m_iBytesWritten;
+    std::atomic<uint64_t>       m_iErrors;
+};
+
+// A complete PNG file of 8 bit RGB rows, iWidth * 3 bytes each, compressed with
+// adaptive row filters and fixed Huffman deflate
+void FrameEncodePNG( const uint8_t* pRGB, unsigned int iWidth, unsigned int iHeight, std::vector<uint8_t>& PNG );
@@ -0,0 +1,434 @@
+//--------------------------------------------------------------------------------------
+// File: GPUReadback.cpp
+//
+// Ring of staging resources fenced by event queries
+//--------------------------------------------------------------------------------------
+#include "GPUReadback.h"
+
+#include <algorithm>
+#include <chrono>
+
+#ifndef SAFE_RELEASE
+#define SAFE_RELEASE(p) { if (p) { (p)->Release(); (p) = nullptr; } }
+#endif
+
+
+//--------------------------------------------------------------------------------------
+GPUReadbackOptions GPUReadbackDefaultOptions()
+{
+    GPUReadbackOptions options;
+    options.iNumSlots = 3;
+    options.iLatencyFrames = 2;
+    options.bStallWhenFull = false;
+    return options;
+}
+
+
+//--------------------------------------------------------------------------------------
+CGPUReadbackRing::CGPUReadbackRing() :
+    m_pd3dDevice( nullptr ),
+    m_Options( GPUReadbackDefaultOptions() ),
+    m_iFrame( 0 ),
+    m_iNextSequence( 0 ),
+    m_bStop( false ),
+    m_iIssued( 0 ),
+    m_iCompleted( 0 ),
+    m_iDropped( 0 ),
+    m_iStalled( 0 ),
+    m_iStalledUs( 0 ),
+    m_iLate( 0 )
+{
+    for ( Slot& slot : m_Slots )
+    {
+        slot.pStaging = nullptr;
+        slot.eDimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+        slot.iWidth = 0;
+        slot.iHeight = 0;
+        slot.eFormat = DXGI_FORMAT_UNKNOWN;
+        slot.pFence = nullptr;
+        slot.Data = GPUReadbackData();
+        slot.iSequence = 0;
+        slot.iState = SLOT_FREE;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+HRESULT CGPUReadbackRing::Create( ID3D11Device* pd3dDevice, const GPUReadbackOptions& options )
+{
+    HRESULT hr;
+    Destroy();
+
+    m_Options = options;
+    m_Options.iNumSlots = std::min( std::max( options.iNumSlots, 1u ), MAX_SLOTS );
+    m_Options.iLatencyFrames = std::min( options.iLatencyFrames, m_Options.iNumSlots - 1 );
+
+    D3D11_QUERY_DESC fenceDesc = { D3D11_QUERY_EVENT, 0 };
+    for ( UINT i = 0 ; i < m_Options.iNumSlots ; i++ )
+    {
+        if ( FAILED( hr = pd3dDevice->CreateQuery( &fenceDesc, &m_Slots[i].pFence ) ) )
+        {
+            Destroy();
+            return hr;
+        }
+    }
+
+    m_pd3dDevice = pd3dDevice;
+    m_iFrame = 0;
+    m_bStop = false;
+    m_Worker = std::thread( &CGPUReadbackRing::WorkerLoop, this );
+    return S_OK;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Callbacks already with the worker still run. Copies left mapped are released mapped,
+// so Flush or Discard first when the context is still alive.
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::Destroy()
+{
+    if ( m_Worker.joinable() )
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_Mutex );
+            m_bStop = true;
+        }
+        m_CV.notify_all();
+        m_Worker.join();
+    }
+
+    for ( Slot& slot : m_Slots )
+    {
+        SAFE_RELEASE( slot.pStaging );
+        SAFE_RELEASE( slot.pFence );
+        slot.Func = nullptr;
+        slot.iState = SLOT_FREE;
+    }
+    m_Work.clear();
+    m_pd3dDevice = nullptr;
+}
+
+
+//--------------------------------------------------------------------------------------
+// A staging resource of the source's size and format in the slot
+//--------------------------------------------------------------------------------------
+bool CGPUReadbackRing::PrepareStaging( Slot& slot, ID3D11Resource* pSource, const D3D11_BOX* pBox )
+{
+    D3D11_RESOURCE_DIMENSION eDimension;
+    pSource->GetType( &eDimension );
+
+    if ( eDimension == D3D11_RESOURCE_DIMENSION_TEXTURE2D )
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        ((ID3D11Texture2D*)pSource)->GetDesc( &desc );
+        if ( desc.SampleDesc.Count != 1 )
+            return false;
+        if ( slot.pStaging && slot.eDimension == eDimension && slot.iWidth == desc.Width && slot.iHeight == desc.Height &&
+             slot.eFormat == desc.Format )
+            return true;
+
+        SAFE_RELEASE( slot.pStaging );
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        desc.MiscFlags = 0;
+        ID3D11Texture2D* pStaging = nullptr;
+        if ( FAILED( m_pd3dDevice->CreateTexture2D( &desc, nullptr, &pStaging ) ) )
+            return false;
+        slot.pStaging = pStaging;
+        slot.iWidth = desc.Width;
+        slot.iHeight = desc.Height;
+        slot.eFormat = desc.Format;
+    }
+    else if ( eDimension == D3D11_RESOURCE_DIMENSION_BUFFER )
+    {
+        D3D11_BUFFER_DESC desc;
+        ((ID3D11Buffer*)pSource)->GetDesc( &desc );
+        const UINT iWidth = pBox ? pBox->right - pBox->left : desc.ByteWidth;
+        if ( slot.pStaging && slot.eDimension == eDimension && slot.iWidth == iWidth )
+            return true;
+
+        SAFE_RELEASE( slot.pStaging );
+        D3D11_BUFFER_DESC stagingDesc = {};
+        stagingDesc.ByteWidth = iWidth;
+        stagingDesc.Usage = D3D11_USAGE_STAGING;
+        stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        ID3D11Buffer* pStaging = nullptr;
+        if ( FAILED( m_pd3dDevice->CreateBuffer( &stagingDesc, nullptr, &pStaging ) ) )
+            return false;
+        slot.pStaging = pStaging;
+        slot.iWidth = iWidth;
+        slot.iHeight = 1;
+        slot.eFormat = DXGI_FORMAT_UNKNOWN;
+    }
+    else
+    {
+        return false;
+    }
+
+    slot.eDimension = eDimension;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CGPUReadbackRing::Readback( ID3D11DeviceContext* pd3dImmediateContext, ID3D11Resource* pSource, const D3D11_BOX* pBox, GPUReadbackCallback Func )
+{
+    if ( !m_pd3dDevice )
+        return false;
+
+    Unmap( pd3dImmediateContext );
+
+    Slot* pSlot = nullptr;
+    for ( UINT i = 0 ; i < m_Options.iNumSlots && !pSlot ; i++ )
+    {
+        if ( m_Slots[i].iState == SLOT_FREE )
+            pSlot = &m_Slots[i];
+    }
+
+    if ( !pSlot )
+    {
+        if ( !m_Options.bStallWhenFull )
+        {
+            m_iDropped++;
+            return false;
+        }
+
+        // Finish the oldest copy, its callback included
+        const auto start = std::chrono::steady_clock::now();
+        pSlot = GetOldestCopy();
+        if ( pSlot->iState == SLOT_COPIED )
+        {
+            WaitForFence( pd3dImmediateContext, *pSlot );
+            if ( !TryMap( pd3dImmediateContext, *pSlot, true ) )
+            {
+                pSlot->Func = nullptr;
+                pSlot->iState = SLOT_FREE;
+                m_iDropped++;
+            }
+        }
+        WaitForWorker( *pSlot );
+        Unmap( pd3dImmediateContext );
+        m_iStalled++;
+        m_iStalledUs += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    if ( !PrepareStaging( *pSlot, pSource, pBox ) )
+    {
+        m_iDropped++;
+        return false;
+    }
+
+    pd3dImmediateContext->CopySubresourceRegion( pSlot->pStaging, 0, 0, 0, 0, pSource, 0, pBox );
+    pd3dImmediateContext->End( pSlot->pFence );
+
+    pSlot->Func = std::move( Func );
+    pSlot->Data = GPUReadbackData();
+    pSlot->Data.iWidth = pSlot->iWidth;
+    pSlot->Data.iHeight = pSlot->iHeight;
+    pSlot->Data.eFormat = pSlot->eFormat;
+    pSlot->Data.iFrame = m_iFrame;
+    pSlot->iSequence = m_iNextSequence++;
+    pSlot->iState = SLOT_COPIED;
+    m_iIssued++;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Maps every copy old enough and done, oldest first, and stops at the first one that is
+// not so the callbacks run in issue order
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::Update( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !m_pd3dDevice )
+        return;
+
+    m_iFrame++;
+    Unmap( pd3dImmediateContext );
+
+    Slot* Copies[MAX_SLOTS];
+    UINT iNumCopies = 0;
+    for ( UINT i = 0 ; i < m_Options.iNumSlots ; i++ )
+    {
+        if ( m_Slots[i].iState == SLOT_COPIED )
+            Copies[iNumCopies++] = &m_Slots[i];
+    }
+    std::sort( Copies, Copies + iNumCopies, []( const Slot* a, const Slot* b ) { return a->iSequence < b->iSequence; } );
+
+    for ( UINT i = 0 ; i < iNumCopies ; i++ )
+    {
+        Slot& slot = *Copies[i];
+        if ( m_iFrame - slot.Data.iFrame < m_Options.iLatencyFrames )
+            break;
+        if ( pd3dImmediateContext->GetData( slot.pFence, nullptr, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH ) != S_OK ||
+             !TryMap( pd3dImmediateContext, slot, false ) )
+        {
+            m_iLate++;
+            break;
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::Flush( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    while ( Slot* pSlot = GetOldestCopy() )
+    {
+        if ( pSlot->iState == SLOT_COPIED )
+        {
+            if ( pd3dImmediateContext->GetData( pSlot->pFence, nullptr, 0, 0 ) != S_OK )
+            {
+                const auto start = std::chrono::steady_clock::now();
+                WaitForFence( pd3dImmediateContext, *pSlot );
+                m_iStalled++;
+                m_iStalledUs += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+            }
+            if ( !TryMap( pd3dImmediateContext, *pSlot, true ) )
+            {
+                pSlot->Func = nullptr;
+                pSlot->iState = SLOT_FREE;
+                m_iDropped++;
+                continue;
+            }
+        }
+        WaitForWorker( *pSlot );
+        Unmap( pd3dImmediateContext );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::Discard( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    for ( UINT i = 0 ; i < m_Options.iNumSlots ; i++ )
+    {
+        Slot& slot = m_Slots[i];
+        if ( slot.iState == SLOT_COPIED )
+        {
+            slot.Func = nullptr;
+            slot.iState = SLOT_FREE;
+            m_iDropped++;
+        }
+        else if ( slot.iState == SLOT_MAPPED )
+        {
+            WaitForWorker( slot );
+        }
+    }
+    Unmap( pd3dImmediateContext );
+}
+
+
+//--------------------------------------------------------------------------------------
+GPUReadbackReport CGPUReadbackRing::GetReport() const
+{
+    GPUReadbackReport report;
+    report.iIssued = m_iIssued;
+    report.iCompleted = m_iCompleted;
+    report.iDropped = m_iDropped;
+    report.iStalled = m_iStalled;
+    report.fStalledMs = m_iStalledUs / 1000.0;
+    report.iLate = m_iLate;
+    return report;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Maps a copy and gives it to the worker, false if the copy is not ready and bWait is
+// off, or the Map failed
+//--------------------------------------------------------------------------------------
+bool CGPUReadbackRing::TryMap( ID3D11DeviceContext* pd3dImmediateContext, Slot& slot, bool bWait )
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if ( FAILED( pd3dImmediateContext->Map( slot.pStaging, 0, D3D11_MAP_READ, bWait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped ) ) )
+        return false;
+
+    slot.Data.pData = mapped.pData;
+    slot.Data.iRowPitch = mapped.RowPitch;
+    {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        slot.iState = SLOT_MAPPED;
+        m_Work.push_back( &slot );
+    }
+    m_CV.notify_one();
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::WaitForFence( ID3D11DeviceContext* pd3dImmediateContext, Slot& slot )
+{
+    while ( pd3dImmediateContext->GetData( slot.pFence, nullptr, 0, 0 ) == S_FALSE )
+        std::this_thread::yield();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::WaitForWorker( Slot& slot )
+{
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_DoneCV.wait( lock, [&]() { return slot.iState != SLOT_MAPPED; } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Returns the slots whose callback has run to the ring
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::Unmap( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    for ( UINT i = 0 ; i < m_Options.iNumSlots ; i++ )
+    {
+        Slot& slot = m_Slots[i];
+        if ( slot.iState == SLOT_DONE )
+        {
+            pd3dImmediateContext->Unmap( slot.pStaging, 0 );
+            slot.Func = nullptr;
+            slot.iState = SLOT_FREE;
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// The copy in flight issued first, nullptr if none
+//--------------------------------------------------------------------------------------
+CGPUReadbackRing::Slot* CGPUReadbackRing::GetOldestCopy()
+{
+    Slot* pOldest = nullptr;
+    for ( UINT i = 0 ; i < m_Options.iNumSlots ; i++ )
+    {
+        Slot& slot = m_Slots[i];
+        const int iState = slot.iState;
+        if ( (iState == SLOT_COPIED || iState == SLOT_MAPPED) && (!pOldest || slot.iSequence < pOldest->iSequence) )
+            pOldest = &slot;
+    }
+    return pOldest;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUReadbackRing::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    for ( ;; )
+    {
+        m_CV.wait( lock, [&]() { return m_bStop || !m_Work.empty(); } );
+        if ( m_Work.empty() )
+            return;
+
+        Slot* pSlot = m_Work.front();
+        m_Work.pop_front();
+        lock.unlock();
+
+        if ( pSlot->Func )
+            pSlot->Func( pSlot->Data );
+
+        lock.lock();
+        pSlot->iState = SLOT_DONE;
+        m_iCompleted++;
+        m_DoneCV.notify_all();
+    }
+}
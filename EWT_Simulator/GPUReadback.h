@@ -0,0 +1,143 @@
+//--------------------------------------------------------------------------------------
+// File: GPUReadback.h
+//
+// Asynchronous copies of GPU resources to the CPU. Readback copies a texture or a range
+// of a buffer into one of a ring of staging resources and ends an event query behind
+// the copy. Update, once a frame, maps the copies whose query has signalled once they
+// are iLatencyFrames old, so the Map never waits for the GPU, and hands the mapped data
+// to a worker thread that runs the readback's callback. The copy is unmapped and its
+// slot reused at a later Update once the callback returned.
+//
+// More slots and latency mean fewer stalls and older data. When every slot is taken,
+// Readback either waits for the oldest copy (bStallWhenFull) or drops the new one; both
+// are counted. Every call but the callbacks is made on the thread owning the context.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <d3d11.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct GPUReadbackOptions
+{
+    UINT iNumSlots;                 // Copies in flight
+    UINT iLatencyFrames;            // Updates before a copy is mapped, below iNumSlots
+    bool bStallWhenFull;            // Readback waits for a slot instead of dropping
+};
+
+GPUReadbackOptions GPUReadbackDefaultOptions();
+
+// The mapped copy handed to a callback, valid until the callback returns
+struct GPUReadbackData
+{
+    const void* pData;
+    UINT iRowPitch;                 // Textures
+    UINT iWidth;                    // Texels of a texture, bytes of a buffer
+    UINT iHeight;
+    DXGI_FORMAT eFormat;            // DXGI_FORMAT_UNKNOWN for buffers
+    uint64_t iFrame;                // Update count when the readback was issued
+};
+
+typedef std::function< void( const GPUReadbackData& data ) > GPUReadbackCallback;
+
+struct GPUReadbackReport
+{
+    uint64_t iIssued;
+    uint64_t iCompleted;            // Callbacks run
+    uint64_t iDropped;              // Every slot was taken and bStallWhenFull was off
+    uint64_t iStalled;              // Readback or Flush waited for the GPU
+    double fStalledMs;
+    uint64_t iLate;                 // Updates that found an old enough copy unfinished
+};
+
+//--------------------------------------------------------------------------------------
+class CGPUReadbackRing
+{
+public:
+    static const UINT MAX_SLOTS = 16;
+
+    CGPUReadbackRing();
+    ~CGPUReadbackRing() { Destroy(); }
+
+    CGPUReadbackRing( const CGPUReadbackRing& ) = delete;
+    CGPUReadbackRing& operator=( const CGPUReadbackRing& ) = delete;
+
+    HRESULT Create( ID3D11Device* pd3dDevice, const GPUReadbackOptions& options );
+    void Destroy();
+    bool IsCreated() const { return m_pd3dDevice != nullptr; }
+
+    // Copies subresource 0 of a texture, or the whole buffer or the byte range of pBox of
+    // a buffer, and calls Func on the worker once the copy arrived. Staging resources are
+    // created on demand and replaced when the source's size or format changes. Returns
+    // false if the readback was dropped.
+    bool Readback( ID3D11DeviceContext* pd3dImmediateContext, ID3D11Resource* pSource, const D3D11_BOX* pBox, GPUReadbackCallback Func );
+
+    // Once a frame
+    void Update( ID3D11DeviceContext* pd3dImmediateContext );
+
+    // Waits for every copy in flight and its callback
+    void Flush( ID3D11DeviceContext* pd3dImmediateContext );
+
+    // Drops the copies in flight without running their callbacks, e.g. before the
+    // resources their callbacks write to go away
+    void Discard( ID3D11DeviceContext* pd3dImmediateContext );
+
+    GPUReadbackReport GetReport() const;
+
+private:
+    enum SlotState
+    {
+        SLOT_FREE,
+        SLOT_COPIED,                // Copy and query issued
+        SLOT_MAPPED,                // With the worker
+        SLOT_DONE                   // Callback returned, to be unmapped
+    };
+
+    struct Slot
+    {
+        ID3D11Resource* pStaging;
+        D3D11_RESOURCE_DIMENSION eDimension;
+        UINT iWidth;
+        UINT iHeight;
+        DXGI_FORMAT eFormat;
+        ID3D11Query* pFence;
+        GPUReadbackCallback Func;
+        GPUReadbackData Data;
+        uint64_t iSequence;         // Issue order
+        std::atomic<int> iState;
+    };
+
+    bool PrepareStaging( Slot& slot, ID3D11Resource* pSource, const D3D11_BOX* pBox );
+    bool TryMap( ID3D11DeviceContext* pd3dImmediateContext, Slot& slot, bool bWait );
+    void WaitForFence( ID3D11DeviceContext* pd3dImmediateContext, Slot& slot );
+    void WaitForWorker( Slot& slot );
+    void Unmap( ID3D11DeviceContext* pd3dImmediateContext );
+    Slot* GetOldestCopy();
+    void WorkerLoop();
+
+    ID3D11Device*               m_pd3dDevice;
+    GPUReadbackOptions          m_Options;
+    Slot                        m_Slots[MAX_SLOTS];
+    uint64_t                    m_iFrame;
+    uint64_t                    m_iNextSequence;
+
+    std::thread                 m_Worker;
+    std::mutex                  m_Mutex;
+    std::condition_variable     m_CV;           // Work for the worker
+    std::condition_variable     m_DoneCV;       // A callback returned
+    std::deque<Slot*>           m_Work;
+    bool                        m_bStop;
+
+    std::atomic<uint64_t>       m_iIssued;
+    std::atomic<uint64_t>       m_iCompleted;
+    std::atomic<uint64_t>       m_iDropped;
+    std::atomic<uint64_t>       m_iStalled;
+    std::atomic<uint64_t>       m_iStalledUs;
+    std::atomic<uint64_t>       m_iLate;
+};
@@ -0,0 +1,175 @@
+//--------------------------------------------------------------------------------------
+// File: GPUStageTimer.cpp
+//
+// D3D11 timestamp queries feeding the stage profiler
+//--------------------------------------------------------------------------------------
+#include "GPUStageTimer.h"
+#include "StageProfiler.h"
+
+#include <cstring>
+
+#ifndef SAFE_RELEASE
+#define SAFE_RELEASE(p) { if (p) { (p)->Release(); (p) = nullptr; } }
+#endif
+
+
+//--------------------------------------------------------------------------------------
+CGPUStageTimer::CGPUStageTimer() :
+    m_iCurrent( 0 ),
+    m_iDepth( 0 ),
+    m_bInFrame( false )
+{
+    memset( m_Frames, 0, sizeof( m_Frames ) );
+}
+
+
+//--------------------------------------------------------------------------------------
+HRESULT CGPUStageTimer::Create( ID3D11Device* pd3dDevice )
+{
+    HRESULT hr;
+
+    D3D11_QUERY_DESC disjointDesc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0 };
+    D3D11_QUERY_DESC timestampDesc = { D3D11_QUERY_TIMESTAMP, 0 };
+
+    for ( Frame& frame : m_Frames )
+    {
+        if ( FAILED( hr = pd3dDevice->CreateQuery( &disjointDesc, &frame.pDisjoint ) ) )
+            return hr;
+        if ( FAILED( hr = pd3dDevice->CreateQuery( &timestampDesc, &frame.pFrameStart ) ) )
+            return hr;
+        for ( Stage& stage : frame.Stages )
+        {
+            if ( FAILED( hr = pd3dDevice->CreateQuery( &timestampDesc, &stage.pBegin ) ) )
+                return hr;
+            if ( FAILED( hr = pd3dDevice->CreateQuery( &timestampDesc, &stage.pEnd ) ) )
+                return hr;
+        }
+        frame.iNumStages = 0;
+        frame.bPending = false;
+    }
+
+    m_iCurrent = 0;
+    m_iDepth = 0;
+    m_bInFrame = false;
+    return S_OK;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::Destroy()
+{
+    for ( Frame& frame : m_Frames )
+    {
+        SAFE_RELEASE( frame.pDisjoint );
+        SAFE_RELEASE( frame.pFrameStart );
+        for ( Stage& stage : frame.Stages )
+        {
+            SAFE_RELEASE( stage.pBegin );
+            SAFE_RELEASE( stage.pEnd );
+        }
+        frame.bPending = false;
+    }
+    m_bInFrame = false;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Reads a finished frame into the profiler. A frame still not done after FRAME_LATENCY
+// frames, or whose clock was disjoint, is dropped rather than waited for.
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::Resolve( ID3D11DeviceContext* pd3dImmediateContext, Frame& frame )
+{
+    frame.bPending = false;
+
+    D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+    if ( pd3dImmediateContext->GetData( frame.pDisjoint, &disjoint, sizeof( disjoint ), D3D11_ASYNC_GETDATA_DONOTFLUSH ) != S_OK )
+        return;
+    if ( disjoint.Disjoint || disjoint.Frequency == 0 )
+        return;
+
+    UINT64 iFrameStart;
+    if ( pd3dImmediateContext->GetData( frame.pFrameStart, &iFrameStart, sizeof( iFrameStart ), D3D11_ASYNC_GETDATA_DONOTFLUSH ) != S_OK )
+        return;
+
+    const double fUsPerTick = 1e6 / (double)disjoint.Frequency;
+    CStageProfiler& profiler = GetStageProfiler();
+    for ( UINT s = 0 ; s < frame.iNumStages ; s++ )
+    {
+        const Stage& stage = frame.Stages[s];
+        UINT64 iBegin, iEnd;
+        if ( pd3dImmediateContext->GetData( stage.pBegin, &iBegin, sizeof( iBegin ), D3D11_ASYNC_GETDATA_DONOTFLUSH ) != S_OK ||
+             pd3dImmediateContext->GetData( stage.pEnd, &iEnd, sizeof( iEnd ), D3D11_ASYNC_GETDATA_DONOTFLUSH ) != S_OK )
+            continue;
+
+        profiler.Record( stage.szName, STAGE_TRACK_GPU,
+                         frame.fCpuStartUs + (double)(iBegin - iFrameStart) * fUsPerTick,
+                         (double)(iEnd - iBegin) * fUsPerTick, frame.iFrame );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::BeginFrame( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    m_bInFrame = false;
+    if ( !GetStageProfiler().IsEnabled() || !m_Frames[0].pDisjoint )
+        return;
+
+    m_iCurrent = (m_iCurrent + 1) % FRAME_LATENCY;
+    Frame& frame = m_Frames[m_iCurrent];
+    if ( frame.bPending )
+        Resolve( pd3dImmediateContext, frame );
+
+    frame.iNumStages = 0;
+    frame.fCpuStartUs = GetStageProfiler().Now();
+    frame.iFrame = GetStageProfiler().GetFrame();
+    pd3dImmediateContext->Begin( frame.pDisjoint );
+    pd3dImmediateContext->End( frame.pFrameStart );
+
+    m_iDepth = 0;
+    m_bInFrame = true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::EndFrame( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !m_bInFrame )
+        return;
+
+    Frame& frame = m_Frames[m_iCurrent];
+    pd3dImmediateContext->End( frame.pDisjoint );
+    frame.bPending = true;
+    m_bInFrame = false;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::Begin( ID3D11DeviceContext* pd3dImmediateContext, const char* szName )
+{
+    if ( !m_bInFrame || m_iDepth == MAX_DEPTH )
+        return;
+
+    Frame& frame = m_Frames[m_iCurrent];
+    UINT iStage = UINT_MAX;
+    if ( frame.iNumStages < MAX_STAGES )
+    {
+        iStage = frame.iNumStages++;
+        Stage& stage = frame.Stages[iStage];
+        strncpy_s( stage.szName, szName, _TRUNCATE );
+        pd3dImmediateContext->End( stage.pBegin );
+    }
+    m_Stack[m_iDepth++] = iStage;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CGPUStageTimer::End( ID3D11DeviceContext* pd3dImmediateContext )
+{
+    if ( !m_bInFrame || m_iDepth == 0 )
+        return;
+
+    const UINT iStage = m_Stack[--m_iDepth];
+    if ( iStage != UINT_MAX )
+        pd3dImmediateContext->End( m_Frames[m_iCurrent].Stages[iStage].pEnd );
+}
@@ -0,0 +1,63 @@
+//--------------------------------------------------------------------------------------
+// File: GPUStageTimer.h
+//
+// GPU side of the stage profiler. Begin / End pairs around the dispatches of a stage
+// issue D3D11 timestamp queries inside a per frame disjoint query. The results are
+// read FRAME_LATENCY frames later, without waiting on the GPU, and recorded on the GPU
+// track of GetStageProfiler(). The GPU clock is placed on the CPU timeline at the time
+// the frame began, so GPU stages show up in the Chrome trace shortly after the CPU
+// work that issued them.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <d3d11.h>
+#include <cstdint>
+
+//--------------------------------------------------------------------------------------
+class CGPUStageTimer
+{
+public:
+    static const UINT MAX_STAGES = 64;         // Per frame, later ones are not timed
+    static const UINT MAX_DEPTH = 8;           // Nesting of Begin / End
+    static const UINT FRAME_LATENCY = 4;       // Frames in flight before a frame is read
+
+    CGPUStageTimer();
+    ~CGPUStageTimer() { Destroy(); }
+
+    HRESULT Create( ID3D11Device* pd3dDevice );
+    void Destroy();
+
+    // Bracket everything a frame submits. Does nothing while the profiler is disabled.
+    void BeginFrame( ID3D11DeviceContext* pd3dImmediateContext );
+    void EndFrame( ID3D11DeviceContext* pd3dImmediateContext );
+
+    void Begin( ID3D11DeviceContext* pd3dImmediateContext, const char* szName );
+    void End( ID3D11DeviceContext* pd3dImmediateContext );
+
+private:
+    struct Stage
+    {
+        char szName[32];
+        ID3D11Query* pBegin;
+        ID3D11Query* pEnd;
+    };
+
+    struct Frame
+    {
+        ID3D11Query* pDisjoint;
+        ID3D11Query* pFrameStart;
+        Stage Stages[MAX_STAGES];
+        UINT iNumStages;
+        double fCpuStartUs;
+        uint64_t iFrame;
+        bool bPending;
+    };
+
+    void Resolve( ID3D11DeviceContext* pd3dImmediateContext, Frame& frame );
+
+    Frame           m_Frames[FRAME_LATENCY];
+    UINT            m_iCurrent;
+    UINT            m_Stack[MAX_DEPTH];
+    UINT            m_iDepth;
+    bool            m_bInFrame;
+};
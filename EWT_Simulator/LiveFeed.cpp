@@ -0,0 +1,358 @@
+//--------------------------------------------------------------------------------------
+// File: LiveFeed.cpp
+//
+// Shared memory ring of particle frames guarded by per slot seqlocks
+//--------------------------------------------------------------------------------------
+#include "LiveFeed.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2, "The live feed needs address-free 64 bit atomics" );
+
+namespace
+{
+    const uint32_t FEED_MAGIC = 0x46545745; // 'EWTF'
+    const uint32_t FEED_VERSION = 1;
+    const size_t ALIGNMENT = 64;
+    const unsigned int MAX_READ_ATTEMPTS = 16;
+
+    size_t AlignUp( size_t iValue )
+    {
+        return (iValue + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    //----------------------------------------------------------------------------------
+    // Segment layout
+    //   FeedHeader
+    //   Slot[iNumSlots], each SlotHeader + iCapacity particles + iCapacity densities
+    // Frame n lives in slot n % iNumSlots.
+    //----------------------------------------------------------------------------------
+    struct FeedHeader
+    {
+        uint32_t iMagic;
+        uint32_t iVersion;
+        uint32_t iNumSlots;
+        uint32_t iCapacity;
+        uint64_t iSlotStride;
+        uint64_t iSlotsOffset;
+        uint64_t iDensitiesOffset;              // In a slot
+        alignas(64) std::atomic<uint64_t> iNumFrames;
+        std::atomic<uint32_t> bClosed;
+    };
+
+    struct SlotHeader
+    {
+        std::atomic<uint64_t> iSequence;        // Odd while the publisher writes the slot
+        uint64_t iFrame;
+        uint64_t iStep;
+        double fTime;
+        uint32_t iNumParticles;
+        uint32_t bDensities;
+    };
+}
+
+
+//--------------------------------------------------------------------------------------
+CLiveFeedPublisher::CLiveFeedPublisher() :
+    m_pBase( nullptr ),
+    m_iSize( 0 ),
+    m_iNextFrame( 0 )
+{
+    m_szName[0] = '\0';
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedPublisher::Create( const char* szName, unsigned int iNumSlots, unsigned int iCapacity )
+{
+    Close();
+    if ( iNumSlots == 0 || strlen( szName ) >= sizeof( m_szName ) )
+        return false;
+
+    const size_t iDensitiesOffset = AlignUp( sizeof( SlotHeader ) ) + AlignUp( (size_t)iCapacity * sizeof( FluidParticle ) );
+    const size_t iSlotStride = iDensitiesOffset + AlignUp( (size_t)iCapacity * sizeof( float ) );
+    const size_t iSlotsOffset = AlignUp( sizeof( FeedHeader ) );
+    const size_t iSize = iSlotsOffset + iNumSlots * iSlotStride;
+
+    // A segment left behind by a publisher that died
+    shm_unlink( szName );
+
+    // Readable by other users' analysis tools, written by the publisher only
+    int fd = shm_open( szName, O_CREAT | O_EXCL | O_RDWR, 0644 );
+    if ( fd < 0 )
+    {
+        perror( "shm_open" );
+        return false;
+    }
+    if ( ftruncate( fd, (off_t)iSize ) != 0 )
+    {
+        perror( "ftruncate" );
+        close( fd );
+        shm_unlink( szName );
+        return false;
+    }
+    void* pData = mmap( nullptr, iSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( pData == MAP_FAILED )
+    {
+        perror( "mmap" );
+        shm_unlink( szName );
+        return false;
+    }
+
+    // The segment starts zeroed: every slot's sequence is even and its frame is 0 with
+    // no particles, which readers tell from frame 0 by the frame count
+    m_pBase = (uint8_t*)pData;
+    m_iSize = iSize;
+    m_iNextFrame = 0;
+    strcpy( m_szName, szName );
+
+    FeedHeader* pHeader = new (m_pBase) FeedHeader;
+    pHeader->iMagic = FEED_MAGIC;
+    pHeader->iVersion = FEED_VERSION;
+    pHeader->iNumSlots = iNumSlots;
+    pHeader->iCapacity = iCapacity;
+    pHeader->iSlotStride = iSlotStride;
+    pHeader->iSlotsOffset = iSlotsOffset;
+    pHeader->iDensitiesOffset = iDensitiesOffset;
+    pHeader->bClosed.store( 0 );
+    for ( unsigned int i = 0 ; i < iNumSlots ; i++ )
+        new (m_pBase + iSlotsOffset + i * iSlotStride) SlotHeader;
+    pHeader->iNumFrames.store( 0, std::memory_order_release );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedPublisher::Publish( uint64_t iStep, double fTime, const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities )
+{
+    if ( !m_pBase )
+        return false;
+
+    FeedHeader* pHeader = (FeedHeader*)m_pBase;
+    if ( Particles.size() > pHeader->iCapacity )
+        return false;
+
+    const uint64_t iFrame = m_iNextFrame++;
+    uint8_t* pSlotBase = m_pBase + pHeader->iSlotsOffset + (iFrame % pHeader->iNumSlots) * pHeader->iSlotStride;
+    SlotHeader* pSlot = (SlotHeader*)pSlotBase;
+    const bool bDensities = !Densities.empty() && Densities.size() >= Particles.size();
+
+    // Odd while writing; the fence keeps the writes below after the odd store
+    const uint64_t iSequence = pSlot->iSequence.load( std::memory_order_relaxed );
+    pSlot->iSequence.store( iSequence + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    pSlot->iFrame = iFrame;
+    pSlot->iStep = iStep;
+    pSlot->fTime = fTime;
+    pSlot->iNumParticles = (uint32_t)Particles.size();
+    pSlot->bDensities = bDensities;
+    memcpy( pSlotBase + AlignUp( sizeof( SlotHeader ) ), Particles.data(), Particles.size() * sizeof( FluidParticle ) );
+    if ( bDensities )
+        memcpy( pSlotBase + pHeader->iDensitiesOffset, Densities.data(), Particles.size() * sizeof( float ) );
+
+    pSlot->iSequence.store( iSequence + 2, std::memory_order_release );
+    pHeader->iNumFrames.store( iFrame + 1, std::memory_order_release );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CLiveFeedPublisher::Close()
+{
+    if ( !m_pBase )
+        return;
+
+    ((FeedHeader*)m_pBase)->bClosed.store( 1, std::memory_order_release );
+    munmap( m_pBase, m_iSize );
+    shm_unlink( m_szName );
+    m_pBase = nullptr;
+    m_iSize = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+CLiveFeedReader::CLiveFeedReader() :
+    m_pBase( nullptr ),
+    m_iSize( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::Open( const char* szName )
+{
+    Close();
+
+    // A feed that does not exist yet is not an error, subscribers poll for it
+    int fd = shm_open( szName, O_RDONLY, 0 );
+    if ( fd < 0 )
+    {
+        if ( errno != ENOENT )
+            perror( "shm_open" );
+        return false;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( FeedHeader ) )
+    {
+        close( fd );
+        return false;
+    }
+    void* pData = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( pData == MAP_FAILED )
+    {
+        perror( "mmap" );
+        return false;
+    }
+
+    m_pBase = (const uint8_t*)pData;
+    m_iSize = (size_t)st.st_size;
+
+    const FeedHeader* pHeader = (const FeedHeader*)m_pBase;
+    if ( pHeader->iMagic != FEED_MAGIC || pHeader->iVersion != FEED_VERSION ||
+         pHeader->iSlotsOffset + pHeader->iNumSlots * pHeader->iSlotStride > m_iSize )
+    {
+        fprintf( stderr, "%s is not a live feed segment\n", szName );
+        Close();
+        return false;
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CLiveFeedReader::Close()
+{
+    if ( m_pBase )
+        munmap( (void*)m_pBase, m_iSize );
+    m_pBase = nullptr;
+    m_iSize = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+unsigned int CLiveFeedReader::GetNumSlots() const
+{
+    return m_pBase ? ((const FeedHeader*)m_pBase)->iNumSlots : 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+unsigned int CLiveFeedReader::GetCapacity() const
+{
+    return m_pBase ? ((const FeedHeader*)m_pBase)->iCapacity : 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+uint64_t CLiveFeedReader::GetNumFrames() const
+{
+    return m_pBase ? ((const FeedHeader*)m_pBase)->iNumFrames.load( std::memory_order_acquire ) : 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::IsClosed() const
+{
+    return !m_pBase || ((const FeedHeader*)m_pBase)->bClosed.load( std::memory_order_acquire ) != 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+const uint8_t* CLiveFeedReader::GetSlot( uint64_t iFrame ) const
+{
+    const FeedHeader* pHeader = (const FeedHeader*)m_pBase;
+    return (m_pBase + pHeader->iSlotsOffset + (iFrame % pHeader->iNumSlots) * pHeader->iSlotStride);
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::BeginRead( uint64_t iFrame, LiveFrameView& view ) const
+{
+    if ( !m_pBase || iFrame >= GetNumFrames() )
+        return false;
+
+    const FeedHeader* pHeader = (const FeedHeader*)m_pBase;
+    const SlotHeader* pSlot = (const SlotHeader*)GetSlot( iFrame );
+    const uint64_t iSequence = pSlot->iSequence.load( std::memory_order_acquire );
+    if ( iSequence & 1 )
+        return false;
+
+    view.iFrame = pSlot->iFrame;
+    view.iStep = pSlot->iStep;
+    view.fTime = pSlot->fTime;
+    view.iNumParticles = std::min<uint32_t>( pSlot->iNumParticles, pHeader->iCapacity );
+    view.pParticles = (const FluidParticle*)((const uint8_t*)pSlot + AlignUp( sizeof( SlotHeader ) ));
+    view.pDensities = pSlot->bDensities ? (const float*)((const uint8_t*)pSlot + pHeader->iDensitiesOffset) : nullptr;
+    view.iSequence = iSequence;
+
+    // An older or newer frame in the slot
+    return view.iFrame == iFrame && EndRead( view );
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::EndRead( const LiveFrameView& view ) const
+{
+    // The fence keeps the reads of the frame before the second load of the sequence
+    std::atomic_thread_fence( std::memory_order_acquire );
+    return ((const SlotHeader*)GetSlot( view.iFrame ))->iSequence.load( std::memory_order_relaxed ) == view.iSequence;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::ReadFrame( uint64_t iFrame, LiveFrame& frame ) const
+{
+    for ( unsigned int iAttempt = 0 ; iAttempt < MAX_READ_ATTEMPTS ; iAttempt++ )
+    {
+        LiveFrameView view;
+        if ( !BeginRead( iFrame, view ) )
+        {
+            // Gone for good once a newer frame took the slot
+            if ( !m_pBase || iFrame >= GetNumFrames() || GetNumFrames() - iFrame > GetNumSlots() )
+                return false;
+            continue;
+        }
+
+        frame.iFrame = view.iFrame;
+        frame.iStep = view.iStep;
+        frame.fTime = view.fTime;
+        frame.Particles.assign( view.pParticles, view.pParticles + view.iNumParticles );
+        if ( view.pDensities )
+            frame.Densities.assign( view.pDensities, view.pDensities + view.iNumParticles );
+        else
+            frame.Densities.clear();
+
+        if ( EndRead( view ) )
+            return true;
+    }
+    return false;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CLiveFeedReader::ReadLatest( LiveFrame& frame ) const
+{
+    for ( unsigned int iAttempt = 0 ; iAttempt < MAX_READ_ATTEMPTS ; iAttempt++ )
+    {
+        const uint64_t iNumFrames = GetNumFrames();
+        if ( iNumFrames == 0 )
+            return false;
+        if ( ReadFrame( iNumFrames - 1, frame ) )
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,119 @@
+//--------------------------------------------------------------------------------------
+// File: LiveFeed.h
+//
+// Live particle frames for analysis processes on the same machine, through a POSIX
+// shared memory ring. The publisher writes every completed frame into the next of
+// iNumSlots slots; any number of readers map the segment read only and read the
+// latest frame, or any of the last iNumSlots, in place. There are no sockets or copies
+// and the publisher never waits for a reader.
+//
+// Every slot is guarded by a seqlock: the publisher makes the slot's sequence odd while
+// it writes and even again after, and a reader checks the sequence is even and
+// unchanged around its read. A reader slower than the publisher sees its frame
+// overwritten and simply moves on to a newer one.
+//
+// POSIX only, it is not part of the Windows project.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A frame in the segment. The pointers are only meaningful until EndRead says whether
+// the frame survived the read.
+struct LiveFrameView
+{
+    uint64_t iFrame;                // 0 for the first frame published
+    uint64_t iStep;
+    double fTime;                   // Simulated seconds
+    unsigned int iNumParticles;
+    const FluidParticle* pParticles;
+    const float* pDensities;        // nullptr when the frame has none
+    uint64_t iSequence;             // Seqlock value at BeginRead
+};
+
+// A frame copied out of the segment
+struct LiveFrame
+{
+    uint64_t iFrame;
+    uint64_t iStep;
+    double fTime;
+    std::vector<FluidParticle> Particles;
+    std::vector<float> Densities;
+};
+
+//--------------------------------------------------------------------------------------
+class CLiveFeedPublisher
+{
+public:
+    CLiveFeedPublisher();
+    ~CLiveFeedPublisher() { Close(); }
+
+    CLiveFeedPublisher( const CLiveFeedPublisher& ) = delete;
+    CLiveFeedPublisher& operator=( const CLiveFeedPublisher& ) = delete;
+
+    // Creates the segment, replacing a stale one of the same name. Frames of more than
+    // iCapacity particles are not published.
+    bool Create( const char* szName, unsigned int iNumSlots, unsigned int iCapacity );
+    bool IsOpen() const { return m_pBase != nullptr; }
+
+    // Densities may be empty
+    bool Publish( uint64_t iStep, double fTime, const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities );
+
+    // Tells the readers no more frames are coming and removes the name; readers keep
+    // their mapping
+    void Close();
+
+    uint64_t GetNumPublished() const { return m_iNextFrame; }
+
+private:
+    uint8_t*        m_pBase;
+    size_t          m_iSize;
+    uint64_t        m_iNextFrame;
+    char            m_szName[256];
+};
+
+//--------------------------------------------------------------------------------------
+class CLiveFeedReader
+{
+public:
+    CLiveFeedReader();
+    ~CLiveFeedReader() { Close(); }
+
+    CLiveFeedReader( const CLiveFeedReader& ) = delete;
+    CLiveFeedReader& operator=( const CLiveFeedReader& ) = delete;
+
+    // Fails quietly while the publisher has not created the feed
+    bool Open( const char* szName );
+    void Close();
+    bool IsOpen() const { return m_pBase != nullptr; }
+
+    unsigned int GetNumSlots() const;
+    unsigned int GetCapacity() const;
+
+    // Frames published so far; the frames still in the ring are
+    // [max( GetNumFrames(), GetNumSlots() ) - GetNumSlots(), GetNumFrames())
+    uint64_t GetNumFrames() const;
+
+    // The publisher closed the feed
+    bool IsClosed() const;
+
+    // Zero copy read of a frame still in the ring: BeginRead fails if the frame is not
+    // there or being overwritten, EndRead fails if it was overwritten since BeginRead,
+    // in which case whatever was read from the view must be thrown away
+    bool BeginRead( uint64_t iFrame, LiveFrameView& view ) const;
+    bool EndRead( const LiveFrameView& view ) const;
+
+    // Copies of a frame, or of the latest frame, retried while the publisher overtakes
+    bool ReadFrame( uint64_t iFrame, LiveFrame& frame ) const;
+    bool ReadLatest( LiveFrame& frame ) const;
+
+private:
+    const uint8_t* GetSlot( uint64_t iFrame ) const;
+
+    const uint8_t*      m_pBase;
+    size_t              m_iSize;
+};
@@ -0,0 +1,146 @@
+//--------------------------------------------------------------------------------------
+// File: LiveFeedSubscriber.cpp
+//
+// Example reader of the shared memory live feed (LiveFeed.h), e.g. of SplatRender
+// --feed. Reads frames in place, without copying them, and prints the mean density and
+// kinetic energy of each. By default it samples the latest frame whenever there is a
+// new one; with --all it follows every frame and counts those overwritten before it
+// got to them. Any number of subscribers can run at once, and they can start before
+// or after the publisher.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread LiveFeedSubscriber.cpp LiveFeed.cpp -lrt
+//
+// Usage: LiveFeedSubscriber NAME [--all] [--frames N] [--wait S]
+//   --all        every frame in order instead of the latest
+//   --frames     stop after N frames, 0 (the default) reads until the feed closes
+//   --wait       seconds to wait for the feed to appear, 10 by default
+//--------------------------------------------------------------------------------------
+#include "LiveFeed.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+namespace
+{
+    struct FrameSummary
+    {
+        double fMeanDensity;        // 0 without densities
+        double fKineticEnergy;      // Per unit mass
+    };
+
+    // Reads the frame in place; false if it was overwritten meanwhile
+    bool Summarize( const CLiveFeedReader& reader, uint64_t iFrame, LiveFrameView& view, FrameSummary& summary )
+    {
+        if ( !reader.BeginRead( iFrame, view ) )
+            return false;
+
+        double fDensity = 0, fEnergy = 0;
+        for ( unsigned int i = 0 ; i < view.iNumParticles ; i++ )
+        {
+            const FluidFloat2& v = view.pParticles[i].vVelocity;
+            fEnergy += 0.5 * ((double)v.x * v.x + (double)v.y * v.y);
+            if ( view.pDensities )
+                fDensity += view.pDensities[i];
+        }
+        summary.fMeanDensity = view.iNumParticles ? fDensity / view.iNumParticles : 0.0;
+        summary.fKineticEnergy = fEnergy;
+        return reader.EndRead( view );
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    const char* szName = nullptr;
+    bool bAll = false;
+    unsigned int iMaxFrames = 0;
+    double fWaitSeconds = 10.0;
+    bool bUsage = false;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--all" ) )
+            bAll = true;
+        else if ( !strcmp( argv[i], "--frames" ) && bHasValue )
+            iMaxFrames = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--wait" ) && bHasValue )
+            fWaitSeconds = atof( argv[++i] );
+        else if ( argv[i][0] != '-' && !szName )
+            szName = argv[i];
+        else
+            bUsage = true;
+    }
+
+    if ( bUsage || !szName )
+    {
+        fprintf( stderr, "Usage: %s NAME [--all] [--frames N] [--wait S]\n", argv[0] );
+        return 2;
+    }
+
+    // The publisher may not have created the feed yet
+    CLiveFeedReader reader;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>( fWaitSeconds );
+    while ( !reader.Open( szName ) && std::chrono::steady_clock::now() < deadline )
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    if ( !reader.IsOpen() )
+    {
+        fprintf( stderr, "cannot open the live feed %s\n", szName );
+        return 1;
+    }
+
+    printf( "%s: %u slots of %u particles\n\n", szName, reader.GetNumSlots(), reader.GetCapacity() );
+    printf( "%8s %8s %10s %10s %12s %14s\n", "frame", "step", "time", "particles", "density", "kinetic" );
+
+    uint64_t iNext = 0, iNumRead = 0, iNumMissed = 0, iNumTorn = 0;
+    for ( ; ; )
+    {
+        // Checked before the frame count so the last frames are read after the close
+        const bool bClosed = reader.IsClosed();
+        const uint64_t iNumFrames = reader.GetNumFrames();
+
+        if ( iNext < iNumFrames )
+        {
+            // Skip to the latest frame, or to the oldest one still in the ring
+            uint64_t iFrame = iNumFrames - 1;
+            if ( bAll )
+            {
+                const uint64_t iOldest = iNumFrames > reader.GetNumSlots() ? iNumFrames - reader.GetNumSlots() : 0;
+                iFrame = std::max( iNext, iOldest );
+                iNumMissed += iFrame - iNext;
+            }
+
+            LiveFrameView view;
+            FrameSummary summary;
+            if ( Summarize( reader, iFrame, view, summary ) )
+            {
+                printf( "%8llu %8llu %10.4f %10u %12.3f %14.6g\n", (unsigned long long)view.iFrame, (unsigned long long)view.iStep,
+                        view.fTime, view.iNumParticles, summary.fMeanDensity, summary.fKineticEnergy );
+                iNumRead++;
+            }
+            else
+            {
+                // Overwritten while being read; --all counts it as missed on the next pass
+                if ( bAll )
+                    continue;
+                iNumTorn++;
+            }
+            iNext = iFrame + 1;
+
+            if ( iMaxFrames && iNumRead >= iMaxFrames )
+                break;
+            continue;
+        }
+
+        if ( bClosed )
+            break;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+
+    printf( "\n%llu frames read, %llu missed, %llu overwritten while read\n", (unsigned long long)iNumRead,
+            (unsigned long long)iNumMissed, (unsigned long long)iNumTorn );
+    return 0;
+}
@@ -0,0 +1,206 @@
+//--------------------------------------------------------------------------------------
+// File: ParityCheck.cpp
+//
+// Verification of the CPU simulator against a snapshot (FluidParity.h): steps the
+// snapshot's start state as many steps as its reference took and compares every
+// particle's position and velocity within ULP / relative / absolute bounds. Snapshots
+// come from the viewer's GPU path (Parity Snapshot button) or are golden CPU runs
+// written by --write-golden, which lets CI catch a kernel change without a GPU.
+// Exits with 1 when a variant is outside the tolerance.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread ParityCheck.cpp FluidParity.cpp FluidCPU.cpp CoarseGrain.cpp
+//       BoundarySDF.cpp ParticleMesh.cpp FFT.cpp BarnesHut.cpp StageProfiler.cpp
+//       PerfCounters.cpp ThreadPool.cpp
+// -ffast-math must not be used, golden runs are compared bit for bit by default.
+//
+// Usage: ParityCheck --write-golden PATH [--particles P] [--steps S]
+//        ParityCheck --check PATH [--variants LIST] [--threads T]
+//                    [--ulps U] [--relative R] [--absolute A]
+//   --variants   comma separated grid, lists, packed, double, compensated; grid only
+//                by default
+//   --ulps, --relative, --absolute
+//                a component passes if any bound holds. 0 ulps and no relative or
+//                absolute bound by default, right for golden CPU snapshots; GPU
+//                snapshots need e.g. --relative 1e-3 --absolute 1e-6
+//--------------------------------------------------------------------------------------
+#include "FluidParity.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+namespace
+{
+    // The lattice with a gentle swirl, so the collision and spring terms all take part
+    std::vector<FluidParticle> CreateGoldenParticles( unsigned int iNumParticles, const FluidParameters& params )
+    {
+        std::vector<FluidParticle> particles = FluidCreateLattice( iNumParticles, params.fInitialParticleSpacing );
+        for ( FluidParticle& p : particles )
+        {
+            const float dx = p.vPosition.x - p.vCenter.x;
+            const float dy = p.vPosition.y - p.vCenter.y;
+            p.vVelocity = { -dy * 0.5f, dx * 0.5f };
+        }
+        return particles;
+    }
+
+    template <class TReal, class TSum>
+    std::vector<FluidParticle> Run( TFluidSimulatorCPU<TReal, TSum>& simulator, const FluidSnapshot& snapshot )
+    {
+        simulator.SetParticles( FluidConvertParticles<TReal>( snapshot.Initial ) );
+        for ( unsigned int i = 0 ; i < snapshot.iSteps ; i++ )
+            simulator.Step( snapshot.Parameters );
+        return FluidConvertParticles<float>( simulator.GetParticles() );
+    }
+
+    bool RunVariant( const std::string& Variant, const FluidSnapshot& snapshot, std::vector<FluidParticle>& Result )
+    {
+        if ( Variant == "double" )
+        {
+            CFluidSimulatorCPUDouble simulator;
+            Result = Run( simulator, snapshot );
+        }
+        else if ( Variant == "compensated" )
+        {
+            CFluidSimulatorCPUCompensated simulator;
+            Result = Run( simulator, snapshot );
+        }
+        else if ( Variant == "grid" || Variant == "lists" || Variant == "packed" )
+        {
+            CFluidSimulatorCPU simulator;
+            simulator.SetNeighbourLists( Variant == "lists" );
+            simulator.SetCompressedStorage( Variant == "packed" );
+            Result = Run( simulator, snapshot );
+        }
+        else
+            return false;
+        return true;
+    }
+
+    std::vector<std::string> SplitList( const char* szList )
+    {
+        std::vector<std::string> items;
+        std::string item;
+        for ( const char* p = szList ; ; p++ )
+        {
+            if ( *p == ',' || *p == 0 )
+            {
+                if ( !item.empty() )
+                    items.push_back( item );
+                item.clear();
+                if ( *p == 0 )
+                    break;
+            }
+            else
+                item += *p;
+        }
+        return items;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    const char* szGoldenPath = nullptr;
+    const char* szCheckPath = nullptr;
+    unsigned int iNumParticles = 16384;
+    unsigned int iNumSteps = 50;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    std::vector<std::string> variants = { "grid" };
+    FluidParityTolerance tolerance = { 0, 0.0f, 0.0f };
+    bool bUsage = false;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--write-golden" ) && bHasValue )
+            szGoldenPath = argv[++i];
+        else if ( !strcmp( argv[i], "--check" ) && bHasValue )
+            szCheckPath = argv[++i];
+        else if ( !strcmp( argv[i], "--particles" ) && bHasValue )
+            iNumParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--steps" ) && bHasValue )
+            iNumSteps = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--variants" ) && bHasValue )
+            variants = SplitList( argv[++i] );
+        else if ( !strcmp( argv[i], "--ulps" ) && bHasValue )
+            tolerance.iMaxUlps = (uint32_t)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--relative" ) && bHasValue )
+            tolerance.fRelative = (float)atof( argv[++i] );
+        else if ( !strcmp( argv[i], "--absolute" ) && bHasValue )
+            tolerance.fAbsolute = (float)atof( argv[++i] );
+        else
+            bUsage = true;
+    }
+
+    if ( bUsage || !szGoldenPath == !szCheckPath )
+    {
+        fprintf( stderr, "Usage: %s --write-golden PATH [--particles P] [--steps S]\n"
+                         "       %s --check PATH [--variants LIST] [--threads T] [--ulps U] [--relative R] [--absolute A]\n",
+                 argv[0], argv[0] );
+        return 2;
+    }
+
+    SetThreadPoolSize( iNumThreads );
+
+    if ( szGoldenPath )
+    {
+        FluidSnapshot snapshot;
+        snapshot.Parameters = FluidDefaultParameters();
+        snapshot.iSteps = iNumSteps;
+        snapshot.Source = "cpu grid";
+        snapshot.Initial = CreateGoldenParticles( iNumParticles, snapshot.Parameters );
+        RunVariant( "grid", snapshot, snapshot.Final );
+
+        if ( !FluidWriteSnapshot( szGoldenPath, snapshot ) )
+        {
+            fprintf( stderr, "cannot write %s\n", szGoldenPath );
+            return 2;
+        }
+        printf( "%s: %u particles, %u steps of the CPU grid path\n", szGoldenPath, iNumParticles, iNumSteps );
+        return 0;
+    }
+
+    FluidSnapshot snapshot;
+    if ( !FluidReadSnapshot( szCheckPath, snapshot ) )
+    {
+        fprintf( stderr, "cannot read snapshot %s\n", szCheckPath );
+        return 2;
+    }
+
+    printf( "%s: %zu particles, %u steps of %s, %u threads\n", szCheckPath, snapshot.Initial.size(), snapshot.iSteps,
+            snapshot.Source.c_str(), iNumThreads );
+    printf( "tolerance %u ulps, relative %g, absolute %g\n\n", tolerance.iMaxUlps, tolerance.fRelative, tolerance.fAbsolute );
+    printf( "%-12s %9s %8s %8s %12s %12s %12s  %s\n", "variant", "compared", "missing", "failed", "max ulps", "max rel", "max abs", "result" );
+
+    bool bAllPassed = true;
+    for ( const std::string& variant : variants )
+    {
+        std::vector<FluidParticle> result;
+        if ( !RunVariant( variant, snapshot, result ) )
+        {
+            fprintf( stderr, "unknown variant %s\n", variant.c_str() );
+            return 2;
+        }
+
+        const FluidParityReport report = FluidCompareParticles( snapshot.Final, result, tolerance );
+        const bool bPassed = report.iFailed == 0 && report.iMissing == 0 && result.size() == snapshot.Final.size();
+        bAllPassed = bAllPassed && bPassed;
+
+        printf( "%-12s %9zu %8zu %8zu %12llu %12.3e %12.3e  %s", variant.c_str(), report.iCompared, report.iMissing,
+                report.iFailed, (unsigned long long)report.iMaxUlps, report.fMaxRelative, report.fMaxAbsolute,
+                bPassed ? "pass" : "FAIL" );
+        if ( !bPassed && report.iCompared )
+            printf( ", worst at rest position (%g, %g)", report.vWorstRestPosition.x, report.vWorstRestPosition.y );
+        printf( "\n" );
+    }
+
+    return bAllPassed ? 0 : 1;
+}
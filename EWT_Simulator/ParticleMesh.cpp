@@ -0,0 +1,275 @@
+//--------------------------------------------------------------------------------------
+// File: ParticleMesh.cpp
+//
+// Particle-mesh long-range solver
+//--------------------------------------------------------------------------------------
+#include "ParticleMesh.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+    const float PI = 3.14159265f;
+
+    int Wrap( int i, int iSize )
+    {
+        i %= iSize;
+        return (i < 0) ? i + iSize : i;
+    }
+
+    // Signed wavenumber of FFT bin i
+    float Wavenumber( size_t i, size_t iSize, float fLength )
+    {
+        const float fBin = (i < iSize / 2) ? (float)i : (float)i - (float)iSize;
+        return 2.0f * PI * fBin / fLength;
+    }
+
+    // Fourier transform of the assignment kernel along one axis, sinc( k h / 2 )^order
+    float AssignmentWindow( float k, float fCellSize, PMAssignment eAssignment )
+    {
+        const float x = 0.5f * k * fCellSize;
+        const float fSinc = (x != 0) ? sinf( x ) / x : 1.0f;
+        return (eAssignment == PM_ASSIGN_CIC) ? fSinc * fSinc : fSinc * fSinc * fSinc;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CParticleMesh::CParticleMesh() :
+    m_Params(),
+    m_vCentroid{ 0, 0 },
+    m_fBackground( 0 ),
+    m_fShortRangeRadius( 0 ),
+    m_fShortRangeCoupling( 0 ),
+    m_fShortRangeDecay( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+// Size the meshes and precompute the Green's function of the screened Poisson equation
+// and the short range it filters out. In 2D a Gaussian of variance 2 rs^2 holds the
+// fraction 1 - exp( -r^2 / 4 rs^2 ) of its mass within r, so that is the part of
+// C m / (2 pi r) the mesh carries. The deposit and the gather each smooth the field by
+// the assignment kernel, so the Green's function divides their window out; the filter
+// is small long before the window is.
+//--------------------------------------------------------------------------------------
+void CParticleMesh::Init( const PMParameters& params )
+{
+    assert( IsPowerOfTwo( params.iMeshSize ) );
+    m_Params = params;
+
+    const size_t N = params.iMeshSize;
+    const float fLength = params.fCellSize * (float)N;
+    const float fScreeningSq = params.fScreening * params.fScreening;
+    const float fSplit = params.fSplitRadius * params.fCellSize;
+
+    m_FFT.Init( N, N );
+    m_Density.assign( N * N, 0.0f );
+    m_Spectrum.resize( N * N );
+    m_GradientX.resize( N * N );
+    m_GradientY.resize( N * N );
+    m_AccelerationX.assign( N * N, 0.0f );
+    m_AccelerationY.assign( N * N, 0.0f );
+
+    m_fShortRangeRadius = 2.0f * fSplit * sqrtf( logf( 1.0f / PM_SHORT_RANGE_TOLERANCE ) );
+    m_fShortRangeCoupling = params.fCoupling * params.fParticleMass / (2.0f * PI);
+    m_fShortRangeDecay = 1.0f / (4.0f * fSplit * fSplit);
+
+    m_Green.resize( N * N );
+    for ( size_t y = 0 ; y < N ; y++ )
+    {
+        const float ky = Wavenumber( y, N, fLength );
+        for ( size_t x = 0 ; x < N ; x++ )
+        {
+            const float kx = Wavenumber( x, N, fLength );
+            const float k_sq = kx * kx + ky * ky;
+            const float fWindow = AssignmentWindow( kx, params.fCellSize, params.eAssignment ) *
+                                  AssignmentWindow( ky, params.fCellSize, params.eAssignment );
+            const float fDenominator = (k_sq + fScreeningSq) * fWindow * fWindow;
+
+            // The mean density has no gradient; dropping it keeps the periodic problem solvable
+            m_Green[y * N + x] = (fDenominator > 0 && (x | y)) ? -params.fCoupling * expf( -k_sq * fSplit * fSplit ) / fDenominator : 0.0f;
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Cells and weights a position is spread over. Cell i covers
+// [origin + i * h, origin + (i + 1) * h) with its centre at origin + (i + 0.5) * h.
+//--------------------------------------------------------------------------------------
+void CParticleMesh::GetStencil( const FluidFloat2& position, Stencil& stencil ) const
+{
+    const int N = (int)m_Params.iMeshSize;
+    const float fInvCellSize = 1.0f / m_Params.fCellSize;
+    const float u[2] = { (position.x - m_Params.fOriginX) * fInvCellSize - 0.5f,
+                         (position.y - m_Params.fOriginY) * fInvCellSize - 0.5f };
+
+    for ( int a = 0 ; a < 2 ; a++ )
+    {
+        int* pIndex = a ? stencil.iY : stencil.iX;
+        float* pWeight = a ? stencil.fWeightY : stencil.fWeightX;
+
+        if ( m_Params.eAssignment == PM_ASSIGN_CIC )
+        {
+            const float fFloor = floorf( u[a] );
+            const float f = u[a] - fFloor;
+            pIndex[0] = Wrap( (int)fFloor, N );
+            pIndex[1] = Wrap( (int)fFloor + 1, N );
+            pWeight[0] = 1.0f - f;
+            pWeight[1] = f;
+        }
+        else
+        {
+            const float fNearest = floorf( u[a] + 0.5f );
+            const float d = u[a] - fNearest;
+            pIndex[0] = Wrap( (int)fNearest - 1, N );
+            pIndex[1] = Wrap( (int)fNearest, N );
+            pIndex[2] = Wrap( (int)fNearest + 1, N );
+            pWeight[0] = 0.5f * (0.5f - d) * (0.5f - d);
+            pWeight[1] = 0.75f - d * d;
+            pWeight[2] = 0.5f * (0.5f + d) * (0.5f + d);
+        }
+    }
+
+    stencil.iCount = (m_Params.eAssignment == PM_ASSIGN_CIC) ? 2 : 3;
+}
+
+
+//--------------------------------------------------------------------------------------
+// One step of the solver
+//--------------------------------------------------------------------------------------
+void CParticleMesh::Solve( const FluidParticle* pParticles, size_t iNumParticles )
+{
+    const size_t N = m_Params.iMeshSize;
+    const size_t iNumCells = N * N;
+    const float fMassPerArea = m_Params.fParticleMass / (m_Params.fCellSize * m_Params.fCellSize);
+    const float fLength = m_Params.fCellSize * (float)N;
+    CThreadPool& pool = GetThreadPool();
+
+    // Deposit
+    // Every chunk deposits into its own mesh, then the meshes are summed cell by cell
+    const size_t iNumChunks = std::max<size_t>( 1, std::min<size_t>( pool.GetNumThreads(), iNumParticles / 1024 ) );
+    const size_t iChunkSize = (iNumParticles + iNumChunks - 1) / iNumChunks;
+    m_DepositScratch.assign( iNumChunks * iNumCells, 0.0f );
+    m_CentroidScratch.assign( iNumChunks * 2, 0.0 );
+
+    pool.ParallelFor( iNumChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t c = iBegin ; c < iEnd ; c++ )
+        {
+            float* pMesh = &m_DepositScratch[c * iNumCells];
+            const size_t iLast = std::min( (c + 1) * iChunkSize, iNumParticles );
+            double fSumX = 0, fSumY = 0;
+            for ( size_t i = c * iChunkSize ; i < iLast ; i++ )
+            {
+                fSumX += pParticles[i].vPosition.x;
+                fSumY += pParticles[i].vPosition.y;
+
+                Stencil stencil;
+                GetStencil( pParticles[i].vPosition, stencil );
+                for ( int sy = 0 ; sy < stencil.iCount ; sy++ )
+                {
+                    float* pRow = pMesh + stencil.iY[sy] * N;
+                    const float fWeightY = stencil.fWeightY[sy] * fMassPerArea;
+                    for ( int sx = 0 ; sx < stencil.iCount ; sx++ )
+                        pRow[stencil.iX[sx]] += stencil.fWeightX[sx] * fWeightY;
+                }
+            }
+            m_CentroidScratch[c * 2] = fSumX;
+            m_CentroidScratch[c * 2 + 1] = fSumY;
+        }
+    } );
+
+    // The dropped mean is a background of density -N m / L^2. Near the granules its
+    // field, with that of their images, is C N m (position - centroid) / 2 L^2; with
+    // screening the mean mode carries no gradient and there is nothing to remove.
+    double fCentroidX = 0, fCentroidY = 0;
+    for ( size_t c = 0 ; c < iNumChunks ; c++ )
+    {
+        fCentroidX += m_CentroidScratch[c * 2];
+        fCentroidY += m_CentroidScratch[c * 2 + 1];
+    }
+    const double fInvNumParticles = iNumParticles ? 1.0 / (double)iNumParticles : 0.0;
+    m_vCentroid = { (float)(fCentroidX * fInvNumParticles), (float)(fCentroidY * fInvNumParticles) };
+    m_fBackground = (m_Params.bIsolated && m_Params.fScreening == 0) ?
+        m_Params.fCoupling * m_Params.fParticleMass * (float)iNumParticles / (2.0f * fLength * fLength) : 0.0f;
+
+    pool.ParallelFor( iNumCells, 4096, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            float fDensity = 0;
+            for ( size_t c = 0 ; c < iNumChunks ; c++ )
+                fDensity += m_DepositScratch[c * iNumCells + i];
+            m_Density[i] = fDensity;
+            m_Spectrum[i] = FFTComplex( fDensity, 0.0f );
+        }
+    } );
+
+    // Solve
+    // phi_k = G(k) rho_k, a_k = -i k phi_k
+    m_FFT.Forward( m_Spectrum.data() );
+
+    pool.ParallelFor( N, 8, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t y = iBegin ; y < iEnd ; y++ )
+        {
+            // The Nyquist bin has no sign, so its derivative is dropped
+            const float ky = (y == N / 2) ? 0.0f : Wavenumber( y, N, fLength );
+            for ( size_t x = 0 ; x < N ; x++ )
+            {
+                const float kx = (x == N / 2) ? 0.0f : Wavenumber( x, N, fLength );
+                const size_t i = y * N + x;
+                const FFTComplex phi = m_Spectrum[i] * m_Green[i];
+                const FFTComplex minusI( 0.0f, -1.0f );
+                m_GradientX[i] = minusI * kx * phi;
+                m_GradientY[i] = minusI * ky * phi;
+            }
+        }
+    } );
+
+    m_FFT.Inverse( m_GradientX.data() );
+    m_FFT.Inverse( m_GradientY.data() );
+
+    pool.ParallelFor( iNumCells, 4096, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            m_AccelerationX[i] = m_GradientX[i].real();
+            m_AccelerationY[i] = m_GradientY[i].real();
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Gather with the deposit kernel, less the background field of an isolated domain
+//--------------------------------------------------------------------------------------
+FluidFloat2 CParticleMesh::Interpolate( const FluidFloat2& position ) const
+{
+    const size_t N = m_Params.iMeshSize;
+
+    Stencil stencil;
+    GetStencil( position, stencil );
+
+    FluidFloat2 acceleration = { 0, 0 };
+    for ( int sy = 0 ; sy < stencil.iCount ; sy++ )
+    {
+        const size_t iRow = stencil.iY[sy] * N;
+        for ( int sx = 0 ; sx < stencil.iCount ; sx++ )
+        {
+            const float w = stencil.fWeightX[sx] * stencil.fWeightY[sy];
+            acceleration.x += w * m_AccelerationX[iRow + stencil.iX[sx]];
+            acceleration.y += w * m_AccelerationY[iRow + stencil.iX[sx]];
+        }
+    }
+
+    acceleration.x -= m_fBackground * (position.x - m_vCentroid.x);
+    acceleration.y -= m_fBackground * (position.y - m_vCentroid.y);
+    return acceleration;
+}
@@ -0,0 +1,274 @@
+//--------------------------------------------------------------------------------------
+// File: ParticleMeshCheck.cpp
+//
+// Accuracy of the particle-mesh field against the direct sum C m / (2 pi r). First the
+// force of one granule on another by distance in mesh cells, for the mesh alone and
+// with the short range the CPU force pass adds; then a full CPU step over granules that
+// fill the middle of the mesh, with the springs off so the step's acceleration is the
+// field alone, timed against the same step without the mesh.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread ParticleMeshCheck.cpp FluidCPU.cpp CoarseGrain.cpp BoundarySDF.cpp
+//       ParticleMesh.cpp FFT.cpp BarnesHut.cpp StageProfiler.cpp PerfCounters.cpp ThreadPool.cpp
+//
+// Usage: ParticleMeshCheck [--mesh M] [--width W] [--split RS] [--tsc] [--periodic]
+//                          [--granules N] [--samples S] [--threads T] [--repeat R]
+//   --mesh       cells per side
+//   --width      mesh width over the width of the granules' square, 2 by default
+//   --split      rs in mesh cells
+//   --periodic   keep the background of the dropped mean (bIsolated off)
+//   --samples    granules checked against the direct sum
+//   --repeat     step R times, the fastest run is reported
+//--------------------------------------------------------------------------------------
+#include "FluidCPU.h"
+#include "ParticleMesh.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+
+namespace
+{
+    const double PI = 3.14159265358979;
+
+    // Granules fill [0.5, 1.5)^2, in the middle of the mesh
+    const float DOMAIN_MIN = 0.5f;
+    const float DOMAIN_CENTRE = 1.0f;
+
+    double ElapsedMs( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    FluidParticle MakeGranule( float x, float y )
+    {
+        FluidParticle P;
+        P.vPosition = { x, y };
+        P.vVelocity = { 0, 0 };
+        P.vIndex = P.vPosition;
+        P.vCenter = P.vPosition;
+        return P;
+    }
+
+    // Acceleration of a granule at position from one of mass m at source, unsplit
+    void AddDirect( const FluidFloat2& position, const FluidFloat2& source, double fCouplingMass, double& ax, double& ay )
+    {
+        const double dx = (double)source.x - position.x;
+        const double dy = (double)source.y - position.y;
+        const double r_sq = dx * dx + dy * dy;
+        if ( r_sq > 0 )
+        {
+            ax += fCouplingMass * dx / (2.0 * PI * r_sq);
+            ay += fCouplingMass * dy / (2.0 * PI * r_sq);
+        }
+    }
+
+    // Mesh plus short range on a granule at position from one at source, as ForcePass sums them
+    FluidFloat2 EvaluateSplit( const CParticleMesh& mesh, const FluidFloat2& position, const FluidFloat2& source, bool bShortRange )
+    {
+        FluidFloat2 a = mesh.Interpolate( position );
+        const float dx = source.x - position.x;
+        const float dy = source.y - position.y;
+        const float r_sq = dx * dx + dy * dy;
+        const float fRadius = mesh.GetShortRangeRadius();
+        if ( bShortRange && r_sq > 0 && r_sq < fRadius * fRadius )
+        {
+            const float f = mesh.ShortRangeFactor( r_sq );
+            a.x += f * dx;
+            a.y += f * dy;
+        }
+        return a;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    unsigned int iMeshSize = 256;
+    float fMeshWidth = 2.0f;
+    float fSplitRadius = 1.25f;
+    PMAssignment eAssignment = PM_ASSIGN_CIC;
+    bool bIsolated = true;
+    size_t iNumGranules = 16384;
+    size_t iNumSamples = 512;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    int iRepeat = 3;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--mesh" ) && bHasValue )
+            iMeshSize = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--width" ) && bHasValue )
+            fMeshWidth = (float)atof( argv[++i] );
+        else if ( !strcmp( argv[i], "--split" ) && bHasValue )
+            fSplitRadius = (float)atof( argv[++i] );
+        else if ( !strcmp( argv[i], "--tsc" ) )
+            eAssignment = PM_ASSIGN_TSC;
+        else if ( !strcmp( argv[i], "--periodic" ) )
+            bIsolated = false;
+        else if ( !strcmp( argv[i], "--granules" ) && bHasValue )
+            iNumGranules = (size_t)atol( argv[++i] );
+        else if ( !strcmp( argv[i], "--samples" ) && bHasValue )
+            iNumSamples = (size_t)atol( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--repeat" ) && bHasValue )
+            iRepeat = atoi( argv[++i] );
+        else
+        {
+            fprintf( stderr, "Usage: %s [--mesh M] [--width W] [--split RS] [--tsc] [--periodic] [--granules N] [--samples S] [--threads T] [--repeat R]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( !IsPowerOfTwo( iMeshSize ) || fMeshWidth < 1.0f || iNumGranules == 0 )
+    {
+        fprintf( stderr, "The mesh size must be a power of two, the mesh must cover the granules and there must be granules\n" );
+        return 1;
+    }
+
+    SetThreadPoolSize( iNumThreads );
+    iNumSamples = std::max<size_t>( 1, std::min( iNumSamples, iNumGranules ) );
+
+    PMParameters meshParams;
+    meshParams.iMeshSize = iMeshSize;
+    meshParams.fOriginX = DOMAIN_CENTRE - 0.5f * fMeshWidth;
+    meshParams.fOriginY = DOMAIN_CENTRE - 0.5f * fMeshWidth;
+    meshParams.fCellSize = fMeshWidth / (float)iMeshSize;
+    meshParams.eAssignment = eAssignment;
+    meshParams.fCoupling = 1.0f;
+    meshParams.fScreening = 0.0f;
+    meshParams.fSplitRadius = fSplitRadius;
+    meshParams.fParticleMass = 1.0f;
+    meshParams.bIsolated = bIsolated;
+
+    CParticleMesh mesh;
+    mesh.Init( meshParams );
+
+    std::mt19937 rng( 1234 );
+    std::uniform_real_distribution<float> uniform( 0.0f, 1.0f );
+
+    printf( "%u^2 mesh %.1fx as wide as the granules, rs %.2f cells, %s, %s, short range radius %.2f cells\n\n", iMeshSize, fMeshWidth, fSplitRadius,
+            eAssignment == PM_ASSIGN_CIC ? "CIC" : "TSC", bIsolated ? "isolated" : "periodic",
+            mesh.GetShortRangeRadius() / meshParams.fCellSize );
+
+    // Pair force
+    // One source near the middle of the mesh and a probe at a random angle, the radial
+    // component as a fraction of C m / (2 pi r)
+    printf( "%8s %10s %10s %12s %12s\n", "cells", "split", "mesh", "mesh+short", "max error" );
+
+    const float distances[] = { 0.5f, 1.0f, 2.0f, 4.0f, 6.0f, 8.0f, 16.0f, 32.0f, 64.0f };
+    const int iNumTrials = 32;
+    for ( float fCells : distances )
+    {
+        if ( fCells * 2.0f >= (float)iMeshSize )
+            break;
+
+        const double r = fCells * meshParams.fCellSize;
+        double fMeshSum = 0, fSplitSum = 0, fMaxError = 0;
+        for ( int t = 0 ; t < iNumTrials ; t++ )
+        {
+            const FluidParticle source = MakeGranule( DOMAIN_CENTRE + uniform( rng ) * meshParams.fCellSize,
+                                                     DOMAIN_CENTRE + uniform( rng ) * meshParams.fCellSize );
+            const float fAngle = 2.0f * (float)PI * uniform( rng );
+            const FluidFloat2 probe = { source.vPosition.x + (float)r * cosf( fAngle ), source.vPosition.y + (float)r * sinf( fAngle ) };
+            const double ux = (source.vPosition.x - probe.x) / r;
+            const double uy = (source.vPosition.y - probe.y) / r;
+            const double fExact = 1.0 / (2.0 * PI * r);
+
+            mesh.Solve( &source, 1 );
+            const FluidFloat2 aMesh = EvaluateSplit( mesh, probe, source.vPosition, false );
+            const FluidFloat2 aSplit = EvaluateSplit( mesh, probe, source.vPosition, true );
+            fMeshSum += (aMesh.x * ux + aMesh.y * uy) / fExact;
+            fSplitSum += (aSplit.x * ux + aSplit.y * uy) / fExact;
+
+            const double ex = aSplit.x - fExact * ux;
+            const double ey = aSplit.y - fExact * uy;
+            fMaxError = std::max( fMaxError, sqrt( ex * ex + ey * ey ) / fExact );
+        }
+
+        const double rs = fSplitRadius;
+        printf( "%8.1f %10.4f %10.4f %12.4f %12.2e\n", fCells, 1.0 - exp( -fCells * fCells / (4.0 * rs * rs) ),
+                fMeshSum / iNumTrials, fSplitSum / iNumTrials, fMaxError );
+    }
+
+    // Granules
+    // Velocities start at zero, so with the springs off the collision and spring terms
+    // vanish and the step's velocity is the field times the time step
+    std::vector<FluidParticle> granules( iNumGranules );
+    for ( FluidParticle& P : granules )
+        P = MakeGranule( DOMAIN_MIN + uniform( rng ), DOMAIN_MIN + uniform( rng ) );
+
+    meshParams.fParticleMass = 1.0f / (float)iNumGranules;
+    mesh.Init( meshParams );
+
+    FluidParameters params = FluidDefaultParameters();
+    params.fSpringK = 0.0f;
+    params.fExternalK = 0.0f;
+
+    CFluidSimulatorCPU simulator;
+    double fStepMs = 1e30, fMeshStepMs = 1e30;
+    for ( int r = 0 ; r < iRepeat ; r++ )
+    {
+        params.pParticleMesh = nullptr;
+        simulator.SetParticles( granules );
+        auto start = std::chrono::steady_clock::now();
+        simulator.Step( params );
+        fStepMs = std::min( fStepMs, ElapsedMs( start ) );
+
+        params.pParticleMesh = &mesh;
+        simulator.SetParticles( granules );
+        start = std::chrono::steady_clock::now();
+        simulator.Step( params );
+        fMeshStepMs = std::min( fMeshStepMs, ElapsedMs( start ) );
+    }
+
+    // The step leaves the granules in grid order; the rest position says which is which
+    const std::vector<FluidParticle>& stepped = simulator.GetParticles();
+    const size_t iSampleStride = stepped.size() / iNumSamples;
+    const double fInvTimeStep = 1.0 / params.fTimeStep;
+
+    double fReferenceRms = 0, fMeshErrorSq = 0, fStepErrorSq = 0, fMaxStepError = 0;
+    std::vector<double> reference( iNumSamples * 2 );
+    GetThreadPool().ParallelFor( iNumSamples, 16, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t i = iBegin ; i < iEnd ; i++ )
+        {
+            const FluidFloat2& position = stepped[i * iSampleStride].vIndex;
+            double ax = 0, ay = 0;
+            for ( const FluidParticle& P : granules )
+                AddDirect( position, P.vPosition, meshParams.fParticleMass, ax, ay );
+            reference[i * 2] = ax;
+            reference[i * 2 + 1] = ay;
+        }
+    } );
+
+    for ( size_t i = 0 ; i < iNumSamples ; i++ )
+    {
+        const FluidParticle& P = stepped[i * iSampleStride];
+        const FluidFloat2 aMesh = mesh.Interpolate( P.vIndex );
+        const double rx = reference[i * 2], ry = reference[i * 2 + 1];
+        const double mx = aMesh.x - rx, my = aMesh.y - ry;
+        const double sx = P.vVelocity.x * fInvTimeStep - rx, sy = P.vVelocity.y * fInvTimeStep - ry;
+        fReferenceRms += rx * rx + ry * ry;
+        fMeshErrorSq += mx * mx + my * my;
+        fStepErrorSq += sx * sx + sy * sy;
+        fMaxStepError = std::max( fMaxStepError, sqrt( sx * sx + sy * sy ) );
+    }
+    fReferenceRms = sqrt( fReferenceRms / (double)iNumSamples );
+
+    // Error relative to the RMS field, so granules near a zero of the field do not dominate
+    printf( "\n%zu granules, %zu samples, %u threads\n", iNumGranules, iNumSamples, iNumThreads );
+    printf( "step %.2f ms, with the mesh %.2f ms\n", fStepMs, fMeshStepMs );
+    printf( "rms error, mesh alone %.2e, step %.2e; max error, step %.2e\n", sqrt( fMeshErrorSq / (double)iNumSamples ) / fReferenceRms,
+            sqrt( fStepErrorSq / (double)iNumSamples ) / fReferenceRms, fMaxStepError / fReferenceRms );
+
+    return 0;
+}
@@ -0,0 +1,403 @@
+//--------------------------------------------------------------------------------------
+// File: PerfCounters.cpp
+//
+// perf_event_open groups per thread and their per stage totals
+//--------------------------------------------------------------------------------------
+#include "PerfCounters.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char* const EVENT_NAMES[COUNTER_COUNT] = { "cycles", "instructions", "llc-misses", "branch-misses" };
+
+    uint32_t GetThreadId()
+    {
+        static std::atomic<uint32_t> s_iNextId( 1 );
+        thread_local const uint32_t s_iId = s_iNextId.fetch_add( 1, std::memory_order_relaxed );
+        return s_iId;
+    }
+
+    // The calling thread's group, opened on first use with the events the first thread
+    // managed to open
+    struct ThreadCounters
+    {
+        int Fds[COUNTER_COUNT];
+        int iLeader;
+        uint32_t iNumOpen;
+        uint32_t Slots[COUNTER_COUNT];  // Position of each open event in the group read
+        bool bOpened;
+        int iStage;                     // Stage of the current BeginWork, -1 if none
+        uint64_t Start[COUNTER_COUNT];
+
+        ThreadCounters() : iLeader( -1 ), iNumOpen( 0 ), bOpened( false ), iStage( -1 )
+        {
+            for ( int& fd : Fds )
+                fd = -1;
+        }
+
+        ~ThreadCounters() { Close(); }
+
+        void Close();
+        int Open( uint32_t iEventMask );
+        bool Read( uint64_t Values[COUNTER_COUNT] ) const;
+    };
+
+    thread_local ThreadCounters s_Counters;
+
+#if defined(__linux__)
+    const uint64_t EVENT_CONFIGS[COUNTER_COUNT] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    int OpenEvent( uint64_t iConfig, int iGroupFd )
+    {
+        perf_event_attr attr;
+        memset( &attr, 0, sizeof( attr ) );
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof( attr );
+        attr.config = iConfig;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;        // Allowed with perf_event_paranoid 2
+        attr.exclude_hv = 1;
+        return (int)syscall( __NR_perf_event_open, &attr, 0, -1, iGroupFd, PERF_FLAG_FD_CLOEXEC );
+    }
+
+    void ThreadCounters::Close()
+    {
+        for ( int& fd : Fds )
+        {
+            if ( fd >= 0 )
+                close( fd );
+            fd = -1;
+        }
+        iLeader = -1;
+        iNumOpen = 0;
+    }
+
+    // Returns the errno of the first failure, 0 once every event in the mask is open
+    int ThreadCounters::Open( uint32_t iEventMask )
+    {
+        bOpened = true;
+        int iError = 0;
+        for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+        {
+            if ( !(iEventMask & (1u << e)) )
+                continue;
+
+            Fds[e] = OpenEvent( EVENT_CONFIGS[e], iLeader );
+            if ( Fds[e] < 0 )
+            {
+                if ( !iError )
+                    iError = errno;
+                continue;
+            }
+            if ( iLeader < 0 )
+                iLeader = Fds[e];
+            Slots[e] = iNumOpen++;
+        }
+        return iError;
+    }
+
+    // Values of the open events, scaled by how long the group was actually counting
+    bool ThreadCounters::Read( uint64_t Values[COUNTER_COUNT] ) const
+    {
+        uint64_t Buffer[3 + COUNTER_COUNT];
+        const ssize_t iBytes = (ssize_t)((3 + iNumOpen) * sizeof( uint64_t ));
+        if ( iLeader < 0 || read( iLeader, Buffer, iBytes ) != iBytes )
+            return false;
+
+        const uint64_t iEnabled = Buffer[1];
+        const uint64_t iRunning = Buffer[2];
+        const double fScale = (iRunning > 0 && iRunning < iEnabled) ? (double)iEnabled / (double)iRunning : 1.0;
+        for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+            Values[e] = (Fds[e] >= 0) ? (uint64_t)((double)Buffer[3 + Slots[e]] * fScale) : 0;
+        return true;
+    }
+
+    std::string DescribeError( int iError )
+    {
+        std::string reason = strerror( iError );
+        if ( iError == EACCES || iError == EPERM )
+        {
+            reason += ", see /proc/sys/kernel/perf_event_paranoid";
+            if ( FILE* pFile = fopen( "/proc/sys/kernel/perf_event_paranoid", "r" ) )
+            {
+                int iLevel;
+                if ( fscanf( pFile, "%d", &iLevel ) == 1 )
+                    reason += " (" + std::to_string( iLevel ) + ")";
+                fclose( pFile );
+            }
+        }
+        else if ( iError == ENOENT || iError == ENODEV || iError == EOPNOTSUPP )
+            reason += ", no hardware PMU exposed (virtual machine?)";
+        return reason;
+    }
+#else
+    void ThreadCounters::Close() {}
+    int ThreadCounters::Open( uint32_t ) { bOpened = true; return -1; }
+    bool ThreadCounters::Read( uint64_t* ) const { return false; }
+    std::string DescribeError( int ) { return "perf_event_open is Linux only"; }
+#endif
+}
+
+
+//--------------------------------------------------------------------------------------
+CPerfCounters::CPerfCounters() :
+    m_iNumStages( 0 ),
+    m_iCurrentStage( -1 ),
+    m_iSteps( 0 ),
+    m_iAvailableEvents( 0 ),
+    m_bEnabled( false ),
+    m_Status( "disabled" )
+{
+    memset( m_Stages, 0, sizeof( m_Stages ) );
+    memset( m_StageStart, 0, sizeof( m_StageStart ) );
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CPerfCounters::SetEnabled( bool bEnable )
+{
+    if ( !bEnable )
+    {
+        m_bEnabled.store( false, std::memory_order_relaxed );
+        SetThreadPoolWorkHooks( nullptr, nullptr );
+        return true;
+    }
+
+    // The first thread decides which events every thread opens
+    if ( !m_iAvailableEvents )
+    {
+        ThreadCounters& counters = s_Counters;
+        counters.Close();
+        const int iError = counters.Open( (1u << COUNTER_COUNT) - 1 );
+        for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+        {
+            if ( counters.Fds[e] >= 0 )
+                m_iAvailableEvents |= 1u << e;
+        }
+
+        if ( !m_iAvailableEvents )
+        {
+            m_Status = "hardware counters unavailable: " + DescribeError( iError );
+            return false;
+        }
+
+        m_Status = "counting";
+        for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+        {
+            if ( !IsEventAvailable( (PerfCounterEvent)e ) )
+                m_Status += std::string( (m_Status == "counting") ? ", missing " : " " ) + EVENT_NAMES[e];
+        }
+    }
+
+    SetThreadPoolWorkHooks( []() { GetPerfCounters().BeginWork(); }, []() { GetPerfCounters().EndWork(); } );
+    m_bEnabled.store( true, std::memory_order_relaxed );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CPerfCounters::BeginStage( const char* szName )
+{
+    int iStage = -1;
+    for ( uint32_t s = 0 ; s < m_iNumStages ; s++ )
+    {
+        if ( !strncmp( m_Stages[s].szName, szName, sizeof( m_Stages[s].szName ) - 1 ) )
+            iStage = (int)s;
+    }
+    if ( iStage < 0 && m_iNumStages < MAX_STAGES )
+    {
+        iStage = (int)m_iNumStages++;
+        strncpy( m_Stages[iStage].szName, szName, sizeof( m_Stages[iStage].szName ) - 1 );
+    }
+
+    ThreadCounters& counters = s_Counters;
+    if ( !counters.bOpened )
+        counters.Open( m_iAvailableEvents );
+
+    m_StageStartTime = std::chrono::steady_clock::now();
+    if ( iStage >= 0 && counters.Read( m_StageStart ) )
+        m_iCurrentStage.store( iStage, std::memory_order_relaxed );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CPerfCounters::EndStage()
+{
+    const int iStage = m_iCurrentStage.load( std::memory_order_relaxed );
+    if ( iStage < 0 )
+        return;
+    m_iCurrentStage.store( -1, std::memory_order_relaxed );
+
+    uint64_t End[COUNTER_COUNT];
+    const uint32_t iThread = GetThreadId() - 1;
+    if ( !s_Counters.Read( End ) || iThread >= MAX_THREADS )
+        return;
+
+    StageTotals& stage = m_Stages[iStage];
+    for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+        stage.Values[iThread][e] += End[e] - m_StageStart[e];
+    stage.bThreadSeen[iThread] = true;
+    stage.fMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - m_StageStartTime ).count();
+}
+
+
+//--------------------------------------------------------------------------------------
+// The pool publishes the job under its mutex, so the stage set before the ParallelFor
+// is visible here and the totals written here are visible once it returns
+//--------------------------------------------------------------------------------------
+void CPerfCounters::BeginWork()
+{
+    ThreadCounters& counters = s_Counters;
+    counters.iStage = m_iCurrentStage.load( std::memory_order_relaxed );
+    if ( counters.iStage < 0 )
+        return;
+
+    if ( !counters.bOpened )
+        counters.Open( m_iAvailableEvents );
+    if ( !counters.Read( counters.Start ) )
+        counters.iStage = -1;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CPerfCounters::EndWork()
+{
+    ThreadCounters& counters = s_Counters;
+    if ( counters.iStage < 0 )
+        return;
+
+    uint64_t End[COUNTER_COUNT];
+    const uint32_t iThread = GetThreadId() - 1;
+    if ( counters.Read( End ) && iThread < MAX_THREADS )
+    {
+        StageTotals& stage = m_Stages[counters.iStage];
+        for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+            stage.Values[iThread][e] += End[e] - counters.Start[e];
+        stage.bThreadSeen[iThread] = true;
+    }
+    counters.iStage = -1;
+}
+
+
+//--------------------------------------------------------------------------------------
+std::vector<PerfStageCounters> CPerfCounters::GetTotals() const
+{
+    std::vector<PerfStageCounters> totals;
+    for ( uint32_t s = 0 ; s < m_iNumStages ; s++ )
+    {
+        const StageTotals& stage = m_Stages[s];
+        const size_t iSum = totals.size();
+        PerfStageCounters sum = {};
+        sum.Name = stage.szName;
+        sum.fMs = stage.fMs;
+        totals.push_back( sum );
+
+        for ( uint32_t t = 0 ; t < MAX_THREADS ; t++ )
+        {
+            if ( !stage.bThreadSeen[t] )
+                continue;
+
+            PerfStageCounters thread = {};
+            thread.Name = stage.szName;
+            thread.iThread = t + 1;
+            for ( uint32_t e = 0 ; e < COUNTER_COUNT ; e++ )
+            {
+                thread.Values[e] = stage.Values[t][e];
+                totals[iSum].Values[e] += stage.Values[t][e];
+            }
+            totals.push_back( thread );
+        }
+    }
+    return totals;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CPerfCounters::Reset()
+{
+    memset( m_Stages, 0, sizeof( m_Stages ) );
+    m_iNumStages = 0;
+    m_iSteps = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CPerfCounters::PrintTotals( FILE* pFile, double fParticlesPerStep, double fInteractionsPerStep ) const
+{
+    fprintf( pFile, "%s\n", m_Status.c_str() );
+    if ( !m_iAvailableEvents || !m_iSteps )
+        return;
+
+    fprintf( pFile, "%-14s %6s %9s %10s %12s %12s %12s %6s %11s %11s %11s\n", "stage", "thread", "ms/step",
+             "Mpart/s", "Minter/s", "cycles", "instr", "IPC", "llc-miss", "miss/kinstr", "br-miss" );
+
+    const double fSteps = (double)m_iSteps;
+    for ( const PerfStageCounters& stage : GetTotals() )
+    {
+        const uint64_t* V = stage.Values;
+        const double fInstructions = (double)V[COUNTER_INSTRUCTIONS];
+        char szThread[16], szMs[16] = "", szParticles[16] = "", szInteractions[16] = "";
+        if ( stage.iThread )
+            snprintf( szThread, sizeof( szThread ), "%u", stage.iThread );
+        else
+        {
+            // Throughput is of the stage as a whole, so only on the sum rows
+            const double fSeconds = stage.fMs / fSteps * 1e-3;
+            const bool bNeighbourPass = (stage.Name == "Density" || stage.Name == "Force");
+            snprintf( szThread, sizeof( szThread ), "all" );
+            snprintf( szMs, sizeof( szMs ), "%.3f", stage.fMs / fSteps );
+            if ( fSeconds > 0 )
+            {
+                snprintf( szParticles, sizeof( szParticles ), "%.2f", fParticlesPerStep / fSeconds * 1e-6 );
+                if ( bNeighbourPass )
+                    snprintf( szInteractions, sizeof( szInteractions ), "%.2f", fInteractionsPerStep / fSeconds * 1e-6 );
+            }
+        }
+
+        auto column = [&]( PerfCounterEvent e, char* sz, size_t iSize, double fValue, const char* szFormat )
+        {
+            if ( IsEventAvailable( e ) )
+                snprintf( sz, iSize, szFormat, fValue );
+            else
+                snprintf( sz, iSize, "-" );
+        };
+
+        char szCycles[24], szInstructions[24], szIPC[16], szMisses[24], szMissRate[16], szBranch[24];
+        column( COUNTER_CYCLES, szCycles, sizeof( szCycles ), V[COUNTER_CYCLES] / fSteps, "%.4g" );
+        column( COUNTER_INSTRUCTIONS, szInstructions, sizeof( szInstructions ), fInstructions / fSteps, "%.4g" );
+        column( COUNTER_CYCLES, szIPC, sizeof( szIPC ), V[COUNTER_CYCLES] ? fInstructions / V[COUNTER_CYCLES] : 0.0, "%.2f" );
+        column( COUNTER_CACHE_MISSES, szMisses, sizeof( szMisses ), V[COUNTER_CACHE_MISSES] / fSteps, "%.4g" );
+        column( COUNTER_CACHE_MISSES, szMissRate, sizeof( szMissRate ), (fInstructions > 0) ? V[COUNTER_CACHE_MISSES] * 1e3 / fInstructions : 0.0, "%.3f" );
+        column( COUNTER_BRANCH_MISSES, szBranch, sizeof( szBranch ), V[COUNTER_BRANCH_MISSES] / fSteps, "%.4g" );
+        if ( !IsEventAvailable( COUNTER_INSTRUCTIONS ) )
+        {
+            snprintf( szIPC, sizeof( szIPC ), "-" );
+            snprintf( szMissRate, sizeof( szMissRate ), "-" );
+        }
+
+        fprintf( pFile, "%-14s %6s %9s %10s %12s %12s %12s %6s %11s %11s %11s\n", stage.iThread ? "" : stage.Name.c_str(),
+                 szThread, szMs, szParticles, szInteractions, szCycles, szInstructions, szIPC, szMisses, szMissRate, szBranch );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CPerfCounters& GetPerfCounters()
+{
+    static CPerfCounters s_Counters;
+    return s_Counters;
+}
@@ -0,0 +1,131 @@
+//--------------------------------------------------------------------------------------
+// File: PerfCounters.h
+//
+// Hardware performance counters per stage of the CPU simulator. Every thread that works
+// on a stage opens its own perf_event_open group (cycles, instructions, last level
+// cache misses, branch misses) on first use; the thread running the stage reads its
+// group around the whole stage and the pool workers read theirs around their share of
+// each ParallelFor. Totals are kept per stage and thread and divided by the steps seen,
+// to tell whether density and force are bound by cache misses or by arithmetic.
+//
+// Counters may not be permitted (perf_event_paranoid, containers, VMs without a PMU)
+// or not exist (other platforms). SetEnabled then fails with a reason and the stages
+// run uncounted; single events the PMU lacks are reported as missing.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+enum PerfCounterEvent
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,       // Last level cache
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+// Totals of one stage on one thread, scaled up when the kernel multiplexed the group
+struct PerfStageCounters
+{
+    std::string Name;
+    uint32_t iThread;           // Small id of the thread, 0 for the sum over threads
+    uint64_t Values[COUNTER_COUNT];
+    double fMs;                 // Wall time of the stage, on the thread running it
+};
+
+//--------------------------------------------------------------------------------------
+class CPerfCounters
+{
+public:
+    static const uint32_t MAX_STAGES = 32;
+    static const uint32_t MAX_THREADS = 64;     // Threads past this are not counted
+
+    CPerfCounters();
+
+    CPerfCounters( const CPerfCounters& ) = delete;
+    CPerfCounters& operator=( const CPerfCounters& ) = delete;
+
+    // Opens the calling thread's counters to check they are permitted. Returns false,
+    // and stays disabled, when none of the events can be counted.
+    bool SetEnabled( bool bEnable );
+    bool IsEnabled() const { return m_bEnabled.load( std::memory_order_relaxed ); }
+
+    // Why SetEnabled failed, or which events are missing
+    const std::string& GetStatus() const { return m_Status; }
+    bool IsEventAvailable( PerfCounterEvent eEvent ) const { return (m_iAvailableEvents & (1u << eEvent)) != 0; }
+
+    // Bracket a stage on the thread running it. Stages do not nest.
+    void BeginStage( const char* szName );
+    void EndStage();
+
+    // Called by the pool workers around their share of a ParallelFor
+    void BeginWork();
+    void EndWork();
+
+    // Counts the steps the totals are divided by
+    void NextStep() { m_iSteps++; }
+    uint64_t GetSteps() const { return m_iSteps; }
+
+    // Per stage sums over threads followed by that stage's per thread rows, in order of
+    // first appearance. Must not run concurrently with a stage.
+    std::vector<PerfStageCounters> GetTotals() const;
+    void Reset();
+
+    // Per step averages next to the stage throughput. Interactions are the neighbour
+    // candidates of a step and are only shown for the neighbour passes.
+    void PrintTotals( FILE* pFile, double fParticlesPerStep, double fInteractionsPerStep ) const;
+
+private:
+    struct StageTotals
+    {
+        char szName[32];
+        uint64_t Values[MAX_THREADS][COUNTER_COUNT];
+        bool bThreadSeen[MAX_THREADS];
+        double fMs;
+    };
+
+    StageTotals                                 m_Stages[MAX_STAGES];
+    uint32_t                                    m_iNumStages;
+    std::atomic<int>                            m_iCurrentStage;    // -1 outside a stage
+    uint64_t                                    m_StageStart[COUNTER_COUNT];
+    std::chrono::steady_clock::time_point       m_StageStartTime;
+    uint64_t                                    m_iSteps;
+    uint32_t                                    m_iAvailableEvents;
+    std::atomic<bool>                           m_bEnabled;
+    std::string                                 m_Status;
+};
+
+// Counters shared by the whole process, created disabled on first use
+CPerfCounters& GetPerfCounters();
+
+//--------------------------------------------------------------------------------------
+// Counts its own lifetime as one stage
+//--------------------------------------------------------------------------------------
+class CScopedPerfStage
+{
+public:
+    explicit CScopedPerfStage( const char* szName ) :
+        m_bActive( GetPerfCounters().IsEnabled() )
+    {
+        if ( m_bActive )
+            GetPerfCounters().BeginStage( szName );
+    }
+
+    ~CScopedPerfStage()
+    {
+        if ( m_bActive )
+            GetPerfCounters().EndStage();
+    }
+
+    CScopedPerfStage( const CScopedPerfStage& ) = delete;
+    CScopedPerfStage& operator=( const CScopedPerfStage& ) = delete;
+
+private:
+    bool m_bActive;
+};
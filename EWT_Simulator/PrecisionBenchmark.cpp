@@ -0,0 +1,174 @@
+//--------------------------------------------------------------------------------------
+// File: PrecisionBenchmark.cpp
+//
+// Error and memory traffic of the compressed particle storage: steps the standard
+// lattice with full fp32 storage and with the packed neighbour stream side by side,
+// and prints how far the compressed run drifts from the fp32 one, the time per step
+// and the bytes each moves per step.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread PrecisionBenchmark.cpp FluidCPU.cpp CoarseGrain.cpp
+//       BoundarySDF.cpp ParticleMesh.cpp FFT.cpp BarnesHut.cpp StageProfiler.cpp PerfCounters.cpp
+//       ThreadPool.cpp
+//
+// Usage: PrecisionBenchmark [--particles P] [--steps S] [--threads T] [--interval I]
+//                           [--lists]
+//   --interval   steps between error reports
+//   --lists      run both with neighbour lists, the force pass then reads velocities only
+//--------------------------------------------------------------------------------------
+#include "FluidCPU.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <thread>
+
+namespace
+{
+    double ElapsedMs( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    // Both runs keep their particles in grid order, which differs once a particle changes
+    // cell in one run and not the other. The rest position is exact and unique, so it
+    // pairs them up again.
+    std::vector<size_t> OrderByRestPosition( const std::vector<FluidParticle>& Particles )
+    {
+        std::vector<size_t> order( Particles.size() );
+        std::iota( order.begin(), order.end(), 0 );
+        std::sort( order.begin(), order.end(), [&]( size_t a, size_t b )
+        {
+            const FluidFloat2& A = Particles[a].vIndex;
+            const FluidFloat2& B = Particles[b].vIndex;
+            return (A.y != B.y) ? A.y < B.y : A.x < B.x;
+        } );
+        return order;
+    }
+
+    struct StepTotals
+    {
+        double fMs = 0;
+        double fBytes = 0;
+    };
+
+    void TimedStep( CFluidSimulatorCPU& simulator, const FluidParameters& params, StepTotals& totals )
+    {
+        auto start = std::chrono::steady_clock::now();
+        simulator.Step( params );
+        totals.fMs += ElapsedMs( start );
+
+        const FluidStorageReport& report = simulator.GetStorageReport();
+        totals.fBytes += (double)(report.iNeighbourBytes + report.iStreamBytes);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    unsigned int iNumParticles = 65536;
+    unsigned int iNumSteps = 500;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    unsigned int iInterval = 50;
+    bool bLists = false;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--particles" ) && bHasValue )
+            iNumParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--steps" ) && bHasValue )
+            iNumSteps = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--interval" ) && bHasValue )
+            iInterval = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--lists" ) )
+            bLists = true;
+        else
+        {
+            fprintf( stderr, "Usage: %s [--particles P] [--steps S] [--threads T] [--interval I] [--lists]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    SetThreadPoolSize( iNumThreads );
+
+    const FluidParameters params = FluidDefaultParameters();
+    const std::vector<FluidParticle> lattice = FluidCreateLattice( iNumParticles, params.fInitialParticleSpacing );
+
+    CFluidSimulatorCPU reference, compressed;
+    reference.SetParticles( lattice );
+    compressed.SetParticles( lattice );
+    compressed.SetCompressedStorage( true );
+    reference.SetNeighbourLists( bLists );
+    compressed.SetNeighbourLists( bLists );
+
+    printf( "%u particles, %u threads%s, offsets %.2e, velocities fp16\n", iNumParticles, iNumThreads,
+            bLists ? ", neighbour lists" : "", params.fSmoothlen / compressed.GetCellSubdivision() / FLUID_OFFSET_SCALE );
+    printf( "errors of the compressed run against fp32; position in particle spacings, velocity and density relative to their rms\n\n" );
+    printf( "%6s %12s %12s %12s %12s %12s %8s\n", "step", "pos rms", "pos max", "vel rms", "dens rms", "dens max", "clamped" );
+
+    StepTotals referenceTotals, compressedTotals;
+    for ( unsigned int iStep = 1 ; iStep <= iNumSteps ; iStep++ )
+    {
+        TimedStep( reference, params, referenceTotals );
+        TimedStep( compressed, params, compressedTotals );
+
+        if ( iStep % iInterval && iStep != iNumSteps )
+            continue;
+
+        const std::vector<FluidParticle>& A = reference.GetParticles();
+        const std::vector<FluidParticle>& B = compressed.GetParticles();
+        const std::vector<size_t> orderA = OrderByRestPosition( A );
+        const std::vector<size_t> orderB = OrderByRestPosition( B );
+
+        double fPositionSq = 0, fPositionMax = 0;
+        double fVelocitySq = 0, fVelocityNorm = 0;
+        double fDensitySq = 0, fDensityMax = 0, fDensityNorm = 0;
+        for ( size_t i = 0 ; i < A.size() ; i++ )
+        {
+            const FluidParticle& a = A[orderA[i]];
+            const FluidParticle& b = B[orderB[i]];
+
+            const double dx = b.vPosition.x - a.vPosition.x;
+            const double dy = b.vPosition.y - a.vPosition.y;
+            fPositionSq += dx * dx + dy * dy;
+            fPositionMax = std::max( fPositionMax, sqrt( dx * dx + dy * dy ) );
+
+            const double du = b.vVelocity.x - a.vVelocity.x;
+            const double dv = b.vVelocity.y - a.vVelocity.y;
+            fVelocitySq += du * du + dv * dv;
+            fVelocityNorm += (double)a.vVelocity.x * a.vVelocity.x + (double)a.vVelocity.y * a.vVelocity.y;
+
+            const double fDensityA = reference.GetDensities()[orderA[i]];
+            const double fDensityB = compressed.GetDensities()[orderB[i]];
+            fDensitySq += (fDensityB - fDensityA) * (fDensityB - fDensityA);
+            fDensityMax = std::max( fDensityMax, fabs( fDensityB - fDensityA ) );
+            fDensityNorm += fDensityA * fDensityA;
+        }
+
+        const double N = (double)A.size();
+        const double fSpacing = params.fInitialParticleSpacing;
+        const double fDensityRms = sqrt( fDensityNorm / N );
+        printf( "%6u %12.3e %12.3e %12.3e %12.3e %12.3e %8u\n", iStep,
+                sqrt( fPositionSq / N ) / fSpacing, fPositionMax / fSpacing,
+                (fVelocityNorm > 0) ? sqrt( fVelocitySq / fVelocityNorm ) : 0.0,
+                sqrt( fDensitySq / N ) / fDensityRms, fDensityMax / fDensityRms,
+                compressed.GetStorageReport().iClampedOffsets );
+    }
+
+    const double fSteps = (double)iNumSteps;
+    printf( "\n%10s %12s %14s %14s\n", "storage", "ms / step", "MB / step", "bytes / particle" );
+    printf( "%10s %12.2f %14.2f %14.1f\n", "fp32", referenceTotals.fMs / fSteps,
+            referenceTotals.fBytes / fSteps / 1e6, referenceTotals.fBytes / fSteps / iNumParticles );
+    printf( "%10s %12.2f %14.2f %14.1f\n", "packed", compressedTotals.fMs / fSteps,
+            compressedTotals.fBytes / fSteps / 1e6, compressedTotals.fBytes / fSteps / iNumParticles );
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+//--------------------------------------------------------------------------------------
+// File: SPSCQueue.h
+//
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Neither side ever waits: TryPush fails when the queue is full, TryPop when it is
+// empty. Used to hand UI parameter changes to the simulation thread.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+//--------------------------------------------------------------------------------------
+// CAPACITY must be a power of two. The head and tail counters run freely and are
+// masked on access, so all CAPACITY slots are usable.
+//--------------------------------------------------------------------------------------
+template <class T, size_t CAPACITY>
+class CSPSCQueue
+{
+    static_assert( CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two" );
+
+public:
+    CSPSCQueue() : m_iHead( 0 ), m_iTail( 0 ) {}
+
+    CSPSCQueue( const CSPSCQueue& ) = delete;
+    CSPSCQueue& operator=( const CSPSCQueue& ) = delete;
+
+    // Producer only
+    bool TryPush( const T& Item )
+    {
+        const size_t iTail = m_iTail.load( std::memory_order_relaxed );
+        if ( iTail - m_iHead.load( std::memory_order_acquire ) == CAPACITY )
+            return false;
+        m_Items[iTail & (CAPACITY - 1)] = Item;
+        m_iTail.store( iTail + 1, std::memory_order_release );
+        return true;
+    }
+
+    // Consumer only
+    bool TryPop( T& Item )
+    {
+        const size_t iHead = m_iHead.load( std::memory_order_relaxed );
+        if ( iHead == m_iTail.load( std::memory_order_acquire ) )
+            return false;
+        Item = m_Items[iHead & (CAPACITY - 1)];
+        m_iHead.store( iHead + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    T                           m_Items[CAPACITY];
+
+    // On separate cache lines so the two threads do not share one
+    alignas( 64 ) std::atomic<size_t> m_iHead;  // Next item to pop, written by the consumer
+    alignas( 64 ) std::atomic<size_t> m_iTail;  // Next free slot, written by the producer
+};
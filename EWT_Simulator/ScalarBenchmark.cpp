@@ -0,0 +1,158 @@
+//--------------------------------------------------------------------------------------
+// File: ScalarBenchmark.cpp
+//
+// Throughput cost of the precisions of the CPU simulator: steps the standard lattice
+// with float, double and compensated density and force sums, and prints the time per
+// step next to how far each run ends from the double + compensated one.
+// POSIX only, it is not part of the Windows project. Build for AVX2 with
+//   g++ -std=c++14 -O3 -mavx2 -mfma -pthread ScalarBenchmark.cpp FluidCPU.cpp
+//       CoarseGrain.cpp BoundarySDF.cpp ParticleMesh.cpp FFT.cpp BarnesHut.cpp StageProfiler.cpp
+//       PerfCounters.cpp ThreadPool.cpp
+// -ffast-math must not be used, it lets the compiler remove the compensation.
+//
+// Usage: ScalarBenchmark [--particles P] [--steps S] [--threads T] [--lists]
+//   --lists      run with neighbour lists
+//--------------------------------------------------------------------------------------
+#include "FluidCPU.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <thread>
+
+namespace
+{
+    struct RunResult
+    {
+        const char* szName;
+        double fMsPerStep;
+        std::vector<double> Positions;      // x, y of each particle, in rest position order
+        double fEnergy;                     // Mean kinetic + spring energy per unit mass
+    };
+
+    template <class TReal, class TSum>
+    RunResult Run( const char* szName, const std::vector<FluidParticle>& Lattice, const FluidParameters& params,
+                   unsigned int iNumSteps, bool bLists )
+    {
+        TFluidSimulatorCPU<TReal, TSum> simulator;
+        simulator.SetParticles( FluidConvertParticles<TReal>( Lattice ) );
+        simulator.SetNeighbourLists( bLists );
+
+        // One untimed step sizes the buffers
+        simulator.Step( params );
+
+        auto start = std::chrono::steady_clock::now();
+        for ( unsigned int i = 1 ; i < iNumSteps ; i++ )
+            simulator.Step( params );
+        const double fMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+        // The runs leave their particles in different grid orders, the exact rest
+        // position pairs them up
+        const std::vector<TFluidParticle<TReal>>& particles = simulator.GetParticles();
+        std::vector<size_t> order( particles.size() );
+        std::iota( order.begin(), order.end(), 0 );
+        std::sort( order.begin(), order.end(), [&]( size_t a, size_t b )
+        {
+            const TFluidFloat2<TReal>& A = particles[a].vIndex;
+            const TFluidFloat2<TReal>& B = particles[b].vIndex;
+            return (A.y != B.y) ? A.y < B.y : A.x < B.x;
+        } );
+
+        RunResult result;
+        result.szName = szName;
+        result.fMsPerStep = fMs / std::max( 1u, iNumSteps - 1 );
+        result.Positions.resize( particles.size() * 2 );
+        result.fEnergy = 0;
+        for ( size_t i = 0 ; i < particles.size() ; i++ )
+        {
+            const TFluidParticle<TReal>& p = particles[order[i]];
+            result.Positions[i * 2 + 0] = (double)p.vPosition.x;
+            result.Positions[i * 2 + 1] = (double)p.vPosition.y;
+
+            const double dx = (double)p.vIndex.x - (double)p.vPosition.x;
+            const double dy = (double)p.vIndex.y - (double)p.vPosition.y;
+            const double vx = (double)p.vVelocity.x, vy = (double)p.vVelocity.y;
+            result.fEnergy += 0.5 * (vx * vx + vy * vy) + 0.5 * params.fSpringK * (dx * dx + dy * dy);
+        }
+        result.fEnergy /= (double)std::max<size_t>( 1, particles.size() );
+        return result;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    unsigned int iNumParticles = 65536;
+    unsigned int iNumSteps = 200;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    bool bLists = false;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--particles" ) && bHasValue )
+            iNumParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--steps" ) && bHasValue )
+            iNumSteps = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--lists" ) )
+            bLists = true;
+        else
+        {
+            fprintf( stderr, "Usage: %s [--particles P] [--steps S] [--threads T] [--lists]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    SetThreadPoolSize( iNumThreads );
+
+    const FluidParameters params = FluidDefaultParameters();
+    const std::vector<FluidParticle> lattice = FluidCreateLattice( iNumParticles, params.fInitialParticleSpacing );
+
+#if defined(__AVX2__)
+    const char* szTarget = "AVX2";
+#else
+    const char* szTarget = "no AVX2, rebuild with -mavx2 -mfma";
+#endif
+    printf( "%u particles, %u steps, %u threads%s, %s\n", iNumParticles, iNumSteps, iNumThreads,
+            bLists ? ", neighbour lists" : "", szTarget );
+    printf( "deviation from double + compensated: position rms and max in particle spacings, energy relative\n\n" );
+
+    const RunResult results[] =
+    {
+        Run<float, FluidPlainSum<float>>( "float", lattice, params, iNumSteps, bLists ),
+        Run<float, FluidCompensatedSum<float>>( "float+comp", lattice, params, iNumSteps, bLists ),
+        Run<double, FluidPlainSum<double>>( "double", lattice, params, iNumSteps, bLists ),
+        Run<double, FluidCompensatedSum<double>>( "double+comp", lattice, params, iNumSteps, bLists ),
+    };
+    const RunResult& reference = results[3];
+    const double fFloatMs = results[0].fMsPerStep;
+
+    printf( "%12s %10s %8s %14s %12s %12s %12s\n", "scalar", "ms / step", "cost", "Mparticles / s", "pos rms", "pos max", "energy" );
+    for ( const RunResult& result : results )
+    {
+        double fErrorSq = 0, fErrorMax = 0;
+        for ( size_t i = 0 ; i < result.Positions.size() ; i += 2 )
+        {
+            const double dx = result.Positions[i + 0] - reference.Positions[i + 0];
+            const double dy = result.Positions[i + 1] - reference.Positions[i + 1];
+            fErrorSq += dx * dx + dy * dy;
+            fErrorMax = std::max( fErrorMax, sqrt( dx * dx + dy * dy ) );
+        }
+
+        const double fSpacing = params.fInitialParticleSpacing;
+        printf( "%12s %10.2f %7.2fx %14.2f %12.3e %12.3e %12.3e\n", result.szName, result.fMsPerStep,
+                result.fMsPerStep / fFloatMs, iNumParticles / (result.fMsPerStep * 1e3),
+                sqrt( fErrorSq / (double)iNumParticles ) / fSpacing, fErrorMax / fSpacing,
+                (reference.fEnergy != 0) ? fabs( result.fEnergy - reference.fEnergy ) / fabs( reference.fEnergy ) : 0.0 );
+    }
+
+    return 0;
+}
@@ -0,0 +1,351 @@
+//--------------------------------------------------------------------------------------
+// File: SharedMemoryTransport.cpp
+//
+// POSIX shared memory IHaloTransport
+//--------------------------------------------------------------------------------------
+#include "SharedMemoryTransport.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert( ATOMIC_INT_LOCK_FREE == 2, "Shared memory barrier needs address-free atomics" );
+
+namespace
+{
+    const uint32_t SHARED_MAGIC = 0x45575444; // 'EWTD'
+    const size_t ALIGNMENT = 64;
+
+    size_t AlignUp( size_t iValue )
+    {
+        return (iValue + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Segment layout
+//   SharedHeader
+//   DomainStepReport[2][iNumRanks]                          (AllGather, by parity)
+//   Mailbox[2][iNumRanks][iNumRanks], each MailboxHeader + iCapacity particles
+//   Gather area: uint32_t count per rank + iGatherCapacity particles
+//--------------------------------------------------------------------------------------
+struct CSharedMemoryTransport::SharedHeader
+{
+    uint32_t iMagic;
+    uint32_t iNumRanks;
+    uint64_t iCapacity;
+    uint64_t iGatherCapacity;
+    uint64_t iSize;
+    uint64_t iReportsOffset;
+    uint64_t iMailboxesOffset;
+    uint64_t iMailboxStride;
+    uint64_t iGatherOffset;
+    alignas(64) std::atomic<uint32_t> iBarrierCount;
+    alignas(64) std::atomic<uint32_t> iBarrierGeneration;
+};
+
+struct CSharedMemoryTransport::MailboxHeader
+{
+    uint32_t iNumMigrants;
+    uint32_t iNumHalo;
+    uint32_t bOverflow;
+    uint32_t iPadding;
+};
+
+
+//--------------------------------------------------------------------------------------
+CSharedMemoryTransport::CSharedMemoryTransport() :
+    m_pHeader( nullptr ),
+    m_pBase( nullptr ),
+    m_iSize( 0 ),
+    m_iRank( 0 ),
+    m_iParity( 0 )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+CSharedMemoryTransport::~CSharedMemoryTransport()
+{
+    Close();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSharedMemoryTransport::Close()
+{
+    if ( m_pBase )
+        munmap( m_pBase, m_iSize );
+    m_pBase = nullptr;
+    m_pHeader = nullptr;
+    m_iSize = 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::Map( int fd, size_t iSize )
+{
+    void* pData = mmap( nullptr, iSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( pData == MAP_FAILED )
+    {
+        perror( "mmap" );
+        return false;
+    }
+
+    m_pBase = (uint8_t*)pData;
+    m_pHeader = (SharedHeader*)pData;
+    m_iSize = iSize;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::Create( const char* szName, unsigned int iNumRanks, size_t iCapacity, size_t iGatherCapacity )
+{
+    Close();
+
+    const size_t iMailboxStride = AlignUp( sizeof( MailboxHeader ) + iCapacity * sizeof( FluidParticle ) );
+    const size_t iReportsOffset = AlignUp( sizeof( SharedHeader ) );
+    const size_t iMailboxesOffset = iReportsOffset + AlignUp( 2 * iNumRanks * sizeof( DomainStepReport ) );
+    const size_t iGatherOffset = iMailboxesOffset + 2 * (size_t)iNumRanks * iNumRanks * iMailboxStride;
+    const size_t iSize = iGatherOffset + AlignUp( iNumRanks * sizeof( uint32_t ) ) + iGatherCapacity * sizeof( FluidParticle );
+
+    int fd = shm_open( szName, O_CREAT | O_EXCL | O_RDWR, 0600 );
+    if ( fd < 0 )
+    {
+        perror( "shm_open" );
+        return false;
+    }
+    if ( ftruncate( fd, (off_t)iSize ) != 0 )
+    {
+        perror( "ftruncate" );
+        close( fd );
+        shm_unlink( szName );
+        return false;
+    }
+    if ( !Map( fd, iSize ) )
+    {
+        shm_unlink( szName );
+        return false;
+    }
+
+    // The segment starts zeroed, so only the header needs filling in
+    SharedHeader* pHeader = new (m_pBase) SharedHeader;
+    pHeader->iMagic = SHARED_MAGIC;
+    pHeader->iNumRanks = iNumRanks;
+    pHeader->iCapacity = iCapacity;
+    pHeader->iGatherCapacity = iGatherCapacity;
+    pHeader->iSize = iSize;
+    pHeader->iReportsOffset = iReportsOffset;
+    pHeader->iMailboxesOffset = iMailboxesOffset;
+    pHeader->iMailboxStride = iMailboxStride;
+    pHeader->iGatherOffset = iGatherOffset;
+    pHeader->iBarrierCount.store( 0 );
+    pHeader->iBarrierGeneration.store( 0 );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::Open( const char* szName, unsigned int iRank )
+{
+    Close();
+
+    int fd = shm_open( szName, O_RDWR, 0600 );
+    if ( fd < 0 )
+    {
+        perror( "shm_open" );
+        return false;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( SharedHeader ) )
+    {
+        close( fd );
+        return false;
+    }
+    if ( !Map( fd, (size_t)st.st_size ) )
+        return false;
+
+    if ( m_pHeader->iMagic != SHARED_MAGIC || iRank >= m_pHeader->iNumRanks )
+    {
+        fprintf( stderr, "%s is not a domain segment for rank %u\n", szName, iRank );
+        Close();
+        return false;
+    }
+
+    m_iRank = iRank;
+    m_iParity = 0;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSharedMemoryTransport::Unlink( const char* szName )
+{
+    shm_unlink( szName );
+}
+
+
+//--------------------------------------------------------------------------------------
+unsigned int CSharedMemoryTransport::GetNumRanks() const
+{
+    return m_pHeader ? m_pHeader->iNumRanks : 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Sense reversing barrier across processes
+//--------------------------------------------------------------------------------------
+void CSharedMemoryTransport::Barrier()
+{
+    const uint32_t iGeneration = m_pHeader->iBarrierGeneration.load( std::memory_order_acquire );
+    if ( m_pHeader->iBarrierCount.fetch_add( 1, std::memory_order_acq_rel ) + 1 == m_pHeader->iNumRanks )
+    {
+        m_pHeader->iBarrierCount.store( 0, std::memory_order_relaxed );
+        m_pHeader->iBarrierGeneration.fetch_add( 1, std::memory_order_release );
+        return;
+    }
+
+    unsigned int iSpins = 0;
+    while ( m_pHeader->iBarrierGeneration.load( std::memory_order_acquire ) == iGeneration )
+    {
+        if ( ++iSpins > 64 )
+            std::this_thread::yield();
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CSharedMemoryTransport::MailboxHeader* CSharedMemoryTransport::GetMailbox( unsigned int iParity, unsigned int iSrc, unsigned int iDst ) const
+{
+    const size_t iNumRanks = m_pHeader->iNumRanks;
+    const size_t iIndex = (iParity * iNumRanks + iSrc) * iNumRanks + iDst;
+    return (MailboxHeader*)(m_pBase + m_pHeader->iMailboxesOffset + iIndex * m_pHeader->iMailboxStride);
+}
+
+
+//--------------------------------------------------------------------------------------
+// Write every outgoing message into our mailboxes, wait for everyone, then read the
+// mailboxes addressed to us. The next exchange uses the other parity, so a fast rank
+// cannot overwrite a mailbox that a slow rank is still reading.
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::Exchange( const std::vector<DomainMessage>& Send, std::vector<DomainMessage>& Recv )
+{
+    const unsigned int iNumRanks = m_pHeader->iNumRanks;
+    const size_t iCapacity = m_pHeader->iCapacity;
+
+    for ( unsigned int iDst = 0 ; iDst < iNumRanks ; iDst++ )
+    {
+        if ( iDst == m_iRank )
+            continue;
+
+        MailboxHeader* pMailbox = GetMailbox( m_iParity, m_iRank, iDst );
+        const DomainMessage& message = Send[iDst];
+        const size_t iCount = message.Migrants.size() + message.Halo.size();
+        pMailbox->bOverflow = (iCount > iCapacity) ? 1 : 0;
+        if ( pMailbox->bOverflow )
+        {
+            pMailbox->iNumMigrants = 0;
+            pMailbox->iNumHalo = 0;
+            continue;
+        }
+
+        FluidParticle* pParticles = (FluidParticle*)(pMailbox + 1);
+        if ( !message.Migrants.empty() )
+            memcpy( pParticles, message.Migrants.data(), message.Migrants.size() * sizeof( FluidParticle ) );
+        if ( !message.Halo.empty() )
+            memcpy( pParticles + message.Migrants.size(), message.Halo.data(), message.Halo.size() * sizeof( FluidParticle ) );
+        pMailbox->iNumMigrants = (uint32_t)message.Migrants.size();
+        pMailbox->iNumHalo = (uint32_t)message.Halo.size();
+    }
+
+    Barrier();
+
+    // Every rank sees the same overflow flags, so every rank fails together
+    bool bOverflow = false;
+    Recv.resize( iNumRanks );
+    for ( unsigned int iSrc = 0 ; iSrc < iNumRanks ; iSrc++ )
+    {
+        for ( unsigned int iDst = 0 ; iDst < iNumRanks ; iDst++ )
+        {
+            if ( iSrc != iDst && GetMailbox( m_iParity, iSrc, iDst )->bOverflow )
+                bOverflow = true;
+        }
+
+        DomainMessage& message = Recv[iSrc];
+        message.Migrants.clear();
+        message.Halo.clear();
+        if ( iSrc == m_iRank )
+            continue;
+
+        const MailboxHeader* pMailbox = GetMailbox( m_iParity, iSrc, m_iRank );
+        const FluidParticle* pParticles = (const FluidParticle*)(pMailbox + 1);
+        message.Migrants.assign( pParticles, pParticles + pMailbox->iNumMigrants );
+        message.Halo.assign( pParticles + pMailbox->iNumMigrants, pParticles + pMailbox->iNumMigrants + pMailbox->iNumHalo );
+    }
+
+    m_iParity ^= 1;
+
+    if ( bOverflow )
+        fprintf( stderr, "Rank %u: a message exceeded the mailbox capacity of %zu particles\n", m_iRank, iCapacity );
+    return !bOverflow;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::AllGather( const DomainStepReport& Local, std::vector<DomainStepReport>& All )
+{
+    const unsigned int iNumRanks = m_pHeader->iNumRanks;
+    DomainStepReport* pReports = (DomainStepReport*)(m_pBase + m_pHeader->iReportsOffset) + m_iParity * iNumRanks;
+
+    pReports[m_iRank] = Local;
+    Barrier();
+    All.assign( pReports, pReports + iNumRanks );
+
+    m_iParity ^= 1;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Every rank publishes its count, then writes its particles after those of the lower
+// ranks; rank 0 reads them back once everyone is done
+//--------------------------------------------------------------------------------------
+bool CSharedMemoryTransport::Gather( const std::vector<FluidParticle>& Local, std::vector<FluidParticle>& All )
+{
+    const unsigned int iNumRanks = m_pHeader->iNumRanks;
+    uint32_t* pCounts = (uint32_t*)(m_pBase + m_pHeader->iGatherOffset);
+    FluidParticle* pParticles = (FluidParticle*)(m_pBase + m_pHeader->iGatherOffset + AlignUp( iNumRanks * sizeof( uint32_t ) ));
+
+    pCounts[m_iRank] = (uint32_t)Local.size();
+    Barrier();
+
+    size_t iOffset = 0;
+    size_t iTotal = 0;
+    for ( unsigned int r = 0 ; r < iNumRanks ; r++ )
+    {
+        if ( r < m_iRank )
+            iOffset += pCounts[r];
+        iTotal += pCounts[r];
+    }
+    const bool bFits = iTotal <= m_pHeader->iGatherCapacity;
+    if ( bFits && !Local.empty() )
+        memcpy( pParticles + iOffset, Local.data(), Local.size() * sizeof( FluidParticle ) );
+    Barrier();
+
+    if ( m_iRank == 0 && bFits )
+        All.assign( pParticles, pParticles + iTotal );
+
+    // Nobody may touch the counts again until rank 0 has read the particles
+    Barrier();
+    return bFits;
+}
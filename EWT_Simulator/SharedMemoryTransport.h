@@ -0,0 +1,55 @@
+//--------------------------------------------------------------------------------------
+// File: SharedMemoryTransport.h
+//
+// IHaloTransport between processes on the same machine, through a POSIX shared memory
+// segment. Each ordered pair of ranks has a mailbox; mailboxes are double buffered by
+// step parity so a single barrier per collective is enough. Pages are only committed
+// when touched, so the unused mailboxes of non-adjacent ranks cost no memory.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "DomainDecomposition.h"
+
+#include <cstddef>
+#include <cstdint>
+
+//--------------------------------------------------------------------------------------
+class CSharedMemoryTransport : public IHaloTransport
+{
+public:
+    CSharedMemoryTransport();
+    ~CSharedMemoryTransport();
+
+    // Create the segment (once, before the workers start)
+    // iCapacity bounds the particles one rank can send another in a step, iGatherCapacity
+    // the particles Gather can collect
+    bool Create( const char* szName, unsigned int iNumRanks, size_t iCapacity, size_t iGatherCapacity );
+
+    // Attach to an existing segment as iRank
+    bool Open( const char* szName, unsigned int iRank );
+
+    // Remove the segment name, mappings stay valid until closed
+    static void Unlink( const char* szName );
+
+    unsigned int GetRank() const override { return m_iRank; }
+    unsigned int GetNumRanks() const override;
+
+    bool Exchange( const std::vector<DomainMessage>& Send, std::vector<DomainMessage>& Recv ) override;
+    bool AllGather( const DomainStepReport& Local, std::vector<DomainStepReport>& All ) override;
+    bool Gather( const std::vector<FluidParticle>& Local, std::vector<FluidParticle>& All ) override;
+
+private:
+    struct SharedHeader;
+    struct MailboxHeader;
+
+    bool Map( int fd, size_t iSize );
+    void Close();
+    void Barrier();
+    MailboxHeader* GetMailbox( unsigned int iParity, unsigned int iSrc, unsigned int iDst ) const;
+
+    SharedHeader*   m_pHeader;
+    uint8_t*        m_pBase;
+    size_t          m_iSize;
+    unsigned int    m_iRank;
+    unsigned int    m_iParity;
+};
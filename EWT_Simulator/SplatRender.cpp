@@ -0,0 +1,425 @@
+//--------------------------------------------------------------------------------------
+// File: SplatRender.cpp
+//
+// Offline frames of a CPU run without a GPU. Steps the CPU simulator from the lattice
+// and renders every few steps with the headless splat renderer (SplatRenderer.h),
+// writing the frames as numbered PPM files, or through the asynchronous frame encoder
+// (FrameEncoder.h) as PNG files, a Y4M video or raw RGB. Per frame times of the binning
+// and blending passes are printed, with the step time for comparison, and the encoder's
+// written, dropped and blocked frame counts at the end. With --heatmap the frames are
+// density heatmaps instead of sprites. With --feed every step's particles are also
+// published to a shared memory live feed (LiveFeed.h) for LiveFeedSubscriber and other
+// analysis processes. --record writes every step to a trajectory file (TrajectoryStore.h)
+// and --replay renders a recorded run instead of simulating, with the time to seek and
+// decode each frame in place of the step time. --coarse reduces every step inside the
+// simulator to coarse cell fields and radial profiles (CoarseGrain.h) and writes those
+// instead, typically with --record dumping the particles every few hundred steps only.
+// --stats has the integrate pass reduce every step to energies, momentum and extremes
+// (FluidStepStatistics) and prints them under each frame.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread SplatRender.cpp SplatRenderer.cpp FrameEncoder.cpp LiveFeed.cpp
+//       TrajectoryStore.cpp CoarseGrain.cpp FluidCPU.cpp BoundarySDF.cpp ParticleMesh.cpp FFT.cpp BarnesHut.cpp
+//       StageProfiler.cpp PerfCounters.cpp ThreadPool.cpp -lrt
+//
+// Usage: SplatRender [--particles P] [--steps S] [--every K] [--width W] [--height H]
+//                    [--size S] [--tile T] [--threads T] [--fit] [--out PATH]
+//                    [--format F] [--queue N] [--drop] [--heatmap Q] [--bin B]
+//                    [--feed NAME] [--feed-slots N] [--record PATH] [--keyframes K]
+//                    [--record-every K] [--replay PATH] [--coarse PATH] [--coarse-block B]
+//                    [--radial N] [--stats]
+//   --steps      steps simulated, 0 renders the initial state only
+//   --every      steps between frames, the initial state is always rendered
+//   --size       half the side of a sprite, in simulation units as g_fParticleRenderSize
+//                Sprites narrower than a pixel can miss every pixel centre and vanish,
+//                as on the GPU
+//   --fit        frame the initial particles instead of the viewer's map, for runs too
+//                large for the map
+//   --out        ppm and png frames are written to PATH00000.ppm, PATH00001.ppm, ...,
+//                y4m and raw frames to the file PATH; nothing is written without it
+//   --format     ppm (written by this thread, the default), png, y4m or raw (encoded
+//                on the encoder's threads)
+//   --queue      frames the encoder holds, 8 by default
+//   --drop       drop frames while the encoder is full instead of waiting for it
+//   --heatmap    colour bins of pixels by count, density or displacement; the ramp runs
+//                from 0 to the fullest bin of every frame
+//   --bin        pixels on a side of a heatmap bin, 2 by default
+//   --feed       shared memory object of the live feed, e.g. /ewt_feed (Linux needs
+//                the leading slash), replaced if it exists and removed at the end
+//   --feed-slots frames kept in the live feed for slow readers, 8 by default
+//   --record     trajectory file of every step, initial state included
+//   --keyframes  frames from one keyframe to the next in the recording, 32 by default
+//   --record-every  steps between the recorded frames, 1 by default; the last step is
+//                always recorded
+//   --replay     trajectory file to render, up to its last step; --particles and
+//                --steps are ignored
+//   --coarse     field file of every simulated step but the last, each record holding
+//                the state the step started from
+//   --coarse-block  grid cells per coarse cell on a side, 4 by default
+//   --radial     bins of the radial profile, 0 (the default) for none; together they
+//                reach 1.5 times the lattice's half side from its centre
+//   --stats      kinetic, elastic and total energy, momentum, top speed and density range
+//                of the last step, and the speed histogram of the final step at the end
+//--------------------------------------------------------------------------------------
+#include "FrameEncoder.h"
+#include "CoarseGrain.h"
+#include "LiveFeed.h"
+#include "SplatRenderer.h"
+#include "ThreadPool.h"
+#include "TrajectoryStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+namespace
+{
+    // The default lattice spacing unless the lattice would not fit the simulation grid,
+    // as in StageBenchmark
+    float GetSpacing( unsigned int iNumParticles, const FluidParameters& params )
+    {
+        const float fGridSize = CFluidSimulatorCPU::GRID_DIM * params.fSmoothlen * 0.9f;
+        return std::min( params.fInitialParticleSpacing, fGridSize / sqrtf( (float)std::max( iNumParticles, 1u ) ) );
+    }
+
+    bool WriteFrame( const CSplatRenderer& renderer, const char* szPrefix, unsigned int iFrame )
+    {
+        char szPath[1024];
+        snprintf( szPath, sizeof( szPath ), "%s%05u.ppm", szPrefix, iFrame );
+        if ( renderer.WritePPM( szPath ) )
+            return true;
+        fprintf( stderr, "cannot write %s\n", szPath );
+        return false;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    unsigned int iNumParticles = 65536;
+    unsigned int iNumSteps = 100;
+    unsigned int iEvery = 10;
+    unsigned int iWidth = 1280;
+    unsigned int iHeight = 960;
+    unsigned int iTileSize = 64;
+    unsigned int iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    float fSize = SPLAT_PARTICLE_SIZE;
+    bool bFit = false;
+    const char* szPrefix = nullptr;
+    const char* szFormat = "ppm";
+    FrameEncoderOptions encoderOptions = FrameDefaultEncoderOptions();
+    const char* szHeatmap = nullptr;
+    unsigned int iBinSize = 2;
+    const char* szFeed = nullptr;
+    unsigned int iFeedSlots = 8;
+    const char* szRecord = nullptr;
+    unsigned int iKeyframeInterval = 32;
+    unsigned int iRecordEvery = 1;
+    const char* szReplay = nullptr;
+    const char* szCoarse = nullptr;
+    CoarseGrainSettings coarseSettings = CoarseGrainDefaultSettings();
+    bool bStats = false;
+    bool bUsage = false;
+
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--particles" ) && bHasValue )
+            iNumParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--steps" ) && bHasValue )
+            iNumSteps = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--every" ) && bHasValue )
+            iEvery = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--width" ) && bHasValue )
+            iWidth = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--height" ) && bHasValue )
+            iHeight = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--size" ) && bHasValue )
+            fSize = (float)atof( argv[++i] );
+        else if ( !strcmp( argv[i], "--tile" ) && bHasValue )
+            iTileSize = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--threads" ) && bHasValue )
+            iNumThreads = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--fit" ) )
+            bFit = true;
+        else if ( !strcmp( argv[i], "--out" ) && bHasValue )
+            szPrefix = argv[++i];
+        else if ( !strcmp( argv[i], "--format" ) && bHasValue )
+            szFormat = argv[++i];
+        else if ( !strcmp( argv[i], "--queue" ) && bHasValue )
+            encoderOptions.iQueueFrames = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--drop" ) )
+            encoderOptions.bBlockWhenFull = false;
+        else if ( !strcmp( argv[i], "--heatmap" ) && bHasValue )
+            szHeatmap = argv[++i];
+        else if ( !strcmp( argv[i], "--bin" ) && bHasValue )
+            iBinSize = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--feed" ) && bHasValue )
+            szFeed = argv[++i];
+        else if ( !strcmp( argv[i], "--feed-slots" ) && bHasValue )
+            iFeedSlots = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--record" ) && bHasValue )
+            szRecord = argv[++i];
+        else if ( !strcmp( argv[i], "--keyframes" ) && bHasValue )
+            iKeyframeInterval = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--record-every" ) && bHasValue )
+            iRecordEvery = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--replay" ) && bHasValue )
+            szReplay = argv[++i];
+        else if ( !strcmp( argv[i], "--coarse" ) && bHasValue )
+            szCoarse = argv[++i];
+        else if ( !strcmp( argv[i], "--coarse-block" ) && bHasValue )
+            coarseSettings.iCellBlock = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--radial" ) && bHasValue )
+            coarseSettings.iRadialBins = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--stats" ) )
+            bStats = true;
+        else
+            bUsage = true;
+    }
+
+    const bool bEncoder = strcmp( szFormat, "ppm" ) != 0;
+    if ( !strcmp( szFormat, "png" ) )
+        encoderOptions.eFormat = FRAME_FORMAT_PNG;
+    else if ( !strcmp( szFormat, "y4m" ) )
+        encoderOptions.eFormat = FRAME_FORMAT_Y4M;
+    else if ( !strcmp( szFormat, "raw" ) )
+        encoderOptions.eFormat = FRAME_FORMAT_RAW;
+    else if ( bEncoder )
+        bUsage = true;
+
+    SplatHeatmapQuantity eHeatmap = SPLAT_HEATMAP_COUNT;
+    if ( szHeatmap && !strcmp( szHeatmap, "density" ) )
+        eHeatmap = SPLAT_HEATMAP_DENSITY;
+    else if ( szHeatmap && !strcmp( szHeatmap, "displacement" ) )
+        eHeatmap = SPLAT_HEATMAP_DISPLACEMENT;
+    else if ( szHeatmap && strcmp( szHeatmap, "count" ) )
+        bUsage = true;
+
+    if ( bUsage )
+    {
+        fprintf( stderr, "Usage: %s [--particles P] [--steps S] [--every K] [--width W] [--height H]\n"
+                         "       [--size S] [--tile T] [--threads T] [--fit] [--out PATH]\n"
+                         "       [--format ppm|png|y4m|raw] [--queue N] [--drop]\n"
+                         "       [--heatmap count|density|displacement] [--bin B]\n"
+                         "       [--feed NAME] [--feed-slots N] [--record PATH] [--keyframes K]\n"
+                         "       [--record-every K] [--replay PATH] [--coarse PATH] [--coarse-block B]\n"
+                         "       [--radial N] [--stats]\n", argv[0] );
+        return 2;
+    }
+
+    SetThreadPoolSize( iNumThreads );
+
+    FluidParameters params = FluidDefaultParameters();
+    params.fInitialParticleSpacing = GetSpacing( iNumParticles, params );
+
+    CFluidSimulatorCPU simulator;
+    simulator.SetParticles( FluidCreateLattice( iNumParticles, params.fInitialParticleSpacing ) );
+    simulator.SetStatistics( bStats && !szReplay );
+
+    // A replay renders the recorded frames in place of the simulator's
+    CTrajectoryReader replay;
+    std::vector<FluidParticle> replayParticles;
+    std::vector<float> replayDensities;
+    if ( szReplay )
+    {
+        if ( !replay.Open( szReplay ) || replay.GetNumFrames() == 0 || !replay.ReadFrame( 0, replayParticles, replayDensities ) )
+        {
+            fprintf( stderr, "cannot read the trajectory %s\n", szReplay );
+            return 1;
+        }
+        iNumParticles = (unsigned int)replayParticles.size();
+        iNumSteps = (unsigned int)replay.GetFrameInfo( replay.GetNumFrames() - 1 ).iStep;
+        printf( "%s: %zu frames up to step %u%s\n", szReplay, replay.GetNumFrames(), iNumSteps,
+                replay.IsRecovered() ? ", index rebuilt" : "" );
+    }
+
+    CSplatRenderer renderer;
+    renderer.SetTileSize( iTileSize );
+    renderer.SetFramebufferSize( iWidth, iHeight );
+    renderer.SetParticleSize( fSize );
+    if ( szHeatmap )
+    {
+        renderer.SetMode( SPLAT_MODE_HEATMAP );
+        renderer.SetHeatmap( eHeatmap, iBinSize, 0.0f, 0.0f );
+    }
+    renderer.SetView( bFit ? SplatFitView( szReplay ? replayParticles : simulator.GetParticles(), fSize, renderer.GetWidth(), renderer.GetHeight() ) : SplatDefaultView() );
+
+    CFrameEncoder encoder;
+    if ( szPrefix && bEncoder )
+    {
+        encoderOptions.szPath = szPrefix;
+        if ( !encoder.Open( encoderOptions ) )
+        {
+            fprintf( stderr, "cannot open %s\n", szPrefix );
+            return 1;
+        }
+    }
+
+    CLiveFeedPublisher feed;
+    if ( szFeed && !feed.Create( szFeed, iFeedSlots, iNumParticles ) )
+    {
+        fprintf( stderr, "cannot create the live feed %s\n", szFeed );
+        return 1;
+    }
+
+    CTrajectoryWriter recording;
+    if ( szRecord && !recording.Open( szRecord, iKeyframeInterval ) )
+    {
+        fprintf( stderr, "cannot open %s\n", szRecord );
+        return 1;
+    }
+
+    // The simulator reduces each step's sorted cells as it goes
+    CCoarseGrainer coarseGrainer;
+    CCoarseFieldWriter coarseFields;
+    if ( szCoarse && !szReplay )
+    {
+        const float fHalfSide = 0.5f * params.fInitialParticleSpacing * sqrtf( (float)iNumParticles );
+        coarseSettings.fRadialBinWidth = 1.5f * fHalfSide / std::max( coarseSettings.iRadialBins, 1u );
+        coarseGrainer.SetSettings( coarseSettings );
+        if ( !coarseFields.Open( szCoarse ) )
+        {
+            fprintf( stderr, "cannot open %s\n", szCoarse );
+            return 1;
+        }
+        params.pCoarseGrainer = &coarseGrainer;
+    }
+
+    printf( "%u particles, %ux%u pixels in %u pixel tiles, %u threads\n\n", iNumParticles, renderer.GetWidth(),
+            renderer.GetHeight(), iTileSize, GetThreadPool().GetNumThreads() );
+    printf( "%6s %6s %10s %12s %10s %10s %10s\n", "frame", "step", "splats", "bin entries", "bin ms", "blend ms",
+            szReplay ? "seek ms" : "step ms" );
+
+    double fStepMs = 0, fTotalBinMs = 0, fTotalBlendMs = 0;
+    unsigned int iNumFrames = 0;
+    for ( unsigned int iStep = 0 ; ; )
+    {
+        // Densities are those of the last step, none before the first
+        const std::vector<float> noDensities;
+        const std::vector<float>& densities = iStep > 0 ? simulator.GetDensities() : noDensities;
+        if ( feed.IsOpen() )
+            feed.Publish( iStep, iStep * (double)params.fTimeStep, simulator.GetParticles(), densities );
+        const bool bRecord = iStep % iRecordEvery == 0 || iStep == iNumSteps;
+        if ( bRecord && recording.IsOpen() && !recording.Write( iStep, iStep * (double)params.fTimeStep, simulator.GetParticles(), densities ) )
+        {
+            fprintf( stderr, "cannot write %s\n", szRecord );
+            return 1;
+        }
+
+        if ( iStep % iEvery == 0 || iStep == iNumSteps )
+        {
+            if ( szReplay )
+            {
+                auto start = std::chrono::steady_clock::now();
+                if ( !replay.ReadFrame( replay.FindStep( iStep ), replayParticles, replayDensities ) )
+                {
+                    fprintf( stderr, "cannot read step %u of %s\n", iStep, szReplay );
+                    return 1;
+                }
+                fStepMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+                renderer.Render( replayParticles, replayDensities );
+            }
+            else
+            {
+                renderer.Render( simulator.GetParticles(), densities );
+            }
+            const SplatRenderReport& report = renderer.GetReport();
+            printf( "%6u %6u %10zu %12zu %10.2f %10.2f %10.2f\n", iNumFrames, iStep, report.iNumSplats, report.iNumBinEntries,
+                    report.fBinMs, report.fBlendMs, fStepMs );
+            fTotalBinMs += report.fBinMs;
+            fTotalBlendMs += report.fBlendMs;
+
+            if ( simulator.GetStatistics() && iStep > 0 )
+            {
+                const FluidStepStatistics& stats = simulator.GetStepStatistics();
+                const double fEnergy = stats.fKineticEnergy + stats.fElasticEnergy;
+                printf( "       kinetic %.4e  elastic %.4e  total %.4e  momentum (%.2e, %.2e)  max speed %.4f  density %.1f..%.1f\n",
+                        stats.fKineticEnergy, stats.fElasticEnergy, fEnergy, stats.fMomentumX, stats.fMomentumY, stats.fMaxSpeed,
+                        stats.fMinDensity, stats.fMaxDensity );
+            }
+
+            if ( encoder.IsOpen() )
+                encoder.Submit( renderer.GetPixels().data(), renderer.GetWidth(), renderer.GetHeight(), renderer.GetWidth() * 4 );
+            else if ( szPrefix && !WriteFrame( renderer, szPrefix, iNumFrames ) )
+                return 1;
+            iNumFrames++;
+        }
+
+        if ( iStep == iNumSteps )
+            break;
+
+        if ( !szReplay )
+        {
+            auto start = std::chrono::steady_clock::now();
+            simulator.Step( params );
+            fStepMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+            if ( coarseFields.IsOpen() && !coarseFields.Write( iStep, iStep * (double)params.fTimeStep, coarseGrainer.GetFrame() ) )
+            {
+                fprintf( stderr, "cannot write %s\n", szCoarse );
+                return 1;
+            }
+        }
+        iStep++;
+    }
+
+    printf( "\n%u frames, %.2f ms per frame (bin %.2f, blend %.2f)\n", iNumFrames, (fTotalBinMs + fTotalBlendMs) / iNumFrames,
+            fTotalBinMs / iNumFrames, fTotalBlendMs / iNumFrames );
+    if ( simulator.GetStatistics() && iNumSteps > 0 )
+    {
+        // Up to the last occupied bin
+        const uint32_t* pHistogram = simulator.GetStepStatistics().SpeedHistogram;
+        unsigned int iNumBins = FLUID_STATISTICS_BINS;
+        while ( iNumBins > 1 && pHistogram[iNumBins - 1] == 0 )
+            iNumBins--;
+        printf( "speeds of the last step in bins of %g:", FLUID_STATISTICS_MAX_SPEED / FLUID_STATISTICS_BINS );
+        for ( unsigned int i = 0 ; i < iNumBins ; i++ )
+            printf( " %u", pHistogram[i] );
+        printf( "\n" );
+    }
+    if ( feed.IsOpen() )
+        printf( "live feed: %llu frames published to %s\n", (unsigned long long)feed.GetNumPublished(), szFeed );
+    if ( recording.IsOpen() )
+    {
+        const bool bOk = recording.Close();
+        const TrajectoryWriterReport report = recording.GetReport();
+        printf( "recording: %llu frames (%llu keyframes), %.1f MB of %.1f MB, %s\n", (unsigned long long)report.iFrames,
+                (unsigned long long)report.iKeyframes, report.iWrittenBytes / (1024.0 * 1024.0), report.iRawBytes / (1024.0 * 1024.0),
+                bOk ? "saved" : "failed" );
+        if ( !bOk )
+            return 1;
+    }
+
+    if ( coarseFields.IsOpen() )
+    {
+        // Against the particles and densities of the same steps
+        const bool bOk = coarseFields.Close();
+        const CoarseFieldReport report = coarseFields.GetReport();
+        const double fRawBytes = (double)report.iFrames * iNumParticles * (sizeof( FluidParticle ) + sizeof( float ));
+        const CoarseGrainFrame& frame = coarseGrainer.GetFrame();
+        printf( "coarse fields: %llu frames of %ux%u of %ux%u cells, %.2f MB, %.0f times less than the particles, %s\n",
+                (unsigned long long)report.iFrames, frame.iWidth, frame.iHeight, frame.iDim, frame.iDim,
+                report.iWrittenBytes / (1024.0 * 1024.0), fRawBytes / std::max<uint64_t>( report.iWrittenBytes, 1 ),
+                bOk ? "saved" : "failed" );
+        if ( !bOk )
+            return 1;
+    }
+
+    if ( encoder.IsOpen() )
+    {
+        const bool bOk = encoder.Close();
+        const FrameEncoderReport report = encoder.GetReport();
+        printf( "encoder: %llu frames written (%.1f MB), %llu dropped, %llu blocked for %.1f ms, %llu errors\n",
+                (unsigned long long)report.iWritten, report.iBytesWritten / (1024.0 * 1024.0), (unsigned long long)report.iDropped,
+                (unsigned long long)report.iBlocked, report.fBlockedMs, (unsigned long long)report.iErrors );
+        if ( !bOk )
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,512 @@
+//--------------------------------------------------------------------------------------
+// File: SplatRenderer.cpp
+//
+// Binning and blending of the headless splat renderer
+//--------------------------------------------------------------------------------------
+#include "SplatRenderer.h"
+#include "StageProfiler.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+    // Rainbow in FluidRender.hlsl
+    const float RAINBOW[2][4] = {
+        { 1.00f, 0.60f, 0.00f, 0.775f },
+        { 1.00f, 0.00f, 0.00f, 0.955f },
+    };
+
+    const unsigned int MAX_FRAMEBUFFER_SIZE = 65535;
+
+    // Particles binned by one thread at a time, a chunk's counts cover every tile
+    const size_t BIN_GRAIN = 65536;
+
+    double MillisecondsSince( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    // First pixel whose centre is at or right of fEdge, the rasteriser's top-left rule
+    int FirstPixel( float fEdge )
+    {
+        return (int)ceilf( fEdge - 0.5f );
+    }
+
+    uint32_t ToUnorm8( float f )
+    {
+        return (uint32_t)(std::min( std::max( f, 0.0f ), 1.0f ) * 255.0f + 0.5f);
+    }
+
+    // saturate( (n - lower) / (upper - lower) ) of VisualizeNumber
+    float GetRamp( float fValue, float fLower, float fUpper )
+    {
+        const float fRange = fUpper - fLower;
+        const float fRamp = (fRange != 0.0f) ? (fValue - fLower) / fRange : (fValue >= fUpper ? 1.0f : 0.0f);
+        return std::min( std::max( fRamp, 0.0f ), 1.0f );
+    }
+
+    // The ramp's colour blended once over black, as a packed RGBA8 pixel
+    uint32_t GetRampPixel( float t )
+    {
+        float vColor[4];
+        for ( int c = 0 ; c < 4 ; c++ )
+            vColor[c] = RAINBOW[0][c] + (RAINBOW[1][c] - RAINBOW[0][c]) * t;
+        return ToUnorm8( vColor[0] * vColor[3] ) | (ToUnorm8( vColor[1] * vColor[3] ) << 8) |
+               (ToUnorm8( vColor[2] * vColor[3] ) << 16) | (ToUnorm8( vColor[3] ) << 24);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+SplatView SplatDefaultView()
+{
+    SplatView view = { 0.0f, 0.0f, SPLAT_MAP_WIDTH, SPLAT_MAP_HEIGHT };
+    return view;
+}
+
+
+//--------------------------------------------------------------------------------------
+SplatView SplatFitView( const std::vector<FluidParticle>& Particles, float fParticleSize, unsigned int iWidth, unsigned int iHeight )
+{
+    if ( Particles.empty() || iWidth == 0 || iHeight == 0 )
+        return SplatDefaultView();
+
+    float fMinX = Particles[0].vPosition.x, fMaxX = fMinX;
+    float fMinY = Particles[0].vPosition.y, fMaxY = fMinY;
+    for ( const FluidParticle& p : Particles )
+    {
+        fMinX = std::min( fMinX, p.vPosition.x );
+        fMaxX = std::max( fMaxX, p.vPosition.x );
+        fMinY = std::min( fMinY, p.vPosition.y );
+        fMaxY = std::max( fMaxY, p.vPosition.y );
+    }
+
+    const float fAspect = (float)iWidth / (float)iHeight;
+    float fWidth = fMaxX - fMinX + 2 * fParticleSize;
+    float fHeight = fMaxY - fMinY + 2 * fParticleSize;
+    if ( fWidth > fHeight * fAspect )
+        fHeight = fWidth / fAspect;
+    else
+        fWidth = fHeight * fAspect;
+
+    SplatView view = { (fMinX + fMaxX - fWidth) / 2, (fMinY + fMaxY - fHeight) / 2, fWidth, fHeight };
+    return view;
+}
+
+
+//--------------------------------------------------------------------------------------
+CSplatRenderer::CSplatRenderer() :
+    m_iWidth( 0 ),
+    m_iHeight( 0 ),
+    m_iTileSize( 64 ),
+    m_iTileSide( 64 ),
+    m_iTilesX( 0 ),
+    m_iTilesY( 0 ),
+    m_View( SplatDefaultView() ),
+    m_fParticleSize( SPLAT_PARTICLE_SIZE ),
+    m_fDensityLower( SPLAT_DENSITY_LOWER ),
+    m_fDensityUpper( SPLAT_DENSITY_UPPER ),
+    m_eMode( SPLAT_MODE_SPRITES ),
+    m_eHeatmapQuantity( SPLAT_HEATMAP_COUNT ),
+    m_iBinSize( 2 ),
+    m_iBinsX( 0 ),
+    m_iBinsY( 0 ),
+    m_fHeatmapLower( 0.0f ),
+    m_fHeatmapUpper( 0.0f ),
+    m_iNumChunks( 0 ),
+    m_Report()
+{
+    SetFramebufferSize( 1280, 960 );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::SetFramebufferSize( unsigned int iWidth, unsigned int iHeight )
+{
+    m_iWidth = std::min( std::max( iWidth, 1u ), MAX_FRAMEBUFFER_SIZE );
+    m_iHeight = std::min( std::max( iHeight, 1u ), MAX_FRAMEBUFFER_SIZE );
+    m_Pixels.assign( (size_t)m_iWidth * m_iHeight, 0xFF000000 );
+    UpdateTiles();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::SetTileSize( unsigned int iTileSize )
+{
+    m_iTileSize = std::max( iTileSize, 8u );
+    UpdateTiles();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::SetMode( SplatRenderMode eMode )
+{
+    m_eMode = eMode;
+    UpdateTiles();
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::SetHeatmap( SplatHeatmapQuantity eQuantity, unsigned int iBinSize, float fLower, float fUpper )
+{
+    m_eHeatmapQuantity = eQuantity;
+    m_iBinSize = std::min( std::max( iBinSize, 1u ), 256u );
+    m_fHeatmapLower = fLower;
+    m_fHeatmapUpper = fUpper;
+    UpdateTiles();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Tile and bin grids of the framebuffer. A heatmap tile is a whole number of bins so no
+// bin is shared by two tiles.
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::UpdateTiles()
+{
+    m_iTileSide = m_iTileSize;
+    if ( m_eMode == SPLAT_MODE_HEATMAP )
+        m_iTileSide = (m_iTileSize + m_iBinSize - 1) / m_iBinSize * m_iBinSize;
+
+    m_iTilesX = (m_iWidth + m_iTileSide - 1) / m_iTileSide;
+    m_iTilesY = (m_iHeight + m_iTileSide - 1) / m_iTileSide;
+    m_iBinsX = (m_iWidth + m_iBinSize - 1) / m_iBinSize;
+    m_iBinsY = (m_iHeight + m_iBinSize - 1) / m_iBinSize;
+}
+
+
+//--------------------------------------------------------------------------------------
+// The pixels the sprite of ParticleGS covers, false if none
+//--------------------------------------------------------------------------------------
+bool CSplatRenderer::GetSplat( const FluidParticle& p, float fDensity, SplatRecord& splat ) const
+{
+    const float fScaleX = m_iWidth / m_View.fWidth;
+    const float fScaleY = m_iHeight / m_View.fHeight;
+    const float fTop = m_View.fBottom + m_View.fHeight;
+
+    const float fX0 = (p.vPosition.x - m_fParticleSize - m_View.fLeft) * fScaleX;
+    const float fX1 = (p.vPosition.x + m_fParticleSize - m_View.fLeft) * fScaleX;
+    const float fY0 = (fTop - p.vPosition.y - m_fParticleSize) * fScaleY;
+    const float fY1 = (fTop - p.vPosition.y + m_fParticleSize) * fScaleY;
+
+    // Also rejects NaN positions
+    if ( !(fX1 > 0.0f && fX0 < (float)m_iWidth && fY1 > 0.0f && fY0 < (float)m_iHeight) )
+        return false;
+
+    const int iX0 = std::max( FirstPixel( fX0 ), 0 );
+    const int iX1 = std::min( FirstPixel( fX1 ), (int)m_iWidth );
+    const int iY0 = std::max( FirstPixel( fY0 ), 0 );
+    const int iY1 = std::min( FirstPixel( fY1 ), (int)m_iHeight );
+    if ( iX0 >= iX1 || iY0 >= iY1 )
+        return false;
+
+    splat.iX0 = (uint16_t)iX0;
+    splat.iX1 = (uint16_t)iX1;
+    splat.iY0 = (uint16_t)iY0;
+    splat.iY1 = (uint16_t)iY1;
+    splat.fValue = GetRamp( fDensity, m_fDensityLower, m_fDensityUpper );
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// The bin under the particle and the quantity it adds to the bin, false if off screen
+//--------------------------------------------------------------------------------------
+bool CSplatRenderer::GetHeatmapSplat( const FluidParticle& p, float fDensity, SplatRecord& splat ) const
+{
+    const float fX = (p.vPosition.x - m_View.fLeft) * (m_iWidth / m_View.fWidth);
+    const float fY = (m_View.fBottom + m_View.fHeight - p.vPosition.y) * (m_iHeight / m_View.fHeight);
+    if ( !(fX >= 0.0f && fX < (float)m_iWidth && fY >= 0.0f && fY < (float)m_iHeight) )
+        return false;
+
+    const unsigned int iX0 = (unsigned int)fX / m_iBinSize * m_iBinSize;
+    const unsigned int iY0 = (unsigned int)fY / m_iBinSize * m_iBinSize;
+    splat.iX0 = (uint16_t)iX0;
+    splat.iY0 = (uint16_t)iY0;
+    splat.iX1 = (uint16_t)std::min( iX0 + m_iBinSize, m_iWidth );
+    splat.iY1 = (uint16_t)std::min( iY0 + m_iBinSize, m_iHeight );
+
+    if ( m_eHeatmapQuantity == SPLAT_HEATMAP_DENSITY )
+        splat.fValue = fDensity;
+    else if ( m_eHeatmapQuantity == SPLAT_HEATMAP_DISPLACEMENT )
+        splat.fValue = hypotf( p.vPosition.x - p.vIndex.x, p.vPosition.y - p.vIndex.y );
+    else
+        splat.fValue = 1.0f;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Counting sort of the splats by tile. Every chunk of particles counts its entries per
+// tile, the counts are turned into offsets tile by tile and chunk by chunk, and every
+// chunk writes its entries at its offsets, so each tile lists its splats in particle
+// order whatever the thread count.
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::Bin( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities )
+{
+    const size_t iNumParticles = Particles.size();
+    const unsigned int iNumTiles = m_iTilesX * m_iTilesY;
+    const bool bDensities = Densities.size() >= iNumParticles;
+    const bool bHeatmap = m_eMode == SPLAT_MODE_HEATMAP;
+
+    m_iNumChunks = (unsigned int)std::max<size_t>( (iNumParticles + BIN_GRAIN - 1) / BIN_GRAIN, 1 );
+    const size_t iChunkSize = (iNumParticles + m_iNumChunks - 1) / m_iNumChunks;
+    m_ChunkCounts.assign( (size_t)m_iNumChunks * iNumTiles, 0 );
+    std::vector<size_t> chunkSplats( m_iNumChunks, 0 );
+
+    // Calls Func( splat, tile ) for every tile a splat of the chunk overlaps
+    auto ForEachSplat = [&]( size_t iChunk, const auto& Func )
+    {
+        size_t iNumSplats = 0;
+        const size_t iEnd = std::min( (iChunk + 1) * iChunkSize, iNumParticles );
+        for ( size_t i = iChunk * iChunkSize ; i < iEnd ; i++ )
+        {
+            SplatRecord splat;
+            const float fDensity = bDensities ? Densities[i] : (bHeatmap ? 0.0f : m_fDensityLower);
+            if ( !(bHeatmap ? GetHeatmapSplat( Particles[i], fDensity, splat ) : GetSplat( Particles[i], fDensity, splat )) )
+                continue;
+            iNumSplats++;
+
+            const unsigned int iTileX1 = (splat.iX1 - 1u) / m_iTileSide;
+            const unsigned int iTileY1 = (splat.iY1 - 1u) / m_iTileSide;
+            for ( unsigned int iTileY = splat.iY0 / m_iTileSide ; iTileY <= iTileY1 ; iTileY++ )
+            {
+                for ( unsigned int iTileX = splat.iX0 / m_iTileSide ; iTileX <= iTileX1 ; iTileX++ )
+                    Func( splat, iTileY * m_iTilesX + iTileX );
+            }
+        }
+        return iNumSplats;
+    };
+
+    GetThreadPool().ParallelFor( m_iNumChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t iChunk = iBegin ; iChunk < iEnd ; iChunk++ )
+        {
+            uint32_t* pCounts = &m_ChunkCounts[iChunk * iNumTiles];
+            chunkSplats[iChunk] = ForEachSplat( iChunk, [&]( const SplatRecord&, unsigned int iTile ) { pCounts[iTile]++; } );
+        }
+    } );
+
+    m_TileStarts.resize( iNumTiles + 1 );
+    uint32_t iOffset = 0;
+    for ( unsigned int iTile = 0 ; iTile < iNumTiles ; iTile++ )
+    {
+        m_TileStarts[iTile] = iOffset;
+        for ( unsigned int iChunk = 0 ; iChunk < m_iNumChunks ; iChunk++ )
+        {
+            uint32_t& iCount = m_ChunkCounts[(size_t)iChunk * iNumTiles + iTile];
+            const uint32_t iChunkCount = iCount;
+            iCount = iOffset;
+            iOffset += iChunkCount;
+        }
+    }
+    m_TileStarts[iNumTiles] = iOffset;
+
+    if ( m_Records.size() < iOffset )
+        m_Records.resize( iOffset );
+
+    GetThreadPool().ParallelFor( m_iNumChunks, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t iChunk = iBegin ; iChunk < iEnd ; iChunk++ )
+        {
+            uint32_t* pOffsets = &m_ChunkCounts[iChunk * iNumTiles];
+            ForEachSplat( iChunk, [&]( const SplatRecord& splat, unsigned int iTile ) { m_Records[pOffsets[iTile]++] = splat; } );
+        }
+    } );
+
+    m_Report.iNumBinEntries = iOffset;
+    for ( size_t iNumSplats : chunkSplats )
+        m_Report.iNumSplats += iNumSplats;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Blends every tile's splats over the black the viewer clears to: SRC_ALPHA /
+// INV_SRC_ALPHA on the colour, ONE / ZERO on the alpha. The tile is blended in float and
+// rounded to 8 bits once, where the GPU rounds after every splat.
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::Blend()
+{
+    const unsigned int iNumTiles = m_iTilesX * m_iTilesY;
+
+    GetThreadPool().ParallelFor( iNumTiles, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        std::vector<float> tile( (size_t)m_iTileSide * m_iTileSide * 4 );
+
+        for ( size_t iTile = iBegin ; iTile < iEnd ; iTile++ )
+        {
+            const unsigned int iTileX0 = (unsigned int)(iTile % m_iTilesX) * m_iTileSide;
+            const unsigned int iTileY0 = (unsigned int)(iTile / m_iTilesX) * m_iTileSide;
+            const unsigned int iTileX1 = std::min( iTileX0 + m_iTileSide, m_iWidth );
+            const unsigned int iTileY1 = std::min( iTileY0 + m_iTileSide, m_iHeight );
+
+            for ( size_t i = 0 ; i < tile.size() ; i += 4 )
+            {
+                tile[i] = tile[i + 1] = tile[i + 2] = 0.0f;
+                tile[i + 3] = 1.0f;
+            }
+
+            for ( uint32_t iRecord = m_TileStarts[iTile] ; iRecord < m_TileStarts[iTile + 1] ; iRecord++ )
+            {
+                const SplatRecord& splat = m_Records[iRecord];
+                const float t = splat.fValue;
+                float vColor[4];
+                for ( int c = 0 ; c < 4 ; c++ )
+                    vColor[c] = RAINBOW[0][c] + (RAINBOW[1][c] - RAINBOW[0][c]) * t;
+                const float fAlpha = vColor[3];
+                const float fKeep = 1.0f - fAlpha;
+                const float fR = vColor[0] * fAlpha, fG = vColor[1] * fAlpha, fB = vColor[2] * fAlpha;
+
+                const unsigned int iX0 = std::max<unsigned int>( splat.iX0, iTileX0 ) - iTileX0;
+                const unsigned int iX1 = std::min<unsigned int>( splat.iX1, iTileX1 ) - iTileX0;
+                const unsigned int iY0 = std::max<unsigned int>( splat.iY0, iTileY0 ) - iTileY0;
+                const unsigned int iY1 = std::min<unsigned int>( splat.iY1, iTileY1 ) - iTileY0;
+                for ( unsigned int y = iY0 ; y < iY1 ; y++ )
+                {
+                    float* pPixel = &tile[((size_t)y * m_iTileSide + iX0) * 4];
+                    for ( unsigned int x = iX0 ; x < iX1 ; x++, pPixel += 4 )
+                    {
+                        pPixel[0] = fR + pPixel[0] * fKeep;
+                        pPixel[1] = fG + pPixel[1] * fKeep;
+                        pPixel[2] = fB + pPixel[2] * fKeep;
+                        pPixel[3] = fAlpha;
+                    }
+                }
+            }
+
+            for ( unsigned int y = iTileY0 ; y < iTileY1 ; y++ )
+            {
+                const float* pPixel = &tile[(size_t)(y - iTileY0) * m_iTileSide * 4];
+                uint32_t* pOut = &m_Pixels[(size_t)y * m_iWidth + iTileX0];
+                for ( unsigned int x = iTileX0 ; x < iTileX1 ; x++, pPixel += 4 )
+                    *pOut++ = ToUnorm8( pPixel[0] ) | (ToUnorm8( pPixel[1] ) << 8) | (ToUnorm8( pPixel[2] ) << 16) | (ToUnorm8( pPixel[3] ) << 24);
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Sums every tile's heatmap splats into its bins. A tile's bins are its own, so the
+// tiles need no atomics, and each bin adds its particles in particle order.
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::Accumulate()
+{
+    const size_t iNumBins = (size_t)m_iBinsX * m_iBinsY;
+    m_BinCounts.assign( iNumBins, 0 );
+    m_BinSums.assign( iNumBins, 0.0f );
+
+    GetThreadPool().ParallelFor( (size_t)m_iTilesX * m_iTilesY, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        for ( size_t iTile = iBegin ; iTile < iEnd ; iTile++ )
+        {
+            for ( uint32_t iRecord = m_TileStarts[iTile] ; iRecord < m_TileStarts[iTile + 1] ; iRecord++ )
+            {
+                const SplatRecord& splat = m_Records[iRecord];
+                const size_t iBin = (size_t)(splat.iY0 / m_iBinSize) * m_iBinsX + splat.iX0 / m_iBinSize;
+                m_BinCounts[iBin]++;
+                m_BinSums[iBin] += splat.fValue;
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Colours every bin by its count or mean quantity, as HeatmapPS. Empty bins stay black.
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::Colour()
+{
+    const bool bCount = m_eHeatmapQuantity == SPLAT_HEATMAP_COUNT;
+    auto GetValue = [&]( size_t iBin ) { return bCount ? (float)m_BinCounts[iBin] : m_BinSums[iBin] / m_BinCounts[iBin]; };
+
+    float fLower = m_fHeatmapLower, fUpper = m_fHeatmapUpper;
+    if ( !(fUpper > fLower) )
+    {
+        fLower = 0.0f;
+        fUpper = 0.0f;
+        for ( size_t iBin = 0 ; iBin < m_BinCounts.size() ; iBin++ )
+        {
+            if ( m_BinCounts[iBin] )
+                fUpper = std::max( fUpper, GetValue( iBin ) );
+        }
+    }
+
+    GetThreadPool().ParallelFor( m_iBinsY, 1, [&]( size_t iBegin, size_t iEnd )
+    {
+        std::vector<uint32_t> row( m_iBinsX );
+        for ( size_t iBinY = iBegin ; iBinY < iEnd ; iBinY++ )
+        {
+            for ( unsigned int iBinX = 0 ; iBinX < m_iBinsX ; iBinX++ )
+            {
+                const size_t iBin = iBinY * m_iBinsX + iBinX;
+                row[iBinX] = m_BinCounts[iBin] ? GetRampPixel( GetRamp( GetValue( iBin ), fLower, fUpper ) ) : 0xFF000000;
+            }
+
+            const unsigned int iY1 = std::min( (unsigned int)(iBinY + 1) * m_iBinSize, m_iHeight );
+            for ( unsigned int y = (unsigned int)iBinY * m_iBinSize ; y < iY1 ; y++ )
+            {
+                uint32_t* pOut = &m_Pixels[(size_t)y * m_iWidth];
+                for ( unsigned int x = 0 ; x < m_iWidth ; x++ )
+                    pOut[x] = row[x / m_iBinSize];
+            }
+        }
+    } );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CSplatRenderer::Render( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities )
+{
+    m_Report = SplatRenderReport();
+    m_Report.iNumTiles = m_iTilesX * m_iTilesY;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        CScopedStageTimer timer( "Splat Bin" );
+        Bin( Particles, Densities );
+    }
+    m_Report.fBinMs = MillisecondsSince( start );
+
+    start = std::chrono::steady_clock::now();
+    if ( m_eMode == SPLAT_MODE_HEATMAP )
+    {
+        CScopedStageTimer timer( "Splat Heatmap" );
+        Accumulate();
+        Colour();
+    }
+    else
+    {
+        CScopedStageTimer timer( "Splat Blend" );
+        Blend();
+    }
+    m_Report.fBlendMs = MillisecondsSince( start );
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CSplatRenderer::WritePPM( const char* szPath ) const
+{
+    FILE* pFile = fopen( szPath, "wb" );
+    if ( !pFile )
+        return false;
+
+    fprintf( pFile, "P6\n%u %u\n255\n", m_iWidth, m_iHeight );
+    std::vector<uint8_t> row( (size_t)m_iWidth * 3 );
+    bool bOk = true;
+    for ( unsigned int y = 0 ; y < m_iHeight && bOk ; y++ )
+    {
+        const uint32_t* pPixel = &m_Pixels[(size_t)y * m_iWidth];
+        for ( unsigned int x = 0 ; x < m_iWidth ; x++ )
+        {
+            row[x * 3 + 0] = (uint8_t)(pPixel[x]);
+            row[x * 3 + 1] = (uint8_t)(pPixel[x] >> 8);
+            row[x * 3 + 2] = (uint8_t)(pPixel[x] >> 16);
+        }
+        bOk = fwrite( row.data(), 1, row.size(), pFile ) == row.size();
+    }
+    return (fclose( pFile ) == 0) && bOk;
+}
@@ -0,0 +1,160 @@
+//--------------------------------------------------------------------------------------
+// File: SplatRenderer.h
+//
+// Headless CPU version of RenderFluid. Every particle is drawn as the square sprite
+// ParticleGS emits, coloured by its density with the ramp of VisualizeNumber in
+// FluidRender.hlsl and alpha blended like g_pParticleBlendState, into an RGBA8
+// framebuffer. No Direct3D device or window is needed, so frames of large CPU runs can
+// be rendered on machines without a GPU.
+//
+// The framebuffer is split into square tiles. A parallel binning pass lists the splats
+// overlapping every tile, in particle order, and the tiles are then blended in
+// parallel, each in a small float buffer that stays in cache. Particles are blended in
+// the order they are given, as the GPU blends primitives in draw order, so a frame does
+// not depend on the thread count.
+//
+// The heatmap mode is the CPU version of HeatmapCS and HeatmapPS: every particle lands
+// in the square bin of pixels under its position and each bin is coloured once by its
+// particle count or the mean density or displacement of its particles. The binning pass
+// is shared with the sprites; tiles hold whole bins, so the tiles accumulate their bins
+// in parallel without atomics.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstdint>
+#include <vector>
+
+// The viewer's defaults (EWT_Simulator.cpp and FluidRender.hlsl)
+const float SPLAT_MAP_HEIGHT = 1.2f;
+const float SPLAT_MAP_WIDTH = (4.0f / 3.0f) * SPLAT_MAP_HEIGHT;
+const float SPLAT_PARTICLE_SIZE = 0.005f;      // g_fParticleRenderSize, half the sprite's side
+const float SPLAT_DENSITY_LOWER = 0.0f;         // VisualizeNumber range of ParticleVS
+const float SPLAT_DENSITY_UPPER = 650.0f;
+
+enum SplatRenderMode
+{
+    SPLAT_MODE_SPRITES,
+    SPLAT_MODE_HEATMAP
+};
+
+// Quantity coloured by the heatmap, HEATMAP_COUNT, ... in FluidRender.hlsl
+enum SplatHeatmapQuantity
+{
+    SPLAT_HEATMAP_COUNT,
+    SPLAT_HEATMAP_DENSITY,
+    SPLAT_HEATMAP_DISPLACEMENT      // Distance from the rest position
+};
+
+// Rectangle of the simulation plane shown by the framebuffer, y up
+struct SplatView
+{
+    float fLeft;
+    float fBottom;
+    float fWidth;
+    float fHeight;
+};
+
+// The viewer's map, [0, SPLAT_MAP_WIDTH] x [0, SPLAT_MAP_HEIGHT]
+SplatView SplatDefaultView();
+
+// Smallest view with the framebuffer's aspect ratio holding every particle and its sprite
+SplatView SplatFitView( const std::vector<FluidParticle>& Particles, float fParticleSize, unsigned int iWidth, unsigned int iHeight );
+
+// Work of the last Render
+struct SplatRenderReport
+{
+    size_t iNumSplats;              // Particles overlapping the framebuffer
+    size_t iNumBinEntries;          // Splat and tile pairs, more than iNumSplats at tile edges
+    unsigned int iNumTiles;
+    double fBinMs;
+    double fBlendMs;                // Or the heatmap's accumulation and colouring
+};
+
+//--------------------------------------------------------------------------------------
+class CSplatRenderer
+{
+public:
+    CSplatRenderer();
+
+    // At most 65535 pixels on a side
+    void SetFramebufferSize( unsigned int iWidth, unsigned int iHeight );
+    unsigned int GetWidth() const { return m_iWidth; }
+    unsigned int GetHeight() const { return m_iHeight; }
+
+    void SetView( const SplatView& view ) { m_View = view; }
+    const SplatView& GetView() const { return m_View; }
+
+    void SetParticleSize( float fSize ) { m_fParticleSize = fSize; }
+    void SetDensityRange( float fLower, float fUpper ) { m_fDensityLower = fLower; m_fDensityUpper = fUpper; }
+
+    // Pixels on a side of a tile, 64 by default. The heatmap rounds it up to whole bins.
+    void SetTileSize( unsigned int iTileSize );
+
+    void SetMode( SplatRenderMode eMode );
+    SplatRenderMode GetMode() const { return m_eMode; }
+
+    // Bins of iBinSize pixels on a side, colour ramp over [fLower, fUpper]. If fUpper is
+    // not above fLower the ramp runs from 0 to the largest bin of every frame.
+    void SetHeatmap( SplatHeatmapQuantity eQuantity, unsigned int iBinSize, float fLower, float fUpper );
+
+    // Densities[i] colours Particles[i]; if Densities is empty every particle takes
+    // the colour of the lower end of the range
+    void Render( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities );
+
+    // RGBA8 pixels of the last Render, top row first, red in the lowest byte
+    const std::vector<uint32_t>& GetPixels() const { return m_Pixels; }
+    const SplatRenderReport& GetReport() const { return m_Report; }
+
+    // Binary PPM (P6) of the RGB channels
+    bool WritePPM( const char* szPath ) const;
+
+private:
+    // A splat's pixel rectangle [iX0, iX1) x [iY0, iY1) clipped to the framebuffer, and
+    // its position in the colour ramp. A heatmap splat is its bin, with the quantity.
+    struct SplatRecord
+    {
+        uint16_t iX0;
+        uint16_t iY0;
+        uint16_t iX1;
+        uint16_t iY1;
+        float fValue;
+    };
+
+    bool GetSplat( const FluidParticle& p, float fDensity, SplatRecord& splat ) const;
+    bool GetHeatmapSplat( const FluidParticle& p, float fDensity, SplatRecord& splat ) const;
+    void UpdateTiles();
+    void Bin( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities );
+    void Blend();
+    void Accumulate();
+    void Colour();
+
+    unsigned int                m_iWidth;
+    unsigned int                m_iHeight;
+    unsigned int                m_iTileSize;        // As set
+    unsigned int                m_iTileSide;        // As used, whole bins in heatmap mode
+    unsigned int                m_iTilesX;
+    unsigned int                m_iTilesY;
+    SplatView                   m_View;
+    float                       m_fParticleSize;
+    float                       m_fDensityLower;
+    float                       m_fDensityUpper;
+
+    SplatRenderMode             m_eMode;
+    SplatHeatmapQuantity        m_eHeatmapQuantity;
+    unsigned int                m_iBinSize;
+    unsigned int                m_iBinsX;
+    unsigned int                m_iBinsY;
+    float                       m_fHeatmapLower;
+    float                       m_fHeatmapUpper;
+    std::vector<uint32_t>       m_BinCounts;
+    std::vector<float>          m_BinSums;
+
+    unsigned int                m_iNumChunks;
+    std::vector<uint32_t>       m_ChunkCounts;      // Entries of every chunk in every tile, then their offsets
+    std::vector<uint32_t>       m_TileStarts;       // Range of every tile in m_Records, one more than tiles
+    std::vector<SplatRecord>    m_Records;          // Grouped by tile, in particle order within a tile
+    std::vector<uint32_t>       m_Pixels;
+    SplatRenderReport           m_Report;
+};
@@ -0,0 +1,446 @@
+//--------------------------------------------------------------------------------------
+// File: StageBenchmark.cpp
+//
+// Regression benchmark of the CPU simulator. For every particle count, thread count and
+// initial condition it times each pass on its own (build grid, sort grid with every
+// FluidSortAlgorithm and a std::sort binning baseline, grid indices, rearrange,
+// density, force, integrate with and without the step statistics) and full steps end
+// to end, for the grid walk, neighbour list and packed variants of the neighbour
+// passes. Results are printed and written as JSON with pair interactions per second and
+// bytes per particle, to compare releases.
+// POSIX only, it is not part of the Windows project. Build with
+//   g++ -std=c++14 -O2 -pthread StageBenchmark.cpp FluidCPU.cpp CoarseGrain.cpp
+//       BoundarySDF.cpp ParticleMesh.cpp FFT.cpp BarnesHut.cpp StageProfiler.cpp PerfCounters.cpp
+//       ThreadPool.cpp
+//
+// Usage: StageBenchmark [--min-particles P] [--max-particles P] [--max-threads T]
+//                       [--initial LIST] [--variants LIST] [--repeat R] [--steps S]
+//                       [--json PATH] [--label NAME]
+//   --min/max-particles  sizes swept by factors of 4, the maximum always included
+//                        (8K to 16M by default)
+//   --max-threads        thread counts swept by factors of 2 from 1, hardware threads
+//                        by default
+//   --initial            comma separated lattice, random, clustered
+//   --variants           comma separated grid, lists, packed
+//   --repeat             runs of each pass, the median and fastest are reported
+//   --steps              full steps timed end to end
+//   --json               output file, StageBenchmark.json by default
+//   --label              stored in the JSON, e.g. the release being measured
+//
+// The grid is GRID_DIM cells of one smoothing length on a side. Sizes whose lattice
+// would not fit are packed closer so they still cover the grid; cells then hold more
+// particles and the JSON's candidates per particle grows accordingly. Sort Grid rows of
+// the grid variant are named after the algorithm (counting, radix, merge, std_sort);
+// the lists and packed variants time the default algorithm only.
+//--------------------------------------------------------------------------------------
+#include "FluidCPU.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+
+namespace
+{
+    struct BenchmarkOptions
+    {
+        unsigned int iMinParticles = 8192;
+        unsigned int iMaxParticles = 16u << 20;
+        unsigned int iMaxThreads = std::max( 1u, std::thread::hardware_concurrency() );
+        std::vector<std::string> Initial = { "lattice", "random", "clustered" };
+        std::vector<std::string> Variants = { "grid", "lists", "packed" };
+        unsigned int iRepeat = 5;
+        unsigned int iSteps = 5;
+        const char* szJsonPath = "StageBenchmark.json";
+        const char* szLabel = "";
+    };
+
+    struct StageResult
+    {
+        const char* szStage;
+        std::string Variant;
+        std::string Initial;
+        unsigned int iNumParticles;
+        unsigned int iNumThreads;
+        double fMedianMs;
+        double fMinMs;
+        double fInteractions;           // Pair candidates per run, 0 for the streaming passes
+        double fBytesPerParticle;
+    };
+
+    std::vector<std::string> SplitList( const char* szList )
+    {
+        std::vector<std::string> items;
+        std::string item;
+        for ( const char* p = szList ; ; p++ )
+        {
+            if ( *p == ',' || *p == 0 )
+            {
+                if ( !item.empty() )
+                    items.push_back( item );
+                item.clear();
+                if ( *p == 0 )
+                    break;
+            }
+            else
+                item += *p;
+        }
+        return items;
+    }
+
+    double ElapsedMs( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    // Median and fastest of iRepeat runs of Run, Prepare runs untimed before each
+    void TimeRuns( unsigned int iRepeat, const std::function<void()>& Prepare, const std::function<void()>& Run,
+                   double& fMedianMs, double& fMinMs )
+    {
+        std::vector<double> times;
+        for ( unsigned int r = 0 ; r < iRepeat ; r++ )
+        {
+            if ( Prepare )
+                Prepare();
+            auto start = std::chrono::steady_clock::now();
+            Run();
+            times.push_back( ElapsedMs( start ) );
+        }
+        std::sort( times.begin(), times.end() );
+        fMedianMs = times[times.size() / 2];
+        fMinMs = times.front();
+    }
+
+    // Spacing of the initial conditions, the default one unless the lattice would not
+    // fit the grid
+    float GetSpacing( unsigned int iNumParticles, const FluidParameters& params )
+    {
+        const float fGridSize = CFluidSimulatorCPU::GRID_DIM * params.fSmoothlen * 0.98f;
+        return std::min( params.fInitialParticleSpacing, fGridSize / sqrtf( (float)iNumParticles ) );
+    }
+
+    // The lattice, or the same number of particles uniformly or in Gaussian clusters
+    // over its square, each anchored where it starts
+    std::vector<FluidParticle> CreateParticles( const std::string& Initial, unsigned int iNumParticles, float fSpacing )
+    {
+        std::vector<FluidParticle> particles = FluidCreateLattice( iNumParticles, fSpacing );
+        if ( Initial == "lattice" )
+            return particles;
+
+        const float fSize = fSpacing * (unsigned int)sqrtf( (float)iNumParticles );
+        std::mt19937 rng( iNumParticles );
+        std::uniform_real_distribution<float> uniform( 0.0f, fSize );
+
+        const unsigned int NUM_CLUSTERS = 16;
+        FluidFloat2 clusters[NUM_CLUSTERS];
+        for ( FluidFloat2& c : clusters )
+            c = { uniform( rng ), uniform( rng ) };
+        std::normal_distribution<float> normal( 0.0f, fSize / 16 );
+
+        for ( size_t i = 0 ; i < particles.size() ; i++ )
+        {
+            FluidParticle& p = particles[i];
+            if ( Initial == "random" )
+                p.vPosition = { uniform( rng ), uniform( rng ) };
+            else
+            {
+                const FluidFloat2& c = clusters[i % NUM_CLUSTERS];
+                p.vPosition.x = std::min( std::max( c.x + normal( rng ), 0.0f ), fSize );
+                p.vPosition.y = std::min( std::max( c.y + normal( rng ), 0.0f ), fSize );
+            }
+            p.vIndex = p.vPosition;
+        }
+        return particles;
+    }
+
+    // Per particle traffic of the streaming passes, reads plus writes of the arrays each
+    // must touch. The neighbour passes report what their loops actually read.
+    double StreamBytesPerParticle( const char* szStage )
+    {
+        const double fParticle = sizeof( FluidParticle );
+        const double fPosition = sizeof( FluidFloat2 );
+        if ( !strcmp( szStage, "Build Grid" ) )
+            return fPosition + 4;                       // Position in, cell out
+        if ( !strcmp( szStage, "Grid Indices" ) )
+            return 4;                                   // Sorted cells in
+        if ( !strcmp( szStage, "Rearrange" ) )
+            return 4 + 2 * fParticle;                   // Id in, particle gathered and written
+        if ( !strcmp( szStage, "Integrate" ) )
+            return 2 * fParticle + fPosition;           // Particle read and written, acceleration in
+        return 0;
+    }
+
+    // Same for the sorts, whose traffic depends on the algorithm
+    double SortBytesPerParticle( FluidSortAlgorithm eSort )
+    {
+        switch ( eSort )
+        {
+            case FLUID_SORT_RADIX: return 4 + 8 + 4 + 8 + 8;    // Cell in, scratch out, y digits, scratch in, id and cell out
+            case FLUID_SORT_MERGE: return 4 + 8 + 8 + 8;        // Cell in, key written and read, id and cell out; merges not counted
+            default: return 4 + 4 + 4;                          // Cell in, id and cell out
+        }
+    }
+
+    void RunConfiguration( const BenchmarkOptions& options, const std::string& Initial, const std::string& Variant,
+                           unsigned int iNumParticles, unsigned int iNumThreads, std::vector<StageResult>& Results )
+    {
+        FluidParameters params = FluidDefaultParameters();
+        const float fSpacing = GetSpacing( iNumParticles, params );
+        const std::vector<FluidParticle> initial = CreateParticles( Initial, iNumParticles, fSpacing );
+
+        CFluidSimulatorCPU simulator;
+        simulator.SetNeighbourLists( Variant == "lists" );
+        simulator.SetCompressedStorage( Variant == "packed" );
+        simulator.SetParticles( initial );
+
+        // One step sizes the buffers and measures the cell costs the balancer uses
+        simulator.Step( params );
+        const double fInteractions = (double)simulator.GetBalanceReport().iInteractions;
+
+        auto add = [&]( const char* szStage, const char* szVariant, double fMedianMs, double fMinMs, double fPairs, double fBytes )
+        {
+            StageResult result = { szStage, szVariant, Initial, iNumParticles, iNumThreads, fMedianMs, fMinMs, fPairs, fBytes };
+            Results.push_back( result );
+            printf( "%-10s %-8s %9u %3u  %-13s %10.3f %10.3f %10.2f %10.2f %8.1f\n", Initial.c_str(), szVariant,
+                    iNumParticles, iNumThreads, szStage, fMedianMs, fMinMs, iNumParticles / (fMedianMs * 1e3),
+                    fPairs / (fMedianMs * 1e3), fBytes );
+            fflush( stdout );
+        };
+
+        const double N = (double)iNumParticles;
+        const char* szVariant = Variant.c_str();
+        double fMedianMs, fMinMs;
+
+        // Each pass again on the state the previous ones left, which stays the same as
+        // long as nothing integrates
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.BuildGrid( params ); }, fMedianMs, fMinMs );
+        add( "Build Grid", szVariant, fMedianMs, fMinMs, 0, StreamBytesPerParticle( "Build Grid" ) );
+
+        // The sort turns the histograms into offsets, so they are rebuilt before each run.
+        // The sort does not depend on the neighbour passes, so only the grid variant
+        // times every algorithm
+        const FluidSortAlgorithm eDefaultSort = simulator.GetSortAlgorithm();
+        for ( int s = 0 ; s < FLUID_SORT_COUNT ; s++ )
+        {
+            const FluidSortAlgorithm eSort = (FluidSortAlgorithm)s;
+            if ( Variant != "grid" && eSort != eDefaultSort )
+                continue;
+            simulator.SetSortAlgorithm( eSort );
+            TimeRuns( options.iRepeat, [&] { simulator.BuildGrid( params ); }, [&] { simulator.SortGrid(); }, fMedianMs, fMinMs );
+            add( "Sort Grid", (Variant == "grid") ? FluidSortAlgorithmName( eSort ) : szVariant, fMedianMs, fMinMs, 0, SortBytesPerParticle( eSort ) );
+        }
+        simulator.SetSortAlgorithm( eDefaultSort );
+
+        // Binning baseline, a comparison sort of (cell, id) keys
+        if ( Variant == "grid" )
+        {
+            std::vector<uint64_t> keys( iNumParticles );
+            const float fInvCellSize = 1.0f / params.fSmoothlen;
+            const float fMaxCell = (float)(CFluidSimulatorCPU::GRID_DIM - 1);
+            auto fill = [&]
+            {
+                const std::vector<FluidParticle>& particles = simulator.GetParticles();
+                for ( size_t i = 0 ; i < particles.size() ; i++ )
+                {
+                    const float x = std::min( std::max( particles[i].vPosition.x * fInvCellSize, 0.0f ), fMaxCell );
+                    const float y = std::min( std::max( particles[i].vPosition.y * fInvCellSize, 0.0f ), fMaxCell );
+                    const uint64_t cell = (uint64_t)y * CFluidSimulatorCPU::GRID_DIM + (uint64_t)x;
+                    keys[i] = (cell << 32) | i;
+                }
+            };
+            TimeRuns( options.iRepeat, fill, [&] { std::sort( keys.begin(), keys.end() ); }, fMedianMs, fMinMs );
+            add( "Sort Grid", "std_sort", fMedianMs, fMinMs, 0, 2.0 * sizeof( uint64_t ) );
+        }
+
+        // Back to the default algorithm's grid for the passes that follow
+        simulator.BuildGrid( params );
+        simulator.SortGrid();
+
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.BuildGridIndices(); }, fMedianMs, fMinMs );
+        add( "Grid Indices", szVariant, fMedianMs, fMinMs, 0, StreamBytesPerParticle( "Grid Indices" ) );
+
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.RearrangeParticles(); }, fMedianMs, fMinMs );
+        add( "Rearrange", szVariant, fMedianMs, fMinMs, 0, StreamBytesPerParticle( "Rearrange" ) );
+
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.Density( params ); }, fMedianMs, fMinMs );
+        const double fDensityBytes = (double)simulator.GetStorageReport().iNeighbourBytes;
+        add( "Density", szVariant, fMedianMs, fMinMs, fInteractions, fDensityBytes / N );
+
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.Force( params ); }, fMedianMs, fMinMs );
+        const double fForceBytes = (double)simulator.GetStorageReport().iNeighbourBytes - fDensityBytes;
+        add( "Force", szVariant, fMedianMs, fMinMs, fInteractions, fForceBytes / N );
+
+        // Integrating swaps the sorted and unsorted arrays, so later runs move other
+        // data of the same size
+        TimeRuns( options.iRepeat, nullptr, [&] { simulator.Integrate( params ); }, fMedianMs, fMinMs );
+        add( "Integrate", szVariant, fMedianMs, fMinMs, 0, StreamBytesPerParticle( "Integrate" ) );
+
+        // Same pass reducing the step statistics on the way, which reads the densities too
+        if ( Variant == "grid" )
+        {
+            simulator.SetStatistics( true );
+            TimeRuns( options.iRepeat, nullptr, [&] { simulator.Integrate( params ); }, fMedianMs, fMinMs );
+            add( "Integrate", "stats", fMedianMs, fMinMs, 0, StreamBytesPerParticle( "Integrate" ) + sizeof( float ) );
+            simulator.SetStatistics( false );
+        }
+
+        // End to end, from the initial state again
+        simulator.SetParticles( initial );
+        simulator.Step( params );
+        std::vector<double> steps;
+        double fStepInteractions = 0, fStepBytes = 0;
+        for ( unsigned int s = 0 ; s < std::max( 1u, options.iSteps ) ; s++ )
+        {
+            auto start = std::chrono::steady_clock::now();
+            simulator.Step( params );
+            steps.push_back( ElapsedMs( start ) );
+
+            const FluidStorageReport& report = simulator.GetStorageReport();
+            fStepInteractions += (double)simulator.GetBalanceReport().iInteractions;
+            fStepBytes += (double)(report.iNeighbourBytes + report.iStreamBytes);
+        }
+        const double fSteps = (double)steps.size();
+        std::sort( steps.begin(), steps.end() );
+        add( "Step", szVariant, steps[steps.size() / 2], steps.front(), fStepInteractions / fSteps, fStepBytes / fSteps / N );
+    }
+
+    void WriteJsonString( FILE* pFile, const std::string& s )
+    {
+        fputc( '"', pFile );
+        for ( char c : s )
+        {
+            if ( c == '"' || c == '\\' )
+                fputc( '\\', pFile );
+            if ( (unsigned char)c >= 0x20 )
+                fputc( c, pFile );
+        }
+        fputc( '"', pFile );
+    }
+
+    bool WriteJson( const BenchmarkOptions& options, const std::vector<StageResult>& Results )
+    {
+        FILE* pFile = fopen( options.szJsonPath, "w" );
+        if ( !pFile )
+            return false;
+
+        const FluidParameters params = FluidDefaultParameters();
+        fprintf( pFile, "{\n  \"benchmark\": \"StageBenchmark\",\n  \"label\": " );
+        WriteJsonString( pFile, options.szLabel );
+        fprintf( pFile, ",\n  \"hardware_threads\": %u,\n  \"repeat\": %u,\n  \"steps\": %u,\n  \"results\": [",
+                 std::thread::hardware_concurrency(), options.iRepeat, options.iSteps );
+
+        for ( size_t i = 0 ; i < Results.size() ; i++ )
+        {
+            const StageResult& r = Results[i];
+            fprintf( pFile, "%s\n    {\"stage\": ", i ? "," : "" );
+            WriteJsonString( pFile, r.szStage );
+            fprintf( pFile, ", \"variant\": " );
+            WriteJsonString( pFile, r.Variant );
+            fprintf( pFile, ", \"initial\": " );
+            WriteJsonString( pFile, r.Initial );
+            fprintf( pFile, ", \"particles\": %u, \"threads\": %u, \"spacing\": %.6g, \"median_ms\": %.6g, \"min_ms\": %.6g, "
+                     "\"particles_per_sec\": %.6g, \"pair_interactions_per_sec\": %.6g, \"candidates_per_particle\": %.6g, "
+                     "\"bytes_per_particle\": %.6g}",
+                     r.iNumParticles, r.iNumThreads, GetSpacing( r.iNumParticles, params ), r.fMedianMs, r.fMinMs,
+                     r.iNumParticles / (r.fMedianMs * 1e-3), r.fInteractions / (r.fMedianMs * 1e-3),
+                     r.fInteractions / r.iNumParticles, r.fBytesPerParticle );
+        }
+
+        fprintf( pFile, "\n  ]\n}\n" );
+        return fclose( pFile ) == 0;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+int main( int argc, char* argv[] )
+{
+    BenchmarkOptions options;
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        const bool bHasValue = i + 1 < argc;
+        if ( !strcmp( argv[i], "--min-particles" ) && bHasValue )
+            options.iMinParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--max-particles" ) && bHasValue )
+            options.iMaxParticles = (unsigned int)atoi( argv[++i] );
+        else if ( !strcmp( argv[i], "--max-threads" ) && bHasValue )
+            options.iMaxThreads = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--initial" ) && bHasValue )
+            options.Initial = SplitList( argv[++i] );
+        else if ( !strcmp( argv[i], "--variants" ) && bHasValue )
+            options.Variants = SplitList( argv[++i] );
+        else if ( !strcmp( argv[i], "--repeat" ) && bHasValue )
+            options.iRepeat = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--steps" ) && bHasValue )
+            options.iSteps = std::max( 1, atoi( argv[++i] ) );
+        else if ( !strcmp( argv[i], "--json" ) && bHasValue )
+            options.szJsonPath = argv[++i];
+        else if ( !strcmp( argv[i], "--label" ) && bHasValue )
+            options.szLabel = argv[++i];
+        else
+        {
+            fprintf( stderr, "Usage: %s [--min-particles P] [--max-particles P] [--max-threads T] [--initial LIST] "
+                     "[--variants LIST] [--repeat R] [--steps S] [--json PATH] [--label NAME]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    for ( const std::string& initial : options.Initial )
+    {
+        if ( initial != "lattice" && initial != "random" && initial != "clustered" )
+        {
+            fprintf( stderr, "unknown initial condition %s\n", initial.c_str() );
+            return 1;
+        }
+    }
+    for ( const std::string& variant : options.Variants )
+    {
+        if ( variant != "grid" && variant != "lists" && variant != "packed" )
+        {
+            fprintf( stderr, "unknown variant %s\n", variant.c_str() );
+            return 1;
+        }
+    }
+
+    std::vector<unsigned int> sizes;
+    for ( unsigned int n = std::max( 1u, options.iMinParticles ) ; n < options.iMaxParticles ; n *= 4 )
+        sizes.push_back( n );
+    sizes.push_back( options.iMaxParticles );
+
+    std::vector<unsigned int> threads;
+    for ( unsigned int t = 1 ; t < options.iMaxThreads ; t *= 2 )
+        threads.push_back( t );
+    threads.push_back( options.iMaxThreads );
+
+    printf( "%-10s %-8s %9s %3s  %-13s %10s %10s %10s %10s %8s\n", "initial", "variant", "particles", "thr", "stage",
+            "median ms", "min ms", "Mpart/s", "Mpairs/s", "B/part" );
+
+    std::vector<StageResult> results;
+    for ( unsigned int iNumThreads : threads )
+    {
+        SetThreadPoolSize( iNumThreads );
+        for ( unsigned int iNumParticles : sizes )
+        {
+            for ( const std::string& initial : options.Initial )
+            {
+                for ( const std::string& variant : options.Variants )
+                    RunConfiguration( options, initial, variant, iNumParticles, iNumThreads, results );
+            }
+        }
+    }
+
+    if ( !WriteJson( options, results ) )
+    {
+        fprintf( stderr, "cannot write %s\n", options.szJsonPath );
+        return 1;
+    }
+    printf( "\n%zu results written to %s\n", results.size(), options.szJsonPath );
+    return 0;
+}
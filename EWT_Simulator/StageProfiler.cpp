@@ -0,0 +1,232 @@
+//--------------------------------------------------------------------------------------
+// File: StageProfiler.cpp
+//
+// Lock-free ring of stage timings and its exports
+//--------------------------------------------------------------------------------------
+#include "StageProfiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+
+namespace
+{
+    // Small id per thread, in order of first use, for the Chrome trace tid
+    uint32_t GetThreadId()
+    {
+        static std::atomic<uint32_t> s_iNextId( 1 );
+        thread_local const uint32_t s_iId = s_iNextId.fetch_add( 1, std::memory_order_relaxed );
+        return s_iId;
+    }
+
+    // Nearest rank percentile of sorted values
+    double Percentile( const std::vector<double>& Sorted, double fFraction )
+    {
+        const size_t iRank = (size_t)std::ceil( fFraction * (double)Sorted.size() );
+        return Sorted[std::min( Sorted.size(), std::max<size_t>( iRank, 1 ) ) - 1];
+    }
+
+    FILE* OpenForWriting( const char* szPath )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, "w" ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, "w" );
+#endif
+    }
+
+    void WriteJsonString( FILE* pFile, const char* sz )
+    {
+        fputc( '"', pFile );
+        for ( ; *sz ; sz++ )
+        {
+            if ( *sz == '"' || *sz == '\\' )
+                fputc( '\\', pFile );
+            if ( (unsigned char)*sz >= 0x20 )
+                fputc( *sz, pFile );
+        }
+        fputc( '"', pFile );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CStageProfiler::CStageProfiler( size_t iCapacity ) :
+    m_iCapacity( 1 ),
+    m_iHead( 0 ),
+    m_iFrame( 0 ),
+    m_bEnabled( false ),
+    m_Epoch( std::chrono::steady_clock::now() )
+{
+    while ( m_iCapacity < iCapacity )
+        m_iCapacity <<= 1;
+
+    m_Slots.reset( new Slot[m_iCapacity] );
+    for ( size_t i = 0 ; i < m_iCapacity ; i++ )
+        m_Slots[i].iSequence.store( 0, std::memory_order_relaxed );
+}
+
+
+//--------------------------------------------------------------------------------------
+// Every writer claims the next sample with one fetch_add and publishes it through the
+// slot's sequence, a per slot seqlock. A writer that laps a slow one on the same slot
+// only costs that sample, which the readers then skip.
+//--------------------------------------------------------------------------------------
+void CStageProfiler::Record( const char* szName, StageTrack eTrack, double fStartUs, double fDurationUs, uint64_t iFrame )
+{
+    if ( !IsEnabled() )
+        return;
+
+    const uint64_t i = m_iHead.fetch_add( 1, std::memory_order_relaxed );
+    Slot& slot = m_Slots[i & (m_iCapacity - 1)];
+
+    slot.iSequence.store( 2 * i + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    StageSample& sample = slot.Sample;
+    strncpy( sample.szName, szName, sizeof( sample.szName ) - 1 );
+    sample.szName[sizeof( sample.szName ) - 1] = 0;
+    sample.iTrack = (uint32_t)eTrack;
+    sample.iThread = (eTrack == STAGE_TRACK_CPU) ? GetThreadId() : 0;
+    sample.iFrame = iFrame;
+    sample.fStartUs = fStartUs;
+    sample.fDurationUs = fDurationUs;
+
+    slot.iSequence.store( 2 * i + 2, std::memory_order_release );
+}
+
+
+//--------------------------------------------------------------------------------------
+void CStageProfiler::Snapshot( std::vector<StageSample>& Samples ) const
+{
+    Samples.clear();
+
+    const uint64_t iHead = m_iHead.load( std::memory_order_acquire );
+    const uint64_t iBegin = (iHead > m_iCapacity) ? iHead - m_iCapacity : 0;
+    Samples.reserve( (size_t)(iHead - iBegin) );
+
+    for ( uint64_t i = iBegin ; i < iHead ; i++ )
+    {
+        const Slot& slot = m_Slots[i & (m_iCapacity - 1)];
+        const uint64_t iSequence = slot.iSequence.load( std::memory_order_acquire );
+        if ( iSequence != 2 * i + 2 )
+            continue;
+
+        StageSample sample;
+        memcpy( &sample, &slot.Sample, sizeof( sample ) );
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if ( slot.iSequence.load( std::memory_order_relaxed ) != iSequence )
+            continue;
+
+        Samples.push_back( sample );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CStageProfiler::Clear()
+{
+    for ( size_t i = 0 ; i < m_iCapacity ; i++ )
+        m_Slots[i].iSequence.store( 0, std::memory_order_relaxed );
+    m_iHead.store( 0, std::memory_order_release );
+}
+
+
+//--------------------------------------------------------------------------------------
+std::vector<StageStatistics> CStageProfiler::GetStatistics() const
+{
+    std::vector<StageSample> samples;
+    Snapshot( samples );
+
+    // Group by track and name, keeping the order the stages first ran in
+    std::map<std::pair<uint32_t, std::string>, size_t> lookup;
+    std::vector<StageStatistics> statistics;
+    std::vector<std::vector<double>> durations;
+    for ( const StageSample& sample : samples )
+    {
+        auto key = std::make_pair( sample.iTrack, std::string( sample.szName ) );
+        auto it = lookup.find( key );
+        if ( it == lookup.end() )
+        {
+            it = lookup.insert( std::make_pair( key, statistics.size() ) ).first;
+            StageStatistics stage = {};
+            stage.Name = sample.szName;
+            stage.iTrack = sample.iTrack;
+            statistics.push_back( stage );
+            durations.emplace_back();
+        }
+        durations[it->second].push_back( sample.fDurationUs );
+    }
+
+    for ( size_t s = 0 ; s < statistics.size() ; s++ )
+    {
+        std::vector<double>& values = durations[s];
+        std::sort( values.begin(), values.end() );
+
+        double fTotal = 0;
+        for ( double f : values )
+            fTotal += f;
+
+        StageStatistics& stage = statistics[s];
+        stage.iCount = values.size();
+        stage.fMeanUs = fTotal / (double)values.size();
+        stage.fP50Us = Percentile( values, 0.50 );
+        stage.fP90Us = Percentile( values, 0.90 );
+        stage.fP99Us = Percentile( values, 0.99 );
+        stage.fMaxUs = values.back();
+    }
+    return statistics;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CStageProfiler::PrintStatistics( FILE* pFile ) const
+{
+    fprintf( pFile, "%-24s %5s %8s %10s %10s %10s %10s %10s\n", "stage", "track", "count", "mean us", "p50 us", "p90 us", "p99 us", "max us" );
+    for ( const StageStatistics& stage : GetStatistics() )
+    {
+        fprintf( pFile, "%-24s %5s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stage.Name.c_str(),
+                 (stage.iTrack == STAGE_TRACK_GPU) ? "GPU" : "CPU", stage.iCount,
+                 stage.fMeanUs, stage.fP50Us, stage.fP90Us, stage.fP99Us, stage.fMaxUs );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+// Complete ("X") events in the Trace Event Format, one process per track
+//--------------------------------------------------------------------------------------
+bool CStageProfiler::WriteChromeTrace( const char* szPath ) const
+{
+    std::vector<StageSample> samples;
+    Snapshot( samples );
+
+    FILE* pFile = OpenForWriting( szPath );
+    if ( !pFile )
+        return false;
+
+    fprintf( pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    fprintf( pFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"CPU\"}},\n", STAGE_TRACK_CPU + 1 );
+    fprintf( pFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"GPU\"}}", STAGE_TRACK_GPU + 1 );
+
+    for ( const StageSample& sample : samples )
+    {
+        fprintf( pFile, ",\n{\"name\":" );
+        WriteJsonString( pFile, sample.szName );
+        fprintf( pFile, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+                 (sample.iTrack == STAGE_TRACK_GPU) ? "gpu" : "cpu", sample.iTrack + 1, sample.iThread,
+                 sample.fStartUs, sample.fDurationUs, (unsigned long long)sample.iFrame );
+    }
+
+    fprintf( pFile, "\n]}\n" );
+    return fclose( pFile ) == 0;
+}
+
+
+//--------------------------------------------------------------------------------------
+CStageProfiler& GetStageProfiler()
+{
+    static CStageProfiler s_Profiler;
+    return s_Profiler;
+}
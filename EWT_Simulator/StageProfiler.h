@@ -0,0 +1,137 @@
+//--------------------------------------------------------------------------------------
+// File: StageProfiler.h
+//
+// Per stage timings of the simulator. CPU stages are timed with steady_clock by
+// CScopedStageTimer; the GPU path turns D3D11 timestamp queries into the same samples
+// (CGPUStageTimer). Samples go into a fixed size lock-free ring, overwriting the oldest,
+// from which they can be written out as a Chrome trace (chrome://tracing, Perfetto) or
+// summarised as per stage percentiles.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Timeline a sample belongs to, a process in the Chrome trace
+enum StageTrack
+{
+    STAGE_TRACK_CPU,
+    STAGE_TRACK_GPU
+};
+
+struct StageSample
+{
+    char szName[32];
+    uint32_t iTrack;            // StageTrack
+    uint32_t iThread;           // Small id of the recording thread, 0 on the GPU track
+    uint64_t iFrame;
+    double fStartUs;            // Since the profiler was created
+    double fDurationUs;
+};
+
+struct StageStatistics
+{
+    std::string Name;
+    uint32_t iTrack;
+    size_t iCount;
+    double fMeanUs;
+    double fP50Us;
+    double fP90Us;
+    double fP99Us;
+    double fMaxUs;
+};
+
+//--------------------------------------------------------------------------------------
+class CStageProfiler
+{
+public:
+    // iCapacity is rounded up to a power of two
+    explicit CStageProfiler( size_t iCapacity = 65536 );
+
+    CStageProfiler( const CStageProfiler& ) = delete;
+    CStageProfiler& operator=( const CStageProfiler& ) = delete;
+
+    // Disabled profilers record nothing, the scoped timers then cost one load
+    void SetEnabled( bool bEnable ) { m_bEnabled.store( bEnable, std::memory_order_relaxed ); }
+    bool IsEnabled() const { return m_bEnabled.load( std::memory_order_relaxed ); }
+
+    // Microseconds since the profiler was created
+    double Now() const
+    {
+        return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - m_Epoch ).count();
+    }
+
+    // Frame or step number stamped on the samples
+    void NextFrame() { m_iFrame.fetch_add( 1, std::memory_order_relaxed ); }
+    uint64_t GetFrame() const { return m_iFrame.load( std::memory_order_relaxed ); }
+
+    // Safe to call from any number of threads
+    void Record( const char* szName, StageTrack eTrack, double fStartUs, double fDurationUs, uint64_t iFrame );
+
+    // Copy of the samples in the ring, oldest first. Samples being written are skipped.
+    void Snapshot( std::vector<StageSample>& Samples ) const;
+
+    // Drops every sample, must not run concurrently with Record
+    void Clear();
+
+    // Per stage percentiles of the samples in the ring, in order of first appearance
+    std::vector<StageStatistics> GetStatistics() const;
+    void PrintStatistics( FILE* pFile ) const;
+
+    bool WriteChromeTrace( const char* szPath ) const;
+
+private:
+    // Sequence 2i + 1 while sample i is written, 2i + 2 once it is complete
+    struct Slot
+    {
+        std::atomic<uint64_t> iSequence;
+        StageSample Sample;
+    };
+
+    std::unique_ptr<Slot[]>                     m_Slots;
+    size_t                                      m_iCapacity;
+    std::atomic<uint64_t>                       m_iHead;        // Samples ever recorded
+    std::atomic<uint64_t>                       m_iFrame;
+    std::atomic<bool>                           m_bEnabled;
+    std::chrono::steady_clock::time_point       m_Epoch;
+};
+
+// Profiler shared by the whole process, created disabled on first use
+CStageProfiler& GetStageProfiler();
+
+//--------------------------------------------------------------------------------------
+// Times its own lifetime on the CPU track
+//--------------------------------------------------------------------------------------
+class CScopedStageTimer
+{
+public:
+    explicit CScopedStageTimer( const char* szName ) :
+        m_szName( szName ),
+        m_bActive( GetStageProfiler().IsEnabled() ),
+        m_fStartUs( m_bActive ? GetStageProfiler().Now() : 0 )
+    {
+    }
+
+    ~CScopedStageTimer()
+    {
+        if ( m_bActive )
+        {
+            CStageProfiler& profiler = GetStageProfiler();
+            profiler.Record( m_szName, STAGE_TRACK_CPU, m_fStartUs, profiler.Now() - m_fStartUs, profiler.GetFrame() );
+        }
+    }
+
+    CScopedStageTimer( const CScopedStageTimer& ) = delete;
+    CScopedStageTimer& operator=( const CScopedStageTimer& ) = delete;
+
+private:
+    const char* m_szName;
+    bool m_bActive;
+    double m_fStartUs;
+};
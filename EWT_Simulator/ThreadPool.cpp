@@ -0,0 +1,164 @@
+//--------------------------------------------------------------------------------------
+// File: ThreadPool.cpp
+//
+// Persistent worker pool used by the CPU side of the simulator
+//--------------------------------------------------------------------------------------
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace
+{
+    std::atomic<ThreadPoolWorkHook> s_pBeginWork( nullptr );
+    std::atomic<ThreadPoolWorkHook> s_pEndWork( nullptr );
+}
+
+//--------------------------------------------------------------------------------------
+CThreadPool::CThreadPool( unsigned int iNumThreads ) :
+    m_pJob( nullptr ),
+    m_iJobCount( 0 ),
+    m_iJobGrain( 1 ),
+    m_iNextChunk( 0 ),
+    m_iGeneration( 0 ),
+    m_iBusyWorkers( 0 ),
+    m_bQuit( false )
+{
+    if ( iNumThreads == 0 )
+        iNumThreads = std::max( 1u, std::thread::hardware_concurrency() );
+
+    // The caller of ParallelFor is the last thread
+    for ( unsigned int i = 1 ; i < iNumThreads ; i++ )
+        m_Workers.emplace_back( &CThreadPool::WorkerLoop, this );
+}
+
+
+//--------------------------------------------------------------------------------------
+CThreadPool::~CThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        m_bQuit = true;
+    }
+    m_WakeCV.notify_all();
+
+    for ( auto& worker : m_Workers )
+        worker.join();
+}
+
+
+//--------------------------------------------------------------------------------------
+// Grab chunks until the current job runs dry
+//--------------------------------------------------------------------------------------
+void CThreadPool::RunChunks()
+{
+    const size_t iNumChunks = (m_iJobCount + m_iJobGrain - 1) / m_iJobGrain;
+    for ( ;; )
+    {
+        size_t iChunk = m_iNextChunk.fetch_add( 1, std::memory_order_relaxed );
+        if ( iChunk >= iNumChunks )
+            break;
+
+        size_t iBegin = iChunk * m_iJobGrain;
+        size_t iEnd = std::min( iBegin + m_iJobGrain, m_iJobCount );
+        (*m_pJob)( iBegin, iEnd );
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CThreadPool::WorkerLoop()
+{
+    unsigned int iSeenGeneration = 0;
+    for ( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> lock( m_Mutex );
+            m_WakeCV.wait( lock, [&] { return m_bQuit || m_iGeneration != iSeenGeneration; } );
+            if ( m_bQuit )
+                return;
+            iSeenGeneration = m_iGeneration;
+        }
+
+        const ThreadPoolWorkHook pBeginWork = s_pBeginWork.load( std::memory_order_acquire );
+        const ThreadPoolWorkHook pEndWork = s_pEndWork.load( std::memory_order_acquire );
+        if ( pBeginWork )
+            pBeginWork();
+
+        RunChunks();
+
+        if ( pEndWork )
+            pEndWork();
+
+        {
+            std::lock_guard<std::mutex> lock( m_Mutex );
+            m_iBusyWorkers--;
+        }
+        m_DoneCV.notify_one();
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+void CThreadPool::ParallelFor( size_t iCount, size_t iGrain, const std::function<void( size_t, size_t )>& Func )
+{
+    if ( iCount == 0 )
+        return;
+    iGrain = std::max<size_t>( iGrain, 1 );
+
+    // Not worth waking anybody for a single chunk
+    if ( m_Workers.empty() || iCount <= iGrain )
+    {
+        Func( 0, iCount );
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        m_pJob = &Func;
+        m_iJobCount = iCount;
+        m_iJobGrain = iGrain;
+        m_iNextChunk.store( 0, std::memory_order_relaxed );
+        m_iBusyWorkers = (unsigned int)m_Workers.size();
+        m_iGeneration++;
+    }
+    m_WakeCV.notify_all();
+
+    RunChunks();
+
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_DoneCV.wait( lock, [&] { return m_iBusyWorkers == 0; } );
+    m_pJob = nullptr;
+}
+
+
+//--------------------------------------------------------------------------------------
+namespace
+{
+    std::unique_ptr<CThreadPool>& SharedPool()
+    {
+        static std::unique_ptr<CThreadPool> s_pPool;
+        return s_pPool;
+    }
+}
+
+CThreadPool& GetThreadPool()
+{
+    std::unique_ptr<CThreadPool>& pPool = SharedPool();
+    if ( !pPool )
+        pPool.reset( new CThreadPool() );
+    return *pPool;
+}
+
+void SetThreadPoolSize( unsigned int iNumThreads )
+{
+    std::unique_ptr<CThreadPool>& pPool = SharedPool();
+    pPool.reset();
+    pPool.reset( new CThreadPool( iNumThreads ) );
+}
+
+void SetThreadPoolWorkHooks( ThreadPoolWorkHook pBegin, ThreadPoolWorkHook pEnd )
+{
+    s_pBeginWork.store( pBegin, std::memory_order_release );
+    s_pEndWork.store( pEnd, std::memory_order_release );
+}
@@ -0,0 +1,65 @@
+//--------------------------------------------------------------------------------------
+// File: ThreadPool.h
+//
+// Persistent worker pool used by the CPU side of the simulator (boundary builders,
+// CPU simulation stages). The calling thread always takes part in the work so a pool
+// of N threads keeps N cores busy.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//--------------------------------------------------------------------------------------
+class CThreadPool
+{
+public:
+    // iNumThreads == 0 uses every hardware thread
+    explicit CThreadPool( unsigned int iNumThreads = 0 );
+    ~CThreadPool();
+
+    CThreadPool( const CThreadPool& ) = delete;
+    CThreadPool& operator=( const CThreadPool& ) = delete;
+
+    // Total number of threads taking part in a ParallelFor, including the caller
+    unsigned int GetNumThreads() const { return (unsigned int)m_Workers.size() + 1; }
+
+    // Calls Func( iBegin, iEnd ) for consecutive chunks of at most iGrain items
+    // covering [0, iCount) and returns once every chunk has completed
+    void ParallelFor( size_t iCount, size_t iGrain, const std::function<void( size_t, size_t )>& Func );
+
+private:
+    void WorkerLoop();
+    void RunChunks();
+
+    std::vector<std::thread>                            m_Workers;
+    std::mutex                                          m_Mutex;
+    std::condition_variable                             m_WakeCV;
+    std::condition_variable                             m_DoneCV;
+
+    // Current job, guarded by m_Mutex except for the atomic chunk counter
+    const std::function<void( size_t, size_t )>*        m_pJob;
+    size_t                                              m_iJobCount;
+    size_t                                              m_iJobGrain;
+    std::atomic<size_t>                                 m_iNextChunk;
+    unsigned int                                        m_iGeneration;
+    unsigned int                                        m_iBusyWorkers;
+    bool                                                m_bQuit;
+};
+
+// Pool shared by the whole process, created on first use
+CThreadPool& GetThreadPool();
+
+// Recreate the shared pool with iNumThreads threads (0 = every hardware thread)
+// Must not be called while a ParallelFor is running
+void SetThreadPoolSize( unsigned int iNumThreads );
+
+// Called on every worker thread of every pool around its share of a ParallelFor, not
+// on the calling thread. nullptr removes a hook. Used by the hardware counters.
+typedef void (*ThreadPoolWorkHook)();
+void SetThreadPoolWorkHooks( ThreadPoolWorkHook pBegin, ThreadPoolWorkHook pEnd );
@@ -0,0 +1,543 @@
+//--------------------------------------------------------------------------------------
+// File: TrajectoryStore.cpp
+//
+// Trajectory file layout, the keyframe deltas and the mapped reader
+//--------------------------------------------------------------------------------------
+#include "TrajectoryStore.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // Little endian, as written by both the viewer and the POSIX tools
+    //   FileHeader
+    //   ChunkHeader + payload, one per frame
+    //   TrajectoryFrameInfo[iNumFrames]
+    //   Footer
+    const char FILE_MAGIC[8] = { 'E', 'W', 'T', 'T', 'R', 'A', 'J', '1' };
+    const char FOOTER_MAGIC[8] = { 'E', 'W', 'T', 'T', 'I', 'D', 'X', '1' };
+    const uint32_t CHUNK_MAGIC = 0x4B4E4843; // 'CHNK'
+    const uint32_t FILE_VERSION = 1;
+
+    enum ChunkType
+    {
+        CHUNK_KEYFRAME,             // Particle words, then density words
+        CHUNK_DELTA                 // Zero runs of the byte planes of the XOR with the keyframe
+    };
+
+    const size_t PARTICLE_WORDS = sizeof( FluidParticle ) / sizeof( uint32_t );
+
+    struct FileHeader
+    {
+        char Magic[8];
+        uint32_t iVersion;
+        uint32_t iKeyframeInterval;
+    };
+
+    struct ChunkHeader
+    {
+        uint32_t iMagic;
+        uint32_t iType;
+        uint64_t iStep;
+        double fTime;
+        uint64_t iKeyOffset;
+        uint32_t iNumParticles;
+        uint32_t bDensities;
+        uint64_t iPayloadSize;
+    };
+
+    struct Footer
+    {
+        uint64_t iIndexOffset;
+        uint64_t iNumFrames;
+        char Magic[8];
+    };
+
+    static_assert( sizeof( FluidParticle ) % sizeof( uint32_t ) == 0, "Particles are stored as 32 bit words" );
+    static_assert( sizeof( ChunkHeader ) == 48 && sizeof( TrajectoryFrameInfo ) == 32 && sizeof( Footer ) == 24,
+                   "The trajectory layout must not depend on the compiler" );
+
+    FILE* OpenFile( const char* szPath, const char* szMode )
+    {
+#if defined(_MSC_VER)
+        FILE* pFile = nullptr;
+        return (fopen_s( &pFile, szPath, szMode ) == 0) ? pFile : nullptr;
+#else
+        return fopen( szPath, szMode );
+#endif
+    }
+
+    uint64_t RestKey( const FluidParticle& p )
+    {
+        uint32_t x, y;
+        memcpy( &x, &p.vIndex.x, sizeof( x ) );
+        memcpy( &y, &p.vIndex.y, sizeof( y ) );
+        return ((uint64_t)x << 32) | y;
+    }
+
+    size_t NumWords( size_t iNumParticles, bool bDensities )
+    {
+        return iNumParticles * PARTICLE_WORDS + (bDensities ? iNumParticles : 0);
+    }
+
+    //----------------------------------------------------------------------------------
+    // Zero runs: a control byte c below 0x80 is followed by c + 1 literal bytes, from
+    // 0x80 up it stands for c - 0x7F zero bytes. Single zeros stay in the literals.
+    //----------------------------------------------------------------------------------
+    void EncodeZeroRuns( const uint8_t* pData, size_t iSize, std::vector<uint8_t>& Encoded )
+    {
+        Encoded.clear();
+        size_t i = 0;
+        while ( i < iSize )
+        {
+            size_t iRun = 0;
+            while ( i + iRun < iSize && iRun < 128 && pData[i + iRun] == 0 )
+                iRun++;
+            if ( iRun >= 2 )
+            {
+                Encoded.push_back( (uint8_t)(0x80 + iRun - 1) );
+                i += iRun;
+                continue;
+            }
+
+            const size_t iStart = i;
+            while ( i < iSize && i - iStart < 128 && !(pData[i] == 0 && i + 1 < iSize && pData[i + 1] == 0) )
+                i++;
+            Encoded.push_back( (uint8_t)(i - iStart - 1) );
+            Encoded.insert( Encoded.end(), pData + iStart, pData + i );
+        }
+    }
+
+    bool DecodeZeroRuns( const uint8_t* pData, size_t iSize, uint8_t* pOut, size_t iOutSize )
+    {
+        size_t iOut = 0;
+        for ( size_t i = 0 ; i < iSize ; )
+        {
+            const uint8_t c = pData[i++];
+            const size_t iLength = (c & 0x7F) + 1u;
+            if ( iOut + iLength > iOutSize )
+                return false;
+            if ( c & 0x80 )
+            {
+                memset( pOut + iOut, 0, iLength );
+            }
+            else
+            {
+                if ( i + iLength > iSize )
+                    return false;
+                memcpy( pOut + iOut, pData + i, iLength );
+                i += iLength;
+            }
+            iOut += iLength;
+        }
+        return iOut == iOutSize;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+CTrajectoryWriter::CTrajectoryWriter() :
+    m_pFile( nullptr ),
+    m_bFailed( false ),
+    m_iKeyframeInterval( 1 ),
+    m_iOffset( 0 ),
+    m_iKeyOffset( 0 ),
+    m_iSinceKeyframe( 0 ),
+    m_iKeyParticles( 0 ),
+    m_bKeyDensities( false ),
+    m_iStamp( 0 ),
+    m_Report()
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CTrajectoryWriter::Open( const char* szPath, unsigned int iKeyframeInterval )
+{
+    Close();
+
+    m_pFile = OpenFile( szPath, "wb" );
+    if ( !m_pFile )
+        return false;
+    setvbuf( m_pFile, nullptr, _IOFBF, 1 << 20 );
+
+    FileHeader header = {};
+    memcpy( header.Magic, FILE_MAGIC, sizeof( header.Magic ) );
+    header.iVersion = FILE_VERSION;
+    header.iKeyframeInterval = std::max( iKeyframeInterval, 1u );
+
+    m_bFailed = fwrite( &header, sizeof( header ), 1, m_pFile ) != 1;
+    m_iKeyframeInterval = header.iKeyframeInterval;
+    m_iOffset = sizeof( header );
+    m_Index.clear();
+    m_iSinceKeyframe = 0;
+    m_KeyWords.clear();
+    m_KeySlots.clear();
+    m_Report = TrajectoryWriterReport();
+    return !m_bFailed;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CTrajectoryWriter::WriteChunk( uint32_t iType, uint64_t iStep, double fTime, uint32_t iNumParticles, bool bDensities,
+                                    const void* pPayload, size_t iPayloadSize )
+{
+    ChunkHeader header = {};
+    header.iMagic = CHUNK_MAGIC;
+    header.iType = iType;
+    header.iStep = iStep;
+    header.fTime = fTime;
+    header.iKeyOffset = (iType == CHUNK_KEYFRAME) ? m_iOffset : m_iKeyOffset;
+    header.iNumParticles = iNumParticles;
+    header.bDensities = bDensities;
+    header.iPayloadSize = iPayloadSize;
+
+    bool bOk = fwrite( &header, sizeof( header ), 1, m_pFile ) == 1;
+    bOk = bOk && (iPayloadSize == 0 || fwrite( pPayload, 1, iPayloadSize, m_pFile ) == iPayloadSize);
+    if ( !bOk )
+    {
+        m_bFailed = true;
+        return false;
+    }
+
+    const TrajectoryFrameInfo info = { iStep, fTime, m_iOffset, header.iKeyOffset };
+    m_Index.push_back( info );
+    m_iOffset += sizeof( header ) + iPayloadSize;
+    m_Report.iFrames++;
+    m_Report.iWrittenBytes += sizeof( header ) + iPayloadSize;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Gather the frame's words into the keyframe's order in m_Words; false unless every
+// particle has exactly one match in the keyframe
+//--------------------------------------------------------------------------------------
+bool CTrajectoryWriter::MatchKeyframe( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities )
+{
+    const size_t iNumParticles = Particles.size();
+    const bool bDensities = !Densities.empty();
+    if ( m_KeyWords.empty() || iNumParticles != m_iKeyParticles || bDensities != m_bKeyDensities ||
+         m_KeySlots.size() != iNumParticles )
+        return false;
+
+    if ( ++m_iStamp == 0 )
+    {
+        std::fill( m_Stamps.begin(), m_Stamps.end(), 0u );
+        m_iStamp = 1;
+    }
+    m_Stamps.resize( iNumParticles, 0u );
+    m_Words.resize( m_KeyWords.size() );
+
+    for ( size_t i = 0 ; i < iNumParticles ; i++ )
+    {
+        auto it = m_KeySlots.find( RestKey( Particles[i] ) );
+        if ( it == m_KeySlots.end() || m_Stamps[it->second] == m_iStamp )
+            return false;
+        const uint32_t iSlot = it->second;
+        m_Stamps[iSlot] = m_iStamp;
+        memcpy( &m_Words[iSlot * PARTICLE_WORDS], &Particles[i], sizeof( FluidParticle ) );
+        if ( bDensities )
+            memcpy( &m_Words[iNumParticles * PARTICLE_WORDS + iSlot], &Densities[i], sizeof( float ) );
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CTrajectoryWriter::Write( uint64_t iStep, double fTime, const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities )
+{
+    if ( !m_pFile || m_bFailed || (!Densities.empty() && Densities.size() != Particles.size()) )
+        return false;
+
+    const uint32_t iNumParticles = (uint32_t)Particles.size();
+    const bool bDensities = !Densities.empty();
+    m_Report.iRawBytes += Particles.size() * sizeof( FluidParticle ) + Densities.size() * sizeof( float );
+
+    if ( m_iSinceKeyframe < m_iKeyframeInterval && MatchKeyframe( Particles, Densities ) )
+    {
+        // XOR with the keyframe, then byte plane p holds byte p of every word
+        const size_t iNumWords = m_Words.size();
+        const uint8_t* pWords = (const uint8_t*)m_Words.data();
+        const uint8_t* pKeyWords = (const uint8_t*)m_KeyWords.data();
+        m_Planes.resize( iNumWords * sizeof( uint32_t ) );
+        for ( size_t p = 0 ; p < sizeof( uint32_t ) ; p++ )
+        {
+            uint8_t* pPlane = &m_Planes[p * iNumWords];
+            for ( size_t w = 0 ; w < iNumWords ; w++ )
+                pPlane[w] = pWords[w * sizeof( uint32_t ) + p] ^ pKeyWords[w * sizeof( uint32_t ) + p];
+        }
+        EncodeZeroRuns( m_Planes.data(), m_Planes.size(), m_Encoded );
+
+        m_iSinceKeyframe++;
+        return WriteChunk( CHUNK_DELTA, iStep, fTime, iNumParticles, bDensities, m_Encoded.data(), m_Encoded.size() );
+    }
+
+    // A new keyframe; rest positions that are not unique leave m_KeySlots short, and
+    // the frames up to the next keyframe are keyframes too
+    m_KeyWords.resize( NumWords( iNumParticles, bDensities ) );
+    memcpy( m_KeyWords.data(), Particles.data(), Particles.size() * sizeof( FluidParticle ) );
+    if ( bDensities )
+        memcpy( &m_KeyWords[iNumParticles * PARTICLE_WORDS], Densities.data(), Densities.size() * sizeof( float ) );
+    m_iKeyParticles = iNumParticles;
+    m_bKeyDensities = bDensities;
+    m_KeySlots.clear();
+    m_KeySlots.reserve( iNumParticles );
+    for ( uint32_t i = 0 ; i < iNumParticles ; i++ )
+        m_KeySlots.emplace( RestKey( Particles[i] ), i );
+
+    m_iKeyOffset = m_iOffset;
+    m_iSinceKeyframe = 1;
+    m_Report.iKeyframes++;
+    return WriteChunk( CHUNK_KEYFRAME, iStep, fTime, iNumParticles, bDensities, m_KeyWords.data(), m_KeyWords.size() * sizeof( uint32_t ) );
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CTrajectoryWriter::Close()
+{
+    if ( !m_pFile )
+        return !m_bFailed;
+
+    Footer footer = {};
+    footer.iIndexOffset = m_iOffset;
+    footer.iNumFrames = m_Index.size();
+    memcpy( footer.Magic, FOOTER_MAGIC, sizeof( footer.Magic ) );
+
+    bool bOk = !m_bFailed;
+    bOk = bOk && (m_Index.empty() || fwrite( m_Index.data(), sizeof( TrajectoryFrameInfo ), m_Index.size(), m_pFile ) == m_Index.size());
+    bOk = bOk && fwrite( &footer, sizeof( footer ), 1, m_pFile ) == 1;
+    bOk = (fclose( m_pFile ) == 0) && bOk;
+    m_pFile = nullptr;
+    m_bFailed = !bOk;
+
+    m_KeyWords.clear();
+    m_KeySlots.clear();
+    return bOk;
+}
+
+
+//--------------------------------------------------------------------------------------
+CTrajectoryReader::CTrajectoryReader() :
+    m_pData( nullptr ),
+    m_iSize( 0 ),
+#if defined(_WIN32)
+    m_hFile( INVALID_HANDLE_VALUE ),
+    m_hMapping( nullptr ),
+#endif
+    m_bRecovered( false )
+{
+}
+
+
+//--------------------------------------------------------------------------------------
+bool CTrajectoryReader::Open( const char* szPath )
+{
+    Close();
+
+#if defined(_WIN32)
+    m_hFile = CreateFileA( szPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+    LARGE_INTEGER size;
+    if ( m_hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx( m_hFile, &size ) || size.QuadPart < (LONGLONG)sizeof( FileHeader ) )
+    {
+        Close();
+        return false;
+    }
+    m_hMapping = CreateFileMappingA( m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr );
+    m_pData = m_hMapping ? (const uint8_t*)MapViewOfFile( m_hMapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+    m_iSize = (uint64_t)size.QuadPart;
+#else
+    int fd = open( szPath, O_RDONLY );
+    if ( fd < 0 )
+        return false;
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( FileHeader ) )
+    {
+        close( fd );
+        return false;
+    }
+    void* pData = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    m_pData = (pData == MAP_FAILED) ? nullptr : (const uint8_t*)pData;
+    m_iSize = (uint64_t)st.st_size;
+#endif
+
+    FileHeader header;
+    if ( m_pData )
+        memcpy( &header, m_pData, sizeof( header ) );
+    if ( !m_pData || memcmp( header.Magic, FILE_MAGIC, sizeof( header.Magic ) ) || header.iVersion != FILE_VERSION )
+    {
+        Close();
+        return false;
+    }
+
+    m_bRecovered = !ReadIndex();
+    if ( m_bRecovered )
+        RecoverIndex();
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+void CTrajectoryReader::Close()
+{
+#if defined(_WIN32)
+    if ( m_pData )
+        UnmapViewOfFile( m_pData );
+    if ( m_hMapping )
+        CloseHandle( m_hMapping );
+    if ( m_hFile != INVALID_HANDLE_VALUE )
+        CloseHandle( m_hFile );
+    m_hMapping = nullptr;
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    if ( m_pData )
+        munmap( (void*)m_pData, (size_t)m_iSize );
+#endif
+    m_pData = nullptr;
+    m_iSize = 0;
+    m_bRecovered = false;
+    m_Index.clear();
+}
+
+
+//--------------------------------------------------------------------------------------
+// The index the writer put before the footer, if it is complete and consistent
+//--------------------------------------------------------------------------------------
+bool CTrajectoryReader::ReadIndex()
+{
+    if ( m_iSize < sizeof( FileHeader ) + sizeof( Footer ) )
+        return false;
+
+    Footer footer;
+    memcpy( &footer, m_pData + m_iSize - sizeof( footer ), sizeof( footer ) );
+    if ( memcmp( footer.Magic, FOOTER_MAGIC, sizeof( footer.Magic ) ) || footer.iIndexOffset < sizeof( FileHeader ) ||
+         footer.iNumFrames > m_iSize / sizeof( TrajectoryFrameInfo ) ||
+         footer.iIndexOffset + footer.iNumFrames * sizeof( TrajectoryFrameInfo ) + sizeof( footer ) != m_iSize )
+        return false;
+
+    m_Index.resize( (size_t)footer.iNumFrames );
+    if ( !m_Index.empty() )
+        memcpy( m_Index.data(), m_pData + footer.iIndexOffset, m_Index.size() * sizeof( TrajectoryFrameInfo ) );
+    for ( const TrajectoryFrameInfo& info : m_Index )
+    {
+        if ( info.iOffset >= footer.iIndexOffset || info.iKeyOffset > info.iOffset )
+        {
+            m_Index.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Walk the chunks of a file without an index, up to the first incomplete one
+//--------------------------------------------------------------------------------------
+void CTrajectoryReader::RecoverIndex()
+{
+    m_Index.clear();
+    uint64_t iOffset = sizeof( FileHeader );
+    while ( iOffset + sizeof( ChunkHeader ) <= m_iSize )
+    {
+        ChunkHeader header;
+        memcpy( &header, m_pData + iOffset, sizeof( header ) );
+        if ( header.iMagic != CHUNK_MAGIC || header.iType > CHUNK_DELTA || header.iKeyOffset > iOffset ||
+             header.iPayloadSize > m_iSize - iOffset - sizeof( header ) )
+            break;
+
+        const TrajectoryFrameInfo info = { header.iStep, header.fTime, iOffset, header.iKeyOffset };
+        m_Index.push_back( info );
+        iOffset += sizeof( header ) + header.iPayloadSize;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------
+size_t CTrajectoryReader::FindStep( uint64_t iStep ) const
+{
+    auto it = std::upper_bound( m_Index.begin(), m_Index.end(), iStep,
+                                []( uint64_t iValue, const TrajectoryFrameInfo& info ) { return iValue < info.iStep; } );
+    return (it == m_Index.begin()) ? 0 : (size_t)(it - m_Index.begin()) - 1;
+}
+
+
+//--------------------------------------------------------------------------------------
+size_t CTrajectoryReader::FindTime( double fTime ) const
+{
+    auto it = std::upper_bound( m_Index.begin(), m_Index.end(), fTime,
+                                []( double fValue, const TrajectoryFrameInfo& info ) { return fValue < info.fTime; } );
+    return (it == m_Index.begin()) ? 0 : (size_t)(it - m_Index.begin()) - 1;
+}
+
+
+//--------------------------------------------------------------------------------------
+// Copy the keyframe's words out of the mapping and XOR the frame's delta into them
+//--------------------------------------------------------------------------------------
+bool CTrajectoryReader::ReadFrame( size_t iFrame, std::vector<FluidParticle>& Particles, std::vector<float>& Densities )
+{
+    if ( iFrame >= m_Index.size() )
+        return false;
+
+    const TrajectoryFrameInfo& info = m_Index[iFrame];
+    if ( info.iOffset + sizeof( ChunkHeader ) > m_iSize || info.iKeyOffset + sizeof( ChunkHeader ) > m_iSize )
+        return false;
+    ChunkHeader frame, key;
+    memcpy( &frame, m_pData + info.iOffset, sizeof( frame ) );
+    memcpy( &key, m_pData + info.iKeyOffset, sizeof( key ) );
+
+    const size_t iNumParticles = key.iNumParticles;
+    const size_t iNumWords = NumWords( iNumParticles, key.bDensities != 0 );
+    if ( frame.iMagic != CHUNK_MAGIC || key.iMagic != CHUNK_MAGIC || key.iType != CHUNK_KEYFRAME ||
+         frame.iNumParticles != key.iNumParticles || frame.bDensities != key.bDensities ||
+         key.iPayloadSize != iNumWords * sizeof( uint32_t ) ||
+         info.iKeyOffset + sizeof( key ) + key.iPayloadSize > m_iSize ||
+         info.iOffset + sizeof( frame ) + frame.iPayloadSize > m_iSize )
+        return false;
+
+    const uint8_t* pKey = m_pData + info.iKeyOffset + sizeof( key );
+    Particles.resize( iNumParticles );
+    memcpy( Particles.data(), pKey, iNumParticles * sizeof( FluidParticle ) );
+    if ( key.bDensities )
+    {
+        Densities.resize( iNumParticles );
+        memcpy( Densities.data(), pKey + iNumParticles * sizeof( FluidParticle ), iNumParticles * sizeof( float ) );
+    }
+    else
+    {
+        Densities.clear();
+    }
+
+    if ( frame.iType == CHUNK_KEYFRAME )
+        return info.iOffset == info.iKeyOffset;
+
+    m_Planes.resize( iNumWords * sizeof( uint32_t ) );
+    if ( !DecodeZeroRuns( m_pData + info.iOffset + sizeof( frame ), (size_t)frame.iPayloadSize, m_Planes.data(), m_Planes.size() ) )
+        return false;
+
+    uint8_t* pParticleBytes = (uint8_t*)Particles.data();
+    uint8_t* pDensityBytes = (uint8_t*)Densities.data();
+    const size_t iNumParticleWords = iNumParticles * PARTICLE_WORDS;
+    for ( size_t p = 0 ; p < sizeof( uint32_t ) ; p++ )
+    {
+        const uint8_t* pPlane = &m_Planes[p * iNumWords];
+        for ( size_t w = 0 ; w < iNumParticleWords ; w++ )
+            pParticleBytes[w * sizeof( uint32_t ) + p] ^= pPlane[w];
+        for ( size_t w = iNumParticleWords ; w < iNumWords ; w++ )
+            pDensityBytes[(w - iNumParticleWords) * sizeof( uint32_t ) + p] ^= pPlane[w];
+    }
+    return true;
+}
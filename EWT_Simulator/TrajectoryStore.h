@@ -0,0 +1,137 @@
+//--------------------------------------------------------------------------------------
+// File: TrajectoryStore.h
+//
+// Recorded runs with random access. A trajectory file is a sequence of frame chunks
+// followed by an index of their offsets. Every iKeyframeInterval frames, and whenever
+// the particle set changes, a keyframe stores the particles as they are; the frames in
+// between store their difference to that keyframe, so a frame is decoded from its
+// keyframe and itself alone. Particles are matched to the keyframe by rest position,
+// as the simulators reorder them every step, and decoded frames come in the keyframe's
+// order.
+//
+// A delta XORs every 32 bit word of a frame with the keyframe's, which leaves the
+// unchanged rest positions and the high bytes of slowly moving values zero, splits the
+// words into byte planes and run length codes the zeros.
+//
+// The reader maps the file, so seeking costs a binary search of the index and reading
+// two chunks. A file whose writer did not finish has no index; the reader then rebuilds
+// it by walking the chunks and stops at the first incomplete one.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include "FluidCPU.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+struct TrajectoryFrameInfo
+{
+    uint64_t iStep;
+    double fTime;                   // Simulated seconds
+    uint64_t iOffset;               // Of the frame's chunk
+    uint64_t iKeyOffset;            // Of its keyframe's chunk, iOffset for a keyframe
+};
+
+struct TrajectoryWriterReport
+{
+    uint64_t iFrames;
+    uint64_t iKeyframes;
+    uint64_t iRawBytes;             // Particles and densities as given
+    uint64_t iWrittenBytes;
+};
+
+//--------------------------------------------------------------------------------------
+class CTrajectoryWriter
+{
+public:
+    CTrajectoryWriter();
+    ~CTrajectoryWriter() { Close(); }
+
+    CTrajectoryWriter( const CTrajectoryWriter& ) = delete;
+    CTrajectoryWriter& operator=( const CTrajectoryWriter& ) = delete;
+
+    bool Open( const char* szPath, unsigned int iKeyframeInterval );
+    bool IsOpen() const { return m_pFile != nullptr; }
+
+    // Steps must not decrease. Densities may be empty. A frame whose particles cannot
+    // all be matched to the keyframe's becomes a keyframe itself.
+    bool Write( uint64_t iStep, double fTime, const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities );
+
+    // Writes the index; false if any write failed
+    bool Close();
+
+    TrajectoryWriterReport GetReport() const { return m_Report; }
+
+private:
+    bool WriteChunk( uint32_t iType, uint64_t iStep, double fTime, uint32_t iNumParticles, bool bDensities,
+                     const void* pPayload, size_t iPayloadSize );
+    bool MatchKeyframe( const std::vector<FluidParticle>& Particles, const std::vector<float>& Densities );
+
+    FILE*                                   m_pFile;
+    bool                                    m_bFailed;
+    unsigned int                            m_iKeyframeInterval;
+    uint64_t                                m_iOffset;
+    std::vector<TrajectoryFrameInfo>        m_Index;
+
+    // The current keyframe, as 32 bit words, and where each rest position sits in it
+    uint64_t                                m_iKeyOffset;
+    unsigned int                            m_iSinceKeyframe;
+    uint32_t                                m_iKeyParticles;
+    bool                                    m_bKeyDensities;
+    std::vector<uint32_t>                   m_KeyWords;
+    std::unordered_map<uint64_t, uint32_t>  m_KeySlots;
+
+    // Scratch of the deltas
+    std::vector<uint32_t>                   m_Words;
+    std::vector<uint32_t>                   m_Stamps;
+    uint32_t                                m_iStamp;
+    std::vector<uint8_t>                    m_Planes;
+    std::vector<uint8_t>                    m_Encoded;
+
+    TrajectoryWriterReport                  m_Report;
+};
+
+//--------------------------------------------------------------------------------------
+class CTrajectoryReader
+{
+public:
+    CTrajectoryReader();
+    ~CTrajectoryReader() { Close(); }
+
+    CTrajectoryReader( const CTrajectoryReader& ) = delete;
+    CTrajectoryReader& operator=( const CTrajectoryReader& ) = delete;
+
+    bool Open( const char* szPath );
+    void Close();
+    bool IsOpen() const { return m_pData != nullptr; }
+
+    // The index was rebuilt from the chunks as the file has none
+    bool IsRecovered() const { return m_bRecovered; }
+
+    size_t GetNumFrames() const { return m_Index.size(); }
+    const TrajectoryFrameInfo& GetFrameInfo( size_t iFrame ) const { return m_Index[iFrame]; }
+
+    // The last frame at or before the step or time, 0 if there is none
+    size_t FindStep( uint64_t iStep ) const;
+    size_t FindTime( double fTime ) const;
+
+    // Densities is left empty for frames recorded without them
+    bool ReadFrame( size_t iFrame, std::vector<FluidParticle>& Particles, std::vector<float>& Densities );
+
+private:
+    bool ReadIndex();
+    void RecoverIndex();
+
+    const uint8_t*                          m_pData;
+    uint64_t                                m_iSize;
+#if defined(_WIN32)
+    void*                                   m_hFile;
+    void*                                   m_hMapping;
+#endif
+    bool                                    m_bRecovered;
+    std::vector<TrajectoryFrameInfo>        m_Index;
+    std::vector<uint8_t>                    m_Planes;
+};
@@ -0,0 +1,60 @@
+//--------------------------------------------------------------------------------------
+// File: TripleBuffer.h
+//
+// Lock-free hand-off of the newest complete state from one writer thread to one
+// reader thread. The writer fills the back slot and publishes it; the reader takes the
+// newest published slot whenever it starts a frame. Neither side waits for the other:
+// the writer can publish many states between two reads (the older ones are skipped)
+// and the reader can read the same state many times.
+//--------------------------------------------------------------------------------------
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//--------------------------------------------------------------------------------------
+// Three slots of T. At any time one is the writer's back slot, one the reader's front
+// slot and one sits in the middle. Publish swaps the back slot with the middle one and
+// marks it new; Acquire swaps the front slot with the middle one if it is new.
+//--------------------------------------------------------------------------------------
+template <class T>
+class CTripleBuffer
+{
+public:
+    CTripleBuffer() : m_Slots(), m_iBack( 0 ), m_iMiddle( 1 ), m_iFront( 2 ) {}
+
+    CTripleBuffer( const CTripleBuffer& ) = delete;
+    CTripleBuffer& operator=( const CTripleBuffer& ) = delete;
+
+    // Writer only
+    T& GetBack() { return m_Slots[m_iBack]; }
+
+    void Publish()
+    {
+        m_iBack = m_iMiddle.exchange( m_iBack | NEW_BIT, std::memory_order_acq_rel ) & INDEX_MASK;
+    }
+
+    // Reader only. Returns false if nothing was published since the last call.
+    bool Acquire()
+    {
+        if ( !(m_iMiddle.load( std::memory_order_relaxed ) & NEW_BIT) )
+            return false;
+        m_iFront = m_iMiddle.exchange( m_iFront, std::memory_order_acq_rel ) & INDEX_MASK;
+        return true;
+    }
+
+    const T& GetFront() const { return m_Slots[m_iFront]; }
+
+    // Every slot, for creating and releasing what they hold while neither thread runs
+    T& GetSlot( unsigned int i ) { return m_Slots[i]; }
+    static const unsigned int NUM_SLOTS = 3;
+
+private:
+    static const uint32_t NEW_BIT = 4;
+    static const uint32_t INDEX_MASK = 3;
+
+    T                           m_Slots[NUM_SLOTS];
+    uint32_t                    m_iBack;        // Writer's
+    std::atomic<uint32_t>       m_iMiddle;      // Shared, NEW_BIT if published and not yet read
+    uint32_t                    m_iFront;       // Reader's
+};